@@ -66,7 +66,8 @@ enum qmap_flags {
    *  Performance Note: The sorted index is rebuilt from scratch
    *  whenever it's marked dirty and iteration is requested.
    *  This makes the first iteration after modifications O(n log n)
-   *  instead of O(n). */
+   *  instead of O(n). File-backed maps are saved in key order, so
+   *  the index of a freshly loaded map is ready without sorting. */
   QM_SORTED = 8,
 
   /** Allow duplicate keys in sorted maps. Enables multi-value
@@ -92,6 +93,82 @@ enum qmap_flags {
    *  inserts return QM_MISS instead of growing the table.
    *  Use for memory-constrained environments or fixed-size tables. */
   QM_NOGROW = 32,
+
+  /** Log every change of a file-backed map to "<filename>.wal".
+   *  qmap_open() replays the log over the last snapshot and
+   *  qmap_save() folds it back into the file. At exit, files whose
+   *  maps all use QM_WAL only get their log flushed, so persisting
+   *  a few changes no longer rewrites the whole file.
+   *  See qmap_wal_sync() and QM_CFG_WAL_SYNC for durability. */
+  QM_WAL = 64,
+
+  /** Serve the database straight from the file mapping instead of
+   *  loading it. Opening costs a directory lookup (the checksum of
+   *  the section is not verified, as that would read all of it),
+   *  keys and values returned by qmap_get() and qmap_next() point
+   *  into the shared pages, and the map cannot be changed. The
+   *  sorted index saved with QM_SORTED maps is used in place too.
+   *  Files holding such maps
+   *  are never rewritten by the process, and must not be rewritten
+   *  by another one while mapped. Files in the old format are
+   *  loaded instead. Not valid with QM_MIRROR or QM_WAL. */
+  QM_RDONLY_MMAP = 128,
+
+  /** Defer reading the database until the map is first used
+   *  (get, put, del, iteration, count or qmap_assoc()), so maps a
+   *  process never touches cost nothing but their handle. A file
+   *  about to be rewritten has its unread maps loaded first.
+   *  Ignored with QM_MIRROR and QM_RDONLY_MMAP. (Bits 8 to 16 are
+   *  taken by QM_RECORD.) */
+  QM_LAZY = 0x20000,
+
+  /** Keep values of QM_CFG_VLOG_MIN bytes or more out of memory:
+   *  keys and metadata stay in the map, while such values go to a
+   *  value log, an unlinked file in the directory of the map's file
+   *  (or TMPDIR for maps without one) mapped into the process, so
+   *  the kernel pages them in as qmap_get() reaches them and out
+   *  again under memory pressure. The file on disk is as without
+   *  it; the log only lives as long as the map. Not valid with
+   *  QM_RDONLY_MMAP. */
+  QM_VLOG = 0x40000,
+
+  /** Allocate the map in its file, which holds it as it is in
+   *  memory, instead of loading and saving it: opening maps the file
+   *  (an empty or missing one starts the map) and checks it, and
+   *  qmap_save() and qmap_close() msync what changed. The file is
+   *  the map's alone, database naming it for the checks, and one
+   *  process at a time may have it open (QM_SHARED readers aside).
+   *  A file changed after it was last synced, by a process that did
+   *  not get to close the map, is refused. Not valid with QM_MIRROR,
+   *  QM_WAL, QM_LAZY, QM_RDONLY_MMAP, QM_VLOG, QM_DELTA or
+   *  QM_RECORD. */
+  QM_PHEAP = 0x80000,
+
+  /** Share a map across processes: one writer opens its file with
+   *  QM_PHEAP | QM_SHARED, and any number of readers, in other
+   *  processes, with QM_RDONLY_MMAP | QM_SHARED. Readers map the
+   *  writer's file read-only at the address the writer has it at,
+   *  and serve the map from there with no copy or load of their
+   *  own; each call of theirs sees what the writer last published,
+   *  as of the end of its last call that changed the map. The file
+   *  may be in /dev/shm to keep it off disk. A reader cannot open
+   *  where that address is taken, as in a child forked from the
+   *  writer, and the writer of a file readers had cannot open where
+   *  it is not free. Keys and values qmap_get() and qmap_next()
+   *  return to readers may change or go once the writer changes
+   *  their entry: see qmap_version(). Valid with QM_PHEAP or
+   *  QM_RDONLY_MMAP only, and not with QM_MIRROR, QM_WAL, QM_LAZY,
+   *  QM_VLOG or QM_RECORD. */
+  QM_SHARED = 0x100000,
+
+  /** Keep track of what changed, for qmap_delta_export() to write
+   *  only that out and qmap_delta_apply() to make the same changes
+   *  to a copy of the map elsewhere. Entries note when they last
+   *  changed, and the keys of the last QM_CFG_DELTA_WINDOW
+   *  deletions are kept. None of it is saved: a delta from before
+   *  the map was opened holds the whole map. Not valid with
+   *  QM_MULTIVALUE, QM_PHEAP, QM_RDONLY_MMAP or QM_RECORD. */
+  QM_DELTA = 0x200000,
 };
 
 /**
@@ -154,6 +231,73 @@ enum qmap_if {
   QM_RANGE = 1,
 };
 
+/**
+ * @brief Library-wide tunables, see qmap_config().
+ */
+enum qmap_cfg {
+  /** Worker threads for bulk loads. 0 (the default) uses one per
+   *  online CPU; 1 keeps everything on the calling thread. */
+  QM_CFG_THREADS = 0,
+
+  /** Smallest batch, in entries, worth spreading over threads.
+   *  Defaults to 65536. */
+  QM_CFG_PAR_MIN = 1,
+
+  /** Smallest QM_SORTED map, in entries, whose sorted index is
+   *  built on several threads. Such maps also get it built right at
+   *  qmap_bulk_end() (and so on load) instead of on first use.
+   *  Defaults to 65536. */
+  QM_CFG_SORT_MIN = 2,
+
+  /** fsync a QM_WAL log every this many records. 0 (the default)
+   *  leaves fsync to qmap_wal_sync(), qmap_save() and exit, so that
+   *  callers group their commits. */
+  QM_CFG_WAL_SYNC = 3,
+
+  /** Non-zero reads the section of a database at open, and writes
+   *  saved files, through io_uring where the kernel allows it: the
+   *  file is not mapped, and saves fill a buffer while the previous
+   *  ones are written. Falls back to plain reads and writes. 0 (the
+   *  default) maps files and writes them with pwritev. Built in on
+   *  Linux, unless QMAP_NO_URING is defined. */
+  QM_CFG_IO_URING = 4,
+
+  /** Codec (enum qmap_codec) qmap_save() compresses sections with,
+   *  in blocks inflated on several threads at load. The codec is
+   *  recorded per section, so files stay readable whatever this is
+   *  set to later, as long as the codec is built in. Sections that
+   *  would not shrink, and those qmap_save_step() writes, are stored
+   *  as is. Defaults to QM_CODEC_NONE. */
+  QM_CFG_COMPRESS = 5,
+
+  /** Non-zero has qmap_save() write sections compactly: without the
+   *  size and hash arrays loading rebuilds anyway, integers as
+   *  varints, delta coded in QM_SORTED maps, and the sorted string
+   *  keys of those front coded against the previous key, with a
+   *  restart point every 16 entries so that loading decodes runs of
+   *  them on several threads. Files stay readable whatever this is
+   *  set to later; such sections are loaded even by QM_RDONLY_MMAP
+   *  maps, and compose with QM_CFG_COMPRESS. Defaults to 0. */
+  QM_CFG_COMPACT = 6,
+
+  /** Smallest value, in bytes, that QM_VLOG maps keep in their log
+   *  rather than in memory. Defaults to 4096. */
+  QM_CFG_VLOG_MIN = 7,
+
+  /** How many deleted keys a QM_DELTA map keeps for deltas; applies
+   *  to maps opened after it is set. A delta from before the oldest
+   *  one kept holds the whole map. Defaults to 65536. */
+  QM_CFG_DELTA_WINDOW = 8,
+};
+
+/** Section codecs for QM_CFG_COMPRESS. LZ4 and zstd are built in
+ *  when the library is compiled with QMAP_LZ4 / QMAP_ZSTD. */
+enum qmap_codec {
+  QM_CODEC_NONE = 0,
+  QM_CODEC_LZ4 = 1,
+  QM_CODEC_ZSTD = 2,
+};
+
 /** @} */
 
 /** @defgroup qmap_handle Qmap open, close and save
@@ -207,7 +351,12 @@ enum qmap_if {
  *
  * @note Multiple databases can share a single file. Each database
  *       is identified by a hash of its name (XXH32). Data is saved
- *       and loaded based on this database ID.
+ *       and loaded based on this database ID, which a directory at
+ *       the start of the file maps to the database's section along
+ *       with its types and checksum. A section whose types differ
+ *       from ktype/vtype or whose checksum does not match is not
+ *       loaded, and the file is then never rewritten by the process.
+ *       Files written by older versions are still read.
  */
 uint32_t qmap_open(const char *filename,
                    const char *database,
@@ -216,6 +365,63 @@ uint32_t qmap_open(const char *filename,
                    uint32_t mask,
                    uint32_t flags);
 
+/**
+ * @brief One database for qmap_open_all().
+ */
+typedef struct {
+  const char *database;      /**< Name within the file. */
+  uint32_t ktype, vtype;     /**< As for qmap_open(). */
+  uint32_t mask, flags;      /**< As for qmap_open(). */
+  uint32_t hd;               /**< Out: its handle, or QM_MISS. */
+} qmap_spec_t;
+
+/**
+ * @brief Open several databases of one file, loading them in parallel.
+ *
+ * Opens each spec like qmap_open() would, then reads the sections
+ * on worker threads (see QM_CFG_THREADS), one database per thread
+ * at a time. Specs with QM_LAZY stay unread until first used, and
+ * QM_MIRROR and QM_RDONLY_MMAP ones are opened as qmap_open() does.
+ *
+ * @param[in]     filename File holding the databases.
+ * @param[in,out] specs    What to open; hd is set on return.
+ * @param[in]     n        Number of specs.
+ * @return                 How many were opened.
+ */
+uint32_t qmap_open_all(const char *filename, qmap_spec_t *specs,
+                       uint32_t n);
+
+/** Most files a sharded map is split across. */
+#define QM_MAX_SHARDS 1000
+
+/**
+ * @brief Open a map split across several files by key hash.
+ *
+ * The entries are spread over nshards files named base.000,
+ * base.001 and so on, each holding a section for database as
+ * qmap_open() files do. All of them are loaded at open. qmap_save()
+ * rewrites only the files whose shard changed since it was read or
+ * last saved, on worker threads like other files, so a change to
+ * a few keys rewrites a few files; the files may be symlinks to
+ * other disks. A file may hold shards of several maps of the same
+ * base, and databases of qmap_open() maps too.
+ *
+ * Open with the shard count the files were written with: entries
+ * found in the wrong file are moved by the next save, but files past
+ * the count are not read, so a count below the one written (base.NNN
+ * of the count holding database) is refused. QM_MIRROR, QM_WAL,
+ * QM_LAZY and QM_RDONLY_MMAP are refused too.
+ *
+ * @param[in] base     Path the file names start with.
+ * @param[in] database Database name within each file, or NULL.
+ * @param[in] nshards  Number of files, 1 to QM_MAX_SHARDS.
+ * @return             Handle, or QM_MISS.
+ */
+uint32_t qmap_open_sharded(const char *base, const char *database,
+                           uint32_t ktype, uint32_t vtype,
+                           uint32_t mask, uint32_t flags,
+                           uint32_t nshards);
+
 /**
  * @brief Returns the value type (vtype) of a map.
  */
@@ -229,17 +435,125 @@ size_t qmap_type_len(uint32_t type_id);
 /**
  * @brief Write all file-backed maps to disk.
  *
- * Walks the internal cache, computes file sizes,
- * and performs mmap/memcpy writes for maps
- * associated with a file.
+ * Walks the internal cache and writes the maps of
+ * each file out. With enough entries, sections are
+ * built and written on worker threads, several files
+ * and parts of large maps at once (QM_CFG_THREADS,
+ * QM_CFG_PAR_MIN); the files are the same as from a
+ * serial save. Waits for a background save started by
+ * qmap_save_async() first.
  *
  * @note This is automatically called at process exit.
  *       Explicit calls are only needed for mid-execution
  *       checkpointing or when you want to ensure data
  *       is persisted before continuing.
+ *
+ * Files with QM_WAL maps are synced before their logs are
+ * emptied, which makes this the checkpoint of those maps.
+ *
+ * Files none of whose open maps changed since they were
+ * loaded or last saved are left untouched. Others are written
+ * to <filename>.tmp, synced and renamed over the file, so a
+ * failed or interrupted save leaves the previous file whole.
  */
 void qmap_save(void);
 
+/**
+ * @brief Start qmap_save() in the background.
+ *
+ * Forks a child that writes the maps as they are now, so the
+ * caller only pays for the fork (copying page tables, not
+ * data) while its maps remain usable. Once the child is
+ * reaped by qmap_save_poll() or qmap_save_wait(), the maps
+ * count as saved as of the fork, and QM_WAL logs drop the
+ * records the image holds. Changes made meanwhile are saved
+ * by the next save.
+ *
+ * @return 0 if the save started or nothing needed saving,
+ *         -1 if one is still running or fork() failed.
+ */
+int qmap_save_async(void);
+
+/**
+ * @brief Check on a background save without blocking.
+ *
+ * @return 1 while it runs, 0 once it succeeded (or if none
+ *         was started), -1 if it failed.
+ */
+int qmap_save_poll(void);
+
+/**
+ * @brief Wait for a background save to finish.
+ *
+ * @return 0 if it succeeded or none was started, -1 if it
+ *         failed.
+ */
+int qmap_save_wait(void);
+
+/**
+ * @brief Advance an incremental checkpoint by about budget_us.
+ *
+ * For event loops: the first call captures every file that
+ * needs saving as it is now (the index of each map, not its
+ * payloads), later calls write records to <filename>.tmp until
+ * the budget runs out, renaming each file into place once it
+ * is complete. Maps can be changed between steps: payloads
+ * they replace or delete are kept until written, so the files
+ * hold the maps as they were at the first step. qmap_save(),
+ * qmap_save_async() and closing a map of the checkpoint
+ * complete it first.
+ *
+ * @param[in] budget_us Time to spend, 0 to complete it.
+ * @return 1 while the checkpoint is in progress, 0 once it is
+ *         complete (or nothing needed saving), -1 if a file
+ *         could not be written (the checkpoint is dropped).
+ */
+int qmap_save_step(uint32_t budget_us);
+
+/**
+ * @brief Group commit for QM_WAL maps.
+ *
+ * Writes out the changes buffered since the last call and
+ * fsyncs every log. Changes made before it returns survive a
+ * crash.
+ */
+void qmap_wal_sync(void);
+
+/**
+ * @brief Write what changed in a QM_DELTA map since a version of it.
+ *
+ * Writes to fd the changes made to the map after since, as
+ * deletions of keys and puts of entries as they are now: for
+ * qmap_delta_apply() to make to a map of the same key and value
+ * types and database name, on its own or in a process or host
+ * that reads fd. A since of 0, or from before the map was opened
+ * or before the oldest deletion it keeps (QM_CFG_DELTA_WINDOW),
+ * gets a delta that drops the map and puts all of it.
+ *
+ * @param[in] hd    QM_DELTA map handle.
+ * @param[in] since What an earlier call returned, or 0.
+ * @param[in] fd    Where to write the delta.
+ * @return The version of the map the delta brings a copy to, to
+ *         pass as since next time; since itself if the delta
+ *         could not be written.
+ */
+uint64_t qmap_delta_export(uint32_t hd, uint64_t since, int fd);
+
+/**
+ * @brief Make the changes of a delta from qmap_delta_export().
+ *
+ * Reads a delta from fd and makes its changes through qmap_put(),
+ * qmap_del() and qmap_drop(), so they reach the map's mirrors and
+ * write-ahead log as any others, and QM_SHARED readers see them
+ * as one change. A delta that is cut short or corrupt leaves the
+ * changes before that made: the export can be applied again.
+ *
+ * @param[in] hd Map handle.
+ * @param[in] fd Where to read the delta from.
+ * @return 0, or -1 if fd does not hold a whole delta of this map.
+ */
+int qmap_delta_apply(uint32_t hd, int fd);
+
 /**
  * @brief Close a map and free its resources.
  *
@@ -367,6 +681,31 @@ void qmap_del(uint32_t hd,
  */
 void qmap_del_all(uint32_t hd, const void * const key);
 
+/**
+ * @brief Delete every entry whose key falls in [lo, hi].
+ *
+ * Requires QM_SORTED. The slice is located with two binary
+ * searches on the sorted index, which is spliced once instead
+ * of being marked dirty. When nothing is linked to the map the
+ * payloads are freed in bulk and the hash table rebuilt once;
+ * otherwise each entry is deleted through the regular path so
+ * linked secondaries and mirrors stay consistent.
+ *
+ * @param[in] hd Map handle (QM_SORTED).
+ * @param[in] lo Lowest key to delete (inclusive), NULL → from start.
+ * @param[in] hi Highest key to delete (inclusive), NULL → to end.
+ * @return       Number of entries deleted.
+ *
+ * @code
+ * // Retention trimming of a time-keyed map
+ * uint32_t cutoff = now - retention;
+ * qmap_del_range(by_time, NULL, &cutoff);
+ * @endcode
+ */
+uint32_t qmap_del_range(uint32_t hd,
+                        const void * const lo,
+                        const void * const hi);
+
 /**
  * @brief Remove all entries from a map.
  *
@@ -374,6 +713,64 @@ void qmap_del_all(uint32_t hd, const void * const key);
  */
 void qmap_drop(uint32_t hd);
 
+/**
+ * @brief Enter bulk build mode.
+ *
+ * Presizes the map for @p expected_n more entries so the puts
+ * that follow never regrow it, and defers the work those puts
+ * would repeat per entry to a single pass in qmap_bulk_end():
+ * linked secondaries and mirrors are re-derived once and the
+ * sorted index is left to be rebuilt once.
+ *
+ * When the map is empty, puts also skip the hash table and just
+ * append; the table is built (and duplicate keys resolved, the
+ * last put winning) by qmap_bulk_end(). Until then lookups on
+ * the map do not see the new entries.
+ *
+ * File loading uses this internally.
+ *
+ * @param[in] hd         Map handle.
+ * @param[in] expected_n Number of entries about to be put.
+ */
+void qmap_bulk_begin(uint32_t hd, uint32_t expected_n);
+
+/**
+ * @brief Leave bulk build mode.
+ *
+ * Builds deferred index structures and repopulates linked
+ * maps from the primary. No-op outside bulk mode.
+ *
+ * @param[in] hd Map handle.
+ */
+void qmap_bulk_end(uint32_t hd);
+
+/**
+ * @brief Put many pairs at once.
+ *
+ * Same outcome as calling qmap_put() for each pair in order,
+ * inside a bulk section (one is opened and closed around the call
+ * if not already in one). When the map takes deferred appends and
+ * the batch is large enough, keys and values are copied in and
+ * hashed by several threads, and so is the hash table build of
+ * qmap_bulk_end(); see qmap_config().
+ *
+ * @param[in] hd     Map handle.
+ * @param[in] keys   Array of @p count keys.
+ * @param[in] values Array of @p count values.
+ * @param[in] count  Number of pairs.
+ * @return Number of pairs stored.
+ */
+uint32_t qmap_bulk_put(uint32_t hd, const void * const *keys,
+    const void * const *values, uint32_t count);
+
+/**
+ * @brief Set a library-wide tunable.
+ *
+ * @param[in] opt   One of enum qmap_cfg.
+ * @param[in] value New value.
+ */
+void qmap_config(uint32_t opt, size_t value);
+
 /** @} */
 
 /** @defgroup qmap_assoc Qmap associations
@@ -552,6 +949,25 @@ int qmap_next(const void **key,
               const void **value,
               uint32_t cur_id);
 
+/**
+ * @brief Fetch up to @p max key/value pairs at once.
+ *
+ * Same sequence as repeated qmap_next() calls, but plain scans
+ * (whole map or sorted range) are served by a tight loop that
+ * skips holes and prefetches the payloads ahead. Can be mixed
+ * with qmap_next() on the same cursor.
+ *
+ * @param[in]  cur_id Cursor handle.
+ * @param[out] keys   Receives up to @p max key pointers.
+ * @param[out] vals   Receives the matching value pointers.
+ * @param[in]  max    Capacity of @p keys and @p vals.
+ * @return            Number of pairs written. 0 means the cursor
+ *                    is exhausted; it is released then, and only
+ *                    then (a short batch is not the end).
+ */
+uint32_t qmap_next_batch(uint32_t cur_id, const void **keys,
+                         const void **vals, uint32_t max);
+
 /**
  * @brief End iteration early.
  *
@@ -559,6 +975,27 @@ int qmap_next(const void **key,
  */
 void qmap_fin(uint32_t cur_id);
 
+/**
+ * @brief Split a full iteration into disjoint cursors.
+ *
+ * Divides the map into @p k contiguous slices and opens a cursor
+ * on each, so that k threads can each drain one with qmap_next()
+ * at the same time. Together they visit every entry exactly once.
+ * With QM_RANGE on a QM_SORTED map the slices are ranges of the
+ * sorted index, in order, each yielding its keys in order;
+ * otherwise they split the position space.
+ *
+ * The map must not be modified while any of the cursors is live.
+ *
+ * @param[in]  hd      Map handle.
+ * @param[in]  k       Number of cursors.
+ * @param[out] cursors Receives @p k cursor handles.
+ * @param[in]  flags   0 or QM_RANGE.
+ * @return             Number of cursors opened (@p k).
+ */
+uint32_t qmap_iter_split(uint32_t hd, uint32_t k,
+                         uint32_t *cursors, uint32_t flags);
+
 /**
  * @brief Start iteration over all values for a key.
  *
@@ -603,6 +1040,20 @@ uint32_t qmap_get_multi(uint32_t hd, const void *key);
  */
 uint32_t qmap_count(uint32_t hd, const void *key);
 
+/**
+ * @brief Version of a map, that changes when the map does.
+ *
+ * For QM_SHARED maps it is the version the writer published, odd
+ * while it is making a change. A reader that keeps what qmap_get()
+ * or an iteration returned can take the version before and check
+ * it is the same after it is done with them: if not, the writer
+ * may have changed them meanwhile, and the reader does it again.
+ *
+ * @param[in] hd Map handle.
+ * @return       The version.
+ */
+uint64_t qmap_version(uint32_t hd);
+
 /** @} */
 
 /** @defgroup qmap_type Qmap type customization
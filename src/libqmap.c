@@ -17,6 +17,28 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef QMAP_LZ4
+#include <lz4.h>
+#endif
+#ifdef QMAP_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__linux__) && !defined(QMAP_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define QMAP_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 /* MACROS, STRUCTS, ENUMS AND GLOBALS {{{ */
 
@@ -43,6 +65,11 @@ typedef struct qmap_blk {
   size_t size;
 } qmap_blk_t;
 
+/* Payload carved out of a per-thread arena (see qmap_bulk_put).
+ * It is never free()d on its own, only recycled through the bins
+ * until the arena goes away with the map's payloads. */
+#define QMAP_BLK_ARENA (((size_t) -1 >> 1) + 1)
+
   static inline size_t
 qmap_payload_off(size_t key_len)
 {
@@ -61,18 +88,54 @@ enum QM_MBR {
 enum qm_internal_flags {
   QM_SDIRTY = 1, // sorted list needs rebuild
   QM_IS_MIRROR = 2,  // this is a QM_MIRROR map (shares positions with primary)
+  QM_BULK = 4, // between qmap_bulk_begin and qmap_bulk_end
+  QM_BDEFER = 8, // bulk puts append; hash table built at qmap_bulk_end
+  QM_WLOG = 16, // API changes are appended to head->wal
+  QM_MSORTED = 32, // sorted_idx points into the file mapping
+  QM_KORDER = 64, // bulk puts into the empty map arrive in key order
+  QM_ASYNC = 128, // in the image a background save is writing
+  QM_BHOLD = 256, // qmap_bulk_end leaves the bulk open (loading shards)
+  QM_DRANGE = 512, // qmap_ldel_range spliced sorted_idx already
 };
 
+typedef struct {
+  ids_t ids;
+  int fd;
+  char *mmaped;
+  size_t size;
+  int rdonly;	// mapped or partly unreadable: never rewrite it
+  uint32_t shard;	// of sharded maps, the part of them it holds
+
+  /* write-ahead log, for maps opened with QM_WAL */
+  int wal_fd;
+  char *wal_buf;	// records not yet written
+  size_t wal_len;
+  uint32_t wal_unsynced;	// records written since the last fsync
+  off_t wal_snap;	// log length a background save covers, or -1
+} qmap_file_t;
+
 typedef struct {
   uint32_t types[2], n, m, mask, flags,
            phd, sorted_n, iflags, dbid;
   uint32_t record_id;  /* 0 = not record-aware */
+  uint64_t mods;       /* bumped by every change */
+  uint64_t saved_mods; /* mods when last loaded or saved */
+  uint64_t async_mods; /* mods when a background save forked (QM_ASYNC) */
+  int unloaded;        /* QM_LAZY: 1 before the database is read, 2 while */
+  pthread_t loader;    /* the thread reading it */
   uint32_t vstr_hd;    /* handle to QM_STR/QM_STR map for QM_VSTR fields, 0=lazy */
   const char *file;
+  qmap_file_t *wal;    /* file whose log records changes (QM_WLOG) */
+  const char *shards;  /* qmap_open_sharded: base name of the files */
+  uint32_t nshard;     /* how many, 0 if the map is not sharded */
+  uint64_t *shard_mods;  /* shard -> mods when it last changed */
+  uint64_t *shard_saved; /* shard -> mods when last loaded or saved */
   uint32_t *inv_hds;   /* per-field inverse map handles, calloc'd at open */
   char get_buf[64];    /* reusable formatting buffer for QM_U32/QM_REFERENCE */
 } qmap_head_t;
 
+typedef struct qmap_heap qmap_heap_t;
+
 typedef struct {
   idm_t idm;
 
@@ -83,6 +146,9 @@ typedef struct {
   size_t *key_sizes;	// n -> size of allocated key
   size_t *val_sizes;	// n -> size of allocated value
   qmap_blk_t *payload_bins[QMAP_POOL_BINS];
+  qmap_blk_t *arenas;
+  int hold;		// sections of a checkpoint still reading the payloads
+  qmap_blk_t *held;	// payloads freed meanwhile, kept for it
 
   ids_t linked;
   qmap_assoc_t *assoc;
@@ -91,13 +157,39 @@ typedef struct {
   void *m_assoc_userdata;
 
   uint32_t *sorted_idx;
+
+  /* QM_RDONLY_MMAP: map, key_hashes and the size arrays point into
+   * the section at mm, and keys are found through mm_koff. */
+  const char *mm;
+  const uint64_t *mm_koff;	// n -> key offset from mm
+
+  struct qmap_vlog *vlog;	// QM_VLOG: where large values go
+  qmap_heap_t *heap;	// QM_PHEAP: the file it is allocated in
+  uint64_t *mseq;	// QM_DELTA: n -> mods when last changed
+  struct qmap_delta *delta;	// QM_DELTA: deletions kept for deltas
 } qmap_t;
 
-  static inline void *
-qmap_payload_alloc(qmap_t *qmap, size_t key_len, size_t val_len)
+static qmap_blk_t *qmap_heap_alloc(qmap_heap_t *heap, size_t size);
+static inline void qmap_heap_free(qmap_heap_t *heap, qmap_blk_t *blk);
+static void qmap_delta_new(uint32_t hd);
+static void qmap_delta_tomb(uint32_t hd, const void *key);
+static void qmap_delta_reset(uint32_t hd);
+static void qmap_delta_free(uint32_t hd);
+
+/* Block size a payload of this shape is allocated with */
+  static inline size_t
+qmap_payload_size(size_t key_len, size_t val_len)
 {
   size_t raw = qmap_payload_off(key_len) + val_len;
   size_t size = (raw + (QMAP_POOL_STEP - 1)) & ~(QMAP_POOL_STEP - 1);
+
+  return size <= QMAP_POOL_MAX ? size : raw;
+}
+
+  static inline void *
+qmap_payload_alloc(qmap_t *qmap, size_t key_len, size_t val_len)
+{
+  size_t size = qmap_payload_size(key_len, val_len);
   qmap_blk_t *blk;
   uint32_t bin;
 
@@ -107,11 +199,16 @@ qmap_payload_alloc(qmap_t *qmap, size_t key_len, size_t val_len)
     if (blk) {
       qmap->payload_bins[bin] = blk->next;
       blk->next = NULL;
-      blk->size = size;
+      blk->size = size | (blk->size & QMAP_BLK_ARENA);
       return (void *) (blk + 1);
     }
-  } else {
-    size = raw;
+  }
+
+  /* of a heap, blocks are of the size they have room for */
+  if (qmap->heap) {
+    blk = qmap_heap_alloc(qmap->heap, size);
+    CBUG(!blk, "qmap: heap full\n");
+    return (void *) (blk + 1);
   }
 
   blk = malloc(sizeof(*blk) + size);
@@ -126,42 +223,67 @@ qmap_payload_free(qmap_t *qmap, void *key)
 {
   qmap_blk_t *blk;
   uint32_t bin;
+  size_t size;
 
   if (!key)
     return;
 
   blk = ((qmap_blk_t *) key) - 1;
-  if (blk->size <= QMAP_POOL_MAX) {
-    bin = (uint32_t) (blk->size / QMAP_POOL_STEP - 1);
+  if (qmap->hold) {
+    blk->next = qmap->held;
+    qmap->held = blk;
+    return;
+  }
+
+  size = blk->size & ~QMAP_BLK_ARENA;
+  if (size <= QMAP_POOL_MAX) {
+    bin = (uint32_t) (size / QMAP_POOL_STEP - 1);
     blk->next = qmap->payload_bins[bin];
     qmap->payload_bins[bin] = blk;
-  } else
+  } else if (qmap->heap)
+    qmap_heap_free(qmap->heap, blk);
+  else if (!(blk->size & QMAP_BLK_ARENA))
     free(blk);
 }
 
   static inline void
 qmap_payload_flush(qmap_t *qmap)
 {
+  /* those of a heap stay in its file */
+  if (qmap->heap)
+    return;
+
   for (size_t i = 0; i < QMAP_POOL_BINS; i++) {
     qmap_blk_t *blk = qmap->payload_bins[i];
     while (blk) {
       qmap_blk_t *next = blk->next;
-      free(blk);
+      if (!(blk->size & QMAP_BLK_ARENA))
+        free(blk);
       blk = next;
     }
     qmap->payload_bins[i] = NULL;
   }
+
+  while (qmap->arenas) {
+    qmap_blk_t *next = qmap->arenas->next;
+    free(qmap->arenas);
+    qmap->arenas = next;
+  }
 }
 
   static inline size_t
 qmap_payload_cap(const void *key)
 {
   const qmap_blk_t *blk = ((const qmap_blk_t *) key) - 1;
-  return blk->size;
+  return blk->size & ~QMAP_BLK_ARENA;
 }
 
+/* Cursor flag: qmap_lnext leaves the cursor allocated at the end */
+#define QM_CUR_HOLD (1U << 31)
+
 typedef struct {
   uint32_t hd, pos, sub_cur, ipos, end_pos, flags;
+  uint32_t lim;		// exclusive bound on pos (split cursors)
   size_t key_len;
   const void * key;
 } qmap_cur_t;
@@ -177,18 +299,13 @@ typedef struct {
   qmap_cmp_t *cmp;
 } qmap_type_t;
 
-typedef struct {
-  ids_t ids;
-  int fd;
-  char *mmaped;
-  size_t size;
-} qmap_file_t;
-
 static qmap_head_t qmap_heads[QM_MAX];
 static qmap_t qmaps[QM_MAX];
 static qmap_cur_t qmap_cursors[QM_MAX];
 static idm_t idm, cursor_idm;
-static uint32_t _qsort_cmp_hd;
+/* cursors of a split iteration end on several threads */
+static pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint32_t _qsort_cmp_hd;
 
 static qmap_type_t qmap_types[TYPES_MASK + 1];
 static uint32_t types_n = 0;
@@ -234,2327 +351,8340 @@ static int qmap_record_find_field(uint32_t record_id, const char *field_name)
 
 /* }}} */
 
-/* BUILT-INS {{{ */
+/* FILE SPANS {{{ */
 
-  static uint32_t
-qmap_nohash(const void * const key, size_t len UNUSED)
-{
-  uint32_t u;
-  memcpy(&u, key, sizeof(u));
-  return u;
-}
+/* A span is address space reserved for a file that grows: the file is
+ * mapped at its start, and further into it as it grows, so that what
+ * it holds stays where it is. */
 
-static uint32_t
-qmap_chash(const void *data, size_t len) {
-  return XXH32(data, len, QM_SEED);
-}
+#define QMAP_SPAN ((size_t) 1 << 40)	// address space per file
+#define QMAP_SPAN_GROW ((size_t) 1 << 20)
 
-  static int
-qmap_ccmp(const void * const a,
-    const void * const b,
-    size_t len)
-{
-  return memcmp((char *) a, (char *) b, len);
-}
+typedef struct {
+  int fd;
+  char *base;		// QMAP_SPAN bytes
+  size_t mapped;	// of the file, all of it
+  int rdonly;		// of a file another process grows
+} qmap_span_t;
 
+/* Reserve a span for fd, at hint if it is free, and map the first len
+ * bytes of fd at its start; 0 or -1 */
   static int
-qmap_scmp(const void * const a,
-    const void * const b,
-    size_t len UNUSED)
+qmap_span_open(qmap_span_t *s, int fd, void *hint, size_t len)
 {
-  return strcmp((const char *)a, (const char *)b);
+  s->fd = fd;
+  s->mapped = 0;
+  s->rdonly = 0;
+  s->base = mmap(hint, QMAP_SPAN, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (s->base == MAP_FAILED)
+    return -1;
+
+  if (len && mmap(s->base, len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(s->base, QMAP_SPAN);
+    return -1;
+  }
+
+  s->mapped = len;
+  return 0;
 }
 
+/* Have at least len bytes of the file, mapped; 0 or -1. A read-only
+ * span maps what its file may hold, the file growing on its own */
   static int
-qmap_ucmp(const void * const a,
-    const void * const b,
-    size_t len UNUSED)
+qmap_span_grow(qmap_span_t *s, size_t len)
 {
-  uint32_t ua = * (const uint32_t *) a;
-  uint32_t ub = * (const uint32_t *) b;
-  if (ua < ub) return -1;
-  if (ua > ub) return 1;
+  size_t want = s->mapped + s->mapped / 2;
+
+  if (len <= s->mapped)
+    return 0;
+  if (len > QMAP_SPAN)
+    return -1;
+
+  /* by half of it at a time: a file grows a few times only */
+  want = want > len ? want : len;
+  want = (want + QMAP_SPAN_GROW - 1) & ~(QMAP_SPAN_GROW - 1);
+  want = want < QMAP_SPAN ? want : QMAP_SPAN;
+
+  if ((!s->rdonly && ftruncate(s->fd, (off_t) want))
+      || mmap(s->base + s->mapped, want - s->mapped,
+        s->rdonly ? PROT_READ : PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, s->fd, (off_t) s->mapped) == MAP_FAILED)
+    return -1;
+
+  s->mapped = want;
   return 0;
 }
 
   static void
-qmap_rassoc(const void **skey,
-    const void * const pkey UNUSED,
-    const void * const value,
-    void *userdata UNUSED)
+qmap_span_close(qmap_span_t *s)
 {
-  (void)userdata;
-  *skey = value;
+  munmap(s->base, QMAP_SPAN);
+  close(s->fd);
 }
 
 /* }}} */
 
-/* HELPER FUNCTIONS {{{ */
-
-/* Easily obtain the pointer to the key */
-  static inline void *
-qmap_key(uint32_t hd, uint32_t n)
+/* VALUE LOG {{{ */
+
+/* QM_VLOG maps keep values of qmap_cfg_vlog_min bytes or more out of
+ * their payloads, in a log file of their own: an unlinked file next
+ * to the map's, mapped into address space reserved at open so that
+ * values stay where they are as it grows, and the kernel keeps as
+ * many of them in memory as it can spare. Such a payload only holds
+ * its key, the table pointing into the log. Values are appended and
+ * never written over; the whole pages of those let go of are punched
+ * out of the file, unless a checkpoint or a background save may still
+ * read them. A log that is full or could not be had leaves values in
+ * the payloads. */
+
+typedef struct qmap_vlog {
+  qmap_span_t span;
+  size_t tail;
+  pthread_mutex_t lock;	// of tail and span: bulk puts append on threads
+} qmap_vlog_t;
+
+static size_t qmap_cfg_vlog_min = 4096;
+
+/* A log for a map of filename (NULL for none), or NULL to do without */
+  static qmap_vlog_t *
+qmap_vlog_new(const char *filename)
 {
-  qmap_t *qmap = &qmaps[hd];
-  return (void *) qmap->omap[n];
-}
+  const char *slash = filename ? strrchr(filename, '/') : NULL;
+  const char *dir = getenv("TMPDIR");
+  qmap_vlog_t *log;
+  int fd, dlen;
+
+  if (filename) {
+    dlen = slash ? (int) (slash - filename) : 1;
+    dir = slash ? filename : ".";
+  } else {
+    dir = dir && *dir ? dir : "/tmp";
+    dlen = (int) strlen(dir);
+  }
 
-/* Easily obtain the pointer to the value */
-static inline void *
-qmap_val(uint32_t hd, uint32_t n) {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *pqmap;
+  char path[dlen + sizeof("/.qmap-vlog-XXXXXX")];
 
-  if (head->flags & QM_PGET)
-    return qmap_key(head->phd, n);
+  snprintf(path, sizeof(path), "%.*s/.qmap-vlog-XXXXXX", dlen, dir);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    WARN("qmap: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
 
-  pqmap = &qmaps[head->phd];
-  return * VAL_ADDR(pqmap, n);
+  unlink(path);
+  log = calloc(1, sizeof(*log));
+  CBUG(!log, "malloc error (vlog)\n");
+  if (qmap_span_open(&log->span, fd, NULL, 0)) {
+    close(fd);
+    free(log);
+    return NULL;
+  }
+
+  pthread_mutex_init(&log->lock, NULL);
+  return log;
 }
 
-/* In some cases we want to calculate the id based on the
- * qmap's hash function and the key, and the mask. Other
- * times it's not useful to do that. This is for when it is.
- *
- * When requested, also returns the computed key length/hash so
- * callers that need to store the metadata do not recompute it.
- */
-static inline uint32_t
-qmap_id_hash(uint32_t hd, const void * const key,
-    size_t key_len, uint32_t key_hash);
+  static void
+qmap_vlog_drop(qmap_vlog_t *log)
+{
+  if (!log)
+    return;
 
-  static inline uint32_t
-qmap_id_ex(uint32_t hd, const void * const key,
-    size_t *key_len_out, uint32_t *key_hash_out)
+  qmap_span_close(&log->span);
+  pthread_mutex_destroy(&log->lock);
+  free(log);
+}
+
+/* A copy of len bytes of value in the log, NULL if there is no room */
+  static char *
+qmap_vlog_put(qmap_vlog_t *log, const void *value, size_t len)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  char *dst = NULL;
+  size_t at;
+
+  pthread_mutex_lock(&log->lock);
+  at = log->tail;
+  if (len > QMAP_SPAN - at || qmap_span_grow(&log->span, at + len))
+    goto out;
+
+  /* 8-byte aligned, like payloads */
+  log->tail = at + ((len + 7) & ~(size_t) 7);
+  dst = log->span.base + at;
+out:
+  pthread_mutex_unlock(&log->lock);
+  if (dst)
+    memcpy(dst, value, len);
+  return dst;
+}
 
-  size_t key_len = type->measure
-    ? type->measure(key)
-    : type->len;
-  uint32_t key_hash = type->hash(key, key_len);
+/* Is the value at v in the log? */
+  static inline int
+qmap_vlog_has(const qmap_vlog_t *log, const void *v)
+{
+  return log && (const char *) v >= log->span.base
+    && (const char *) v < log->span.base + QMAP_SPAN;
+}
 
-  if (key_len_out)
-    *key_len_out = key_len;
-  if (key_hash_out)
-    *key_hash_out = key_hash;
+/* Let the whole pages of len bytes at v go from the file */
+  static void
+qmap_vlog_punch(const void *v, size_t len)
+{
+#ifdef MADV_REMOVE
+  uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t from = ((uintptr_t) v + page - 1) & ~(page - 1);
+  uintptr_t to = ((uintptr_t) v + len) & ~(page - 1);
+
+  if (from < to)
+    madvise((void *) from, to - from, MADV_REMOVE);
+#else
+  (void) v; (void) len;
+#endif
+}
 
-  return qmap_id_hash(hd, key, key_len, key_hash);
+/* May values of hd let go of go from its log now? */
+  static inline int
+qmap_vlog_free_ok(uint32_t hd)
+{
+  /* a checkpoint or a background save may still read them */
+  return !qmaps[hd].hold && !(qmap_heads[hd].iflags & QM_ASYNC);
 }
 
-  static inline uint32_t
-qmap_id_hash(uint32_t hd, const void * const key,
-    size_t key_len, uint32_t key_hash)
+/* Let go of the value of entry n of hd if it is in the log */
+  static inline void
+qmap_vlog_free(uint32_t hd, uint32_t n)
 {
-  qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
-  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
-  uint32_t id = key_hash & head->mask;
-  uint32_t probe_count = 0;
 
-  while (1) {
-    uint32_t n = qmap->map[id];
+  if (qmap->vlog && qmap->table && qmap_vlog_has(qmap->vlog, qmap->table[n])
+      && qmap_vlog_free_ok(hd))
+    qmap_vlog_punch(qmap->table[n], qmap->val_sizes[n]);
+}
 
-    if (n == QM_MISS)
-      return id;
+/* Let go of every value in the log */
+  static void
+qmap_vlog_reset(qmap_vlog_t *log)
+{
+  qmap_vlog_punch(log->span.base, log->span.mapped);
+  log->tail = 0;
+}
 
-    const void *okey = qmap_key(hd, n);
+/* Put a value of len bytes of a map in its log if it goes there:
+ * the copy, or NULL if it is to follow the key in the payload */
+  static inline char *
+qmap_vlog_spill(qmap_t *qmap, const void *value, size_t len)
+{
+  if (!qmap->vlog || !len || len < qmap_cfg_vlog_min)
+    return NULL;
 
-    if (okey &&
-        qmap->key_hashes[n] == key_hash)
-    {
-      size_t len;
+  return qmap_vlog_put(qmap->vlog, value, len);
+}
 
-      if (type->measure) {
-        size_t okey_len =
-          qmap->key_sizes[n];
+/* }}} */
 
-        len = key_len > okey_len
-          ? key_len
-          : okey_len;
-      } else {
-        len = type->len;
-      }
+/* PERSISTENT HEAP {{{ */
 
-      if (type->cmp(okey, key, len) == 0)
-        return id;
+/* A QM_PHEAP map is allocated in its file: the arrays and payloads
+ * live in a span of it (see FILE SPANS), so the file is the map as it
+ * is in memory. The first QMAP_HEAP_HDR bytes hold a qmap_hhdr_t, with
+ * what of the head and qmap_t it takes to find the rest, and the
+ * address the file was mapped at: the pointers in it are of that
+ * mapping, and if the file cannot be mapped there again they are moved
+ * by the difference. Opening is then a mapping, the checks of the
+ * header and a pass over the positions in use to rebuild the free ones.
+ * Saving is an msync; a header marked clean says the file was synced
+ * whole after its last change, which every change clears first. */
+
+#define QMAP_HEAP_MAGIC 0x50454851 /* "QHEP" */
+#define QMAP_HEAP_VERSION 1
+#define QMAP_HEAP_HDR 4096
+
+typedef struct {
+  uint32_t magic, version;
+  uint64_t base;	// where it was mapped
+  uint64_t tail;	// bytes handed out, this header included
+  uint32_t clean, dbid;
+  uint32_t types[2], flags, n, m, sorted_n, sdirty, last;
+  uint32_t *map;
+  const void **omap;
+  uint32_t *key_hashes;
+  void **table;
+  size_t *key_sizes, *val_sizes;
+  uint32_t *sorted_idx;
+  qmap_blk_t *bins[QMAP_POOL_BINS];
+  qmap_blk_t *large;	// blocks above QMAP_POOL_MAX let go of
+  uint64_t seq;		// changes published, odd while one is made
+} qmap_hhdr_t;
+
+static_assert(sizeof(qmap_hhdr_t) <= QMAP_HEAP_HDR, "heap header size");
+
+struct qmap_heap {
+  qmap_span_t span;
+  qmap_hhdr_t *hdr;	// at span.base
+  uint32_t depth;	// QM_SHARED writer: changes being made
+  int reader, torn;	// QM_SHARED reader, that found the writer gone
+  uint64_t seq;		// reader: of the map as it has it
+  uint32_t *sorted;	// reader: its own sorted index, of sorted_m
+  uint32_t sorted_m;
+};
+
+/* Blocks above QMAP_POOL_MAX looked at for one to reuse */
+#define QMAP_HEAP_FIT 64
+
+/* A block of at least size bytes after its header, NULL if the file
+ * cannot grow. Its size is all it has room for */
+  static qmap_blk_t *
+qmap_heap_alloc(qmap_heap_t *heap, size_t size)
+{
+  qmap_hhdr_t *hdr = heap->hdr;
+  qmap_blk_t **pp = &hdr->large, *blk;
+
+  size = (size + QMAP_POOL_STEP - 1) & ~(size_t) (QMAP_POOL_STEP - 1);
+
+  /* first fit, of blocks not more than twice as large */
+  for (int i = 0; *pp && i < QMAP_HEAP_FIT; i++, pp = &(*pp)->next)
+    if ((*pp)->size >= size && (*pp)->size / 2 <= size) {
+      blk = *pp;
+      *pp = blk->next;
+      blk->next = NULL;
+      return blk;
     }
 
-    id = (id + 1) & head->mask;
+  if (qmap_span_grow(&heap->span, hdr->tail + sizeof(*blk) + size))
+    return NULL;
 
-    if (++probe_count >= head->m)
-      return QM_MISS;
-  }
+  blk = (qmap_blk_t *) (heap->span.base + hdr->tail);
+  hdr->tail += sizeof(*blk) + size;
+  blk->next = NULL;
+  blk->size = size;
+  return blk;
 }
 
-  static inline uint32_t
-qmap_id(uint32_t hd, const void * const key)
+  static inline void
+qmap_heap_free(qmap_heap_t *heap, qmap_blk_t *blk)
 {
-  return qmap_id_ex(hd, key, NULL, NULL);
+  blk->next = heap->hdr->large;
+  heap->hdr->large = blk;
 }
 
-/* }}} */
+/* Arrays of a map, from its heap if it has one */
+  static void *
+qmap_mem(qmap_t *qmap, size_t size)
+{
+  qmap_blk_t *blk;
 
-/* B-TREE SUPPORT HELPERS {{{ */
+  if (!qmap->heap)
+    return malloc(size);
 
-  static int
-qmap_n_cmp(const void *a, const void *b)
+  blk = qmap_heap_alloc(qmap->heap, size);
+  return blk ? blk + 1 : NULL;
+}
+
+  static void
+qmap_unmem(qmap_t *qmap, void *p)
 {
-  uint32_t n_a = *(const uint32_t *)a;
-  uint32_t n_b = *(const uint32_t *)b;
+  if (!qmap->heap)
+    free(p);
+  else if (p)
+    qmap_heap_free(qmap->heap, (qmap_blk_t *) p - 1);
+}
 
-  const void *key_a = qmap_key(_qsort_cmp_hd, n_a);
-  const void *key_b = qmap_key(_qsort_cmp_hd, n_b);
+  static void *
+qmap_remem(qmap_t *qmap, void *p, size_t size)
+{
+  size_t cap;
+  void *np;
 
-  if (key_a == NULL || key_b == NULL)
-    return 0;
+  if (!qmap->heap)
+    return realloc(p, size);
 
-  qmap_head_t *head = &qmap_heads[_qsort_cmp_hd];
-  qmap_t *qmap = &qmaps[_qsort_cmp_hd];
-  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  cap = p ? ((qmap_blk_t *) p - 1)->size : 0;
+  if (size <= cap)
+    return p;
 
-  if (type->measure) {
-    size_t len_a = qmap->key_sizes[n_a];
-    size_t len_b = qmap->key_sizes[n_b];
-    size_t len = (len_a > len_b) ? len_a : len_b;
-    return type->cmp(key_a, key_b, len);
+  np = qmap_mem(qmap, size);
+  if (np && p) {
+    memcpy(np, p, cap);
+    qmap_unmem(qmap, p);
   }
 
-  return type->cmp(key_a, key_b, type->len);
+  return np;
+}
+
+/* Note that hd is about to change: its file is no longer whole */
+  static inline void
+qmap_heap_dirty(uint32_t hd)
+{
+  qmap_heap_t *heap = qmaps[hd].heap;
+
+  if (!heap || !heap->hdr->clean)
+    return;
+
+  heap->hdr->clean = 0;
+  if (msync(heap->hdr, QMAP_HEAP_HDR, MS_SYNC))
+    WARN("qmap %u: heap msync: %s\n", hd, strerror(errno));
 }
 
+/* Have the header of the heap of hd tell where the map is now */
   static void
-qmap_rebuild_sorted(uint32_t hd)
+qmap_heap_hdr(uint32_t hd)
 {
   qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
-  uint32_t n_idx = 0;
+  qmap_hhdr_t *hdr = qmap->heap->hdr;
+
+  hdr->n = head->n;
+  hdr->m = head->m;
+  hdr->sorted_n = head->sorted_n;
+  hdr->sdirty = !!(head->iflags & QM_SDIRTY);
+  hdr->last = qmap->idm.last;
+  hdr->map = qmap->map;
+  hdr->omap = qmap->omap;
+  hdr->key_hashes = qmap->key_hashes;
+  hdr->table = qmap->table;
+  hdr->key_sizes = qmap->key_sizes;
+  hdr->val_sizes = qmap->val_sizes;
+  hdr->sorted_idx = qmap->sorted_idx;
+  memcpy(hdr->bins, qmap->payload_bins, sizeof(hdr->bins));
+}
 
-  for (uint32_t n = 0; n < qmap->idm.last; n++) {
-    if (qmap->omap[n] != NULL)
-      qmap->sorted_idx[n_idx++] = n;
-  }
-  head->sorted_n = n_idx;
+/* Write what of hd is not in its file yet out; 0 or -1 */
+  static int
+qmap_heap_sync(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_hhdr_t *hdr = qmap->heap->hdr;
 
-  _qsort_cmp_hd = hd;
-  qsort(qmap->sorted_idx, head->sorted_n,
-      sizeof(uint32_t), qmap_n_cmp);
+  if (qmap->heap->reader || hdr->clean)
+    return 0;
 
-  head->iflags &= ~QM_SDIRTY;
-}
+  qmap_heap_hdr(hd);
 
-/* Binary search modes */
-enum {
-  QMAP_BSEARCH_ANY = 0,    /* Find any match (original behavior) */
-  QMAP_BSEARCH_FIRST = 1,  /* Find first occurrence */
-  QMAP_BSEARCH_LAST = 2    /* Find last occurrence */
-};
+  /* all of it first: clean is only ever on disk after the rest */
+  if (msync(qmap->heap->span.base, hdr->tail, MS_SYNC))
+    goto fail;
 
-/* Unified binary search with mode parameter.
- * For QMAP_BSEARCH_ANY: returns insertion point if not found, sets *exact
- * For QMAP_BSEARCH_FIRST/LAST: returns position or -1 if not found */
-  static int
-qmap_bsearch_ex(uint32_t hd, const void *key, int *exact, int mode)
-{
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
-  int result = -1;
+  hdr->clean = 1;
+  if (msync(hdr, QMAP_HEAP_HDR, MS_SYNC))
+    goto fail;
 
-  if (head->iflags & QM_SDIRTY)
-    qmap_rebuild_sorted(hd);
+  head->saved_mods = head->mods;
+  return 0;
 
-  if (head->sorted_n == 0) {
-    if (exact) *exact = 0;
-    return (mode == QMAP_BSEARCH_ANY) ? 0 : -1;
-  }
+fail:
+  hdr->clean = 0;
+  WARN("qmap %u: heap msync: %s\n", hd, strerror(errno));
+  return -1;
+}
 
-  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
-  size_t key_len = qmap_len(head->types[QM_KEY], key);
-  int low = 0, high = (int) head->sorted_n - 1;
-  int mid = 0;
+/* Move the pointers of a heap mapped delta bytes from where they were
+ * of (the list at *pp and the blocks on it, or a pointer) */
+#define QMAP_HEAP_MOVE(p, delta) \
+  do { if (p) (p) = (void *) ((char *) (p) + (delta)); } while (0)
 
-  if (exact) *exact = 0;
+  static void
+qmap_heap_move_list(qmap_blk_t **pp, ptrdiff_t delta)
+{
+  for (; *pp; pp = &(*pp)->next)
+    QMAP_HEAP_MOVE(*pp, delta);
+}
 
-  while (low <= high) {
-    mid = low + (high - low) / 2;
-    const void *mid_key = qmap_key(hd, qmap->sorted_idx[mid]);
+  static void
+qmap_heap_move(qmap_hhdr_t *hdr, ptrdiff_t delta)
+{
+  QMAP_HEAP_MOVE(hdr->map, delta);
+  QMAP_HEAP_MOVE(hdr->omap, delta);
+  QMAP_HEAP_MOVE(hdr->key_hashes, delta);
+  QMAP_HEAP_MOVE(hdr->table, delta);
+  QMAP_HEAP_MOVE(hdr->key_sizes, delta);
+  QMAP_HEAP_MOVE(hdr->val_sizes, delta);
+  QMAP_HEAP_MOVE(hdr->sorted_idx, delta);
+
+  for (uint32_t n = 0; n < hdr->last; n++) {
+    QMAP_HEAP_MOVE(hdr->omap[n], delta);
+    if (hdr->table)
+      QMAP_HEAP_MOVE(hdr->table[n], delta);
+  }
 
-    size_t len;
-    if (type->measure) {
-      size_t mid_len = qmap->key_sizes[qmap->sorted_idx[mid]];
-      len = (key_len > mid_len) ? key_len : mid_len;
-    } else
-      len = type->len;
+  for (uint32_t i = 0; i < QMAP_POOL_BINS; i++)
+    qmap_heap_move_list(&hdr->bins[i], delta);
+  qmap_heap_move_list(&hdr->large, delta);
+  hdr->base += delta;
+}
 
-    int cmp = type->cmp(mid_key, key, len);
+/* Is the header at hdr, of a file of size bytes, one hd can use? */
+  static int
+qmap_heap_valid(uint32_t hd, const qmap_hhdr_t *hdr, size_t size)
+{
+  qmap_head_t *head = &qmap_heads[hd];
 
-    if (cmp == 0) {
-      if (exact) *exact = 1;
-      result = mid;
-      if (mode == QMAP_BSEARCH_ANY)
-        return mid;  /* Return immediately for ANY mode */
-      else if (mode == QMAP_BSEARCH_FIRST)
-        high = mid - 1;  /* Continue searching left */
-      else /* QMAP_BSEARCH_LAST */
-        low = mid + 1;   /* Continue searching right */
-    } else if (cmp < 0)
-      low = mid + 1;
-    else
-      high = mid - 1;
-  }
+  if (hdr->magic != QMAP_HEAP_MAGIC || hdr->version != QMAP_HEAP_VERSION
+      || hdr->tail < QMAP_HEAP_HDR || hdr->tail > size
+      || !hdr->m || hdr->m & (hdr->m - 1) || hdr->last > hdr->m)
+    return 0;
 
-  return (mode == QMAP_BSEARCH_ANY && (exact == NULL || !*exact)) ? low : result;
+  return hdr->types[QM_KEY] == head->types[QM_KEY]
+    && hdr->types[QM_VALUE] == head->types[QM_VALUE]
+    && hdr->dbid == head->dbid
+    && !((hdr->flags ^ head->flags) & (QM_SORTED | QM_MULTIVALUE));
 }
 
-/* Wrapper for backward compatibility with original qmap_bsearch */
-  static inline int
-qmap_bsearch(uint32_t hd, const void *key, int *exact)
+/* Take the arrays of hd, as _qmap_open made them, into its new heap */
+  static void
+qmap_heap_adopt(uint32_t hd)
 {
-  return qmap_bsearch_ex(hd, key, exact, QMAP_BSEARCH_ANY);
-}
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_hhdr_t *hdr = qmap->heap->hdr;
+  void **arr[] = {
+    (void **) &qmap->map, (void **) &qmap->omap,
+    (void **) &qmap->key_hashes, (void **) &qmap->table,
+    (void **) &qmap->key_sizes, (void **) &qmap->val_sizes,
+    (void **) &qmap->sorted_idx,
+  };
+  size_t len[] = {
+    sizeof(uint32_t), sizeof(void *), sizeof(uint32_t), sizeof(void *),
+    sizeof(size_t), sizeof(size_t), sizeof(uint32_t),
+  };
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = QMAP_HEAP_MAGIC;
+  hdr->version = QMAP_HEAP_VERSION;
+  hdr->base = (uint64_t) (uintptr_t) qmap->heap->span.base;
+  hdr->tail = QMAP_HEAP_HDR;
+  hdr->dbid = head->dbid;
+  hdr->types[QM_KEY] = head->types[QM_KEY];
+  hdr->types[QM_VALUE] = head->types[QM_VALUE];
+  hdr->flags = head->flags;
+
+  for (size_t i = 0; i < sizeof(arr) / sizeof(*arr); i++) {
+    void *p;
+
+    if (!*arr[i])
+      continue;
 
-/* OPEN / INITIALIZATION {{{ */
+    p = qmap_mem(qmap, len[i] * head->m);
+    CBUG(!p, "qmap: heap full\n");
+    memcpy(p, *arr[i], len[i] * head->m);
+    free(*arr[i]);
+    *arr[i] = p;
+  }
+}
 
-/* Low level way of opening databases. */
-  static uint32_t
-_qmap_open(uint32_t ktype, uint32_t vtype,
-    uint32_t mask, uint32_t flags)
+/* Take the arrays of hd from the heap it opened, as saved */
+  static void
+qmap_heap_take(uint32_t hd)
 {
-  uint32_t hd = idm_new(&idm);
   qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
-  uint32_t len;
-  size_t ids_len;
+  qmap_hhdr_t *hdr = qmap->heap->hdr;
 
-  mask = mask ? mask : QM_DEFAULT_MASK;
+  free(qmap->map);
+  free(qmap->omap);
+  free(qmap->key_hashes);
+  free(qmap->table);
+  free(qmap->key_sizes);
+  free(qmap->val_sizes);
+  free(qmap->sorted_idx);
+
+  qmap->map = hdr->map;
+  qmap->omap = hdr->omap;
+  qmap->key_hashes = hdr->key_hashes;
+  qmap->table = hdr->table;
+  qmap->key_sizes = hdr->key_sizes;
+  qmap->val_sizes = hdr->val_sizes;
+  qmap->sorted_idx = hdr->sorted_idx;
+  memcpy(qmap->payload_bins, hdr->bins, sizeof(hdr->bins));
+
+  head->n = hdr->n;
+  head->m = hdr->m;
+  head->mask = hdr->m - 1;
+  head->sorted_n = hdr->sorted_n;
+  if (!hdr->sdirty)
+    head->iflags &= ~QM_SDIRTY;
+
+  /* the positions in use give the free ones */
+  for (uint32_t n = 0; n < hdr->last; n++)
+    if (qmap->omap[n])
+      idm_push(&qmap->idm, n);
+}
 
-  /* QM_MULTIVALUE requires QM_SORTED */
-  if ((flags & QM_MULTIVALUE) && !(flags & QM_SORTED)) {
-    fprintf(stderr, "qmap: QM_MULTIVALUE requires QM_SORTED flag\n");
-    idm_del(&idm, hd);
-    return QM_MISS;
-  }
+/* Open the heap of hd at filename, a new one if the file is empty;
+ * 0, or -1 if it cannot be used */
+  static int
+qmap_heap_open(uint32_t hd, const char *filename)
+{
+  qmap_t *qmap = &qmaps[hd];
+  qmap_hhdr_t hdr;
+  qmap_heap_t *heap;
+  struct stat st;
+  int fd;
 
-  DEBUG(1, "%u %u 0x%x %u\n",
-      hd, ktype,
-      mask, flags);
+  fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || fstat(fd, &st)) {
+    WARN("qmap_open: %s: %s\n", filename, strerror(errno));
+    goto fail;
+  }
 
-  len = mask + 1u;
+  /* one process, and one map, has it at a time */
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    WARN("qmap_open: %s: in use\n", filename);
+    goto fail;
+  }
 
-  CBUG((len & mask) != 0, "mask must be 2^k - 1\n");
-  ids_len = len * sizeof(uint32_t);
+  heap = calloc(1, sizeof(*heap));
+  CBUG(!heap, "malloc error (heap)\n");
 
-  qmap->map = malloc(ids_len);
-  qmap->omap = malloc(len * sizeof(void *));
-  CBUG(!(qmap->map && qmap->omap), "malloc error\n");
-  qmap->idm = idm_init();
-  qmap->linked = ids_init();
+  if (!st.st_size) {
+    if (qmap_span_open(&heap->span, fd, NULL, 0)
+        || qmap_span_grow(&heap->span, QMAP_HEAP_HDR))
+      goto fail_heap;
 
-  head->m = len;
-  head->types[QM_KEY] = ktype;
-  head->types[QM_VALUE] = vtype;
-  head->mask = mask;
-  head->flags = flags;
-  head->phd = hd;
+    heap->hdr = (qmap_hhdr_t *) heap->span.base;
+    qmap->heap = heap;
+    qmap_heap_adopt(hd);
+    qmap_heap_sync(hd);
+    return 0;
+  }
 
-  // STORE {{{
-  qmap->table = malloc(sizeof(void *) * len);
-  CBUG(!qmap->table, "malloc error (table)\n");
-  memset(qmap->table, 0, sizeof(void *) * len);
-  // }}}
+  if ((size_t) st.st_size < QMAP_HEAP_HDR
+      || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)
+      || !qmap_heap_valid(hd, &hdr, (size_t) st.st_size))
+  {
+    WARN("qmap_open: %s: not a heap of this map\n", filename);
+    goto fail_heap;
+  }
 
-  qmap->key_hashes = calloc(len, sizeof(*qmap->key_hashes));
-  CBUG(!qmap->key_hashes, "malloc error (key_hashes)\n");
+  if (!hdr.clean) {
+    WARN("qmap_open: %s: changed since last synced\n", filename);
+    goto fail_heap;
+  }
 
-  if (flags & QM_SORTED) {
-    qmap->sorted_idx = malloc(sizeof(uint32_t) * len);
-    CBUG(!qmap->sorted_idx, "malloc error (sorted_idx)\n");
-  } else
-    qmap->sorted_idx = NULL;
+  if (qmap_span_open(&heap->span, fd, (void *) (uintptr_t) hdr.base,
+        (size_t) st.st_size))
+    goto fail_heap;
 
-  qmap->key_sizes = calloc(len, sizeof(*qmap->key_sizes));
-  qmap->val_sizes = calloc(len, sizeof(*qmap->val_sizes));
-  CBUG(!(qmap->key_sizes && qmap->val_sizes), "malloc error (size arrays)\n");
+  /* readers map it where it was: moving it would lose them */
+  if (heap->span.base != (char *) (uintptr_t) hdr.base
+      && (qmap_heads[hd].flags & QM_SHARED))
+  {
+    WARN("qmap_open: %s: cannot be mapped where readers have it\n",
+        filename);
+    qmap_span_close(&heap->span);
+    free(heap);
+    return -1;
+  }
 
-  head->iflags |= QM_SDIRTY;
-  head->sorted_n = 0;
+  heap->hdr = (qmap_hhdr_t *) heap->span.base;
+  qmap->heap = heap;
+  if (heap->hdr->base != (uint64_t) (uintptr_t) heap->span.base) {
+    qmap_heap_dirty(hd);
+    qmap_heap_move(heap->hdr,
+        heap->span.base - (char *) (uintptr_t) heap->hdr->base);
+  }
 
-  memset(qmap->map, 0xFF, ids_len);
-  memset(qmap->omap, 0, sizeof(void *) * len);
+  qmap_heap_take(hd);
+  return 0;
 
-  return hd;
+fail_heap:
+  free(heap);
+fail:
+  if (fd >= 0)
+    close(fd);
+  return -1;
 }
 
-static inline void
-qmap_load_file(char *filename, uint32_t dbid);
-
-static inline uint32_t
-_qmap_put(uint32_t hd, const void * key,
-    const void *value, uint32_t pn);
-
+/* Sync the heap of hd and let go of it, and of the arrays in it */
   static void
-qmap_rebuild_map(uint32_t hd)
+qmap_heap_close(uint32_t hd)
 {
-  qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
 
-  memset(qmap->map, 0xFF,
-      sizeof(uint32_t) * head->m);
+  qmap_heap_sync(hd);
+  qmap_span_close(&qmap->heap->span);
+  free(qmap->heap->sorted);
+  free(qmap->heap);
+  qmap->heap = NULL;
 
-  for (uint32_t n = 0; n < qmap->idm.last; n++) {
-    const void *key = qmap->omap[n];
+  qmap->map = NULL;
+  qmap->omap = NULL;
+  qmap->key_hashes = NULL;
+  qmap->table = NULL;
+  qmap->key_sizes = qmap->val_sizes = NULL;
+  qmap->sorted_idx = NULL;
+  memset(qmap->payload_bins, 0, sizeof(qmap->payload_bins));
+}
 
-    if (!key)
-      continue;
+/* }}} */
 
-    uint32_t id =
-      qmap->key_hashes[n] & head->mask;
+/* SHARED MAPS {{{ */
+
+/* A QM_SHARED map has one writer, a process with its heap open
+ * (QM_PHEAP), and readers in others, which map the same file read-only
+ * at the same address, so that the pointers in it are theirs too, and
+ * serve the map from it with no copy of their own. Changes are
+ * published through hdr->seq, a sequence lock: the writer makes it
+ * odd before the first change of a call, and even again once the
+ * header says where the map is after the last one. A reader takes the
+ * header in when seq moved since it last did, and looks a key up again
+ * if seq moved while it did. Readers only ever write to memory of
+ * their own (a sorted index the writer left to rebuild, say), and what
+ * they find mid-change is bounded by what they mapped: positions are
+ * checked against the table size, and keys are only compared once
+ * their hash matches. */
+
+/* Yields between looks at seq before asking if the writer is there */
+#define QMAP_SHARED_SPIN 1024
+
+/* Does a process still have the heap open to write? */
+  static int
+qmap_shared_writer(qmap_heap_t *heap)
+{
+  if (flock(heap->span.fd, LOCK_SH | LOCK_NB))
+    return 1;
 
-    while (qmap->map[id] != QM_MISS)
-      id = (id + 1) & head->mask;
+  flock(heap->span.fd, LOCK_UN);
+  return 0;
+}
 
-    qmap->map[id] = n;
+/* seq as published, waiting out a change being made; odd if the
+ * writer went away in the middle of one */
+  static uint64_t
+qmap_shared_seq(qmap_heap_t *heap)
+{
+  uint64_t seq;
+
+  for (uint32_t i = 1;
+      (seq = __atomic_load_n(&heap->hdr->seq, __ATOMIC_ACQUIRE)) & 1; i++)
+  {
+    if (i % QMAP_SHARED_SPIN == 0 && !qmap_shared_writer(heap)) {
+      if (!heap->torn)
+        WARN("qmap: shared map left mid-change by its writer\n");
+      heap->torn = 1;
+      break;
+    }
+
+    sched_yield();
   }
+
+  return seq;
 }
 
+/* Take in where the writer last said the map of reader hd is */
   static void
-qmap_grow(uint32_t hd)
+qmap_shared_view(uint32_t hd)
 {
   qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
-  uint32_t old_m = head->m;
-  uint32_t new_m = old_m << 1;
+  qmap_heap_t *heap = qmap->heap;
+  qmap_hhdr_t *hdr = heap->hdr;
+  uint64_t seq;
+
+  while ((seq = qmap_shared_seq(heap)) != heap->seq) {
+    CBUG(qmap_span_grow(&heap->span, hdr->tail),
+        "qmap %u: shared map: %s\n", hd, strerror(errno));
+
+    qmap->map = hdr->map;
+    qmap->omap = hdr->omap;
+    qmap->key_hashes = hdr->key_hashes;
+    qmap->table = hdr->table;
+    qmap->key_sizes = hdr->key_sizes;
+    qmap->val_sizes = hdr->val_sizes;
+    qmap->idm.last = hdr->last;
+    head->n = hdr->n;
+    head->m = hdr->m;
+    head->mask = hdr->m - 1;
+
+    /* an index the writer left to rebuild is rebuilt here, apart */
+    if (hdr->sdirty && hdr->sorted_idx) {
+      if (heap->sorted_m < head->m) {
+        free(heap->sorted);
+        heap->sorted = malloc(sizeof(uint32_t) * head->m);
+        CBUG(!heap->sorted, "malloc error (shared)\n");
+        heap->sorted_m = head->m;
+      }
 
-  CBUG((new_m & (new_m - 1)) != 0,
-      "qmap_grow: capacity not power-of-two");
+      qmap->sorted_idx = heap->sorted;
+      head->iflags |= QM_SDIRTY;
+    } else {
+      qmap->sorted_idx = hdr->sorted_idx;
+      head->sorted_n = hdr->sorted_n;
+      head->iflags &= ~QM_SDIRTY;
+    }
 
-  void *tmp;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+      heap->seq = seq;
+  }
+}
 
-  tmp = realloc(qmap->omap, sizeof(void *) * new_m);
-  CBUG(!tmp, "realloc(omap)");
-  qmap->omap = tmp;
-  memset(&qmap->omap[old_m], 0,
-      sizeof(void *) * (new_m - old_m));
+/* Has the writer changed the map reader hd has since it took it in? */
+  static inline int
+qmap_shared_moved(uint32_t hd)
+{
+  qmap_heap_t *heap = qmaps[hd].heap;
 
-  if (qmap->table) {
-    tmp = realloc(qmap->table,
-        sizeof(void *) * new_m);
+  if (!heap || !heap->reader)
+    return 0;
 
-    CBUG(!tmp, "realloc(table)");
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&heap->hdr->seq, __ATOMIC_RELAXED) != heap->seq;
+}
 
-    qmap->table = tmp;
+/* The writer hd is about to change its map */
+  static inline void
+qmap_shared_begin(uint32_t hd)
+{
+  qmap_heap_t *heap = qmaps[hd].heap;
 
-    memset(&qmap->table[old_m], 0,
-        sizeof(void *) * (new_m - old_m));
-  }
+  if (!heap || !(qmap_heads[hd].flags & QM_SHARED) || heap->depth++)
+    return;
 
-  tmp = realloc(qmap->key_hashes, sizeof(uint32_t) * new_m);
-  CBUG(!tmp, "realloc(key_hashes)");
-  qmap->key_hashes = tmp;
-  memset(qmap->key_hashes + old_m, 0,
-      sizeof(uint32_t) * (new_m - old_m));
+  __atomic_store_n(&heap->hdr->seq, heap->hdr->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-  tmp = realloc(qmap->key_sizes, sizeof(size_t) * new_m);
-  CBUG(!tmp, "realloc(key_sizes)");
-  qmap->key_sizes = tmp;
-  memset(qmap->key_sizes + old_m, 0,
-      sizeof(size_t) * (new_m - old_m));
+/* The writer hd is done changing its map: publish it */
+  static inline void
+qmap_shared_end(uint32_t hd)
+{
+  qmap_heap_t *heap = qmaps[hd].heap;
 
-  tmp = realloc(qmap->val_sizes, sizeof(size_t) * new_m);
-  CBUG(!tmp, "realloc(val_sizes)");
-  qmap->val_sizes = tmp;
-  memset(qmap->val_sizes + old_m, 0,
-      sizeof(size_t) * (new_m - old_m));
+  if (!heap || !heap->depth || --heap->depth)
+    return;
 
-  if (qmap->sorted_idx) {
-    tmp = realloc(qmap->sorted_idx, sizeof(uint32_t) * new_m);
-    CBUG(!tmp, "realloc(sorted_idx)");
-    qmap->sorted_idx = tmp;
-    memset(qmap->sorted_idx + old_m, 0xFF,
-        sizeof(uint32_t) * (new_m - old_m));
+  qmap_heap_hdr(hd);
+  __atomic_store_n(&heap->hdr->seq, heap->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Open hd as a reader of the map at filename; 0, or -1 if it cannot */
+  static int
+qmap_shared_open(uint32_t hd, const char *filename)
+{
+  qmap_t *qmap = &qmaps[hd];
+  qmap_hhdr_t hdr;
+  qmap_heap_t *heap;
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st)) {
+    WARN("qmap_open: %s: %s\n", filename, strerror(errno));
+    goto fail;
   }
 
-  free(qmap->map);
-  qmap->map = malloc(sizeof(uint32_t) * new_m);
-  CBUG(!qmap->map, "malloc(map)");
-  memset(qmap->map, 0xFF, sizeof(uint32_t) * new_m);
+  if ((size_t) st.st_size < QMAP_HEAP_HDR
+      || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)
+      || !qmap_heap_valid(hd, &hdr, (size_t) st.st_size))
+  {
+    WARN("qmap_open: %s: not a heap of this map\n", filename);
+    goto fail;
+  }
 
-  head->m = new_m;
-  head->mask = new_m - 1;
+  heap = calloc(1, sizeof(*heap));
+  CBUG(!heap, "malloc error (shared)\n");
+  heap->span.fd = fd;
 
-  CBUG(head->m != head->mask + 1,
-      "qmap invariant broken");
+  /* with no writer, only a file synced whole is */
+  if (!hdr.clean && !qmap_shared_writer(heap)) {
+    WARN("qmap_open: %s: changed since last synced\n", filename);
+    goto fail_heap;
+  }
 
-  qmap_rebuild_map(hd);
-}
+  if (qmap_span_open(&heap->span, fd, (void *) (uintptr_t) hdr.base, 0))
+    goto fail_heap;
 
-  uint32_t /* API */
-qmap_open(const char *filename,
-    const char *database,
-    uint32_t ktype, uint32_t vtype,
-    uint32_t mask, uint32_t flags)
-{
-  uint32_t record_id = 0;
+  if (heap->span.base != (char *) (uintptr_t) hdr.base) {
+    WARN("qmap_open: %s: its address is taken\n", filename);
+    munmap(heap->span.base, QMAP_SPAN);
+    goto fail_heap;
+  }
 
-  /* ── Handle QM_RECORD flag ────────────────────────────────────────── */
-  if (flags & QM_RECORD_FLAG) {
+  heap->span.rdonly = 1;
+  if (qmap_span_grow(&heap->span, QMAP_HEAP_HDR)) {
+    munmap(heap->span.base, QMAP_SPAN);
+    goto fail_heap;
+  }
+
+  /* a seq it cannot have yet, for a view to be taken at once */
+  heap->hdr = (qmap_hhdr_t *) heap->span.base;
+  heap->reader = 1;
+  heap->seq = ~hdr.seq;
+  free(qmap->map);
+  free(qmap->omap);
+  free(qmap->key_hashes);
+  free(qmap->table);
+  free(qmap->key_sizes);
+  free(qmap->val_sizes);
+  free(qmap->sorted_idx);
+  qmap->sorted_idx = NULL;
+  qmap->heap = heap;
+  qmap_shared_view(hd);
+  return 0;
+
+fail_heap:
+  free(heap);
+fail:
+  if (fd >= 0)
+    close(fd);
+  return -1;
+}
+
+  uint64_t /* API */
+qmap_version(uint32_t hd)
+{
+  qmap_heap_t *heap = qmaps[hd].heap;
+
+  if (heap && (qmap_heads[hd].flags & QM_SHARED))
+    return __atomic_load_n(&heap->hdr->seq, __ATOMIC_ACQUIRE);
+
+  return qmap_heads[hd].mods;
+}
+
+/* }}} */
+
+/* BUILT-INS {{{ */
+
+  static uint32_t
+qmap_nohash(const void * const key, size_t len UNUSED)
+{
+  uint32_t u;
+  memcpy(&u, key, sizeof(u));
+  return u;
+}
+
+static uint32_t
+qmap_chash(const void *data, size_t len) {
+  return XXH32(data, len, QM_SEED);
+}
+
+  static int
+qmap_ccmp(const void * const a,
+    const void * const b,
+    size_t len)
+{
+  return memcmp((char *) a, (char *) b, len);
+}
+
+  static int
+qmap_scmp(const void * const a,
+    const void * const b,
+    size_t len UNUSED)
+{
+  return strcmp((const char *)a, (const char *)b);
+}
+
+  static int
+qmap_ucmp(const void * const a,
+    const void * const b,
+    size_t len UNUSED)
+{
+  uint32_t ua = * (const uint32_t *) a;
+  uint32_t ub = * (const uint32_t *) b;
+  if (ua < ub) return -1;
+  if (ua > ub) return 1;
+  return 0;
+}
+
+  static void
+qmap_rassoc(const void **skey,
+    const void * const pkey UNUSED,
+    const void * const value,
+    void *userdata UNUSED)
+{
+  (void)userdata;
+  *skey = value;
+}
+
+/* }}} */
+
+/* HELPER FUNCTIONS {{{ */
+
+/* Easily obtain the pointer to the key */
+  static inline void *
+qmap_key(uint32_t hd, uint32_t n)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  if (qmap->mm)
+    return (void *) (qmap->mm + qmap->mm_koff[n]);
+
+  return (void *) qmap->omap[n];
+}
+
+/* Easily obtain the pointer to the value */
+static inline void *
+qmap_val(uint32_t hd, uint32_t n) {
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *pqmap;
+
+  if (head->flags & QM_PGET)
+    return qmap_key(head->phd, n);
+
+  pqmap = &qmaps[head->phd];
+  if (pqmap->mm)
+    return (char *) qmap_key(head->phd, n)
+      + qmap_payload_off(pqmap->key_sizes[n]);
+
+  return * VAL_ADDR(pqmap, n);
+}
+
+/* In some cases we want to calculate the id based on the
+ * qmap's hash function and the key, and the mask. Other
+ * times it's not useful to do that. This is for when it is.
+ *
+ * When requested, also returns the computed key length/hash so
+ * callers that need to store the metadata do not recompute it.
+ */
+static inline uint32_t
+qmap_id_hash(uint32_t hd, const void * const key,
+    size_t key_len, uint32_t key_hash);
+
+  static inline uint32_t
+qmap_id_ex(uint32_t hd, const void * const key,
+    size_t *key_len_out, uint32_t *key_hash_out)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+
+  size_t key_len = type->measure
+    ? type->measure(key)
+    : type->len;
+  uint32_t key_hash = type->hash(key, key_len);
+
+  if (key_len_out)
+    *key_len_out = key_len;
+  if (key_hash_out)
+    *key_hash_out = key_hash;
+
+  return qmap_id_hash(hd, key, key_len, key_hash);
+}
+
+  static inline uint32_t
+qmap_id_hash(uint32_t hd, const void * const key,
+    size_t key_len, uint32_t key_hash)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  uint32_t id = key_hash & head->mask;
+  uint32_t probe_count = 0;
+
+  while (1) {
+    uint32_t n = qmap->map[id];
+
+    /* or a position a QM_SHARED reader read mid-change */
+    if (n >= head->m)
+      return n == QM_MISS ? id : QM_MISS;
+
+    const void *okey = qmap_key(hd, n);
+
+    if (okey &&
+        qmap->key_hashes[n] == key_hash)
+    {
+      size_t len;
+
+      if (type->measure) {
+        size_t okey_len =
+          qmap->key_sizes[n];
+
+        len = key_len > okey_len
+          ? key_len
+          : okey_len;
+      } else {
+        len = type->len;
+      }
+
+      if (type->cmp(okey, key, len) == 0)
+        return id;
+    }
+
+    id = (id + 1) & head->mask;
+
+    if (++probe_count >= head->m)
+      return QM_MISS;
+  }
+}
+
+  static inline uint32_t
+qmap_id(uint32_t hd, const void * const key)
+{
+  return qmap_id_ex(hd, key, NULL, NULL);
+}
+
+/* Empty slot id of the hash table of hd, moving back the entries
+ * after it that probing would no longer reach past the hole */
+  static void
+qmap_id_unset(uint32_t hd, uint32_t id)
+{
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t mask = qmap_heads[hd].mask, j = id;
+
+  qmap->map[id] = QM_MISS;
+  for (;;) {
+    uint32_t n, home;
+
+    j = (j + 1) & mask;
+    n = qmap->map[j];
+    if (n == QM_MISS)
+      return;
+
+    /* probing for it starts at home, and passes the hole first */
+    home = qmap->key_hashes[n] & mask;
+    if (((j - home) & mask) < ((j - id) & mask))
+      continue;
+
+    qmap->map[id] = n;
+    qmap->map[j] = QM_MISS;
+    id = j;
+  }
+}
+
+/* Shard of n an entry with key hash goes to */
+  static inline uint32_t
+qmap_shard(uint32_t hash, uint32_t n)
+{
+  /* the low bits pick hash table slots, and QM_U32 keys hash to
+   * themselves: mix them all in before scaling */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+
+  return (uint32_t) (((uint64_t) hash * n) >> 32);
+}
+
+/* Note a change to the entry of hd at position n */
+  static inline void
+qmap_touch(uint32_t hd, uint32_t n)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  head->mods++;
+  if (head->nshard)
+    head->shard_mods[qmap_shard(qmap->key_hashes[n], head->nshard)]
+      = head->mods;
+  if (qmap->mseq)
+    qmap->mseq[n] = head->mods;
+  qmap_heap_dirty(hd);
+}
+
+/* Note a change to every entry of hd */
+  static inline void
+qmap_touch_all(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  head->mods++;
+  for (uint32_t i = 0; i < head->nshard; i++)
+    head->shard_mods[i] = head->mods;
+  if (qmaps[hd].delta)
+    qmap_delta_reset(hd);
+  qmap_heap_dirty(hd);
+}
+
+/* Has hd changed, in its part in file, since it was read or saved? */
+  static inline int
+qmap_dirty(uint32_t hd, const qmap_file_t *file)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  if (head->nshard)
+    return head->shard_mods[file->shard] > head->shard_saved[file->shard];
+
+  return head->mods != head->saved_mods;
+}
+
+/* Record hd as of mods as saved, in file or all of them if NULL */
+  static inline void
+qmap_saved(uint32_t hd, const qmap_file_t *file, uint64_t mods)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  if (!head->nshard)
+    head->saved_mods = mods;
+  else if (file)
+    head->shard_saved[file->shard] = mods;
+  else
+    for (uint32_t i = 0; i < head->nshard; i++)
+      head->shard_saved[i] = mods;
+}
+
+/* Refuse changes to maps served from a file mapping. Every change
+ * to a map asks first, which is when a heap has its file marked as
+ * no longer whole: before any of it is written to. Those let through
+ * end in qmap_done, once the map is as the call leaves it */
+  static inline int
+qmap_rdonly(uint32_t hd)
+{
+  if (!(qmap_heads[hd].flags & QM_RDONLY_MMAP)) {
+    qmap_heap_dirty(hd);
+    qmap_shared_begin(hd);
+    return 0;
+  }
+
+  WARN("qmap %u: map is read-only (QM_RDONLY_MMAP)\n", hd);
+  return 1;
+}
+
+  static inline void
+qmap_done(uint32_t hd)
+{
+  qmap_shared_end(hd);
+}
+
+/* }}} */
+
+/* PARALLEL {{{ */
+
+#define QM_MAX_WORKERS 64
+
+static uint32_t qmap_cfg_threads; /* 0 → online CPUs */
+static size_t qmap_cfg_par_min = 1 << 16;
+static size_t qmap_cfg_sort_min = 1 << 16;
+static size_t qmap_cfg_delta_window = 1 << 16; /* deletions a delta has */
+static size_t qmap_cfg_wal_sync; /* 0 → fsync on qmap_wal_sync only */
+static int qmap_cfg_uring; /* read and write sections through io_uring */
+static uint32_t qmap_cfg_codec; /* QM_CODEC_* saved sections get */
+static int qmap_cfg_compact; /* save sections as QMAP_SEC_COMPACT */
+static __thread uint32_t qmap_worker_cap; /* share of the CPUs, 0 → all */
+
+/* How many workers to split n items of work across, if at least min */
+  static uint32_t
+qmap_workers(size_t n, size_t min)
+{
+  long cpus = qmap_cfg_threads;
+
+  if (!cpus) {
+#ifdef _SC_NPROCESSORS_ONLN
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    cpus = 1;
+#endif
+  }
+
+  if (qmap_worker_cap && cpus > qmap_worker_cap)
+    cpus = qmap_worker_cap;
+
+  if (n < min || cpus <= 1)
+    return 1;
+
+  return cpus > QM_MAX_WORKERS ? QM_MAX_WORKERS : (uint32_t) cpus;
+}
+
+typedef void *qmap_job_t(void *arg);
+
+/* Run job over k argument blocks laid out 'size' bytes apart, the
+ * first one on the calling thread. A block whose thread can not be
+ * started runs inline once the others are done. */
+  static void
+qmap_par(qmap_job_t *job, void *args, size_t size, uint32_t k)
+{
+  pthread_t tids[QM_MAX_WORKERS];
+  int started[QM_MAX_WORKERS];
+
+  for (uint32_t i = 1; i < k; i++)
+    started[i] = pthread_create(&tids[i], NULL, job,
+        (char *) args + size * i) == 0;
+
+  job(args);
+
+  for (uint32_t i = 1; i < k; i++)
+    if (started[i])
+      pthread_join(tids[i], NULL);
+    else
+      job((char *) args + size * i);
+}
+
+static int qmap_codec_built(uint32_t codec);
+
+  void /* API */
+qmap_config(uint32_t opt, size_t value)
+{
+  switch (opt) {
+  case QM_CFG_THREADS:
+    qmap_cfg_threads = value > QM_MAX_WORKERS
+      ? QM_MAX_WORKERS : (uint32_t) value;
+    break;
+  case QM_CFG_PAR_MIN:
+    qmap_cfg_par_min = value;
+    break;
+  case QM_CFG_SORT_MIN:
+    qmap_cfg_sort_min = value;
+    break;
+  case QM_CFG_COMPRESS:
+    if (qmap_codec_built((uint32_t) value))
+      qmap_cfg_codec = (uint32_t) value;
+    else
+      WARN("qmap_config: codec %zu not built in\n", value);
+    break;
+  case QM_CFG_IO_URING:
+    qmap_cfg_uring = value != 0;
+    break;
+  case QM_CFG_COMPACT:
+    qmap_cfg_compact = value != 0;
+    break;
+  case QM_CFG_VLOG_MIN:
+    qmap_cfg_vlog_min = value;
+    break;
+  case QM_CFG_DELTA_WINDOW:
+    qmap_cfg_delta_window = value < UINT32_MAX ? value : UINT32_MAX;
+    break;
+  case QM_CFG_WAL_SYNC:
+    qmap_cfg_wal_sync = value;
+    break;
+  default:
+    WARN("qmap_config: unknown option %u\n", opt);
+  }
+}
+
+/* }}} */
+
+/* B-TREE SUPPORT HELPERS {{{ */
+
+/* Compare the keys at positions n_a and n_b of hd */
+  static inline int
+qmap_pos_cmp(uint32_t hd, uint32_t n_a, uint32_t n_b)
+{
+  const void *key_a = qmap_key(hd, n_a);
+  const void *key_b = qmap_key(hd, n_b);
+
+  if (key_a == NULL || key_b == NULL)
+    return 0;
+
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+
+  if (type->measure) {
+    size_t len_a = qmap->key_sizes[n_a];
+    size_t len_b = qmap->key_sizes[n_b];
+    size_t len = (len_a > len_b) ? len_a : len_b;
+    return type->cmp(key_a, key_b, len);
+  }
+
+  return type->cmp(key_a, key_b, type->len);
+}
+
+  static int
+qmap_n_cmp(const void *a, const void *b)
+{
+  return qmap_pos_cmp(_qsort_cmp_hd,
+      *(const uint32_t *) a, *(const uint32_t *) b);
+}
+
+/* Stable merge sort of positions, using tmp (as long as a) */
+  static void
+qmap_msort(uint32_t hd, uint32_t *a, uint32_t *tmp, size_t n)
+{
+  size_t h = n / 2, i = 0, j = h, o = 0;
+
+  if (n <= 16) {
+    for (size_t x = 1; x < n; x++) {
+      uint32_t v = a[x];
+      size_t y = x;
+
+      for (; y > 0 && qmap_pos_cmp(hd, a[y - 1], v) > 0; y--)
+        a[y] = a[y - 1];
+      a[y] = v;
+    }
+    return;
+  }
+
+  qmap_msort(hd, a, tmp, h);
+  qmap_msort(hd, a + h, tmp + h, n - h);
+
+  if (qmap_pos_cmp(hd, a[h - 1], a[h]) <= 0)
+    return;
+
+  /* the left half moves out of the way; writes never pass j */
+  memcpy(tmp, a, sizeof(uint32_t) * h);
+  while (i < h && j < n)
+    a[o++] = qmap_pos_cmp(hd, tmp[i], a[j]) <= 0 ? tmp[i++] : a[j++];
+  while (i < h)
+    a[o++] = tmp[i++];
+}
+
+/* How many of the first i merged elements of a (an long) and b come
+ * from a. Equal keys take a first, which keeps merges stable. */
+  static size_t
+qmap_corank(uint32_t hd, size_t i, const uint32_t *a, size_t an,
+    const uint32_t *b, size_t bn)
+{
+  size_t lo = i > bn ? i - bn : 0;
+  size_t hi = i < an ? i : an;
+
+  while (lo < hi) {
+    size_t j = lo + (hi - lo) / 2;
+
+    if (qmap_pos_cmp(hd, a[j], b[i - j - 1]) <= 0)
+      lo = j + 1;
+    else
+      hi = j;
+  }
+
+  return lo;
+}
+
+typedef struct {
+  uint32_t hd;
+  uint32_t *a, *b, *out;
+  size_t an, bn, lo, hi;
+} qmap_sort_job_t;
+
+/* Sort run a[0, an), with out as scratch */
+  static void *
+qmap_sort_run_job(void *arg)
+{
+  qmap_sort_job_t *job = arg;
+
+  qmap_msort(job->hd, job->a, job->out, job->an);
+  return NULL;
+}
+
+/* Write elements [lo, hi) of the merge of a and b to out + lo */
+  static void *
+qmap_merge_job(void *arg)
+{
+  qmap_sort_job_t *job = arg;
+  size_t i = qmap_corank(job->hd, job->lo,
+      job->a, job->an, job->b, job->bn);
+  size_t ie = qmap_corank(job->hd, job->hi,
+      job->a, job->an, job->b, job->bn);
+  size_t j = job->lo - i, je = job->hi - ie, o = job->lo;
+
+  while (i < ie && j < je)
+    job->out[o++] = qmap_pos_cmp(job->hd, job->a[i], job->b[j]) <= 0
+      ? job->a[i++] : job->b[j++];
+  while (i < ie)
+    job->out[o++] = job->a[i++];
+  while (j < je)
+    job->out[o++] = job->b[j++];
+
+  return NULL;
+}
+
+/* Sort idx on k threads: k sorted runs, then rounds of pairwise
+ * merges, each merge split among the workers by co-ranking */
+  static void
+qmap_sort_par(uint32_t hd, uint32_t *idx, size_t n, uint32_t k)
+{
+  qmap_sort_job_t jobs[QM_MAX_WORKERS];
+  size_t bnd[QM_MAX_WORKERS + 1];
+  uint32_t *tmp = malloc(sizeof(uint32_t) * n), *src = idx, *dst = tmp;
+  uint32_t runs = k;
+
+  CBUG(!tmp, "malloc error (sort)\n");
+
+  for (uint32_t t = 0; t <= k; t++)
+    bnd[t] = n * t / k;
+
+  for (uint32_t t = 0; t < k; t++) {
+    jobs[t].hd = hd;
+    jobs[t].a = idx + bnd[t];
+    jobs[t].an = bnd[t + 1] - bnd[t];
+    jobs[t].out = tmp + bnd[t];
+  }
+
+  qmap_par(qmap_sort_run_job, jobs, sizeof(*jobs), k);
+
+  while (runs > 1) {
+    uint32_t pairs = (runs + 1) / 2, segs = k / pairs, nj = 0;
+
+    if (!segs)
+      segs = 1;
+
+    for (uint32_t p = 0; p < pairs; p++) {
+      size_t base = bnd[2 * p];
+      size_t mid = bnd[2 * p + 1];
+      size_t end = 2 * p + 2 <= runs ? bnd[2 * p + 2] : mid;
+
+      for (uint32_t g = 0; g < segs; g++) {
+        qmap_sort_job_t *job = &jobs[nj++];
+
+        job->hd = hd;
+        job->a = src + base;
+        job->an = mid - base;
+        job->b = src + mid;
+        job->bn = end - mid;
+        job->out = dst + base;
+        job->lo = (end - base) * g / segs;
+        job->hi = (end - base) * (g + 1) / segs;
+      }
+
+      bnd[p] = base;
+    }
+
+    bnd[pairs] = n;
+    runs = pairs;
+    qmap_par(qmap_merge_job, jobs, sizeof(*jobs), nj);
+
+    uint32_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != idx)
+    memcpy(idx, src, sizeof(uint32_t) * n);
+
+  free(tmp);
+}
+
+  static void
+qmap_rebuild_sorted(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t n_idx = 0;
+
+  for (uint32_t n = 0; n < qmap->idm.last; n++) {
+    if (qmap_key(hd, n) != NULL)
+      qmap->sorted_idx[n_idx++] = n;
+  }
+  head->sorted_n = n_idx;
+
+  uint32_t k = qmap_workers(n_idx, qmap_cfg_sort_min);
+
+  if (k > 1)
+    qmap_sort_par(hd, qmap->sorted_idx, n_idx, k);
+  else {
+    _qsort_cmp_hd = hd;
+    qsort(qmap->sorted_idx, head->sorted_n,
+        sizeof(uint32_t), qmap_n_cmp);
+  }
+
+  head->iflags &= ~QM_SDIRTY;
+}
+
+/* Binary search modes */
+enum {
+  QMAP_BSEARCH_ANY = 0,    /* Find any match (original behavior) */
+  QMAP_BSEARCH_FIRST = 1,  /* Find first occurrence */
+  QMAP_BSEARCH_LAST = 2    /* Find last occurrence */
+};
+
+/* Unified binary search with mode parameter.
+ * For QMAP_BSEARCH_ANY: returns insertion point if not found, sets *exact
+ * For QMAP_BSEARCH_FIRST/LAST: returns position or -1 if not found */
+  static int
+qmap_bsearch_ex(uint32_t hd, const void *key, int *exact, int mode)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  int result = -1;
+
+  if (head->iflags & QM_SDIRTY)
+    qmap_rebuild_sorted(hd);
+
+  if (head->sorted_n == 0) {
+    if (exact) *exact = 0;
+    return (mode == QMAP_BSEARCH_ANY) ? 0 : -1;
+  }
+
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  size_t key_len = qmap_len(head->types[QM_KEY], key);
+  int low = 0, high = (int) head->sorted_n - 1;
+  int mid = 0;
+
+  if (exact) *exact = 0;
+
+  while (low <= high) {
+    mid = low + (high - low) / 2;
+    const void *mid_key = qmap_key(hd, qmap->sorted_idx[mid]);
+
+    size_t len;
+    if (type->measure) {
+      size_t mid_len = qmap->key_sizes[qmap->sorted_idx[mid]];
+      len = (key_len > mid_len) ? key_len : mid_len;
+    } else
+      len = type->len;
+
+    int cmp = type->cmp(mid_key, key, len);
+
+    if (cmp == 0) {
+      if (exact) *exact = 1;
+      result = mid;
+      if (mode == QMAP_BSEARCH_ANY)
+        return mid;  /* Return immediately for ANY mode */
+      else if (mode == QMAP_BSEARCH_FIRST)
+        high = mid - 1;  /* Continue searching left */
+      else /* QMAP_BSEARCH_LAST */
+        low = mid + 1;   /* Continue searching right */
+    } else if (cmp < 0)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+
+  return (mode == QMAP_BSEARCH_ANY && (exact == NULL || !*exact)) ? low : result;
+}
+
+/* Index of the first sorted entry whose key is >= key, or
+ * > key when 'upper' is set. Expects a clean sorted index. */
+  static uint32_t
+qmap_bound(uint32_t hd, const void *key, int upper)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  size_t key_len = qmap_len(head->types[QM_KEY], key);
+  uint32_t low = 0, high = head->sorted_n;
+
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    uint32_t n = qmap->sorted_idx[mid];
+    size_t len;
+
+    if (type->measure) {
+      size_t mid_len = qmap->key_sizes[n];
+      len = (key_len > mid_len) ? key_len : mid_len;
+    } else
+      len = type->len;
+
+    int cmp = type->cmp(qmap_key(hd, n), key, len);
+
+    if (cmp < 0 || (upper && cmp == 0))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+/* Wrapper for backward compatibility with original qmap_bsearch */
+  static inline int
+qmap_bsearch(uint32_t hd, const void *key, int *exact)
+{
+  return qmap_bsearch_ex(hd, key, exact, QMAP_BSEARCH_ANY);
+}
+
+/* OPEN / INITIALIZATION {{{ */
+
+/* Low level way of opening databases. */
+  static uint32_t
+_qmap_open(uint32_t ktype, uint32_t vtype,
+    uint32_t mask, uint32_t flags)
+{
+  uint32_t hd = idm_new(&idm);
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t len;
+  size_t ids_len;
+
+  mask = mask ? mask : QM_DEFAULT_MASK;
+
+  /* QM_MULTIVALUE requires QM_SORTED */
+  if ((flags & QM_MULTIVALUE) && !(flags & QM_SORTED)) {
+    fprintf(stderr, "qmap: QM_MULTIVALUE requires QM_SORTED flag\n");
+    idm_del(&idm, hd);
+    return QM_MISS;
+  }
+
+  /* Mapped maps neither change nor get a writable mirror */
+  if ((flags & QM_RDONLY_MMAP) && (flags & (QM_MIRROR | QM_WAL | QM_VLOG))) {
+    fprintf(stderr, "qmap: QM_RDONLY_MMAP excludes QM_MIRROR, QM_WAL"
+        " and QM_VLOG\n");
+    idm_del(&idm, hd);
+    return QM_MISS;
+  }
+
+  DEBUG(1, "%u %u 0x%x %u\n",
+      hd, ktype,
+      mask, flags);
+
+  len = mask + 1u;
+
+  CBUG((len & mask) != 0, "mask must be 2^k - 1\n");
+  ids_len = len * sizeof(uint32_t);
+
+  qmap->map = malloc(ids_len);
+  qmap->omap = malloc(len * sizeof(void *));
+  CBUG(!(qmap->map && qmap->omap), "malloc error\n");
+  qmap->idm = idm_init();
+  qmap->linked = ids_init();
+  qmap->vlog = NULL;
+
+  head->m = len;
+  head->types[QM_KEY] = ktype;
+  head->types[QM_VALUE] = vtype;
+  head->mask = mask;
+  head->flags = flags;
+  head->phd = hd;
+
+  // STORE {{{
+  qmap->table = malloc(sizeof(void *) * len);
+  CBUG(!qmap->table, "malloc error (table)\n");
+  memset(qmap->table, 0, sizeof(void *) * len);
+  // }}}
+
+  qmap->key_hashes = calloc(len, sizeof(*qmap->key_hashes));
+  CBUG(!qmap->key_hashes, "malloc error (key_hashes)\n");
+
+  if (flags & QM_SORTED) {
+    qmap->sorted_idx = malloc(sizeof(uint32_t) * len);
+    CBUG(!qmap->sorted_idx, "malloc error (sorted_idx)\n");
+  } else
+    qmap->sorted_idx = NULL;
+
+  qmap->key_sizes = calloc(len, sizeof(*qmap->key_sizes));
+  qmap->val_sizes = calloc(len, sizeof(*qmap->val_sizes));
+  CBUG(!(qmap->key_sizes && qmap->val_sizes), "malloc error (size arrays)\n");
+
+  head->iflags |= QM_SDIRTY;
+  /* maps served from a mapping or a heap leave theirs when closed */
+  head->n = head->sorted_n = 0;
+  head->mods = head->saved_mods = 0;
+  head->unloaded = 0;
+
+  memset(qmap->map, 0xFF, ids_len);
+  memset(qmap->omap, 0, sizeof(void *) * len);
+
+  return hd;
+}
+
+static inline void
+qmap_load_file(char *filename, uint32_t hd, int mapped);
+
+static inline uint32_t
+_qmap_put(uint32_t hd, const void * key,
+    const void *value, uint32_t pn);
+
+static void qmap_clear_fast(uint32_t hd);
+
+enum qmap_wal_op {
+  QMAP_WAL_PUT,
+  QMAP_WAL_DEL,
+  QMAP_WAL_DEL_ALL,
+  QMAP_WAL_DEL_RANGE,
+  QMAP_WAL_DROP,
+  QMAP_WAL_END,		// of a delta (qmap_delta_export)
+};
+
+static void qmap_wal_log(uint32_t hd, uint32_t op,
+    const void *a, const void *b);
+static int qmap_wal_record(uint32_t hd, const void *key);
+static void qmap_wal_open(uint32_t hd);
+static void qmap_wal_flush(qmap_file_t *file, int sync);
+static void qmap_wal_reset(qmap_file_t *file);
+static void qmap_ckpt_finish(void);
+static int qmap_wal_covers(const qmap_file_t *file);
+static void qmap_wal_close(qmap_file_t *file);
+
+static int qmap_save_files(char **names, uint32_t n);
+static char **qmap_file_names(uint32_t *n, int all);
+
+static void qmap_lazy_load(uint32_t hd);
+
+/* Read the database of a QM_LAZY map before its first use, or bring
+ * a QM_SHARED reader up to date */
+  static inline void
+qmap_lazy(uint32_t hd)
+{
+  if (__atomic_load_n(&qmap_heads[hd].unloaded, __ATOMIC_ACQUIRE))
+    qmap_lazy_load(hd);
+
+  /* a QM_SHARED reader takes in what the writer changed */
+  if (qmaps[hd].heap && qmaps[hd].heap->reader)
+    qmap_shared_view(hd);
+}
+
+  static void
+qmap_rebuild_map(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  memset(qmap->map, 0xFF,
+      sizeof(uint32_t) * head->m);
+
+  for (uint32_t n = 0; n < qmap->idm.last; n++) {
+    const void *key = qmap->omap[n];
+
+    if (!key)
+      continue;
+
+    uint32_t id =
+      qmap->key_hashes[n] & head->mask;
+
+    while (qmap->map[id] != QM_MISS)
+      id = (id + 1) & head->mask;
+
+    qmap->map[id] = n;
+  }
+}
+
+  static void
+qmap_resize(uint32_t hd, uint32_t new_m)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t old_m = head->m;
+
+  CBUG((new_m & (new_m - 1)) != 0 || new_m <= old_m,
+      "qmap_resize: capacity not a larger power-of-two");
+
+  void *tmp;
+
+  tmp = qmap_remem(qmap, qmap->omap, sizeof(void *) * new_m);
+  CBUG(!tmp, "realloc(omap)");
+  qmap->omap = tmp;
+  memset(&qmap->omap[old_m], 0,
+      sizeof(void *) * (new_m - old_m));
+
+  if (qmap->table) {
+    tmp = qmap_remem(qmap, qmap->table,
+        sizeof(void *) * new_m);
+
+    CBUG(!tmp, "realloc(table)");
+
+    qmap->table = tmp;
+
+    memset(&qmap->table[old_m], 0,
+        sizeof(void *) * (new_m - old_m));
+  }
+
+  tmp = qmap_remem(qmap, qmap->key_hashes, sizeof(uint32_t) * new_m);
+  CBUG(!tmp, "realloc(key_hashes)");
+  qmap->key_hashes = tmp;
+  memset(qmap->key_hashes + old_m, 0,
+      sizeof(uint32_t) * (new_m - old_m));
+
+  tmp = qmap_remem(qmap, qmap->key_sizes, sizeof(size_t) * new_m);
+  CBUG(!tmp, "realloc(key_sizes)");
+  qmap->key_sizes = tmp;
+  memset(qmap->key_sizes + old_m, 0,
+      sizeof(size_t) * (new_m - old_m));
+
+  tmp = qmap_remem(qmap, qmap->val_sizes, sizeof(size_t) * new_m);
+  CBUG(!tmp, "realloc(val_sizes)");
+  qmap->val_sizes = tmp;
+  memset(qmap->val_sizes + old_m, 0,
+      sizeof(size_t) * (new_m - old_m));
+
+  if (qmap->sorted_idx) {
+    tmp = qmap_remem(qmap, qmap->sorted_idx, sizeof(uint32_t) * new_m);
+    CBUG(!tmp, "realloc(sorted_idx)");
+    qmap->sorted_idx = tmp;
+    memset(qmap->sorted_idx + old_m, 0xFF,
+        sizeof(uint32_t) * (new_m - old_m));
+  }
+
+  if (qmap->mseq) {
+    tmp = realloc(qmap->mseq, sizeof(uint64_t) * new_m);
+    CBUG(!tmp, "realloc(mseq)");
+    qmap->mseq = tmp;
+    memset(qmap->mseq + old_m, 0, sizeof(uint64_t) * (new_m - old_m));
+  }
+
+  qmap_unmem(qmap, qmap->map);
+  qmap->map = qmap_mem(qmap, sizeof(uint32_t) * new_m);
+  CBUG(!qmap->map, "malloc(map)");
+  memset(qmap->map, 0xFF, sizeof(uint32_t) * new_m);
+
+  head->m = new_m;
+  head->mask = new_m - 1;
+
+  CBUG(head->m != head->mask + 1,
+      "qmap invariant broken");
+
+  /* In deferred bulk mode the table is built by qmap_bulk_end */
+  if (!(head->iflags & QM_BDEFER))
+    qmap_rebuild_map(hd);
+}
+
+  static inline void
+qmap_grow(uint32_t hd)
+{
+  qmap_resize(hd, qmap_heads[hd].m << 1);
+}
+
+/* Smallest capacity _qmap_put would not grow at with n entries */
+  static inline uint32_t
+qmap_fit(uint32_t m, uint64_t n)
+{
+  while ((n + 1) * 4 >= (uint64_t) m * 3)
+    m <<= 1;
+  return m;
+}
+
+/* Have hd saved to filename, registering the file if it is new */
+  static qmap_file_t *
+qmap_file_add(const char *filename, uint32_t hd)
+{
+  const qmap_file_t *file_p
+    = qmap_get(qmap_files_hd, filename);
+
+  if (!file_p) {
+    qmap_file_t file;
+    memset(&file, 0, sizeof(file));
+    file.ids = ids_init();
+    file.fd = -1;
+    file.wal_fd = -1;
+    file.wal_snap = -1;
+    ids_push(&file.ids, hd);
+    qmap_put(qmap_files_hd, filename, &file);
+    file_p = qmap_get(qmap_files_hd, filename);
+  } else
+    ids_push((ids_t *) &file_p->ids, hd);
+
+  return (qmap_file_t *) file_p;
+}
+
+  uint32_t /* API */
+qmap_open(const char *filename,
+    const char *database,
+    uint32_t ktype, uint32_t vtype,
+    uint32_t mask, uint32_t flags)
+{
+  uint32_t record_id = 0;
+
+  /* ── Handle QM_RECORD flag ────────────────────────────────────────── */
+  if (flags & QM_RECORD_FLAG) {
     record_id = QM_RECORD_ID(flags);
     if (!record_id || record_id > qmap_records_n) {
       fprintf(stderr, "qmap_open: unknown record_id %u\n", record_id);
       return QM_MISS;
     }
-    /* Validate: vtype must match the registered struct type */
-    if (vtype != qmap_records[record_id].struct_type_id) {
-      fprintf(stderr, "qmap_open: record %u requires vtype=%u, got %u\n",
-              record_id, qmap_records[record_id].struct_type_id, vtype);
-      return QM_MISS;
+    /* Validate: vtype must match the registered struct type */
+    if (vtype != qmap_records[record_id].struct_type_id) {
+      fprintf(stderr, "qmap_open: record %u requires vtype=%u, got %u\n",
+              record_id, qmap_records[record_id].struct_type_id, vtype);
+      return QM_MISS;
+    }
+    /* Record-aware maps require string keys (composite key separator) */
+    if (ktype != QM_STR) {
+      fprintf(stderr, "qmap_open: record maps require ktype=QM_STR\n");
+      return QM_MISS;
+    }
+  }
+
+  if ((flags & QM_RDONLY_MMAP) && !filename) {
+    fprintf(stderr, "qmap_open: QM_RDONLY_MMAP requires a file\n");
+    return QM_MISS;
+  }
+
+  if ((flags & QM_PHEAP) && (!filename || record_id || (flags
+          & (QM_MIRROR | QM_WAL | QM_LAZY | QM_RDONLY_MMAP | QM_VLOG))))
+  {
+    fprintf(stderr, "qmap_open: QM_PHEAP requires a file, and excludes"
+        " QM_MIRROR, QM_WAL, QM_LAZY, QM_RDONLY_MMAP, QM_VLOG and"
+        " records\n");
+    return QM_MISS;
+  }
+
+  if ((flags & QM_SHARED) && (!(flags & QM_PHEAP) == !(flags & QM_RDONLY_MMAP)
+        || record_id || (flags & (QM_MIRROR | QM_WAL | QM_LAZY | QM_VLOG))))
+  {
+    fprintf(stderr, "qmap_open: QM_SHARED goes with QM_PHEAP (the writer)"
+        " or QM_RDONLY_MMAP (a reader), and excludes QM_MIRROR, QM_WAL,"
+        " QM_LAZY, QM_VLOG and records\n");
+    return QM_MISS;
+  }
+
+  if ((flags & QM_DELTA) && (record_id
+        || (flags & (QM_MULTIVALUE | QM_PHEAP | QM_RDONLY_MMAP))))
+  {
+    fprintf(stderr, "qmap_open: QM_DELTA excludes QM_MULTIVALUE,"
+        " QM_PHEAP, QM_RDONLY_MMAP and records\n");
+    return QM_MISS;
+  }
+
+  /* Strip record bits so _qmap_open doesn't see them */
+  flags &= ~(QM_RECORD_MASK | QM_RECORD_FLAG);
+
+  uint32_t hd = _qmap_open(ktype, vtype, mask, flags);
+
+  /* Check if open failed */
+  if (hd == QM_MISS)
+    return QM_MISS;
+
+  qmap_head_t *head = &qmap_heads[hd];
+
+  head->record_id = record_id;
+  head->vstr_hd = 0;
+  head->file = filename;
+
+  /* Allocate per-field inverse index handles for record-aware maps */
+  if (record_id > 0) {
+    uint32_t fc = (uint32_t)qmap_records[record_id].field_count;
+    head->inv_hds = calloc(fc, sizeof(uint32_t));
+  } else {
+    head->inv_hds = NULL;
+  }
+  head->get_buf[0] = '\0';
+  if (flags & QM_VLOG)
+    qmaps[hd].vlog = qmap_vlog_new(filename);
+  if (flags & QM_DELTA)
+    qmap_delta_new(hd);
+
+  if (database)
+    head->dbid = XXH32(database, strlen(database), QM_SEED);
+  else
+    head->dbid = QM_MISS;
+
+  /* the file is the map's alone, and not among those qmap_save writes */
+  if (flags & (QM_PHEAP | QM_SHARED)) {
+    head->file = NULL;
+    if (!((flags & QM_PHEAP) ? qmap_heap_open(hd, filename)
+          : qmap_shared_open(hd, filename)))
+      return hd;
+
+    qmap_close(hd);
+    return QM_MISS;
+  }
+
+  if (!filename)
+    goto file_skip;
+
+  if (database) {
+    char buf[strlen(filename)
+      + strlen(database) + 2];
+
+    snprintf(buf, sizeof(buf), "%s/%s",
+        filename, database);
+
+    const uint32_t *ehd = qmap_get(qmap_dbs_hd, buf);
+    uint32_t old_hd = ehd ? *ehd : QM_MISS;
+    qmap_put(qmap_dbs_hd, buf, &hd);
+
+    /* closed handles stay listed, and may have been reused since */
+    if (old_hd != QM_MISS && old_hd != hd && mdbs[old_hd]
+        && qmap_heads[old_hd].dbid == head->dbid
+        && qmap_heads[old_hd].file
+        && !strcmp(qmap_heads[old_hd].file, filename))
+      mdbs[old_hd] = 0;
+  }
+
+  mdbs[hd] = 1;  /* Mark as dirty for save, regardless of database name */
+
+  qmap_file_add(filename, hd);
+
+file_skip:
+  /* loaded on first use; mirrors are filled from the primary now */
+  head->unloaded = filename && (flags & QM_LAZY)
+    && !(flags & (QM_MIRROR | QM_RDONLY_MMAP));
+
+  if (filename && !head->unloaded) {
+    /* loading in the old format goes through the write paths */
+    head->flags &= ~QM_RDONLY_MMAP;
+    qmap_load_file((char*) filename, hd, flags & QM_RDONLY_MMAP);
+    head->flags |= flags & QM_RDONLY_MMAP;
+    head->saved_mods = head->mods;
+  }
+
+  if (filename && (flags & QM_WAL) && !head->unloaded)
+    qmap_wal_open(hd);
+
+  if (!(flags & QM_MIRROR))
+    return hd;
+
+  flags &= ~QM_AINDEX;
+  uint32_t mirror_hd = _qmap_open(vtype, ktype, mask, flags | QM_PGET);
+  qmap_heads[mirror_hd].iflags |= QM_IS_MIRROR;  /* Mark as mirror for position sharing */
+  qmap_assoc(hd + 1, hd, NULL, NULL);
+
+  /* If data was loaded before mirror creation, populate the mirror now */
+  if (filename && head->n > 0) {
+    uint32_t cur = qmap_iter(hd, NULL, 0);
+    const void *key, *value;
+    while (qmap_next(&key, &value, cur)) {
+      _qmap_put(mirror_hd, value, key, qmaps[hd].map[qmap_id(hd, key)]);
+    }
+    qmap_fin(cur);
+  }
+
+  return hd;
+}
+
+  uint32_t /* API */
+qmap_get_vtype(uint32_t hd)
+{
+  return qmap_heads[hd].types[QM_VALUE];
+}
+
+  size_t /* API */
+qmap_type_len(uint32_t type_id)
+{
+  return qmap_types[type_id].len;
+}
+
+  static size_t
+s_measure(const void *key)
+{
+  return strlen(key) + 1;
+}
+
+static void file_close(qmap_file_t *file) {
+  if (file->mmaped) {
+    CBUG(munmap(file->mmaped, file->size) == -1,
+        "munmap failed");
+    file->mmaped = 0;
+  }
+
+  if (file->fd >= 0)
+    close(file->fd);
+  file->fd = -1;
+}
+
+__attribute__((destructor))
+  static void qmap_destruct(void) {
+    uint32_t cur, n;
+    const void *key, *value;
+    char **names;
+
+    qmap_save_wait();
+    qmap_ckpt_finish();
+
+    /* files whose maps all log their changes need no snapshot */
+    names = qmap_file_names(&n, 0);
+    qmap_save_files(names, n);
+    free(names);
+
+    cur = qmap_iter(qmap_files_hd, NULL, 0);
+    while (qmap_next(&key, &value, cur))
+      qmap_wal_close((qmap_file_t *) value);
+
+    for (uint32_t i = idm.last; i-- > 0; )
+      qmap_close(i);
+
+    idm_drop(&cursor_idm);
+    idm_drop(&idm);
+
+    cur = qmap_iter(qmap_files_hd, NULL, 0);
+
+    while (qmap_next(&key, &value, cur))
+      file_close((qmap_file_t *) value);
+
+    qmap_close(qmap_dbs_hd);
+    qmap_close(qmap_files_hd);
+  }
+
+__attribute__((constructor))
+  static void
+qmap_init(void)
+{
+  qmap_type_t *type;
+
+  memset(qmaps, 0, sizeof(qmaps));
+  memset(qmap_heads, 0, sizeof(qmap_heads));
+
+  idm = idm_init();
+  cursor_idm = idm_init();
+
+  // QM_PTR
+  type = &qmap_types[qmap_reg(sizeof(void *))];
+
+  // QM_HNDL
+  type = &qmap_types[qmap_reg(sizeof(uint32_t))];
+  type->hash = qmap_nohash;
+  type->cmp = qmap_ucmp;
+
+  // QM_STR
+  type = &qmap_types[qmap_mreg(s_measure)];
+  type->cmp = qmap_scmp;
+
+  // QM_U32
+  type = &qmap_types[qmap_reg(sizeof(uint32_t))];
+  type->cmp = qmap_ucmp;
+
+  uint32_t qm_file = qmap_reg(sizeof(qmap_file_t));
+  qmap_files_hd = _qmap_open(QM_STR, qm_file,
+      QM_DEFAULT_MASK, 0);
+
+  qmap_dbs_hd = _qmap_open(QM_STR, QM_U32, QM_DEFAULT_MASK, 0);
+}
+
+/* }}} */
+
+/* PUT {{{ */
+
+/* This is the low-level put. It doesn't aim to provide
+ * MIRROR functionality in itself, just putting in whatever
+ * kind of map.
+ */
+/* Helper: Update IDM last position if needed */
+  static inline void
+update_idm_last(qmap_t *qmap, uint32_t pn)
+{
+  if (pn >= qmap->idm.last)
+    qmap->idm.last = pn + 1;
+}
+
+/* ── Inverse index helpers for reference fields ──────────────────────── */
+
+static void ensure_inv_hd(qmap_head_t *head, int fi)
+{
+  if (head->inv_hds[fi] == 0)
+    head->inv_hds[fi] = qmap_open(NULL, NULL, QM_U32, QM_STR, 0xFF, 0);
+}
+
+static void ensure_vstr_hd(qmap_head_t *head)
+{
+  if (head->vstr_hd == 0)
+    head->vstr_hd = qmap_open(NULL, NULL, QM_STR, QM_STR, 0xFF, 0);
+}
+
+static void inverse_add(qmap_head_t *head, int fi,
+    uint32_t target_pos, uint32_t source_pos)
+{
+  ensure_inv_hd(head, fi);
+  uint32_t inv_hd = head->inv_hds[fi];
+  const char *existing = qmap_get(inv_hd, &target_pos);
+
+  if (existing) {
+    /* Check if source_pos already present */
+    const char *p = existing;
+    while (*p) {
+      char *end;
+      unsigned long v = strtoul(p, &end, 10);
+      if (end > p && (uint32_t)v == source_pos)
+        return;
+      if (*end == '\n')
+        p = end + 1;
+      else
+        break;
+    }
+    /* Append */
+    char buf[4096];
+    snprintf(buf, sizeof(buf), "%s%u\n", existing, source_pos);
+    qmap_put(inv_hd, &target_pos, buf);
+  } else {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%u\n", source_pos);
+    qmap_put(inv_hd, &target_pos, buf);
+  }
+}
+
+static void inverse_remove(qmap_head_t *head, int fi,
+    uint32_t target_pos, uint32_t source_pos)
+{
+  if (head->inv_hds[fi] == 0)
+    return;
+  uint32_t inv_hd = head->inv_hds[fi];
+  const char *existing = qmap_get(inv_hd, &target_pos);
+  if (!existing)
+    return;
+
+  /* Rebuild string without source_pos */
+  char buf[4096];
+  size_t pos = 0;
+  const char *p = existing;
+  while (*p) {
+    char *end;
+    unsigned long v = strtoul(p, &end, 10);
+    if (end > p && (uint32_t)v != source_pos)
+      pos += snprintf(buf + pos, sizeof(buf) - pos,
+                      pos > 0 ? "\n%lu" : "%lu", v);
+    if (*end == '\n')
+      p = end + 1;
+    else
+      break;
+  }
+
+  if (pos == 0)
+    qmap_del(inv_hd, &target_pos);
+  else
+    qmap_put(inv_hd, &target_pos, buf);
+}
+
+static void clean_inverses_for_pos(qmap_head_t *head, uint32_t pos)
+{
+  qmap_record_t *rec = &qmap_records[head->record_id];
+  const void *struct_ptr = qmap_val(head->phd, pos);
+  if (!struct_ptr)
+    return;
+
+  for (size_t fi = 0; fi < rec->field_count; fi++) {
+    if (rec->fields[fi].target_record == 0)
+      continue;
+    uint32_t ft = rec->fields[fi].type;
+    size_t  fo = rec->fields[fi].offset;
+    size_t  fm = rec->fields[fi].max_size;
+
+    if (ft == QM_REFERENCE) {
+      const char *id = (const char *)struct_ptr + fo;
+      if (id && id[0]) {
+        uint32_t target_hd = rec->fields[fi].target_hd;
+        if (target_hd > 0) {
+          uint32_t tp = qmap_pos(target_hd, id);
+          if (tp != UINT32_MAX)
+            inverse_remove(head, (int)fi, tp, pos);
+        }
+      }
+    } else if (ft == QM_MULTI_REFERENCE && fm > 0) {
+      const char *s = (const char *)struct_ptr + fo;
+      while (*s) {
+        char *end;
+        unsigned long p = strtoul(s, &end, 10);
+        if (end > s)
+          inverse_remove(head, (int)fi, (uint32_t)p, pos);
+        if (*end == '\n')
+          s = end + 1;
+        else
+          break;
+      }
+    }
+  }
+}
+
+/* Parse \n-separated positions from a string into pos[].
+ * Returns number parsed. */
+static size_t parse_positions(const char *s, uint32_t *pos, size_t max)
+{
+  size_t count = 0;
+  if (!s) return 0;
+  while (*s && count < max) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end > s)
+      pos[count++] = (uint32_t)v;
+    if (*end == '\n')
+      s = end + 1;
+    else
+      break;
+  }
+  return count;
+}
+
+/* Handle inverse index update after a field put on a reference field.
+ * Called AFTER the struct has been re-put, with source_pos known. */
+static void handle_inverse_put(qmap_head_t *head, int fi,
+    uint32_t source_pos,
+    const uint8_t *old_val, const void *new_val,
+    uint32_t ft, size_t fm)
+{
+  qmap_record_t *rec = &qmap_records[head->record_id];
+  (void)fm;
+  if (rec->fields[fi].target_record == 0)
+    return;
+
+  uint32_t old_pos[2048], new_pos[2048];
+  size_t n_old = 0, n_new = 0;
+
+  if (ft == QM_REFERENCE) {
+    uint32_t target_hd = rec->fields[fi].target_hd;
+    const char *id = (const char *)new_val;
+    if (id && id[0] && target_hd > 0) {
+      uint32_t p = qmap_pos(target_hd, id);
+      if (p != UINT32_MAX) new_pos[n_new++] = p;
+    }
+    id = (const char *)old_val;
+    if (id && id[0] && target_hd > 0) {
+      uint32_t p = qmap_pos(target_hd, id);
+      if (p != UINT32_MAX) old_pos[n_old++] = p;
+    }
+  } else if (ft == QM_MULTI_REFERENCE) {
+    n_new = parse_positions((const char *)new_val, new_pos, 2048);
+    n_old = parse_positions((const char *)old_val, old_pos, 2048);
+  }
+
+  /* removed = old \ new */
+  for (size_t i = 0; i < n_old; i++) {
+    int found = 0;
+    for (size_t j = 0; j < n_new; j++) {
+      if (old_pos[i] == new_pos[j]) { found = 1; break; }
+    }
+    if (!found)
+      inverse_remove(head, fi, old_pos[i], source_pos);
+  }
+
+  /* added = new \ old */
+  for (size_t i = 0; i < n_new; i++) {
+    int found = 0;
+    for (size_t j = 0; j < n_old; j++) {
+      if (new_pos[i] == old_pos[j]) { found = 1; break; }
+    }
+    if (!found)
+      inverse_add(head, fi, new_pos[i], source_pos);
+  }
+}
+
+/* }}} */
+
+  static inline uint32_t
+_qmap_put(uint32_t hd, const void * key,
+    const void *value, uint32_t pn)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  /* Grow before clustering gets pathological */
+  if (!(head->flags & QM_NOGROW)) {
+    if ((head->n + 1) * 4 >= head->m * 3)
+      qmap_grow(hd);
+  }
+
+  uint32_t n;
+  const void *aval = value;
+  void *rval, *rkey;
+  char *spill;
+  size_t key_len, klen, vin;
+  uint32_t key_hash;
+  uint32_t lookup_id;
+  uint32_t key_id;
+
+  if (key) {
+    uint32_t old_n;
+
+    lookup_id = qmap_id_ex(hd, key, &key_len, &key_hash);
+    if (lookup_id == QM_MISS) {
+      WARN("qmap %u: probe failure after grow", hd);
+      return QM_MISS;
+    }
+    old_n = qmap->map[lookup_id];
+
+    if (old_n == QM_MISS) {
+      if (pn != QM_MISS) {
+        n = pn;
+        /* Update IDM to know about this position */
+        update_idm_last(qmap, pn);
+      } else {
+        n = idm_new(&qmap->idm);
+      }
+      head->n ++;
+    } else if (head->flags & QM_MULTIVALUE) {
+      /* QM_MULTIVALUE: Allow duplicate keys.
+       * If pn is provided (from qmap_assoc), use it.
+       * Otherwise, allocate a new position.
+       * Don't update hash table - it keeps pointing to first occurrence.
+       * Duplicate is accessible via sorted_idx iteration. */
+      if (pn != QM_MISS && pn != old_n) {
+        n = pn;
+        /* Update IDM to know about this position */
+        update_idm_last(qmap, pn);
+      } else if (pn == QM_MISS) {
+        n = idm_new(&qmap->idm);
+      } else {
+        n = old_n;  /* pn == old_n, update in place */
+      }
+
+      if (n != old_n)
+        head->n ++;
+    } else
+      n = old_n;
+  } else {
+    key_id = n = idm_new(&qmap->idm);
+    head->n ++;
+    key = &key_id;
+    if (head->types[QM_KEY] == QM_STR) {
+      static char _auto_key[32];
+      snprintf(_auto_key, sizeof(_auto_key), "%u", key_id);
+      key = _auto_key;
+    }
+    lookup_id = qmap_id_ex(hd, key, &key_len, &key_hash);
+  }
+
+  if (n >= head->m) {
+    if (head->flags & QM_NOGROW) {
+      head->n--;
+      WARN("qmap %u: capacity reached (%u entries, max %u)",
+          hd, head->n, head->m);
+      return QM_MISS;
+    }
+    qmap_grow(hd);
+    lookup_id = qmap_id_hash(hd, key, key_len, key_hash);
+  }
+  DEBUG(2, "%u %u %u %p\n", hd, n, lookup_id, key);
+
+  rkey = (void *) key;
+  qmap->key_hashes[n] = key_hash;
+
+  if (head->phd == hd) {
+    if (head->types[QM_VALUE] == QM_PTR)
+      value = &value;
+
+    klen = qmap_len(head->types[QM_VALUE], aval);
+    spill = qmap_vlog_spill(qmap, value, klen);
+    vin = spill ? 0 : klen;
+
+    if (qmap->map[lookup_id] == n) {
+      const void *old_key = qmap_key(hd, n);
+      size_t off = qmap_payload_off(key_len);
+      size_t need = qmap_payload_off(key_len) + vin;
+
+      qmap_vlog_free(hd, n);
+
+      /* Reuse key allocation if key/value fit in the existing block,
+       * unless a checkpoint has yet to write the old value. */
+      if (!qmap->hold && qmap->key_sizes[n] == key_len &&
+          memcmp(old_key, key, key_len) == 0 &&
+          qmap_payload_cap(old_key) >= need) {
+        rkey = (void *) old_key;
+        rval = (void *) ((char *) rkey + off);
+      } else {
+        qmap_payload_free(qmap, (void *) old_key);
+        rkey = qmap_payload_alloc(qmap, key_len, vin);
+        rval = (void *) ((char *) rkey + off);
+      }
+
+      memcpy(rkey, key, key_len);
+      memcpy(rval, value, vin);
+      qmap->key_sizes[n] = key_len;
+      qmap->val_sizes[n] = klen;
+    } else {
+      /* New entry - allocate fresh */
+      size_t off = qmap_payload_off(key_len);
+      rkey = qmap_payload_alloc(qmap, key_len, vin);
+      rval = (void *) ((char *) rkey + off);
+      memcpy(rkey, key, key_len);
+      memcpy(rval, value, vin);
+      qmap->key_sizes[n] = key_len;
+      qmap->val_sizes[n] = klen;
+    }
+
+    if (spill)
+      rval = spill;
+
+    * VAL_ADDR(qmap, n) = rval;
+  }
+
+  qmap->omap[n] = rkey;
+
+  /* When sharing a position with the primary on updates, a different
+   * secondary key may overwrite the same position. Clear any stale hash
+   * entries that still point to this position from the former key. */
+  if (head->phd != hd && pn != QM_MISS) {
+    for (uint32_t i = 0; i < head->m; i++) {
+      if (qmap->map[i] == n) {
+        qmap->map[i] = QM_MISS;
+        break;
+      }
+    }
+  }
+
+  /* For QM_MULTIVALUE duplicates, don't update hash table */
+  if (!(head->flags & QM_MULTIVALUE) || qmap->map[lookup_id] == QM_MISS || qmap->map[lookup_id] == n)
+    qmap->map[lookup_id] = n;
+
+  head->iflags |= QM_SDIRTY;
+  qmap_touch(hd, n);
+
+  return lookup_id;
+}
+
+/* Feed the entry at position n of hd to the maps linked to it */
+  static void
+qmap_propagate(uint32_t hd, uint32_t n)
+{
+  idsi_t *cur = ids_iter(&qmaps[hd].linked);
+  const void *rkey = qmap_key(hd, n);
+  const void *rval = qmap_val(hd, n);
+  uint32_t ahd;
+
+  while (ids_next(&ahd, &cur)) {
+    qmap_t *aqmap;
+    qmap_head_t *ahead;
+
+    aqmap = &qmaps[ahd];
+    ahead = &qmap_heads[ahd];
+
+    if (aqmap->m_assoc) {
+      /* Multi-key association: produce multiple secondary keys.
+       * Secondary is a root map storing (ref_value, primary_key). */
+      const void *skeys[64];
+      size_t nkeys = aqmap->m_assoc(skeys, 64, rkey, rval, aqmap->m_assoc_userdata);
+      for (size_t i = 0; i < nkeys; i++) {
+        _qmap_put(ahd, skeys[i], rkey, QM_MISS);
+        free((void *)skeys[i]);
+      }
+    } else if (aqmap->assoc) {
+      const void *skey;
+
+      aqmap->assoc(&skey, rkey, rval, aqmap->assoc_userdata);
+
+      /* Share positions with QM_MIRROR and non-MULTIVALUE linked maps.
+       * MULTIVALUE linked maps keep independent positions to avoid
+       * hash table repointing complexity on duplicate removal. */
+      if (ahead->iflags & QM_IS_MIRROR) {
+        _qmap_put(ahd, skey, rval, n);  /* Mirror: share position */
+      } else if (ahead->flags & QM_MULTIVALUE) {
+        _qmap_put(ahd, skey, rval, QM_MISS);  /* MULTIVALUE: independent */
+      } else {
+        _qmap_put(ahd, skey, rval, n);  /* General: share position */
+      }
+    }
+  }
+}
+
+/* Deferred bulk put: take the next position and store the pair
+ * without touching the hash table, which qmap_bulk_end builds in
+ * one pass. Positions are handed out in insertion order, so the
+ * build can tell which of two equal keys came last. */
+  static uint32_t
+qmap_bulk_append(uint32_t hd, const void *key, const void *value)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  const void *aval = value;
+  size_t key_len, val_len;
+  uint32_t n, key_id;
+  char *spill;
+  void *rkey;
+
+  if (!(head->flags & QM_NOGROW) && (head->n + 1) * 4 >= head->m * 3)
+    qmap_grow(hd);
+
+  n = idm_new(&qmap->idm);
+  if (n >= head->m) {
+    if (head->flags & QM_NOGROW) {
+      idm_del(&qmap->idm, n);
+      WARN("qmap %u: capacity reached (%u entries, max %u)",
+          hd, head->n, head->m);
+      return QM_MISS;
+    }
+    qmap_grow(hd);
+  }
+
+  if (!key) {
+    key_id = n;
+    key = &key_id;
+    if (head->types[QM_KEY] == QM_STR) {
+      static char _auto_key[32];
+      snprintf(_auto_key, sizeof(_auto_key), "%u", key_id);
+      key = _auto_key;
+    }
+  }
+
+  if (head->types[QM_VALUE] == QM_PTR)
+    value = &value;
+
+  key_len = type->measure ? type->measure(key) : type->len;
+  val_len = qmap_len(head->types[QM_VALUE], aval);
+
+  spill = qmap_vlog_spill(qmap, value, val_len);
+  rkey = qmap_payload_alloc(qmap, key_len, spill ? 0 : val_len);
+  memcpy(rkey, key, key_len);
+  if (!spill)
+    memcpy((char *) rkey + qmap_payload_off(key_len), value, val_len);
+
+  qmap->omap[n] = rkey;
+  * VAL_ADDR(qmap, n) = spill
+    ? spill : (char *) rkey + qmap_payload_off(key_len);
+  qmap->key_hashes[n] = type->hash(key, key_len);
+  qmap->key_sizes[n] = key_len;
+  qmap->val_sizes[n] = val_len;
+  head->n++;
+  qmap_touch(hd, n);
+
+  return n;
+}
+
+  static uint32_t
+qmap_lput(uint32_t hd, const void * const key,
+    const void * const value)
+{
+  uint32_t n, id;
+  const void *rval;
+  qmap_head_t *head = &qmap_heads[hd];
+
+  if (head->iflags & QM_BDEFER)
+    return qmap_bulk_append(hd, key, value);
+
+  /* ── Field-level put for record-aware maps ────────────────────────── */
+  if (head->record_id > 0) {
+    const char *k = (const char *)key;
+    const char *colon = strchr(k, ':');
+    if (colon) {
+      size_t sk_len = (size_t)(colon - k);
+      char struct_key[256];
+      if (sk_len >= sizeof(struct_key))
+        return QM_MISS;
+      memcpy(struct_key, k, sk_len);
+      struct_key[sk_len] = '\0';
+      const char *field_name = colon + 1;
+
+      int fi = qmap_record_find_field(head->record_id, field_name);
+      if (fi < 0)
+        return QM_MISS;
+
+      size_t struct_size = qmap_records[head->record_id].struct_size;
+
+      /* Get or create the struct entry */
+      void *struct_ptr = (void *)qmap_get(hd, struct_key);
+      if (!struct_ptr) {
+        void *tmp = calloc(1, struct_size);
+        if (!tmp) return QM_MISS;
+        if (qmap_put(hd, struct_key, tmp) == QM_MISS) {
+          free(tmp);
+          return QM_MISS;
+        }
+        free(tmp);
+        struct_ptr = (void *)qmap_get(hd, struct_key);
+      }
+
+      /* Write the field value */
+      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+      size_t  fo = qmap_records[head->record_id].fields[fi].offset;
+      size_t  fm = qmap_records[head->record_id].fields[fi].max_size;
+
+      if (ft == QM_VSTR) {
+        /* QM_VSTR: store directly under composite key in vstr map,
+         * bypassing struct modification entirely. */
+        ensure_vstr_hd(head);
+        return qmap_put(head->vstr_hd, key, value);
+      }
+
+      /* The field is written in a copy: a checkpoint may still have
+       * the stored struct to write. */
+      uint8_t struct_stack[8192];
+      const void *stored = struct_ptr;
+      struct_ptr = struct_size > sizeof(struct_stack)
+        ? malloc(struct_size) : struct_stack;
+      if (!struct_ptr) return QM_MISS;
+      memcpy(struct_ptr, stored, struct_size);
+
+      /* Save old field value for inverse diff */
+      size_t old_sz = (ft == QM_STR || ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE) ? fm : sizeof(uint32_t);
+      uint8_t old_val_stack[8192];
+      uint8_t *old_val = NULL;
+      if (head->inv_hds) {
+        if (old_sz > sizeof(old_val_stack)) {
+          old_val = malloc(old_sz);
+          if (!old_val) {
+            if (struct_ptr != struct_stack) free(struct_ptr);
+            return QM_MISS;
+          }
+        } else {
+          old_val = old_val_stack;
+        }
+        memcpy(old_val, (char *)struct_ptr + fo, old_sz);
+      }
+
+      if (ft == QM_STR && fm > 0) {
+        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
+        *((char *)struct_ptr + fo + fm - 1) = '\0';
+      } else if (ft == QM_REFERENCE && fm > 0) {
+        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
+        *((char *)struct_ptr + fo + fm - 1) = '\0';
+      } else if (ft == QM_MULTI_REFERENCE && fm > 0) {
+        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
+        *((char *)struct_ptr + fo + fm - 1) = '\0';
+      } else {
+        size_t val_len = qmap_len(ft, value);
+        memcpy((char *)struct_ptr + fo, value, val_len);
+      }
+
+      /* Re-put the struct */
+      uint32_t put_id = qmap_put(hd, struct_key, struct_ptr);
+      if (struct_ptr != struct_stack) free(struct_ptr);
+      if (put_id == QM_MISS) return QM_MISS;
+      uint32_t source_pos = qmaps[hd].map[put_id];
+
+      /* Auto-maintain inverse index for reference fields */
+      if (head->inv_hds) {
+        handle_inverse_put(head, fi, source_pos, old_val, value, ft, fm);
+        if (old_val && old_val != old_val_stack) free(old_val);
+      }
+
+      return put_id;
+    }
+  }
+
+  /* ── Whole-struct put: snapshot old struct for inverse diff ── */
+  uint8_t *old_snap = NULL;
+  if (head->record_id > 0 && head->inv_hds) {
+    size_t ss = qmap_records[head->record_id].struct_size;
+    old_snap = malloc(ss);
+    if (old_snap) {
+      const void *old_val = qmap_get(hd, key);
+      if (old_val)
+        memcpy(old_snap, old_val, ss);
+      else
+        memset(old_snap, 0, ss);  /* new entry, diff against zeros */
+    }
+  }
+
+  id = _qmap_put(hd, key, value, QM_MISS);
+  if (id == QM_MISS) {
+    free(old_snap);
+    return QM_MISS;
+  }
+  n = qmaps[hd].map[id];
+  rval = qmap_val(hd, n);
+
+  /* Bulk mode re-derives linked maps once, at qmap_bulk_end */
+  if (!(head->iflags & QM_BULK))
+    qmap_propagate(hd, n);
+
+  /* ── Update inverse index for reference fields after whole-struct put ── */
+  if (old_snap) {
+    qmap_record_t *rec = &qmap_records[head->record_id];
+    for (size_t fi = 0; fi < rec->field_count; fi++) {
+      uint32_t ft = rec->fields[fi].type;
+      if ((ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE)
+          && rec->fields[fi].target_record > 0) {
+        handle_inverse_put(head, (int)fi, n,
+            old_snap + rec->fields[fi].offset,
+            (const uint8_t *)rval + rec->fields[fi].offset,
+            ft, rec->fields[fi].max_size);
+      }
+    }
+    free(old_snap);
+  }
+
+  return id;
+}
+
+  uint32_t /* API */
+qmap_put(uint32_t hd, const void * const key,
+    const void * const value)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  uint32_t ret;
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return QM_MISS;
+
+  if (!(head->iflags & QM_WLOG)) {
+    ret = qmap_lput(hd, key, value);
+    qmap_done(hd);
+    return ret;
+  }
+
+  /* Field puts re-put their struct: only the outer call is logged */
+  head->iflags &= ~QM_WLOG;
+  ret = qmap_lput(hd, key, value);
+  head->iflags |= QM_WLOG;
+
+  /* auto keys are logged as the key they got */
+  if (ret != QM_MISS && !qmap_wal_record(hd, key))
+    qmap_wal_log(hd, QMAP_WAL_PUT, key ? key : qmap_key(hd,
+          (head->iflags & QM_BDEFER) ? ret : qmaps[hd].map[ret]), value);
+
+  qmap_done(hd);
+  return ret;
+}
+
+/* BULK {{{ */
+
+/* Do positions a and b of hd hold equal keys? */
+  static inline int
+qmap_n_eq(uint32_t hd, uint32_t a, uint32_t b)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+
+  if (qmap->key_hashes[a] != qmap->key_hashes[b])
+    return 0;
+
+  if (type->measure) {
+    if (qmap->key_sizes[a] != qmap->key_sizes[b])
+      return 0;
+    return type->cmp(qmap->omap[a], qmap->omap[b],
+        qmap->key_sizes[a]) == 0;
+  }
+
+  return type->cmp(qmap->omap[a], qmap->omap[b], type->len) == 0;
+}
+
+/* Drop a duplicate left behind by deferred bulk puts */
+  static inline void
+qmap_bulk_drop_n(uint32_t hd, uint32_t n)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  qmap_vlog_free(hd, n);
+  qmap_payload_free(qmap, (void *) qmap->omap[n]);
+  qmap->omap[n] = NULL;
+  * VAL_ADDR(qmap, n) = NULL;
+  qmap->key_hashes[n] = 0;
+  qmap->key_sizes[n] = 0;
+  qmap->val_sizes[n] = 0;
+  idm_del(&qmap->idm, n);
+  head->n--;
+}
+
+/* Build the hash table of a map filled by deferred bulk puts.
+ * Positions are visited in insertion order: with QM_MULTIVALUE the
+ * table keeps pointing to the first duplicate, otherwise a later put
+ * of the same key replaces the earlier entry, like qmap_put would. */
+  static void
+qmap_bulk_build_map(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t last = qmap->idm.last;
+
+  memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
+
+  for (uint32_t n = 0; n < last; n++) {
+    uint32_t id, o;
+
+    if (!qmap->omap[n])
+      continue;
+
+    id = qmap->key_hashes[n] & head->mask;
+
+    while ((o = qmap->map[id]) != QM_MISS && !qmap_n_eq(hd, o, n))
+      id = (id + 1) & head->mask;
+
+    if (o == QM_MISS)
+      qmap->map[id] = n;
+    else if (!(head->flags & QM_MULTIVALUE)) {
+      qmap_bulk_drop_n(hd, o);
+      qmap->map[id] = n;
+    }
+  }
+}
+
+/* Parallel build: positions are radix-partitioned by the high bits
+ * of their home slot, so that each worker fills its own contiguous
+ * region of the table. Chains that would run past the end of a
+ * region, and the duplicates a worker replaces, are handed back and
+ * dealt with serially. Partitions keep positions in ascending order,
+ * so the outcome is that of qmap_bulk_build_map. */
+
+typedef struct {
+  uint32_t hd, shift, parts;
+  uint32_t lo, hi;	// positions counted / scattered by this worker
+  uint32_t *hist;	// per-part counts, then scatter cursors
+  uint32_t *buf;	// partitioned positions
+  uint32_t *spill, spill_n, spill_m;
+  uint32_t *drop, drop_n, drop_m;
+  int phase;
+} qmap_build_job_t;
+
+  static inline void
+qmap_build_push(uint32_t **arr, uint32_t *n, uint32_t *m, uint32_t v)
+{
+  if (*n == *m) {
+    *m = *m ? *m * 2 : 64;
+    *arr = realloc(*arr, sizeof(uint32_t) * *m);
+    CBUG(!*arr, "realloc error (bulk build)\n");
+  }
+  (*arr)[(*n)++] = v;
+}
+
+  static void *
+qmap_build_job(void *arg)
+{
+  qmap_build_job_t *job = arg;
+  qmap_head_t *head = &qmap_heads[job->hd];
+  qmap_t *qmap = &qmaps[job->hd];
+  uint32_t n, part;
+
+  if (job->phase < 2) {
+    for (n = job->lo; n < job->hi; n++) {
+      if (!qmap->omap[n])
+        continue;
+      part = (qmap->key_hashes[n] & head->mask) >> job->shift;
+      if (job->phase == 0)
+        job->hist[part]++;
+      else
+        job->buf[job->hist[part]++] = n;
+    }
+    return NULL;
+  }
+
+  /* phase 2: part lo of the table, positions buf[0, hi) */
+  uint32_t end = (job->lo + 1) << job->shift;
+
+  for (uint32_t i = 0; i < job->hi; i++) {
+    uint32_t id, o;
+
+    n = job->buf[i];
+    id = qmap->key_hashes[n] & head->mask;
+
+    while ((o = qmap->map[id]) != QM_MISS && !qmap_n_eq(job->hd, o, n))
+      if (++id == end)
+        break;
+
+    if (id == end)
+      qmap_build_push(&job->spill, &job->spill_n, &job->spill_m, n);
+    else if (o == QM_MISS)
+      qmap->map[id] = n;
+    else if (!(head->flags & QM_MULTIVALUE)) {
+      qmap_build_push(&job->drop, &job->drop_n, &job->drop_m, o);
+      qmap->map[id] = n;
+    }
+  }
+
+  return NULL;
+}
+
+  static void
+qmap_bulk_build_par(uint32_t hd, uint32_t k)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t last = qmap->idm.last, bits = 0, parts;
+  qmap_build_job_t jobs[QM_MAX_WORKERS];
+  uint32_t *hist, *buf, off = 0;
+
+  while ((2U << bits) <= k)
+    bits++;
+  parts = 1U << bits;
+
+  hist = calloc((size_t) k * parts, sizeof(uint32_t));
+  buf = malloc(sizeof(uint32_t) * (head->n ? head->n : 1));
+  CBUG(!hist || !buf, "malloc error (bulk build)\n");
+
+  memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
+  memset(jobs, 0, sizeof(jobs));
+
+  for (uint32_t t = 0; t < k; t++) {
+    jobs[t].hd = hd;
+    jobs[t].parts = parts;
+    jobs[t].shift = __builtin_ctz(head->m) - bits;
+    jobs[t].lo = (uint32_t) ((uint64_t) last * t / k);
+    jobs[t].hi = (uint32_t) ((uint64_t) last * (t + 1) / k);
+    jobs[t].hist = hist + (size_t) t * parts;
+    jobs[t].buf = buf;
+  }
+
+  qmap_par(qmap_build_job, jobs, sizeof(*jobs), k);
+
+  /* counts become scatter cursors: part-major, worker order within */
+  for (uint32_t p = 0; p < parts; p++)
+    for (uint32_t t = 0; t < k; t++) {
+      uint32_t c = jobs[t].hist[p];
+      jobs[t].hist[p] = off;
+      off += c;
+    }
+
+  for (uint32_t t = 0; t < k; t++)
+    jobs[t].phase = 1;
+
+  qmap_par(qmap_build_job, jobs, sizeof(*jobs), k);
+
+  /* after scattering, worker k-1's cursor is where each part ends */
+  for (uint32_t p = 0, start = 0; p < parts; p++) {
+    uint32_t pend = jobs[k - 1].hist[p];
+
+    jobs[p].phase = 2;
+    jobs[p].lo = p;
+    jobs[p].buf = buf + start;
+    jobs[p].hi = pend - start;
+    start = pend;
+  }
+
+  qmap_par(qmap_build_job, jobs, sizeof(*jobs), parts);
+
+  for (uint32_t p = 0; p < parts; p++) {
+    for (uint32_t i = 0; i < jobs[p].spill_n; i++) {
+      uint32_t n = jobs[p].spill[i], id, o;
+
+      id = qmap->key_hashes[n] & head->mask;
+      while ((o = qmap->map[id]) != QM_MISS && !qmap_n_eq(hd, o, n))
+        id = (id + 1) & head->mask;
+
+      if (o == QM_MISS)
+        qmap->map[id] = n;
+      else if (!(head->flags & QM_MULTIVALUE)) {
+        qmap_bulk_drop_n(hd, o);
+        qmap->map[id] = n;
+      }
+    }
+    free(jobs[p].spill);
+  }
+
+  for (uint32_t p = 0; p < parts; p++) {
+    for (uint32_t i = 0; i < jobs[p].drop_n; i++)
+      qmap_bulk_drop_n(hd, jobs[p].drop[i]);
+    free(jobs[p].drop);
+  }
+
+  free(buf);
+  free(hist);
+}
+
+/* Positions were handed out in key order: index them as they are */
+  static void
+qmap_sorted_in_order(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t k = 0;
+
+  for (uint32_t n = 0; n < qmap->idm.last; n++)
+    if (qmap->omap[n])
+      qmap->sorted_idx[k++] = n;
+
+  head->sorted_n = k;
+  head->iflags &= ~QM_SDIRTY;
+}
+
+/* A large sorted map gets its index now, while it can be built on
+ * several threads, rather than on the first ordered access */
+  static void
+qmap_bulk_sort(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  if ((head->flags & QM_SORTED) && (head->iflags & QM_SDIRTY)
+      && qmap_workers(head->n, qmap_cfg_sort_min) > 1)
+    qmap_rebuild_sorted(hd);
+}
+
+/* Re-derive every map linked to hd from its current contents */
+  static void
+qmap_bulk_relink(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  idsi_t *cur = ids_iter(&qmap->linked);
+  uint32_t ahd;
+
+  if (!cur)
+    return;
+
+  while (ids_next(&ahd, &cur)) {
+    qmap_head_t *ahead = &qmap_heads[ahd];
+    uint32_t m = qmap_fit(ahead->m, head->n);
+
+    qmap_clear_fast(ahd);
+    if (m > ahead->m && !(ahead->flags & QM_NOGROW))
+      qmap_resize(ahd, m);
+  }
+
+  for (uint32_t n = 0; n < qmap->idm.last; n++)
+    if (qmap->omap[n])
+      qmap_propagate(hd, n);
+
+  cur = ids_iter(&qmap->linked);
+  while (ids_next(&ahd, &cur))
+    qmap_bulk_sort(ahd);
+}
+
+  void /* API */
+qmap_bulk_begin(uint32_t hd, uint32_t expected_n)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t m;
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return;
+
+  m = qmap_fit(head->m, (uint64_t) head->n + expected_n);
+
+  if (m > head->m && !(head->flags & QM_NOGROW))
+    qmap_resize(hd, m);
+
+  head->iflags |= QM_BULK;
+
+  /* Appending without lookups needs an empty root map that hands out
+   * positions in order, and nothing that reads the map back while
+   * putting (record maps look up the old struct). */
+  if (head->n == 0 && head->phd == hd && !head->record_id
+      && ids_iter(&qmap->idm.free) == NULL)
+    head->iflags |= QM_BDEFER;
+
+  qmap_done(hd);
+}
+
+  void /* API */
+qmap_bulk_end(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  if (!(head->iflags & QM_BULK) || (head->iflags & QM_BHOLD))
+    return;
+
+  qmap_shared_begin(hd);
+  if (head->iflags & QM_BDEFER) {
+    uint32_t k = qmap_workers(head->n, qmap_cfg_par_min);
+
+    if (k > 1)
+      qmap_bulk_build_par(hd, k);
+    else
+      qmap_bulk_build_map(hd);
+  }
+
+  head->iflags &= ~(QM_BULK | QM_BDEFER);
+
+  if (head->iflags & QM_KORDER) {
+    qmap_sorted_in_order(hd);
+    head->iflags &= ~QM_KORDER;
+  } else
+    head->iflags |= QM_SDIRTY;
+
+  qmap_bulk_sort(hd);
+  qmap_bulk_relink(hd);
+  qmap_done(hd);
+}
+
+typedef struct {
+  uint32_t hd, base, lo, hi;
+  const void * const *keys;
+  const void * const *values;
+  qmap_blk_t *arena;
+} qmap_append_job_t;
+
+/* Bytes a payload takes inside an arena, header included */
+  static inline size_t
+qmap_arena_size(size_t key_len, size_t val_len)
+{
+  size_t size = qmap_payload_size(key_len, val_len);
+
+  return sizeof(qmap_blk_t) + ((size + QMAP_POOL_STEP - 1)
+      & ~(size_t) (QMAP_POOL_STEP - 1));
+}
+
+/* Append keys[lo, hi) at base + i, carving every payload out of a
+ * single arena allocation. Workers touch disjoint positions only.
+ * Values that go to the log are put there while sizing the arena,
+ * which leaves them out. */
+  static void *
+qmap_append_job(void *arg)
+{
+  qmap_append_job_t *job = arg;
+  qmap_head_t *head = &qmap_heads[job->hd];
+  qmap_t *qmap = &qmaps[job->hd];
+  qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  uint32_t vtype = head->types[QM_VALUE];
+  size_t total = 0;
+  char *mem;
+
+  for (uint32_t i = job->lo; i < job->hi; i++) {
+    size_t key_len = type->measure
+      ? type->measure(job->keys[i]) : type->len;
+    size_t val_len = qmap_len(vtype, job->values[i]);
+    char *spill = vtype == QM_PTR ? NULL
+      : qmap_vlog_spill(qmap, job->values[i], val_len);
+
+    qmap->table[job->base + i] = spill;
+    total += qmap_arena_size(key_len, spill ? 0 : val_len);
+  }
+
+  if (!total)
+    return NULL;
+
+  job->arena = malloc(sizeof(qmap_blk_t) + total);
+  CBUG(!job->arena, "malloc error (arena)\n");
+  job->arena->next = NULL;
+  job->arena->size = total;
+  mem = (char *) (job->arena + 1);
+
+  for (uint32_t i = job->lo; i < job->hi; i++) {
+    const void *key = job->keys[i];
+    const void *value = vtype == QM_PTR ? &job->values[i] : job->values[i];
+    size_t key_len = type->measure ? type->measure(key) : type->len;
+    size_t val_len = qmap_len(vtype, job->values[i]);
+    qmap_blk_t *blk = (qmap_blk_t *) mem;
+    uint32_t n = job->base + i;
+    void *rkey = blk + 1;
+    int spilled = * VAL_ADDR(qmap, n) != NULL;
+    size_t vin = spilled ? 0 : val_len;
+
+    mem += qmap_arena_size(key_len, vin);
+    blk->next = NULL;
+    blk->size = qmap_payload_size(key_len, vin) | QMAP_BLK_ARENA;
+
+    memcpy(rkey, key, key_len);
+    memcpy((char *) rkey + qmap_payload_off(key_len), value, vin);
+
+    qmap->omap[n] = rkey;
+    if (!spilled)
+      * VAL_ADDR(qmap, n) = (char *) rkey + qmap_payload_off(key_len);
+    qmap->key_hashes[n] = type->hash(key, key_len);
+    qmap->key_sizes[n] = key_len;
+    qmap->val_sizes[n] = val_len;
+  }
+
+  return NULL;
+}
+
+  uint32_t /* API */
+qmap_bulk_put(uint32_t hd, const void * const *keys,
+    const void * const *values, uint32_t count)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  int own = !(head->iflags & QM_BULK);
+  uint32_t k, stored = 0;
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return 0;
+
+  qmap_bulk_begin(hd, count);
+  k = qmap_workers(count, qmap_cfg_par_min);
+
+  /* Auto-keys and a full table need qmap_put's handling, and heaps
+   * have no arenas */
+  if (k > 1 && (head->iflags & QM_BDEFER) && !qmap->heap
+      && (uint64_t) qmap->idm.last + count < head->m) {
+    for (uint32_t i = 0; i < count; i++)
+      if (!keys[i]) {
+        k = 1;
+        break;
+      }
+  } else
+    k = 1;
+
+  if (k > 1) {
+    qmap_append_job_t jobs[QM_MAX_WORKERS];
+    uint32_t base = qmap->idm.last;
+
+    if (head->iflags & QM_WLOG)
+      for (uint32_t i = 0; i < count; i++)
+        qmap_wal_log(hd, QMAP_WAL_PUT, keys[i], values[i]);
+
+    for (uint32_t t = 0; t < k; t++) {
+      jobs[t].hd = hd;
+      jobs[t].base = base;
+      jobs[t].lo = (uint32_t) ((uint64_t) count * t / k);
+      jobs[t].hi = (uint32_t) ((uint64_t) count * (t + 1) / k);
+      jobs[t].keys = keys;
+      jobs[t].values = values;
+      jobs[t].arena = NULL;
+    }
+
+    qmap_par(qmap_append_job, jobs, sizeof(*jobs), k);
+
+    for (uint32_t t = 0; t < k; t++)
+      if (jobs[t].arena) {
+        jobs[t].arena->next = qmap->arenas;
+        qmap->arenas = jobs[t].arena;
+      }
+
+    qmap->idm.last = base + count;
+    head->n += count;
+    head->mods++;
+    for (uint32_t i = 0; (head->nshard || qmap->mseq) && i < count; i++)
+      qmap_touch(hd, base + i);
+    stored = count;
+  } else
+    for (uint32_t i = 0; i < count; i++)
+      if (qmap_put(hd, keys[i], values[i]) != QM_MISS)
+        stored++;
+
+  if (own)
+    qmap_bulk_end(hd);
+
+  qmap_done(hd);
+  return stored;
+}
+
+/* }}} */
+
+/* }}} */
+
+/* GET {{{ */
+
+static int qmap_lnext(uint32_t *sn, uint32_t cur_id);
+
+  const void * /* API */
+qmap_get(uint32_t hd, const void * const key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  qmap_lazy(hd);
+
+  /* ── Composite-key resolution for record-aware maps ──────────────── */
+  if (head->record_id > 0) {
+    const char *k = (const char *)key;
+    const char *colon = strchr(k, ':');
+    if (colon) {
+      size_t sk_len = (size_t)(colon - k);
+      char struct_key[256];
+      if (sk_len >= sizeof(struct_key))
+        return NULL;
+      memcpy(struct_key, k, sk_len);
+      struct_key[sk_len] = '\0';
+
+      int fi = qmap_record_find_field(head->record_id, colon + 1);
+      if (fi < 0)
+        return NULL;
+
+      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+
+      if (ft == QM_VSTR) {
+        /* QM_VSTR: look up the composite key directly in vstr map */
+        if (head->vstr_hd == 0)
+          return NULL;
+        return qmap_get(head->vstr_hd, k);
+      }
+
+      const void *struct_ptr = qmap_get(hd, struct_key);
+      if (!struct_ptr)
+        return NULL;
+
+      size_t field_offset = qmap_records[head->record_id].fields[fi].offset;
+      const char *result = (const char *)struct_ptr + field_offset;
+      return result;
+    }
+  }
+
+  const void *value;
+  uint32_t cur_id, sn;
+
+  /* a QM_SHARED reader looks again if the writer changed the map */
+  do {
+    cur_id = qmap_iter(hd, key, 0);
+    value = NULL;
+    if (qmap_lnext(&sn, cur_id)) {
+      qmap_fin(cur_id);
+      value = qmap_val(hd, sn);
+    }
+  } while (qmap_shared_moved(hd));
+
+  return value;
+}
+
+/* }}} */
+
+/* DELETE {{{ */
+
+  static inline uint32_t
+qmap_root(uint32_t hd)
+{
+  while(qmap_heads[hd].phd != hd)
+    hd = qmap_heads[hd].phd;
+
+  return hd;
+}
+
+static void qmap_ndel(uint32_t hd, uint32_t n);
+
+static void qmap_ndel_topdown(uint32_t hd, uint32_t n) {
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  const void *key;
+  uint32_t id, ahd;
+  idsi_t *cur;
+
+  // Guard against already-closed maps (omap is NULL after close)
+  if (!qmap->omap)
+    return;
+
+  if (n >= head->m)
+    return;
+
+  key = qmap_key(hd, n);
+
+  cur = ids_iter(&qmap->linked);
+
+  while (ids_next(&ahd, &cur)) {
+    if (qmaps[ahd].m_assoc && key) {
+      /* Multi-assoc: secondary is a root map storing (ref_val, pkey).
+       * Iterate to find and delete entries whose value matches the
+       * primary key being deleted. */
+      uint32_t mcur = qmap_iter(ahd, NULL, 0);
+      uint32_t msn;
+      uint32_t to_del[256];
+      size_t ndel = 0;
+
+      while (qmap_lnext(&msn, mcur)) {
+        const void *mval = qmap_val(ahd, msn);
+        if (mval && qmap_scmp(mval, key, 0) == 0) {
+          to_del[ndel++] = msn;
+          if (ndel >= 256) break;
+        }
+      }
+      qmap_fin(mcur);
+
+      for (size_t i = 0; i < ndel; i++)
+        qmap_ndel(ahd, to_del[i]);
+    } else {
+      qmap_ndel_topdown(ahd, n);
+    }
+  }
+
+  /* nothing is here, as in a mirror where a value is another key's
+   * too: there is no entry to count off */
+  if (!key)
+    return;
+
+  qmap_touch(hd, n);
+  if (qmap->delta)
+    qmap_delta_tomb(hd, key);
+
+  id = qmap_id(hd, key);
+
+  /* For QM_MULTIVALUE maps, check if other duplicates exist before clearing hash entry.
+   * Do this BEFORE freeing the key! */
+  uint32_t new_map_entry = QM_MISS;
+  int sidx = -1;
+  if ((head->flags & QM_MULTIVALUE) && !(head->iflags & QM_DRANGE)) {
+    int first = qmap_bsearch_ex(hd, key, NULL, QMAP_BSEARCH_FIRST);
+
+    if (first != -1) {
+      uint32_t first_pos = qmap->sorted_idx[first];
+      int last = qmap_bsearch_ex(hd, key, NULL, QMAP_BSEARCH_LAST);
+
+      /* The search left the index clean, so find n in its run of
+       * duplicates and splice it out below instead of dirtying the
+       * whole index for the next lookup to rebuild. */
+      for (int i = first; i <= last; i++)
+        if (qmap->sorted_idx[i] == n) {
+          sidx = i;
+          break;
+        }
+
+      if (first_pos == n) {
+        /* Deleting the first entry, check if a second exists */
+        int second = first + 1;
+        if (second < (int)head->sorted_n) {
+          const void *second_key = qmap_key(hd, qmap->sorted_idx[second]);
+          qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+          size_t key_len = qmap->key_sizes[n];
+          size_t len;
+          if (type->measure) {
+            size_t second_len = qmap->key_sizes[qmap->sorted_idx[second]];
+            len = (key_len > second_len) ? key_len : second_len;
+          } else
+            len = type->len;
+
+          if (type->cmp(key, second_key, len) == 0)
+            new_map_entry = qmap->sorted_idx[second];
+        }
+      } else {
+        /* Not deleting first entry, first remains valid */
+        new_map_entry = first_pos;
+      }
+    }
+  }
+
+  if (head->phd == hd) {
+    qmap_vlog_free(hd, n);
+    qmap_payload_free(qmap, (void *) key);
+    * VAL_ADDR(qmap, n) = NULL;
+  }
+
+  qmap->key_hashes[n] = 0;
+  qmap->key_sizes[n] = 0;
+  qmap->val_sizes[n] = 0;
+
+  if (sidx >= 0) {
+    memmove(&qmap->sorted_idx[sidx], &qmap->sorted_idx[sidx + 1],
+        sizeof(uint32_t) * (head->sorted_n - (uint32_t) sidx - 1));
+    head->sorted_n--;
+  } else if (!(head->iflags & QM_DRANGE))
+    head->iflags |= QM_SDIRTY;
+
+  /* Update hash table entry */
+  if (id != QM_MISS) {
+    if (new_map_entry != QM_MISS)
+      qmap->map[id] = new_map_entry;
+    else
+      qmap_id_unset(hd, id);
+  }
+
+  qmap->omap[n] = NULL;
+  idm_del(&qmap->idm, n);
+  head->n --;
+
+}
+
+/* Delete based on position */
+static inline void
+qmap_ndel(uint32_t hd, uint32_t n) {
+  qmap_ndel_topdown(qmap_root(hd), n);
+}
+
+  static void
+qmap_clear_fast(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  if (head->phd == hd) {
+    for (uint32_t n = 0; n < qmap->idm.last; n++) {
+      const void *key = qmap->omap[n];
+      if (!key)
+        continue;
+      qmap_payload_free(qmap, (void *) key);
+    }
+  }
+
+  memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
+  memset(qmap->omap, 0, sizeof(void *) * head->m);
+  memset(qmap->key_hashes, 0, sizeof(uint32_t) * head->m);
+  memset(qmap->key_sizes, 0, sizeof(size_t) * head->m);
+  if (head->phd == hd) {
+    memset(qmap->table, 0, sizeof(void *) * head->m);
+    memset(qmap->val_sizes, 0, sizeof(size_t) * head->m);
+  }
+
+  idm_drop(&qmap->idm);
+  qmap->idm.last = 0;
+  head->n = 0;
+  head->iflags |= QM_SDIRTY;
+  qmap_touch_all(hd);
+
+  /* every payload is back in the bins: let arenas go as well */
+  if (qmap->arenas && !qmap->hold)
+    qmap_payload_flush(qmap);
+
+  if (qmap->vlog && qmap_vlog_free_ok(hd))
+    qmap_vlog_reset(qmap->vlog);
+}
+
+  static void
+qmap_ldel(uint32_t hd, const void * const key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  /* ── Field-level delete for record-aware maps ─────────────────────── */
+  if (head->record_id > 0) {
+    const char *k = (const char *)key;
+    const char *colon = strchr(k, ':');
+    if (colon) {
+      size_t sk_len = (size_t)(colon - k);
+      char struct_key[256];
+      if (sk_len >= sizeof(struct_key))
+        return;
+      memcpy(struct_key, k, sk_len);
+      struct_key[sk_len] = '\0';
+
+      int fi = qmap_record_find_field(head->record_id, colon + 1);
+      if (fi < 0)
+        return;
+
+      void *struct_ptr = (void *)qmap_get(hd, struct_key);
+      if (!struct_ptr)
+        return;
+
+      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+      size_t   fo = qmap_records[head->record_id].fields[fi].offset;
+      size_t   fm = qmap_records[head->record_id].fields[fi].max_size;
+
+      if (ft == QM_VSTR) {
+        /* QM_VSTR: delete the composite key entry from the vstr map */
+        if (head->vstr_hd) {
+          qmap_del(head->vstr_hd, k);
+        }
+        return;
+      }
+
+      size_t field_size = fm;
+      if (field_size == 0)
+        field_size = qmap_len(ft, NULL);
+
+      /* Snapshot old value for inverse cleanup */
+      uint8_t old_val[8192];
+      size_t old_sz = (ft == QM_STR || ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE) ? fm : sizeof(uint32_t);
+      if (old_sz > sizeof(old_val)) return;
+      memcpy(old_val, (char *)struct_ptr + fo, old_sz);
+
+      /* cleared in a copy, as in qmap_lput */
+      size_t struct_size = qmap_records[head->record_id].struct_size;
+      uint8_t struct_stack[8192];
+      const void *stored = struct_ptr;
+      struct_ptr = struct_size > sizeof(struct_stack)
+        ? malloc(struct_size) : struct_stack;
+      if (!struct_ptr) return;
+      memcpy(struct_ptr, stored, struct_size);
+
+      memset((char *)struct_ptr + fo, 0, field_size);
+
+      /* Re-put the struct */
+      uint32_t put_id = qmap_put(hd, struct_key, struct_ptr);
+      if (struct_ptr != struct_stack) free(struct_ptr);
+      if (put_id == QM_MISS) return;
+      uint32_t source_pos = qmaps[hd].map[put_id];
+
+      /* Clean inverse: old references removed (new value is zeroed) */
+      if (head->inv_hds && (ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE)) {
+        handle_inverse_put(head, fi, source_pos, old_val,
+                           (const void*)"",
+                           ft, fm);
+      }
+      return;
+    }
+  }
+
+  uint32_t cur = qmap_iter(hd, key, 0), sn;
+
+  if (head->flags & QM_MULTIVALUE) {
+    if (qmap_lnext(&sn, cur)) {
+      if (head->record_id > 0 && head->inv_hds)
+        clean_inverses_for_pos(head, sn);
+      qmap_ndel(hd, sn);
+    }
+    qmap_fin(cur);
+  } else {
+    while (qmap_lnext(&sn, cur)) {
+      if (head->record_id > 0 && head->inv_hds)
+        clean_inverses_for_pos(head, sn);
+      qmap_ndel(hd, sn);
+    }
+    qmap_fin(cur);
+  }
+}
+
+  void /* API */
+qmap_del(uint32_t hd, const void * const key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return;
+
+  if (!(head->iflags & QM_WLOG)) {
+    qmap_ldel(hd, key);
+    qmap_done(hd);
+    return;
+  }
+
+  head->iflags &= ~QM_WLOG;
+  qmap_ldel(hd, key);
+  head->iflags |= QM_WLOG;
+
+  if (!qmap_wal_record(hd, key))
+    qmap_wal_log(hd, QMAP_WAL_DEL, key, NULL);
+  qmap_done(hd);
+}
+
+  static void
+qmap_ldel_all(uint32_t hd, const void * const key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+
+  if (head->flags & QM_MULTIVALUE) {
+    /* Fast path: if nothing is linked to this map, bulk-delete by
+     * clearing the matching slots once and rebuilding the hash table.
+     * This avoids repeated probe-chain maintenance for every duplicate. */
+    uint32_t cur = qmap_get_multi(hd, key);
+    uint32_t sn;
+    size_t n = 0, cap = head->n ? head->n : 1;
+    uint32_t *positions = malloc(sizeof(*positions) * cap);
+    int fast_path = ids_iter(&qmap->linked) == NULL && head->phd == hd;
+
+    if (cur == QM_MISS)
+      return;
+
+    CBUG(!positions, "malloc error (del_all)\n");
+
+    while (qmap_lnext(&sn, cur))
+      positions[n++] = sn;
+
+    if (fast_path) {
+      for (size_t i = 0; i < n; i++) {
+        uint32_t pos = positions[i];
+        const void *old_key = qmap_key(hd, pos);
+
+        qmap_touch(hd, pos);
+        if (qmap->delta)
+          qmap_delta_tomb(hd, old_key);
+        qmap_vlog_free(hd, pos);
+        qmap_payload_free(qmap, (void *) old_key);
+        qmap->key_sizes[pos] = 0;
+        qmap->val_sizes[pos] = 0;
+        qmap->omap[pos] = NULL;
+        * VAL_ADDR(qmap, pos) = NULL;
+        idm_del(&qmap->idm, pos);
+        head->n--;
+      }
+
+      head->iflags |= QM_SDIRTY;
+
+      if (head->n == 0)
+        memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
+      else
+        qmap_rebuild_map(hd);
+    } else {
+      for (size_t i = 0; i < n; i++)
+        qmap_ndel(hd, positions[i]);
+    }
+
+    free(positions);
+  } else {
+    /* For regular maps, just call qmap_del once */
+    qmap_del(hd, key);
+  }
+}
+
+  void /* API */
+qmap_del_all(uint32_t hd, const void * const key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return;
+
+  if (!(head->iflags & QM_WLOG)) {
+    qmap_ldel_all(hd, key);
+    qmap_done(hd);
+    return;
+  }
+
+  head->iflags &= ~QM_WLOG;
+  qmap_ldel_all(hd, key);
+  head->iflags |= QM_WLOG;
+
+  if (!qmap_wal_record(hd, key))
+    qmap_wal_log(hd, QMAP_WAL_DEL_ALL, key, NULL);
+  qmap_done(hd);
+}
+
+  static uint32_t
+qmap_ldel_range(uint32_t hd, const void * const lo,
+    const void * const hi)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t first, last, count, *positions;
+  int fast_path = head->phd == hd && ids_iter(&qmap->linked) == NULL
+    && !head->inv_hds;
+
+  if (!(head->flags & QM_SORTED)) {
+    WARN("qmap %u: qmap_del_range requires QM_SORTED", hd);
+    return 0;
+  }
+
+  if (head->iflags & QM_SDIRTY)
+    qmap_rebuild_sorted(hd);
+
+  first = lo ? qmap_bound(hd, lo, 0) : 0;
+  last = hi ? qmap_bound(hd, hi, 1) : head->sorted_n;
+
+  if (first >= last)
+    return 0;
+
+  count = last - first;
+  positions = malloc(sizeof(*positions) * count);
+  CBUG(!positions, "malloc error (del_range)\n");
+  memcpy(positions, &qmap->sorted_idx[first],
+      sizeof(*positions) * count);
+
+  /* Whatever the deletes below do, the sorted index ends up as the
+   * entries around the slice, in the same order */
+  memmove(&qmap->sorted_idx[first], &qmap->sorted_idx[last],
+      sizeof(uint32_t) * (head->sorted_n - last));
+  head->sorted_n -= count;
+
+  if (fast_path) {
+    /* Nothing to cascade to: free the slice in bulk and
+     * rebuild the hash table once. */
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t pos = positions[i];
+
+      qmap_touch(hd, pos);
+      if (qmap->delta)
+        qmap_delta_tomb(hd, qmap->omap[pos]);
+      qmap_vlog_free(hd, pos);
+      qmap_payload_free(qmap, (void *) qmap->omap[pos]);
+      qmap->key_hashes[pos] = 0;
+      qmap->key_sizes[pos] = 0;
+      qmap->val_sizes[pos] = 0;
+      qmap->omap[pos] = NULL;
+      * VAL_ADDR(qmap, pos) = NULL;
+      idm_del(&qmap->idm, pos);
+      head->n--;
+    }
+
+    if (head->n == 0)
+      memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
+    else
+      qmap_rebuild_map(hd);
+  } else {
+    /* the deletes cascade, but leave the index to the splice above */
+    head->iflags |= QM_DRANGE;
+    for (uint32_t i = 0; i < count; i++) {
+      if (head->record_id > 0 && head->inv_hds)
+        clean_inverses_for_pos(head, positions[i]);
+      qmap_ndel(hd, positions[i]);
+    }
+    head->iflags &= ~QM_DRANGE;
+
+    /* duplicates past the slice lost their slot with those in it */
+    if (head->flags & QM_MULTIVALUE)
+      qmap_rebuild_map(hd);
+  }
+
+  if (head->n == head->sorted_n)
+    head->iflags &= ~QM_SDIRTY;
+  else
+    head->iflags |= QM_SDIRTY;
+
+  free(positions);
+  return count;
+}
+
+  uint32_t /* API */
+qmap_del_range(uint32_t hd, const void * const lo,
+    const void * const hi)
+{
+  uint32_t count;
+
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return 0;
+
+  count = qmap_ldel_range(hd, lo, hi);
+
+  if (count && (qmap_heads[hd].iflags & QM_WLOG))
+    qmap_wal_log(hd, QMAP_WAL_DEL_RANGE, lo, hi);
+
+  qmap_done(hd);
+  return count;
+}
+
+/* }}} */
+
+/* ITERATION {{{ */
+
+  static inline uint32_t
+qmap_cur_new(void)
+{
+  uint32_t cur_id;
+
+  pthread_mutex_lock(&cursor_lock);
+  cur_id = idm_new(&cursor_idm);
+  pthread_mutex_unlock(&cursor_lock);
+  return cur_id;
+}
+
+  static inline void
+qmap_cur_del(uint32_t cur_id)
+{
+  pthread_mutex_lock(&cursor_lock);
+  /* marks it ended, for callers that still qmap_fin it */
+  qmap_cursors[cur_id].hd = QM_MISS;
+  idm_del(&cursor_idm, cur_id);
+  pthread_mutex_unlock(&cursor_lock);
+}
+
+  void /* API */
+qmap_fin(uint32_t cur_id)
+{
+  qmap_cur_t *cursor = &qmap_cursors[cur_id];
+
+  /* already freed by the qmap_next that ran it out */
+  if (cursor->hd == QM_MISS)
+    return;
+
+  if (cursor->sub_cur)
+    qmap_fin(cursor->sub_cur);
+
+  qmap_cur_del(cur_id);
+}
+
+  uint32_t /* API */
+qmap_iter(uint32_t hd, const void * const key, uint32_t flags)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t cur_id = qmap_cur_new();
+  qmap_cur_t *cursor = &qmap_cursors[cur_id];
+
+  qmap_lazy(hd);
+
+  if (key && (head->flags & QM_MULTIVALUE)) {
+    /* For QM_MULTIVALUE maps, use sorted iteration to find all duplicates.
+     * Find first occurrence of this key */
+    int first = qmap_bsearch_ex(hd, key, NULL, QMAP_BSEARCH_FIRST);
+    cursor->pos = (first != -1) ? (uint32_t)first : head->sorted_n;
+    cursor->end_pos = QM_MISS;
+    /* Use sorted iteration but stop at key boundary */
+    flags |= QM_RANGE;
+  } else if (key && (flags & QM_RANGE) && (head->flags & QM_SORTED)) {
+    int exact;
+    cursor->pos = qmap_bsearch(hd, key, &exact);
+    cursor->end_pos = head->sorted_n;
+  } else if (key && !(flags & QM_RANGE)) {
+    uint32_t id = qmap_id(hd, key);
+    if (id == QM_MISS) {
+      cursor->pos = QM_MISS;
+      cursor->end_pos = QM_MISS;
+    } else {
+      cursor->pos = qmap->map[id];
+      cursor->end_pos = cursor->pos;
+    }
+  } else
+    cursor->pos = cursor->end_pos = 0;
+
+  cursor->ipos = cursor->pos;
+  cursor->lim = QM_MISS;
+  cursor->sub_cur = 0;
+  cursor->hd = hd;
+  cursor->key = key;
+  cursor->key_len = key ? qmap_len(head->types[QM_KEY], key) : 0;
+  cursor->flags = flags;
+  return cur_id;
+}
+
+  uint32_t /* API */
+qmap_iter_split(uint32_t hd, uint32_t k, uint32_t *cursors,
+    uint32_t flags)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  int sorted = (flags & QM_RANGE) && (head->flags & QM_SORTED);
+  uint32_t total;
+
+  qmap_lazy(hd);
+
+  /* Cursors only read from here on: the index must be ready */
+  if (sorted && (head->iflags & QM_SDIRTY))
+    qmap_rebuild_sorted(hd);
+
+  total = sorted ? head->sorted_n : qmap->idm.last;
+
+  for (uint32_t i = 0; i < k; i++) {
+    uint32_t cur_id = qmap_iter(hd, NULL, flags & QM_RANGE);
+    qmap_cur_t *cursor = &qmap_cursors[cur_id];
+
+    cursor->pos = cursor->ipos = (uint32_t) ((uint64_t) total * i / k);
+    cursor->lim = (uint32_t) ((uint64_t) total * (i + 1) / k);
+    cursors[i] = cur_id;
+  }
+
+  return k;
+}
+
+/* low-level next */
+  static int
+qmap_lnext(uint32_t *sn, uint32_t cur_id)
+{
+  register qmap_cur_t *cursor
+    = &qmap_cursors[cur_id];
+  register qmap_head_t *head = &qmap_heads[cursor->hd];
+  register qmap_t *qmap = &qmaps[cursor->hd];
+  uint32_t n;
+  const void *key;
+
+  if ((cursor->flags & QM_RANGE)
+      && (head->flags & QM_SORTED))
+  {
+    if (head->iflags & QM_SDIRTY)
+      qmap_rebuild_sorted(cursor->hd);
+
+    if (cursor->pos >= head->sorted_n || cursor->pos >= cursor->lim)
+      goto end;
+
+    n = qmap->sorted_idx[cursor->pos];
+
+    if (cursor->key && (head->flags & QM_MULTIVALUE)) {
+      if (cursor->end_pos == QM_MISS)
+        cursor->end_pos = (uint32_t) qmap_bsearch_ex(
+            cursor->hd, cursor->key, NULL,
+            QMAP_BSEARCH_LAST);
+      if (cursor->pos > cursor->end_pos)
+        goto end;
+    }
+
+    *sn = n;
+    cursor->pos++;
+    return 1;
+  }
+
+cagain:
+  n = cursor->pos;
+
+  if (n >= qmap->idm.last || n >= cursor->lim)
+    goto end;
+
+  key = qmap_key(cursor->hd, n);
+  if (key == NULL) {
+    cursor->pos++;
+    goto cagain;
+  }
+
+  if (cursor->flags & QM_RANGE) {
+    if (!cursor->key)
+      goto next;
+
+    qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+    size_t len;
+
+    if (type->measure) {
+      size_t key_len = type->measure(key);
+      size_t start_key_len = cursor->key_len;
+      len = (key_len > start_key_len)
+        ? key_len
+        : start_key_len;
+    } else
+      len = type->len;
+
+    if (type->cmp(key, cursor->key, len) < 0) {
+      cursor->pos++;
+      goto cagain;
+    }
+  } else if (cursor->key && n != cursor->ipos)
+    goto end;
+next:
+
+  DEBUG(3, "NEXT! cur_id %u key %p\n",
+      cur_id, key);
+
+  cursor->pos++;
+  *sn = n;
+  return 1;
+end:
+  if (!(cursor->flags & QM_CUR_HOLD))
+    qmap_cur_del(cur_id);
+  *sn = QM_MISS;
+  return 0;
+}
+
+  int /* API */
+qmap_next(const void ** ckey, const void ** cval,
+    uint32_t cur_id)
+{
+  register qmap_cur_t *c;
+  uint32_t sn;
+  int ret = qmap_lnext(&sn, cur_id);
+
+  if (!ret)
+    return 0;
+
+  c = &qmap_cursors[cur_id];
+  if (ckey)
+    *ckey = qmap_key(c->hd, sn);
+  if (cval)
+    *cval = qmap_val(c->hd, sn);
+  return 1;
+}
+
+/* How far ahead of the entry being copied out to prefetch */
+#define QMAP_PREFETCH 8
+
+  uint32_t /* API */
+qmap_next_batch(uint32_t cur_id, const void **keys,
+    const void **vals, uint32_t max)
+{
+  qmap_cur_t *cursor = &qmap_cursors[cur_id];
+  qmap_head_t *head = &qmap_heads[cursor->hd];
+  qmap_t *qmap = &qmaps[cursor->hd];
+  const void **omap = qmap->omap;
+  /* QM_PGET values are the keys of the primary */
+  const void **pkeys = qmaps[head->phd].omap;
+  void **table = qmaps[head->phd].table;
+  int pget = head->flags & QM_PGET;
+  /* mapped maps have no pointer arrays to read from */
+  int direct = omap && (pget ? pkeys != NULL : table != NULL);
+  uint32_t got = 0, sn;
+
+  if (direct && (cursor->flags & QM_RANGE) && (head->flags & QM_SORTED)
+      && !(cursor->key && (head->flags & QM_MULTIVALUE)))
+  {
+    /* sorted scan: every slot of the index up to the end is a hit */
+    uint32_t end, *idx;
+
+    if (head->iflags & QM_SDIRTY)
+      qmap_rebuild_sorted(cursor->hd);
+
+    idx = qmap->sorted_idx;
+    end = head->sorted_n < cursor->lim ? head->sorted_n : cursor->lim;
+
+    for (uint32_t p = cursor->pos; got < max && p < end; p++) {
+      uint32_t n = idx[p];
+
+      if (p + QMAP_PREFETCH < end)
+        __builtin_prefetch(omap[idx[p + QMAP_PREFETCH]]);
+
+      keys[got] = omap[n];
+      vals[got++] = pget ? pkeys[n] : table[n];
+    }
+
+    cursor->pos += got;
+  } else if (direct && !cursor->key) {
+    /* full scan: skip holes without going through qmap_lnext */
+    uint32_t end = qmap->idm.last < cursor->lim
+      ? qmap->idm.last : cursor->lim;
+    uint32_t n = cursor->pos;
+
+    for (; got < max && n < end; n++) {
+      if (n + QMAP_PREFETCH < end)
+        __builtin_prefetch(omap[n + QMAP_PREFETCH]);
+
+      if (!omap[n])
+        continue;
+
+      keys[got] = omap[n];
+      vals[got++] = pget ? pkeys[n] : table[n];
+    }
+
+    cursor->pos = n;
+  } else {
+    /* the cursor must outlive a last, partial batch */
+    cursor->flags |= QM_CUR_HOLD;
+    while (got < max && qmap_lnext(&sn, cur_id)) {
+      keys[got] = qmap_key(cursor->hd, sn);
+      vals[got++] = qmap_val(cursor->hd, sn);
+    }
+    cursor->flags &= ~QM_CUR_HOLD;
+  }
+
+  if (!got)
+    qmap_cur_del(cur_id);
+
+  return got;
+}
+
+/* }}} */
+
+/* DROP + CLOSE + OTHERS {{{ */
+
+  static void
+qmap_ldrop(uint32_t hd)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  if (ids_iter(&qmap->linked) == NULL) {
+    qmap_clear_fast(hd);
+    return;
+  }
+
+  uint32_t cur_id = qmap_iter(hd, NULL, 0), sn;
+
+  while (qmap_lnext(&sn, cur_id))
+    qmap_ndel(hd, sn);
+}
+
+  void /* API */
+qmap_drop(uint32_t hd)
+{
+  qmap_lazy(hd);
+
+  if (qmap_rdonly(hd))
+    return;
+
+  qmap_ldrop(hd);
+
+  if (qmap_heads[hd].iflags & QM_WLOG)
+    qmap_wal_log(hd, QMAP_WAL_DROP, NULL, NULL);
+  qmap_done(hd);
+}
+
+/* Leave the files of sharded map hd, which is closing */
+  static void
+qmap_shards_detach(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  for (uint32_t i = 0; i < head->nshard; i++) {
+    char name[strlen(head->shards) + 12];
+    qmap_file_t *file;
+
+    snprintf(name, sizeof(name), "%s.%03u", head->shards, i);
+    file = (qmap_file_t *) qmap_get(qmap_files_hd, name);
+    if (!file)
+      continue;
+
+    ids_remove(&file->ids, hd);
+    if (ids_peek(&file->ids) == IDM_MISS) {
+      file_close(file);
+      file->rdonly = 0;
+    }
+  }
+
+  free(head->shard_mods);
+  free(head->shard_saved);
+  head->shard_mods = head->shard_saved = NULL;
+  head->shards = NULL;
+  head->nshard = 0;
+}
+
+  void /* API */
+qmap_close(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_vlog_t *vlog;
+  idsi_t *cur;
+  uint32_t ahd;
+
+  if (!qmap->omap && !qmap->mm)
+    return;
+
+  /* the payloads go away: write them out first */
+  if (qmap->hold)
+    qmap_ckpt_finish();
+
+  if (head->iflags & QM_WLOG) {
+    qmap_wal_flush(head->wal, 0);
+    head->iflags &= ~QM_WLOG;
+  }
+
+  /* what is left to do for a heap is to write it out */
+  if (qmap->heap)
+    qmap_heap_sync(hd);
+
+  /* a background save may still read the log: it is let go of
+   * whole, and not punched entry by entry */
+  vlog = qmap->vlog;
+  qmap->vlog = NULL;
+
+  /* a reused handle is not in the image */
+  head->iflags &= ~QM_ASYNC;
+
+  if (!qmap->mm && !qmap->heap)
+    qmap_ldrop(hd);
+
+  cur = ids_iter(&qmap->linked);
+  while (ids_next(&ahd, &cur))
+    qmap_close(ahd);
+
+  ids_drop(&qmap->linked);
+
+  /* Close inverse index maps */
+  if (head->inv_hds) {
+    uint32_t fc = head->record_id > 0 && head->record_id < qmap_records_n
+                ? (uint32_t)qmap_records[head->record_id].field_count : 0;
+    for (uint32_t i = 0; i < fc; i++) {
+      if (head->inv_hds[i])
+        qmap_close(head->inv_hds[i]);
+    }
+    free(head->inv_hds);
+    head->inv_hds = NULL;
+  }
+
+  /* Close variable-length string map */
+  if (head->vstr_hd) {
+    qmap_close(head->vstr_hd);
+    head->vstr_hd = 0;
+  }
+
+  idm_drop(&qmap->idm);
+  qmap->idm.last = 0;
+  qmap_payload_flush(qmap);
+  qmap_vlog_drop(vlog);
+  qmap_delta_free(hd);
+  if (qmap->heap)
+    qmap_heap_close(hd);
+
+  /* these belong to the file mapping */
+  if (qmap->mm) {
+    qmap->map = NULL;
+    qmap->key_hashes = NULL;
+    qmap->key_sizes = qmap->val_sizes = NULL;
+    qmap->mm = NULL;
+    qmap->mm_koff = NULL;
+    if (head->iflags & QM_MSORTED)
+      qmap->sorted_idx = NULL;
+    head->iflags &= ~QM_MSORTED;
+  }
+
+  free(qmap->map);
+  free(qmap->omap);
+  free(qmap->key_hashes);
+  free(qmap->key_sizes);
+  free(qmap->val_sizes);
+  if (qmap->sorted_idx)
+    free(qmap->sorted_idx);
+  if (qmap_heads[hd].phd == hd)
+    free(qmap->table);
+  qmap->omap = NULL;
+  idm_del(&idm, hd);
+
+  // remove any file associations so we don't try
+  // saving it to a file after it is closed.
+  if (head->nshard) {
+    qmap_shards_detach(hd);
+    return;
+  }
+
+  if (!head->file)
+    return;
+  qmap_file_t *file = (qmap_file_t *) qmap_get(qmap_files_hd, head->file);
+  if (!file)
+    return;
+  ids_remove(&file->ids, hd);
+  head->file = NULL;
+
+  /* with its last map gone, reopening the file reads it afresh */
+  if (ids_peek(&file->ids) == IDM_MISS) {
+    file_close(file);
+    file->rdonly = 0;
+  }
+}
+
+  void /* API */
+qmap_assoc(uint32_t hd, uint32_t link, qmap_assoc_t cb, void *userdata)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  qmap_lazy(hd);
+  qmap_lazy(link);
+
+  if (!cb)
+    cb = qmap_rassoc;
+
+  ids_push(&qmaps[link].linked, hd);
+
+  qmap->assoc = cb;
+  qmap->assoc_userdata = userdata;
+  qmap_heads[hd].phd = link;
+
+  qmap_unmem(qmap, qmap->table);
+  qmap->table = NULL;
+
+  if (qmap_heads[link].n > 0) {
+    uint32_t cur = qmap_iter(link, NULL, 0);
+    const void *key, *value;
+
+    while (qmap_next(&key, &value, cur)) {
+      const void *skey;
+      qmap->assoc(&skey, key, value, qmap->assoc_userdata);
+      _qmap_put(hd, skey, value, QM_MISS);
+    }
+    qmap_fin(cur);
+  }
+}
+
+  void /* API */
+qmap_assoc_multi(uint32_t hd, uint32_t link, qmap_assoc_multi_t cb, void *userdata)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  qmap_lazy(hd);
+  qmap_lazy(link);
+
+  if (!cb)
+    return;
+
+  ids_push(&qmaps[link].linked, hd);
+
+  qmap->m_assoc = cb;
+  qmap->m_assoc_userdata = userdata;
+  qmap_heads[hd].phd = link;
+
+  /* Backfill existing entries in the primary */
+  if (qmap_heads[link].n > 0) {
+    uint32_t cur = qmap_iter(link, NULL, 0);
+    const void *key, *value;
+
+    while (qmap_next(&key, &value, cur)) {
+      const void *skeys[64];
+      size_t nkeys = qmap->m_assoc(skeys, 64, key, value, qmap->m_assoc_userdata);
+      for (size_t i = 0; i < nkeys; i++) {
+        _qmap_put(hd, skeys[i], key, QM_MISS);
+        free((void *)skeys[i]);
+      }
+    }
+    qmap_fin(cur);
+  }
+}
+
+  uint32_t /* API */
+qmap_reg(size_t len)
+{
+  if (types_n > TYPES_MASK) {
+    fprintf(stderr, "qmap_reg: type limit reached\n");
+    return QM_MISS;
+  }
+  uint32_t id = types_n ++;
+  qmap_type_t *type = &qmap_types[id];
+
+  memset(type, 0, sizeof(qmap_type_t));
+  type->len = len;
+  type->hash = qmap_chash;
+  type->cmp = qmap_ccmp;
+  return id;
+}
+
+  void
+qmap_cmp_set(uint32_t ref, qmap_cmp_t *cmp)
+{
+  qmap_type_t *type = &qmap_types[ref];
+  type->cmp = cmp;
+}
+
+  uint32_t /* API */
+qmap_mreg(qmap_measure_t *measure)
+{
+  if (types_n > TYPES_MASK) {
+    fprintf(stderr, "qmap_mreg: type limit reached\n");
+    return QM_MISS;
+  }
+  uint32_t id = types_n ++;
+  qmap_type_t *type = &qmap_types[id];
+
+  memset(type, 0, sizeof(qmap_type_t));
+  type->measure = measure;
+  type->hash = qmap_chash;
+  type->cmp = qmap_ccmp;
+  type->len = 0;
+  return id;
+}
+
+  size_t /* API */
+qmap_len(uint32_t type_id, const void *key)
+{
+  qmap_type_t *type = &qmap_types[type_id];
+
+  return type->measure
+    ? type->measure(key)
+    : type->len;
+}
+
+/* }}} */
+
+/* RECORD-AWARE MAP SUPPORT {{{ */
+
+  uint32_t /* API */
+qmap_record_register(const char *name, size_t struct_size,
+    const qmap_record_field_t *fields, size_t field_count)
+{
+  if (qmap_records_n >= QMAP_MAX_RECORDS) {
+    fprintf(stderr, "qmap_record_register: record limit reached\n");
+    return QM_MISS;
+  }
+  if (struct_size == 0) {
+    fprintf(stderr, "qmap_record_register: struct_size must be > 0\n");
+    return QM_MISS;
+  }
+  if (!fields || field_count == 0 || field_count > QMAP_MAX_RECORD_FIELDS) {
+    fprintf(stderr, "qmap_record_register: invalid fields\n");
+    return QM_MISS;
+  }
+
+  uint32_t struct_type_id = qmap_reg(struct_size);
+  if (struct_type_id == QM_MISS) {
+    fprintf(stderr, "qmap_record_register: qmap_reg failed\n");
+    return QM_MISS;
+  }
+
+  uint32_t id = ++qmap_records_n;
+  qmap_record_t *rec = &qmap_records[id];
+
+  memset(rec, 0, sizeof(*rec));
+  strncpy(rec->name, name ? name : "unnamed", sizeof(rec->name) - 1);
+  rec->struct_size = struct_size;
+  rec->struct_type_id = struct_type_id;
+  rec->field_count = field_count;
+
+  for (size_t i = 0; i < field_count; i++) {
+    strncpy(rec->fields[i].name, fields[i].name,
+            sizeof(rec->fields[i].name) - 1);
+    rec->fields[i].type = fields[i].type;
+    rec->fields[i].offset = fields[i].offset;
+    rec->fields[i].max_size = fields[i].max_size;
+    rec->fields[i].target_record = fields[i].target_record;
+    rec->fields[i].target_hd = fields[i].target_hd;
+    strncpy(rec->fields[i].inverse, fields[i].inverse ? fields[i].inverse : "",
+            sizeof(rec->fields[i].inverse) - 1);
+  }
+
+  return id;
+}
+
+  uint32_t /* API */
+qmap_record_type_id(uint32_t record_id)
+{
+  if (!record_id || record_id > qmap_records_n)
+    return QM_MISS;
+  return qmap_records[record_id].struct_type_id;
+}
+
+  void /* API */
+qmap_record_field_set_target_hd(uint32_t record_id,
+    const char *field_name,
+    uint32_t target_hd)
+{
+  if (!record_id || record_id > qmap_records_n) return;
+  int fi = qmap_record_find_field(record_id, field_name);
+  if (fi < 0) return;
+  qmap_records[record_id].fields[fi].target_hd = target_hd;
+}
+
+  uint32_t /* API */
+qmap_field_put(uint32_t hd, const char *item_id,
+    const char *field_name, const char *value)
+{
+  if (!value) return QM_MISS;
+  qmap_head_t *head = &qmap_heads[hd];
+  if (head->record_id == 0) return QM_MISS;
+  int fi = qmap_record_find_field(head->record_id, field_name);
+  if (fi < 0) return QM_MISS;
+  uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+
+  char key[256];
+  snprintf(key, sizeof(key), "%s:%s", item_id, field_name);
+
+  if (ft == QM_REFERENCE) {
+    uint32_t thd = qmap_records[head->record_id].fields[fi].target_hd;
+    if (thd == 0)
+      return QM_MISS;
+    if (!value || ((const char *)value)[0] == '\0')
+      return QM_MISS;
+    uint32_t pos = qmap_pos(thd, value);
+    if (pos == UINT32_MAX)
+      return QM_MISS;
+    return qmap_put(hd, key, value);
+  }
+
+	if (ft == QM_MULTI_REFERENCE) {
+	    uint32_t thd = qmap_records[head->record_id].fields[fi].target_hd;
+	    if (!thd) return qmap_put(hd, key, value);
+
+	    static char resolved[65536];
+	    size_t off = 0;
+	    const char *p = value;
+	    while (*p) {
+	      const char *nl = strchr(p, '\n');
+	      size_t len = nl ? (size_t)(nl - p) : strlen(p);
+	      if (len > 0) {
+	        char id[256];
+	        size_t cplen = len < sizeof(id) - 1 ? len : sizeof(id) - 1;
+	        memcpy(id, p, cplen);
+	        id[cplen] = '\0';
+	        uint32_t pos = qmap_pos(thd, id);
+	        if (off > 0 && off < sizeof(resolved) - 1)
+	          resolved[off++] = '\n';
+	        if (pos != UINT32_MAX) {
+	          off += (size_t)snprintf(resolved + off, sizeof(resolved) - off,
+	                                 "%u", pos);
+	        } else {
+	          size_t slen = strlen(id);
+	          if (slen > sizeof(resolved) - off - 1)
+	            slen = sizeof(resolved) - off - 1;
+	          memcpy(resolved + off, id, slen);
+	          off += slen;
+	        }
+	      }
+	      if (!nl) break;
+	      p = nl + 1;
+	    }
+	    resolved[off < sizeof(resolved) ? off : sizeof(resolved) - 1] = '\0';
+	    return qmap_put(hd, key, resolved);
+	  }
+
+  return qmap_put(hd, key, value);
+}
+
+  const char * /* API */
+qmap_field_get(uint32_t hd, const char *item_id,
+    const char *field_name)
+{
+  if (!item_id || !field_name) return NULL;
+  qmap_head_t *head = &qmap_heads[hd];
+  if (head->record_id == 0) return NULL;
+  int fi = qmap_record_find_field(head->record_id, field_name);
+  if (fi < 0) return NULL;
+  uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+
+  char key[256];
+  snprintf(key, sizeof(key), "%s:%s", item_id, field_name);
+
+  if (ft == QM_REFERENCE) {
+    const char *stored = qmap_get(hd, key);
+    if (!stored || stored[0] == '\0')
+      return NULL;
+    return stored;
+  }
+
+  return qmap_get(hd, key);
+}
+
+  const char * /* API */
+qmap_get_key(uint32_t hd, uint32_t pos)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  qmap_lazy(hd);
+
+  if (pos >= qmap->idm.last)
+    return NULL;
+  const void *key = qmap_key(hd, pos);
+  return key ? (const char *)key : NULL;
+}
+
+  uint32_t /* API */
+qmap_pos(uint32_t hd, const char *key)
+{
+  qmap_t *qmap = &qmaps[hd];
+
+  qmap_lazy(hd);
+
+  for (uint32_t i = 0; i < qmap->idm.last; i++) {
+    const char *okey = qmap_key(hd, i);
+    if (okey && strcmp(okey, key) == 0)
+      return i;
+  }
+  return UINT32_MAX;
+}
+
+  size_t /* API */
+qmap_inv_get(uint32_t hd, const char *field_name,
+    uint32_t target_pos,
+    uint32_t *out, size_t max)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  if (!head->inv_hds || head->record_id == 0 || !field_name)
+    return 0;
+
+  int fi = qmap_record_find_field(head->record_id, field_name);
+  if (fi < 0)
+    return 0;
+
+  qmap_record_t *rec = &qmap_records[head->record_id];
+  if (rec->fields[fi].target_record == 0)
+    return 0;
+
+  uint32_t inv_hd = head->inv_hds[fi];
+  if (inv_hd == 0)
+    return 0;
+
+  const char *val = qmap_get(inv_hd, &target_pos);
+  if (!val || !*val)
+    return 0;
+
+  size_t count = 0;
+  const char *p = val;
+  while (*p && count < max) {
+    char *end;
+    unsigned long v = strtoul(p, &end, 10);
+    if (end > p)
+      out[count++] = (uint32_t)v;
+    if (*end == '\n')
+      p = end + 1;
+    else
+      break;
+  }
+
+  return count;
+}
+
+/* }}} */
+
+/* IO_URING {{{ */
+
+/* With QM_CFG_IO_URING, sections are read at load and written at save
+ * through an io_uring of the calling thread instead of a mapping and
+ * pwritev: large reads go out several at a time, and a save fills its
+ * next buffer while the kernel writes the last ones. Whatever the
+ * ring does not complete (an old kernel, a short transfer) is redone
+ * with pread / pwrite, and where no ring can be set up the usual path
+ * is taken. */
+
+/* Read all of buf at off, 0 or an errno */
+  static int
+qmap_pread(int fd, void *buf, size_t len, off_t off)
+{
+  while (len) {
+    ssize_t r = pread(fd, buf, len, off);
+
+    if (r < 0 && errno == EINTR)
+      continue;
+
+    if (r <= 0)
+      return r < 0 ? errno : EIO;
+
+    buf = (char *) buf + r;
+    len -= (size_t) r;
+    off += r;
+  }
+
+  return 0;
+}
+
+static int qmap_pwrite(int fd, const void *buf, size_t len, off_t off);
+
+#ifdef QMAP_URING
+
+#define QMAP_URING_DEPTH 8
+#define QMAP_URING_BUFS 4
+#define QMAP_URING_CHUNK (4 << 20)	// bytes per read
+
+/* A transfer in flight */
+typedef struct {
+  char *buf;
+  size_t len;
+  uint64_t off;
+  int fd, write;
+  int own;		// buffer of the ring it uses, or -1
+  int *errp;		// where to leave its errno
+  int busy;
+} qmap_uio_t;
+
+typedef struct qmap_uring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  uint32_t inflight;
+  qmap_uio_t io[QMAP_URING_DEPTH];
+  char *bufs[QMAP_URING_BUFS];	// for writes, bufsz bytes each
+  int busy[QMAP_URING_BUFS];
+  size_t bufsz;
+} qmap_uring_t;
+
+/* A ring with bufsz byte write buffers, or NULL to do without */
+  static qmap_uring_t *
+qmap_uring_new(size_t bufsz)
+{
+  struct io_uring_params p;
+  qmap_uring_t *r;
+  int fd;
+
+  if (!qmap_cfg_uring)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  fd = (int) syscall(__NR_io_uring_setup, QMAP_URING_DEPTH, &p);
+  if (fd < 0)
+    return NULL;
+
+  r = calloc(1, sizeof(*r));
+  CBUG(!r, "malloc error (io_uring)\n");
+  r->fd = fd;
+  r->bufsz = bufsz;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len)
+      r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ptr
+    : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED
+      || r->sqes == MAP_FAILED)
+  {
+    if (r->sqes != MAP_FAILED)
+      munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+      munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != MAP_FAILED)
+      munmap(r->sq_ptr, r->sq_len);
+    close(fd);
+    free(r);
+    return NULL;
+  }
+
+  r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+  return r;
+}
+
+/* Finish transfer io, which the ring did res bytes of */
+  static void
+qmap_uring_done(qmap_uring_t *r, qmap_uio_t *io, int res)
+{
+  size_t done = res > 0 ? (size_t) res : 0;
+  int err = 0;
+
+  if (done < io->len)
+    err = io->write
+      ? qmap_pwrite(io->fd, io->buf + done, io->len - done,
+          (off_t) (io->off + done))
+      : qmap_pread(io->fd, io->buf + done, io->len - done,
+          (off_t) (io->off + done));
+
+  if (err)
+    __atomic_store_n(io->errp, err, __ATOMIC_RELAXED);
+
+  if (io->own >= 0)
+    r->busy[io->own] = 0;
+  io->busy = 0;
+  r->inflight--;
+}
+
+/* Reap completions until at most left transfers are in flight */
+  static void
+qmap_uring_reap(qmap_uring_t *r, uint32_t left)
+{
+  while (r->inflight > left) {
+    unsigned head = *r->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        CBUG(errno != EINTR && errno != EAGAIN, "io_uring_enter");
+      continue;
+    }
+
+    cqe = &r->cqes[head & *r->cq_mask];
+    qmap_uring_done(r, &r->io[cqe->user_data], cqe->res);
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Queue a transfer of len bytes (below 4 GiB) and submit it */
+  static void
+qmap_uring_submit(qmap_uring_t *r, int write, int fd, char *buf,
+    size_t len, uint64_t off, int *errp)
+{
+  unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  uint32_t slot = 0;
+  qmap_uio_t *io;
+
+  qmap_uring_reap(r, QMAP_URING_DEPTH - 1);
+  while (r->io[slot].busy)
+    slot++;
+
+  io = &r->io[slot];
+  *io = (qmap_uio_t) { buf, len, off, fd, write, -1, errp, 1 };
+  for (int b = 0; b < QMAP_URING_BUFS; b++)
+    if (buf == r->bufs[b])
+      io->own = b;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = (uint32_t) len;
+  sqe->off = off;
+  sqe->user_data = slot;
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->inflight++;
+
+  /* not taken up: it is done in place */
+  if (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 1) {
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    qmap_uring_done(r, io, 0);
+  }
+}
+
+/* Write len bytes of buf at off, leaving an errno at *errp if that
+ * fails; buf must stay as it is until the ring is drained or, if it
+ * is one of the ring's, until qmap_uring_buf hands it out again */
+  static void
+qmap_uring_write(qmap_uring_t *r, int fd, const void *buf, size_t len,
+    uint64_t off, int *errp)
+{
+  while (len) {
+    size_t c = len > (1U << 30) ? 1U << 30 : len;
+
+    qmap_uring_submit(r, 1, fd, (char *) buf, c, off, errp);
+    buf = (const char *) buf + c;
+    len -= c;
+    off += c;
+  }
+}
+
+/* Read len bytes at off into buf, 0 or an errno */
+  static int
+qmap_uring_read(qmap_uring_t *r, int fd, void *buf, size_t len,
+    uint64_t off)
+{
+  int err = 0;
+
+  while (len) {
+    size_t c = len > QMAP_URING_CHUNK ? QMAP_URING_CHUNK : len;
+
+    qmap_uring_submit(r, 0, fd, buf, c, off, &err);
+    buf = (char *) buf + c;
+    len -= c;
+    off += c;
+  }
+
+  qmap_uring_reap(r, 0);
+  return err;
+}
+
+/* A write buffer none of the transfers uses */
+  static char *
+qmap_uring_buf(qmap_uring_t *r)
+{
+  for (;;) {
+    for (int b = 0; b < QMAP_URING_BUFS; b++) {
+      if (r->busy[b])
+        continue;
+
+      if (!r->bufs[b]) {
+        r->bufs[b] = malloc(r->bufsz);
+        CBUG(!r->bufs[b], "malloc error (io_uring)\n");
+      }
+
+      r->busy[b] = 1;
+      return r->bufs[b];
+    }
+
+    qmap_uring_reap(r, r->inflight - 1);
+  }
+}
+
+/* Give a buffer from qmap_uring_buf back unused */
+  static void
+qmap_uring_unbuf(qmap_uring_t *r, char *buf)
+{
+  for (int b = 0; b < QMAP_URING_BUFS; b++)
+    if (buf == r->bufs[b])
+      r->busy[b] = 0;
+}
+
+/* Wait for what is in flight and tear the ring down */
+  static void
+qmap_uring_free(qmap_uring_t *r)
+{
+  if (!r)
+    return;
+
+  qmap_uring_reap(r, 0);
+  for (int b = 0; b < QMAP_URING_BUFS; b++)
+    free(r->bufs[b]);
+
+  munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  munmap(r->sq_ptr, r->sq_len);
+  close(r->fd);
+  free(r);
+}
+
+#else
+
+typedef struct qmap_uring qmap_uring_t;
+
+  static inline qmap_uring_t *
+qmap_uring_new(size_t bufsz)
+{
+  (void) bufsz;
+  return NULL;
+}
+
+static inline void qmap_uring_write(qmap_uring_t *r, int fd,
+    const void *buf, size_t len, uint64_t off, int *errp)
+{ (void) r; (void) fd; (void) buf; (void) len; (void) off; (void) errp; }
+static inline int qmap_uring_read(qmap_uring_t *r, int fd, void *buf,
+    size_t len, uint64_t off)
+{ (void) r; (void) fd; (void) buf; (void) len; (void) off; return ENOSYS; }
+static inline char *qmap_uring_buf(qmap_uring_t *r)
+{ (void) r; return NULL; }
+static inline void qmap_uring_unbuf(qmap_uring_t *r, char *buf)
+{ (void) r; (void) buf; }
+static inline void qmap_uring_free(qmap_uring_t *r) { (void) r; }
+
+#endif
+
+/* }}} */
+
+/* A file starts with a qmap_fhdr_t and a directory of one
+ * qmap_dirent_t per database, followed by their sections. Sections
+ * and every part of them are 8-byte aligned: the key offsets, key
+ * sizes and value sizes (u64) and the key hashes (u32) of the n
+ * entries, then optionally an m slot hash table of entry indexes
+ * (QM_MISS if empty) and the entry indexes in key order, then the
+ * records. QM_SORTED maps are written in key order
+ * (QMAP_SEC_ORDERED) so that loading them sorts nothing. A record is
+ * laid out like a payload, the value following the key at
+ * qmap_payload_off(key size), so that all of it can be used in place
+ * by QM_RDONLY_MMAP maps. Sections can also be stored compact or
+ * compressed, as the sections of those name below.
+ *
+ * Files without the magic are in the packed format of old, a
+ * [dbid u32][size u64][n u32][k v k v ...] run per database, size
+ * counting the whole run. */
+
+#define QMAP_MAGIC 0x50414d51 /* "QMAP" */
+#define QMAP_VERSION 2
+#define QMAP_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+enum qmap_sec_flags {
+  QMAP_SEC_HASH = 1, // has the hash table
+  QMAP_SEC_SORTED = 2, // has the sorted index
+  QMAP_SEC_ORDERED = 4, // entries are in key order
+  QMAP_SEC_COMPACT = 8, // encoded as the COMPACT ENCODING section says
+};
+
+typedef struct {
+  uint32_t magic, version, ndb, flags;
+} qmap_fhdr_t;
+
+typedef struct {
+  uint32_t dbid, types[2], flags;
+  uint32_t n, m;
+  uint32_t crc;		// XXH32 of the section
+  uint32_t codec;	// QM_CODEC_* the section is compressed with
+  uint64_t off, size;	// of the section, from the file start
+} qmap_dirent_t;
+
+static_assert(sizeof(size_t) == sizeof(uint64_t),
+    "mapped sections are used as size_t arrays");
+
+/* Offsets of the parts of a section */
+typedef struct {
+  size_t koff, ksize, vsize, hash, map, sorted, rec;
+} qmap_layout_t;
+
+  static inline void
+qmap_layout(qmap_layout_t *l, const qmap_dirent_t *de)
+{
+  /* compact sections have none of the arrays */
+  uint32_t n = (de->flags & QMAP_SEC_COMPACT) ? 0 : de->n;
+  uint32_t m = (de->flags & QMAP_SEC_HASH) ? de->m : 0;
+  uint32_t ns = (de->flags & QMAP_SEC_SORTED) ? n : 0;
+
+  l->koff = 0;
+  l->ksize = l->koff + sizeof(uint64_t) * n;
+  l->vsize = l->ksize + sizeof(uint64_t) * n;
+  l->hash = l->vsize + sizeof(uint64_t) * n;
+  l->map = QMAP_ALIGN(l->hash + sizeof(uint32_t) * n);
+  l->sorted = QMAP_ALIGN(l->map + sizeof(uint32_t) * m);
+  l->rec = QMAP_ALIGN(l->sorted + sizeof(uint32_t) * ns);
+}
+
+/* Directory entry of a section for hd, all but crc and off */
+  static inline void
+qmap_sec_plan(qmap_dirent_t *de, uint32_t hd, uint32_t n)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+
+  memset(de, 0, sizeof(*de));
+  de->dbid = head->dbid;
+  de->types[QM_KEY] = head->types[QM_KEY];
+  de->types[QM_VALUE] = head->types[QM_VALUE];
+  de->n = n;
+
+  /* nothing to look up in an empty map */
+  if (n) {
+    de->flags |= QMAP_SEC_HASH;
+    de->m = qmap_fit(8, n);
+  }
+
+  if (head->flags & QM_SORTED)
+    de->flags |= QMAP_SEC_SORTED | QMAP_SEC_ORDERED;
+}
+
+/* COMPRESSION {{{ */
+
+/* With QM_CFG_COMPRESS, qmap_save stores sections as blocks of
+ * QMAP_ZBLOCK bytes of the section compressed one by one, after a
+ * qmap_zhdr_t and the offsets of the nblk blocks and of their end,
+ * from the section start. The directory entry names the codec, and
+ * its size and checksum are of what is on disk. Loading inflates the
+ * blocks on several threads back into the section as qmap_sec_build
+ * lays it out. Sections that would not shrink are stored as is. */
+
+#define QMAP_ZBLOCK (1 << 20)
+#define QMAP_ZMIN 4096	// smaller sections are stored as is
+
+typedef struct {
+  uint64_t raw;		// bytes of the section inflated
+  uint32_t nblk, blk;	// blocks, and bytes inflated per block
+} qmap_zhdr_t;
+
+  static int
+qmap_codec_built(uint32_t codec)
+{
+  switch (codec) {
+  case QM_CODEC_NONE:
+    return 1;
+#ifdef QMAP_LZ4
+  case QM_CODEC_LZ4:
+    return 1;
+#endif
+#ifdef QMAP_ZSTD
+  case QM_CODEC_ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/* Room to compress len bytes into */
+  static size_t
+qmap_codec_bound(uint32_t codec, size_t len)
+{
+  switch (codec) {
+#ifdef QMAP_LZ4
+  case QM_CODEC_LZ4:
+    return (size_t) LZ4_compressBound((int) len);
+#endif
+#ifdef QMAP_ZSTD
+  case QM_CODEC_ZSTD:
+    return ZSTD_compressBound(len);
+#endif
+  default:
+    return len;
+  }
+}
+
+/* Compress len bytes of src into dst; 0 if that fails */
+  static size_t
+qmap_codec_pack(uint32_t codec, char *dst, size_t cap,
+    const char *src, size_t len)
+{
+  switch (codec) {
+#ifdef QMAP_LZ4
+  case QM_CODEC_LZ4: {
+    int r = LZ4_compress_default(src, dst, (int) len, (int) cap);
+
+    return r > 0 ? (size_t) r : 0;
+  }
+#endif
+#ifdef QMAP_ZSTD
+  case QM_CODEC_ZSTD: {
+    size_t r = ZSTD_compress(dst, cap, src, len, 3);
+
+    return ZSTD_isError(r) ? 0 : r;
+  }
+#endif
+  default:
+    (void) dst; (void) cap; (void) src; (void) len;
+    return 0;
+  }
+}
+
+/* Inflate a block into exactly len bytes of dst; 0 or -1 */
+  static int
+qmap_codec_unpack(uint32_t codec, char *dst, size_t len,
+    const char *src, size_t clen)
+{
+  switch (codec) {
+#ifdef QMAP_LZ4
+  case QM_CODEC_LZ4:
+    return LZ4_decompress_safe(src, dst, (int) clen, (int) len)
+      == (int) len ? 0 : -1;
+#endif
+#ifdef QMAP_ZSTD
+  case QM_CODEC_ZSTD:
+    return ZSTD_decompress(dst, len, src, clen) == len ? 0 : -1;
+#endif
+  default:
+    (void) dst; (void) len; (void) src; (void) clen;
+    return -1;
+  }
+}
+
+typedef struct {
+  const qmap_dirent_t *de;
+  const char *base;
+  char *raw;
+  uint32_t *next;	// next block, shared
+  int *bad;
+} qmap_inflate_job_t;
+
+  static void *
+qmap_inflate_job(void *arg)
+{
+  qmap_inflate_job_t *job = arg;
+  const qmap_zhdr_t *zh = (const qmap_zhdr_t *) job->base;
+  const uint64_t *zoff = (const uint64_t *) (zh + 1);
+  uint32_t b;
+
+  while ((b = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED))
+      < zh->nblk)
+  {
+    uint64_t at = (uint64_t) b * zh->blk;
+    uint64_t len = zh->raw - at < zh->blk ? zh->raw - at : zh->blk;
+
+    if (qmap_codec_unpack(job->de->codec, job->raw + at, len,
+          job->base + zoff[b], zoff[b + 1] - zoff[b]))
+      __atomic_store_n(job->bad, 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+/* The section at base inflated, its directory entry as if stored as
+ * is in *rde; NULL if it does not inflate */
+  static char *
+qmap_sec_inflate(const char *base, const qmap_dirent_t *de,
+    qmap_dirent_t *rde)
+{
+  qmap_inflate_job_t jobs[QM_MAX_WORKERS];
+  const qmap_zhdr_t *zh = (const qmap_zhdr_t *) base;
+  const uint64_t *zoff = (const uint64_t *) (zh + 1);
+  uint32_t next = 0, k;
+  qmap_layout_t l;
+  int bad = 0;
+  char *raw;
+
+  if (!qmap_codec_built(de->codec)) {
+    WARN("qmap: section compressed with codec %u, not built in\n",
+        de->codec);
+    return NULL;
+  }
+
+  *rde = *de;
+  rde->codec = QM_CODEC_NONE;
+  qmap_layout(&l, rde);
+
+  if (de->size < sizeof(*zh) || !zh->blk
+      || zh->nblk != (zh->raw + zh->blk - 1) / zh->blk
+      || zh->raw < l.rec
+      || (de->size - sizeof(*zh)) / sizeof(uint64_t) <= zh->nblk)
+    goto corrupt;
+
+  for (uint32_t b = 0; b < zh->nblk; b++)
+    if (zoff[b] > zoff[b + 1] || zoff[b + 1] > de->size)
+      goto corrupt;
+
+  rde->size = zh->raw;
+  raw = malloc(zh->raw ? zh->raw : 1);
+  CBUG(!raw, "malloc error (load)\n");
+
+  k = qmap_workers(zh->nblk, 2);
+  if (k > zh->nblk)
+    k = zh->nblk;
+
+  for (uint32_t j = 0; j < k; j++)
+    jobs[j] = (qmap_inflate_job_t) { de, base, raw, &next, &bad };
+
+  if (k)
+    qmap_par(qmap_inflate_job, jobs, sizeof(*jobs), k);
+
+  if (!bad)
+    return raw;
+
+  free(raw);
+corrupt:
+  WARN("qmap: corrupt compressed section\n");
+  return NULL;
+}
+
+/* }}} */
+
+/* COMPACT ENCODING {{{ */
+
+/* With QM_CFG_COMPACT, qmap_save writes sections (QMAP_SEC_COMPACT)
+ * without the size, offset and hash arrays and the hash table, which
+ * loading rebuilds anyway: a qmap_chdr_t and the offsets of nrst
+ * restart points, one every QMAP_RESTART entries, then the entries.
+ * QM_U32 and QM_HNDL keys and values are varints, keys being deltas
+ * (mod 2^32) from the previous one in QMAP_SEC_ORDERED sections; QM_STR keys
+ * of those are front coded, as the bytes they share with the previous
+ * key and a varint length and the rest. Other strings are a varint
+ * length and their bytes, without the NUL, values of other types of
+ * a size of their own likewise, and fixed size ones are as they are.
+ * A restart point starts over from no previous key, so each run of
+ * entries between two decodes on its own: loading spreads them over
+ * threads, and they are where a lookup would seek to. */
+
+#define QMAP_RESTART 16
+
+typedef struct {
+  uint32_t nrst, every;	// restart points, and entries between them
+} qmap_chdr_t;
+
+enum qmap_enc {
+  QMAP_ENC_VARINT,	// QM_U32, QM_HNDL
+  QMAP_ENC_STR,		// QM_STR, NUL dropped
+  QMAP_ENC_FIXED,	// as is, of the type's size
+  QMAP_ENC_BYTES,	// varint length, then as is
+};
+
+  static inline int
+qmap_enc_kind(uint32_t type)
+{
+  if (type == QM_U32 || type == QM_HNDL)
+    return QMAP_ENC_VARINT;
+  if (type == QM_STR)
+    return QMAP_ENC_STR;
+  return qmap_types[type].measure ? QMAP_ENC_BYTES : QMAP_ENC_FIXED;
+}
+
+  static inline void
+qmap_vput(char **p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *(*p)++ = (char) (v | 0x80);
+    v >>= 7;
+  }
+  *(*p)++ = (char) v;
+}
+
+/* 0, or -1 if there is no whole varint before end */
+  static inline int
+qmap_vget(const char **p, const char *end, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char c = (unsigned char) *(*p)++;
+
+    *v |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return 0;
+  }
+
+  return -1;
+}
+
+/* Entries [i, i + cnt) of a compact section, decoded to payloads */
+typedef struct {
+  uint32_t hd;
+  const char *p, *end;	// encoded, from restart point i / QMAP_RESTART
+  uint32_t cnt;
+  int ordered, bad;
+  char *out;
+  size_t len, cap;
+  size_t *off;		// key and value of each entry in out
+} qmap_unpack_job_t;
+
+  static char *
+qmap_unpack_room(qmap_unpack_job_t *job, size_t len)
+{
+  if (job->cap - job->len < len) {
+    job->cap = (job->cap + len) * 2;
+    job->out = realloc(job->out, job->cap);
+    CBUG(!job->out, "malloc error (load)\n");
+  }
+
+  job->len += len;
+  return job->out + job->len - len;
+}
+
+/* Decode a key or value of kind at job->p; prev is the offset of the
+ * previous key in out, or -1 at a restart point */
+  static int
+qmap_unpack_one(qmap_unpack_job_t *job, uint32_t type, int key,
+    size_t prev, uint64_t *last)
+{
+  int kind = qmap_enc_kind(type);
+  uint64_t v, shared = 0;
+  char *d;
+
+  switch (kind) {
+  case QMAP_ENC_VARINT:
+    if (qmap_vget(&job->p, job->end, &v))
+      return -1;
+
+    if (v > UINT32_MAX)
+      return -1;
+
+    /* deltas wrap, whatever order the keys compare in */
+    if (key && job->ordered && prev != (size_t) -1)
+      v = (uint32_t) (v + *last);
+
+    *last = key ? v : *last;
+    d = qmap_unpack_room(job, sizeof(uint32_t));
+    memcpy(d, &(uint32_t) { (uint32_t) v }, sizeof(uint32_t));
+    return 0;
+
+  case QMAP_ENC_STR:
+    if (key && job->ordered && qmap_vget(&job->p, job->end, &shared))
+      return -1;
+    if (qmap_vget(&job->p, job->end, &v)
+        || v > (uint64_t) (job->end - job->p)
+        || (shared && (prev == (size_t) -1
+            || shared > strlen(job->out + prev))))
+      return -1;
+
+    d = qmap_unpack_room(job, shared + v + 1);
+    if (shared)
+      memcpy(d, job->out + prev, shared);
+    memcpy(d + shared, job->p, v);
+    d[shared + v] = '\0';
+    job->p += v;
+    return 0;
+
+  case QMAP_ENC_FIXED:
+    v = qmap_types[type].len;
+    break;
+
+  default:
+    if (qmap_vget(&job->p, job->end, &v))
+      return -1;
+  }
+
+  if (v > (uint64_t) (job->end - job->p))
+    return -1;
+
+  d = qmap_unpack_room(job, v);
+  memcpy(d, job->p, v);
+  job->p += v;
+  return 0;
+}
+
+  static void *
+qmap_unpack_job(void *arg)
+{
+  qmap_unpack_job_t *job = arg;
+  qmap_head_t *head = &qmap_heads[job->hd];
+  size_t prev = (size_t) -1;
+  uint64_t last = 0;
+
+  job->off = malloc(sizeof(size_t) * 2 * (job->cnt ? job->cnt : 1));
+  CBUG(!job->off, "malloc error (load)\n");
+
+  for (uint32_t i = 0; i < job->cnt && !job->bad; i++) {
+    if (i % QMAP_RESTART == 0)
+      prev = (size_t) -1;
+
+    job->off[2 * i] = job->len;
+    job->bad = qmap_unpack_one(job, head->types[QM_KEY], 1, prev, &last);
+    prev = job->off[2 * i];
+
+    job->off[2 * i + 1] = job->len;
+    job->bad = job->bad
+      || qmap_unpack_one(job, head->types[QM_VALUE], 0, prev, &last);
+  }
+
+  return NULL;
+}
+
+/* Load a compact section, runs of restart points decoded on several
+ * threads; -1 if it is corrupt */
+  static int
+qmap_load_compact(uint32_t hd, const char *base, const qmap_dirent_t *de)
+{
+  qmap_unpack_job_t jobs[QM_MAX_WORKERS];
+  const qmap_chdr_t *ch = (const qmap_chdr_t *) base;
+  const uint64_t *rst = (const uint64_t *) (ch + 1);
+  const char *end = base + de->size;
+  uint32_t k, bad = 0;
+
+  if (de->size < sizeof(*ch) || ch->every != QMAP_RESTART
+      || ch->nrst != (de->n + QMAP_RESTART - 1) / QMAP_RESTART
+      || (de->size - sizeof(*ch)) / sizeof(uint64_t) < ch->nrst)
+    goto corrupt;
+
+  for (uint32_t g = 0; g < ch->nrst; g++)
+    if (rst[g] > de->size || (g && rst[g] < rst[g - 1]))
+      goto corrupt;
+
+  k = qmap_workers(de->n, qmap_cfg_par_min);
+  if (k > ch->nrst)
+    k = ch->nrst;
+
+  for (uint32_t j = 0; j < k; j++) {
+    uint32_t g0 = (uint32_t) ((uint64_t) ch->nrst * j / k);
+    uint32_t g1 = (uint32_t) ((uint64_t) ch->nrst * (j + 1) / k);
+    uint32_t last = g1 * QMAP_RESTART < de->n ? g1 * QMAP_RESTART : de->n;
+
+    memset(&jobs[j], 0, sizeof(jobs[j]));
+    jobs[j].hd = hd;
+    jobs[j].p = base + rst[g0];
+    jobs[j].end = g1 < ch->nrst ? base + rst[g1] : end;
+    jobs[j].cnt = last - g0 * QMAP_RESTART;
+    jobs[j].ordered = !!(de->flags & QMAP_SEC_ORDERED);
+  }
+
+  if (k)
+    qmap_par(qmap_unpack_job, jobs, sizeof(*jobs), k);
+
+  for (uint32_t j = 0; j < k; j++)
+    bad |= jobs[j].bad;
+
+  if (!bad) {
+    if ((de->flags & QMAP_SEC_ORDERED)
+        && (qmap_heads[hd].flags & QM_SORTED) && !qmap_heads[hd].n)
+      qmap_heads[hd].iflags |= QM_KORDER;
+
+    qmap_bulk_begin(hd, de->n);
+    for (uint32_t j = 0; j < k; j++) {
+      qmap_unpack_job_t *job = &jobs[j];
+      const void **keys = malloc(sizeof(void *) * (job->cnt ? job->cnt : 1));
+      const void **vals = malloc(sizeof(void *) * (job->cnt ? job->cnt : 1));
+
+      CBUG(!keys || !vals, "malloc error (load)\n");
+      for (uint32_t i = 0; i < job->cnt; i++) {
+        keys[i] = job->out + job->off[2 * i];
+        vals[i] = job->out + job->off[2 * i + 1];
+      }
+
+      qmap_bulk_put(hd, keys, vals, job->cnt);
+      free(keys);
+      free(vals);
+    }
+    qmap_bulk_end(hd);
+  }
+
+  for (uint32_t j = 0; j < k; j++) {
+    free(jobs[j].out);
+    free(jobs[j].off);
+  }
+
+  if (!bad)
+    return 0;
+
+corrupt:
+  WARN("qmap: corrupt compact section\n");
+  return -1;
+}
+
+/* }}} */
+
+
+/* Records handed to qmap_bulk_put at a time while loading */
+#define QMAP_LOAD_CHUNK (1 << 20)
+
+/* Load a database in the old format, mm being its run */
+  static void
+_qmap_load(uint32_t hd, const char *mm)
+{
+  mm += sizeof(uint32_t) + sizeof(uint64_t);
+
+  uint32_t amount;
+  memcpy(&amount, mm, sizeof(amount));
+  mm += sizeof(uint32_t);
+
+  qmap_head_t *head = &qmap_heads[hd];
+  uint32_t ktype = head->types[QM_KEY];
+  uint32_t vtype = head->types[QM_VALUE];
+
+  uint32_t chunk = amount < QMAP_LOAD_CHUNK ? amount : QMAP_LOAD_CHUNK;
+  const void **keys = malloc(sizeof(void *) * (chunk ? chunk : 1));
+  const void **vals = malloc(sizeof(void *) * (chunk ? chunk : 1));
+
+  CBUG(!keys || !vals, "malloc error (load)\n");
+  qmap_bulk_begin(hd, amount);
+
+  /* Records are variable length, so finding them is serial; copying
+   * them in and hashing is what qmap_bulk_put spreads over threads */
+  for (uint32_t i = 0; i < amount; ) {
+    uint32_t c = 0;
+
+    for (; c < chunk && i < amount; c++, i++) {
+      size_t klen = qmap_len(ktype, mm);
+      const char *mval = mm + klen;
+      size_t vlen = qmap_len(vtype, mval);
+
+      keys[c] = mm;
+      vals[c] = mval;
+      mm = mval + vlen;
     }
-    /* Record-aware maps require string keys (composite key separator) */
-    if (ktype != QM_STR) {
-      fprintf(stderr, "qmap_open: record maps require ktype=QM_STR\n");
-      return QM_MISS;
+
+    qmap_bulk_put(hd, keys, vals, c);
+  }
+
+  qmap_bulk_end(hd);
+  free(keys);
+  free(vals);
+}
+
+/* The run of dbid in an old format file (the first one for a map
+ * without a database name), NULL if there is none */
+  static const char *
+qmap_v1_find(const char *mm, size_t size, uint32_t dbid)
+{
+  size_t off = 0;
+
+  while (size - off >= 2 * sizeof(uint32_t) + sizeof(uint64_t)) {
+    uint32_t lid;
+    uint64_t len;
+
+    memcpy(&lid, mm + off, sizeof(lid));
+    memcpy(&len, mm + off + sizeof(lid), sizeof(len));
+
+    if (len < 2 * sizeof(uint32_t) + sizeof(uint64_t)
+        || len > size - off)
+    {
+      WARN("qmap: corrupt database at offset %zu\n", off);
+      return NULL;
+    }
+
+    if (dbid == QM_MISS || lid == dbid)
+      return mm + off;
+
+    off += len;
+  }
+
+  return NULL;
+}
+
+/* Copy the entries of a section into hd */
+  static void
+qmap_load_sec(uint32_t hd, const char *base, const qmap_dirent_t *de)
+{
+  uint32_t amount = de->n;
+  qmap_layout_t l;
+
+  qmap_layout(&l, de);
+
+  const uint64_t *koff = (const uint64_t *) (base + l.koff);
+  const uint64_t *ksize = (const uint64_t *) (base + l.ksize);
+  uint32_t chunk = amount < QMAP_LOAD_CHUNK ? amount : QMAP_LOAD_CHUNK;
+  const void **keys = malloc(sizeof(void *) * (chunk ? chunk : 1));
+  const void **vals = malloc(sizeof(void *) * (chunk ? chunk : 1));
+
+  CBUG(!keys || !vals, "malloc error (load)\n");
+
+  /* appended in key order, the entries need no sorting */
+  if ((de->flags & QMAP_SEC_ORDERED)
+      && (qmap_heads[hd].flags & QM_SORTED) && !qmap_heads[hd].n)
+    qmap_heads[hd].iflags |= QM_KORDER;
+
+  qmap_bulk_begin(hd, amount);
+
+  for (uint32_t i = 0; i < amount; ) {
+    uint32_t c = 0;
+
+    for (; c < chunk && i < amount; c++, i++) {
+      keys[c] = base + koff[i];
+      vals[c] = base + koff[i] + qmap_payload_off(ksize[i]);
+    }
+
+    qmap_bulk_put(hd, keys, vals, c);
+  }
+
+  qmap_bulk_end(hd);
+  free(keys);
+  free(vals);
+}
+
+/* Serve hd from a section of the file mapping (QM_RDONLY_MMAP) */
+  static void
+qmap_mmap_attach(uint32_t hd, const char *base, const qmap_dirent_t *de)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  qmap_layout_t l;
+
+  qmap_layout(&l, de);
+
+  free(qmap->map);
+  free(qmap->omap);
+  free(qmap->table);
+  free(qmap->key_hashes);
+  free(qmap->key_sizes);
+  free(qmap->val_sizes);
+  qmap->omap = NULL;
+  qmap->table = NULL;
+
+  /* never written through: changes are refused by qmap_rdonly */
+  qmap->map = (uint32_t *) (base + l.map);
+  qmap->key_hashes = (uint32_t *) (base + l.hash);
+  qmap->key_sizes = (size_t *) (base + l.ksize);
+  qmap->val_sizes = (size_t *) (base + l.vsize);
+  qmap->mm_koff = (const uint64_t *) (base + l.koff);
+  qmap->mm = base;
+  qmap->idm.last = de->n;
+
+  head->n = de->n;
+  head->m = de->m;
+  head->mask = de->m - 1;
+  head->iflags |= QM_SDIRTY;
+
+  if (!qmap->sorted_idx)
+    return;
+
+  free(qmap->sorted_idx);
+  if (de->flags & QMAP_SEC_SORTED) {
+    qmap->sorted_idx = (uint32_t *) (base + l.sorted);
+    head->sorted_n = de->n;
+    head->iflags &= ~QM_SDIRTY;
+    head->iflags |= QM_MSORTED;
+    return;
+  }
+
+  /* no index saved: it is built on first use */
+  qmap->sorted_idx = malloc(sizeof(uint32_t) * (de->n ? de->n : 1));
+  CBUG(!qmap->sorted_idx, "malloc error (sorted_idx)\n");
+}
+
+#define QMAP_DIR_BAD ((const qmap_dirent_t *) -1)
+
+/* The section of hd's database in a file of this format, NULL if
+ * the file has none, QMAP_DIR_BAD if it cannot be used */
+  static const qmap_dirent_t *
+qmap_dir_find(const char *mm, size_t size, uint32_t hd)
+{
+  const qmap_fhdr_t *fhdr = (const qmap_fhdr_t *) mm;
+  const qmap_dirent_t *dir = (const qmap_dirent_t *) (fhdr + 1);
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_layout_t l;
+
+  if ((size - sizeof(*fhdr)) / sizeof(*dir) < fhdr->ndb) {
+    WARN("qmap: corrupt directory\n");
+    return QMAP_DIR_BAD;
+  }
+
+  for (uint32_t i = 0; i < fhdr->ndb; i++) {
+    const qmap_dirent_t *de = &dir[i];
+
+    if (de->dbid != head->dbid)
+      continue;
+
+    qmap_layout(&l, de);
+    if (de->off > size || de->size > size - de->off
+        || (!de->codec && de->size < l.rec) || (de->off & 7)
+        || ((de->flags & QMAP_SEC_HASH)
+          && (!de->m || (de->m & (de->m - 1)))))
+    {
+      WARN("qmap: corrupt section %u\n", i);
+      return QMAP_DIR_BAD;
+    }
+
+    if (de->types[QM_KEY] != head->types[QM_KEY]
+        || de->types[QM_VALUE] != head->types[QM_VALUE])
+    {
+      WARN("qmap: section %u holds types %u:%u, not %u:%u\n", i,
+          de->types[QM_KEY], de->types[QM_VALUE],
+          head->types[QM_KEY], head->types[QM_VALUE]);
+      return QMAP_DIR_BAD;
     }
+
+    return de;
+  }
+
+  return NULL;
+}
+
+/* Map the file for reading; -1 if it is missing or empty */
+  static int
+qmap_file_map(qmap_file_t *file, const char *filename)
+{
+  struct stat sb;
+
+  file->fd = open(filename, O_RDONLY);
+  if (file->fd < 0)
+    return -1;
+
+  CBUG(fstat(file->fd, &sb) == -1, "fstat");
+
+  file->size = sb.st_size;
+  if (file->size == 0) {
+    close(file->fd);
+    file->fd = -1;
+    return -1;
+  }
+
+  file->mmaped = (char*) mmap(NULL, file->size,
+      PROT_READ, MAP_SHARED, file->fd, 0);
+  if (file->mmaped == MAP_FAILED) {
+    file->mmaped = 0;
+    close(file->fd);
+    file->fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Load a section whose sum checked out, inflating it first if it is
+ * compressed; -1 if it does not inflate or decode */
+  static int
+qmap_load_stored(uint32_t hd, const char *base, const qmap_dirent_t *de)
+{
+  qmap_dirent_t rde;
+  char *raw = NULL;
+  int ret = 0;
+
+  if (de->codec) {
+    raw = qmap_sec_inflate(base, de, &rde);
+    if (!raw)
+      return -1;
+
+    base = raw;
+    de = &rde;
   }
 
-  /* Strip record bits so _qmap_open doesn't see them */
-  flags &= ~(QM_RECORD_MASK | QM_RECORD_FLAG);
+  if (de->flags & QMAP_SEC_COMPACT)
+    ret = qmap_load_compact(hd, base, de);
+  else
+    qmap_load_sec(hd, base, de);
 
-  uint32_t hd = _qmap_open(ktype, vtype, mask, flags);
+  free(raw);
+  return ret;
+}
 
-  /* Check if open failed */
-  if (hd == QM_MISS)
-    return QM_MISS;
+/* Keep the file as it is, a database of it not being loaded */
+  static void
+qmap_load_refuse(qmap_file_t *file, const char *filename)
+{
+  /* saving would replace what could not be read with nothing
+   * (qmap_open_all loads databases of a file concurrently) */
+  WARN("qmap: %s: database not loaded, file left as is\n", filename);
+  __atomic_store_n(&file->rdonly, 1, __ATOMIC_RELAXED);
+}
 
-  qmap_head_t *head = &qmap_heads[hd];
+/* Does fd hold a file in the current format? Reads its header */
+  static int
+qmap_fhdr_read(int fd, qmap_fhdr_t *fhdr)
+{
+  return !qmap_pread(fd, fhdr, sizeof(*fhdr), 0)
+    && fhdr->magic == QMAP_MAGIC && fhdr->version == QMAP_VERSION;
+}
 
-  head->record_id = record_id;
-  head->vstr_hd = 0;
-  head->file = filename;
+/* With QM_CFG_IO_URING: read the directory and the section of hd
+ * instead of mapping the file. 0 if the file is for the mapping to
+ * deal with (missing, in the old format or of another version) */
+  static int
+qmap_load_read(qmap_file_t *file, const char *filename, uint32_t hd)
+{
+  const qmap_dirent_t *de;
+  qmap_uring_t *ring;
+  qmap_fhdr_t fhdr;
+  struct stat sb;
+  char *dir, *sec;
+  size_t dlen;
+  int fd, err;
 
-  /* Allocate per-field inverse index handles for record-aware maps */
-  if (record_id > 0) {
-    uint32_t fc = (uint32_t)qmap_records[record_id].field_count;
-    head->inv_hds = calloc(fc, sizeof(uint32_t));
-  } else {
-    head->inv_hds = NULL;
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (fstat(fd, &sb) == -1 || !qmap_fhdr_read(fd, &fhdr)) {
+    close(fd);
+    return 0;
   }
-  head->get_buf[0] = '\0';
-  if (database)
-    head->dbid = XXH32(database, strlen(database), QM_SEED);
-  else
-    head->dbid = QM_MISS;
 
-  if (!filename)
-    goto file_skip;
+  /* qmap_dir_find checks the directory fits before reading it */
+  dlen = sizeof(fhdr) + sizeof(qmap_dirent_t) * (size_t) fhdr.ndb;
+  if (dlen > (size_t) sb.st_size)
+    dlen = sizeof(fhdr);
+
+  dir = malloc(dlen);
+  CBUG(!dir, "malloc error (load)\n");
+  err = qmap_pread(fd, dir, dlen, 0);
+  de = err ? QMAP_DIR_BAD : qmap_dir_find(dir, (size_t) sb.st_size, hd);
+
+  if (de && de != QMAP_DIR_BAD) {
+    sec = malloc(de->size ? de->size : 1);
+    CBUG(!sec, "malloc error (load)\n");
+
+    /* a ring that can not be had leaves plain reads */
+    ring = qmap_uring_new(0);
+    err = ring ? qmap_uring_read(ring, fd, sec, de->size, de->off)
+      : qmap_pread(fd, sec, de->size, (off_t) de->off);
+    qmap_uring_free(ring);
+
+    if (err) {
+      WARN("qmap: %s: %s\n", filename, strerror(err));
+      de = QMAP_DIR_BAD;
+    } else if (XXH32(sec, de->size, QM_SEED) != de->crc) {
+      WARN("qmap: %s: checksum mismatch\n", filename);
+      de = QMAP_DIR_BAD;
+    } else if (qmap_load_stored(hd, sec, de))
+      de = QMAP_DIR_BAD;
+
+    free(sec);
+  }
 
-  if (database) {
-    char buf[strlen(filename)
-      + strlen(database) + 2];
+  if (de == QMAP_DIR_BAD)
+    qmap_load_refuse(file, filename);
 
-    snprintf(buf, sizeof(buf), "%s/%s",
-        filename, database);
+  free(dir);
+  close(fd);
+  return 1;
+}
 
-    const uint32_t *ehd = qmap_get(qmap_dbs_hd, buf);
-    uint32_t old_hd = ehd ? *ehd : QM_MISS;
-    qmap_put(qmap_dbs_hd, buf, &hd);
+  static inline void
+qmap_load_file(char *filename, uint32_t hd, int mapped)
+{
+  qmap_file_t *file = (qmap_file_t *)
+    qmap_get(qmap_files_hd, filename);
 
-    if (old_hd != QM_MISS && mdbs[old_hd])
-      mdbs[old_hd] = 0;
-  }
+  const qmap_fhdr_t *fhdr;
+  const qmap_dirent_t *de;
+  const char *base;
 
-  mdbs[hd] = 1;  /* Mark as dirty for save, regardless of database name */
+  if (mapped)
+    file->rdonly = 1;
 
-  const qmap_file_t *file_p
-    = qmap_get(qmap_files_hd, filename);
+  if (!file->mmaped && !mapped && qmap_cfg_uring
+      && qmap_load_read(file, filename, hd))
+    return;
 
-  if (!file_p) {
-    qmap_file_t file;
-    memset(&file, 0, sizeof(file));
-    file.ids = ids_init();
-    file.fd = -1;
-    ids_push(&file.ids, hd);
-    qmap_put(qmap_files_hd, filename, &file);
-  } else
-    ids_push((ids_t *) &file_p->ids, hd);
+  if (!file->mmaped && qmap_file_map(file, filename))
+    return;
 
-file_skip:
-  if (filename)
-    qmap_load_file((char*) filename, head->dbid);
+  fhdr = (const qmap_fhdr_t *) file->mmaped;
 
-  if (!(flags & QM_MIRROR))
-    return hd;
+  if (file->size < sizeof(*fhdr) || fhdr->magic != QMAP_MAGIC) {
+    base = qmap_v1_find(file->mmaped, file->size, qmap_heads[hd].dbid);
+    if (base)
+      _qmap_load(hd, base);
+    return;
+  }
 
-  flags &= ~QM_AINDEX;
-  uint32_t mirror_hd = _qmap_open(vtype, ktype, mask, flags | QM_PGET);
-  qmap_heads[mirror_hd].iflags |= QM_IS_MIRROR;  /* Mark as mirror for position sharing */
-  qmap_assoc(hd + 1, hd, NULL, NULL);
+  if (fhdr->version != QMAP_VERSION) {
+    WARN("qmap: %s: unknown format version %u\n",
+        filename, fhdr->version);
+    goto refuse;
+  }
 
-  /* If data was loaded before mirror creation, populate the mirror now */
-  if (filename && head->n > 0) {
-    uint32_t cur = qmap_iter(hd, NULL, 0);
-    const void *key, *value;
-    while (qmap_next(&key, &value, cur)) {
-      _qmap_put(mirror_hd, value, key, qmaps[hd].map[qmap_id(hd, key)]);
-    }
-    qmap_fin(cur);
+  de = qmap_dir_find(file->mmaped, file->size, hd);
+  if (de == QMAP_DIR_BAD)
+    goto refuse;
+  if (!de)
+    return;
+
+  base = file->mmaped + de->off;
+
+  /* in place, only a hash table makes it usable (and compressed
+   * sections are not); checking the sum would read it all */
+  if (mapped && (de->flags & QMAP_SEC_HASH) && !de->codec) {
+    qmap_mmap_attach(hd, base, de);
+    return;
   }
 
-  return hd;
-}
+  if (XXH32(base, de->size, QM_SEED) != de->crc) {
+    WARN("qmap: %s: checksum mismatch\n", filename);
+    goto refuse;
+  }
 
-  uint32_t /* API */
-qmap_get_vtype(uint32_t hd)
-{
-  return qmap_heads[hd].types[QM_VALUE];
-}
+  if (!qmap_load_stored(hd, base, de))
+    return;
 
-  size_t /* API */
-qmap_type_len(uint32_t type_id)
-{
-  return qmap_types[type_id].len;
+refuse:
+  qmap_load_refuse(file, filename);
 }
 
-  static size_t
-s_measure(const void *key)
-{
-  return strlen(key) + 1;
-}
+static pthread_mutex_t qmap_lazy_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void file_close(qmap_file_t *file) {
-  if (file->mmaped) {
-    CBUG(munmap(file->mmaped, file->size) == -1,
-        "munmap failed");
-    file->mmaped = 0;
-  }
+/* Read the database of an unread map, on the calling thread */
+  static void
+qmap_lazy_read(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
 
-  if (file->fd >= 0)
-    close(file->fd);
-  file->fd = -1;
+  head->loader = pthread_self();
+  __atomic_store_n(&head->unloaded, 2, __ATOMIC_RELEASE);
+  qmap_load_file((char *) head->file, hd, 0);
+  head->saved_mods = head->mods;
 }
 
-__attribute__((destructor))
-  static void qmap_destruct(void) {
-    qmap_save();
+/* Done reading: replay the log, which other maps of the file share */
+  static void
+qmap_lazy_done(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
 
-    for (uint32_t i = idm.last; i-- > 0; )
-      qmap_close(i);
+  if (head->flags & QM_WAL)
+    qmap_wal_open(hd);
 
-    idm_drop(&cursor_idm);
-    idm_drop(&idm);
+  __atomic_store_n(&head->unloaded, 0, __ATOMIC_RELEASE);
+}
 
-    uint32_t cur = qmap_iter(qmap_files_hd, NULL, 0);
-    const void *key, *value;
+  static void
+qmap_lazy_load(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
 
-    while (qmap_next(&key, &value, cur))
-      file_close((qmap_file_t *) value);
+  /* loading puts through the API */
+  if (__atomic_load_n(&head->unloaded, __ATOMIC_ACQUIRE) == 2
+      && pthread_equal(head->loader, pthread_self()))
+    return;
 
-    qmap_close(qmap_dbs_hd);
-    qmap_close(qmap_files_hd);
+  /* concurrent readers: the first one loads, the others wait */
+  pthread_mutex_lock(&qmap_lazy_lock);
+  if (head->unloaded) {
+    qmap_lazy_read(hd);
+    qmap_lazy_done(hd);
   }
+  pthread_mutex_unlock(&qmap_lazy_lock);
+}
 
-__attribute__((constructor))
+/* A file is rewritten whole: read what its maps have yet to */
   static void
-qmap_init(void)
+qmap_lazy_file(const qmap_file_t *file)
 {
-  qmap_type_t *type;
+  idsi_t *cur = ids_iter((ids_t *) &file->ids);
+  uint32_t hd;
 
-  memset(qmaps, 0, sizeof(qmaps));
-  memset(qmap_heads, 0, sizeof(qmap_heads));
+  while (ids_next(&hd, &cur))
+    if (mdbs[hd])
+      qmap_lazy(hd);
+}
 
-  idm = idm_init();
-  cursor_idm = idm_init();
+typedef struct {
+  const qmap_spec_t *specs;
+  uint32_t n, cap;
+  uint32_t *next;	// next spec to load, shared
+} qmap_open_job_t;
 
-  // QM_PTR
-  type = &qmap_types[qmap_reg(sizeof(void *))];
+  static void *
+qmap_open_job(void *arg)
+{
+  qmap_open_job_t *job = arg;
+  uint32_t cap = qmap_worker_cap, i;
+
+  /* big databases still split their load, over fewer CPUs */
+  qmap_worker_cap = job->cap;
+  while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->n)
+    if (job->specs[i].hd != QM_MISS
+        && !(job->specs[i].flags & QM_LAZY)
+        && qmap_heads[job->specs[i].hd].unloaded)
+      qmap_lazy_read(job->specs[i].hd);
+
+  qmap_worker_cap = cap;
+  return NULL;
+}
 
-  // QM_HNDL
-  type = &qmap_types[qmap_reg(sizeof(uint32_t))];
-  type->hash = qmap_nohash;
-  type->cmp = qmap_ucmp;
+  uint32_t /* API */
+qmap_open_all(const char *filename, qmap_spec_t *specs, uint32_t n)
+{
+  qmap_open_job_t jobs[QM_MAX_WORKERS];
+  qmap_file_t *file;
+  uint32_t k, cpus, next = 0, opened = 0;
+  int own = 0;
 
-  // QM_STR
-  type = &qmap_types[qmap_mreg(s_measure)];
-  type->cmp = qmap_scmp;
+  if (!filename)
+    return 0;
 
-  // QM_U32
-  type = &qmap_types[qmap_reg(sizeof(uint32_t))];
-  type->cmp = qmap_ucmp;
+  /* register them all, unread */
+  for (uint32_t i = 0; i < n; i++) {
+    specs[i].hd = qmap_open(filename, specs[i].database,
+        specs[i].ktype, specs[i].vtype, specs[i].mask,
+        specs[i].flags | QM_LAZY);
+    opened += specs[i].hd != QM_MISS;
+  }
 
-  uint32_t qm_file = qmap_reg(sizeof(qmap_file_t));
-  qmap_files_hd = _qmap_open(QM_STR, qm_file,
-      QM_DEFAULT_MASK, 0);
+  if (!opened)
+    return 0;
 
-  qmap_dbs_hd = _qmap_open(QM_STR, QM_U32, QM_DEFAULT_MASK, 0);
-}
+  /* one mapping for all the workers to read from; without a file
+   * there is nothing to share out */
+  file = (qmap_file_t *) qmap_get(qmap_files_hd, filename);
+  if (!file->mmaped && qmap_cfg_uring) {
+    /* or each worker reads its own sections (qmap_load_read) */
+    qmap_fhdr_t fhdr;
+    int fd = open(filename, O_RDONLY);
+
+    own = fd >= 0 && qmap_fhdr_read(fd, &fhdr);
+    if (fd >= 0)
+      close(fd);
+  }
 
-/* }}} */
+  if (!file->mmaped && !own)
+    qmap_file_map(file, filename);
 
-/* PUT {{{ */
+  k = file->mmaped || own ? qmap_workers(n, 2) : 1;
+  cpus = qmap_workers(SIZE_MAX, 0);
+  for (uint32_t j = 0; j < k; j++) {
+    jobs[j].specs = specs;
+    jobs[j].n = n;
+    jobs[j].cap = cpus / k ? cpus / k : 1;
+    jobs[j].next = &next;
+  }
 
-/* This is the low-level put. It doesn't aim to provide
- * MIRROR functionality in itself, just putting in whatever
- * kind of map.
- */
-/* Helper: Update IDM last position if needed */
-  static inline void
-update_idm_last(qmap_t *qmap, uint32_t pn)
-{
-  if (pn >= qmap->idm.last)
-    qmap->idm.last = pn + 1;
-}
+  pthread_mutex_lock(&qmap_lazy_lock);
+  qmap_par(qmap_open_job, jobs, sizeof(*jobs), k);
 
-/* ── Inverse index helpers for reference fields ──────────────────────── */
+  /* logs are replayed here, the puts seeing this thread as loader */
+  for (uint32_t i = 0; i < n; i++)
+    if (specs[i].hd != QM_MISS && qmap_heads[specs[i].hd].unloaded == 2) {
+      qmap_heads[specs[i].hd].loader = pthread_self();
+      qmap_lazy_done(specs[i].hd);
+    }
+  pthread_mutex_unlock(&qmap_lazy_lock);
 
-static void ensure_inv_hd(qmap_head_t *head, int fi)
-{
-  if (head->inv_hds[fi] == 0)
-    head->inv_hds[fi] = qmap_open(NULL, NULL, QM_U32, QM_STR, 0xFF, 0);
+  return opened;
 }
 
-static void ensure_vstr_hd(qmap_head_t *head)
+/* Does the file hold a section of hd's database? */
+  static int
+qmap_file_has(const char *filename, uint32_t hd)
 {
-  if (head->vstr_hd == 0)
-    head->vstr_hd = qmap_open(NULL, NULL, QM_STR, QM_STR, 0xFF, 0);
+  const qmap_dirent_t *de = NULL;
+  qmap_fhdr_t fhdr;
+  struct stat sb;
+  size_t dlen;
+  char *dir;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (!fstat(fd, &sb) && qmap_fhdr_read(fd, &fhdr)) {
+    dlen = sizeof(fhdr) + sizeof(qmap_dirent_t) * (size_t) fhdr.ndb;
+    if (dlen > (size_t) sb.st_size)
+      dlen = sizeof(fhdr);
+
+    dir = malloc(dlen);
+    CBUG(!dir, "malloc error (open)\n");
+    if (!qmap_pread(fd, dir, dlen, 0))
+      de = qmap_dir_find(dir, (size_t) sb.st_size, hd);
+    free(dir);
+  }
+
+  close(fd);
+  return de != NULL;
 }
 
-static void inverse_add(qmap_head_t *head, int fi,
-    uint32_t target_pos, uint32_t source_pos)
+  uint32_t /* API */
+qmap_open_sharded(const char *base, const char *database,
+    uint32_t ktype, uint32_t vtype, uint32_t mask, uint32_t flags,
+    uint32_t nshards)
 {
-  ensure_inv_hd(head, fi);
-  uint32_t inv_hd = head->inv_hds[fi];
-  const char *existing = qmap_get(inv_hd, &target_pos);
+  qmap_head_t *head;
+  qmap_t *qmap;
+  uint32_t hd;
+  int misplaced = 0;
 
-  if (existing) {
-    /* Check if source_pos already present */
-    const char *p = existing;
-    while (*p) {
-      char *end;
-      unsigned long v = strtoul(p, &end, 10);
-      if (end > p && (uint32_t)v == source_pos)
-        return;
-      if (*end == '\n')
-        p = end + 1;
-      else
-        break;
-    }
-    /* Append */
-    char buf[4096];
-    snprintf(buf, sizeof(buf), "%s%u\n", existing, source_pos);
-    qmap_put(inv_hd, &target_pos, buf);
-  } else {
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%u\n", source_pos);
-    qmap_put(inv_hd, &target_pos, buf);
+  if (!base || !nshards || nshards > QM_MAX_SHARDS) {
+    fprintf(stderr, "qmap_open_sharded: needs a base name and 1 to %u "
+        "shards\n", QM_MAX_SHARDS);
+    return QM_MISS;
+  }
+
+  /* these work on a file of the map, and it has several */
+  if (flags & (QM_MIRROR | QM_WAL | QM_LAZY | QM_RDONLY_MMAP)) {
+    fprintf(stderr, "qmap_open_sharded: QM_MIRROR, QM_WAL, QM_LAZY and "
+        "QM_RDONLY_MMAP are not for sharded maps\n");
+    return QM_MISS;
+  }
+
+  hd = qmap_open(NULL, database, ktype, vtype, mask, flags);
+  if (hd == QM_MISS)
+    return QM_MISS;
+
+  /* written with more shards: those past the count would be lost */
+  {
+    char name[strlen(base) + 12];
+
+    snprintf(name, sizeof(name), "%s.%03u", base, nshards);
+    if (nshards < QM_MAX_SHARDS && qmap_file_has(name, hd)) {
+      fprintf(stderr, "qmap_open_sharded: %s holds more than %u "
+          "shards\n", base, nshards);
+      qmap_close(hd);
+      return QM_MISS;
+    }
+  }
+
+  head = &qmap_heads[hd];
+  qmap = &qmaps[hd];
+  head->shards = base;
+  head->nshard = nshards;
+  head->shard_mods = calloc(nshards, sizeof(uint64_t));
+  head->shard_saved = calloc(nshards, sizeof(uint64_t));
+  CBUG(!head->shard_mods || !head->shard_saved, "malloc error (open)\n");
+  mdbs[hd] = 1;
+
+  /* the shards go in as one bulk load, built and sorted at its end */
+  qmap_bulk_begin(hd, 0);
+  head->iflags |= QM_BHOLD;
+
+  for (uint32_t i = 0; i < nshards; i++) {
+    char name[strlen(base) + 12];
+    uint32_t from = qmap->idm.last;
+    qmap_file_t *file;
+
+    snprintf(name, sizeof(name), "%s.%03u", base, i);
+    file = qmap_file_add(name, hd);
+    file->shard = i;
+    qmap_load_file(name, hd, 0);
+
+    /* written with another shard count: the next save moves them */
+    for (uint32_t p = from; p < qmap->idm.last && !misplaced; p++)
+      misplaced = qmap->omap[p]
+        && qmap_shard(qmap->key_hashes[p], nshards) != i;
   }
+
+  /* each shard is in key order, but not all of them together */
+  head->iflags &= ~(QM_BHOLD | QM_KORDER);
+  qmap_bulk_end(hd);
+
+  qmap_saved(hd, NULL, head->mods);
+  if (misplaced)
+    qmap_touch_all(hd);
+
+  return hd;
 }
 
-static void inverse_remove(qmap_head_t *head, int fi,
-    uint32_t target_pos, uint32_t source_pos)
+/* Buffered sequential writer of sections, checksumming what it writes */
+typedef struct {
+  int fd;
+  int err;		// errno of the first failed write
+  char *buf;		// NULL to only checksum
+  size_t len;
+  uint64_t off;		// bytes put so far
+  uint64_t at;		// where the buffer goes in the file
+  XXH32_state_t *crc;	// or NULL
+  qmap_uring_t *ring;	// to write through, or NULL
+  int *errp;		// with a ring, where write errors go
+} qmap_wbuf_t;
+
+#define QMAP_WBUF (1 << 20)
+
+/* Write out the buffer, then len bytes of data */
+  static void
+qmap_wbuf_flush(qmap_wbuf_t *w, const void *data, size_t len)
 {
-  if (head->inv_hds[fi] == 0)
-    return;
-  uint32_t inv_hd = head->inv_hds[fi];
-  const char *existing = qmap_get(inv_hd, &target_pos);
-  if (!existing)
+  struct iovec iov[2] = {
+    { w->buf, w->len },
+    { (void *) data, len },
+  };
+  struct iovec *v = iov;
+  int cnt = w->len || len ? 2 : 0;
+
+  /* the filled buffer is written while the next one fills */
+  if (w->ring) {
+    if (w->len) {
+      qmap_uring_write(w->ring, w->fd, w->buf, w->len, w->at, w->errp);
+      w->buf = qmap_uring_buf(w->ring);
+    }
+
+    if (len)
+      qmap_uring_write(w->ring, w->fd, data, len, w->at + w->len, w->errp);
+
+    w->at += w->len + len;
+    w->len = 0;
     return;
+  }
 
-  /* Rebuild string without source_pos */
-  char buf[4096];
-  size_t pos = 0;
-  const char *p = existing;
-  while (*p) {
-    char *end;
-    unsigned long v = strtoul(p, &end, 10);
-    if (end > p && (uint32_t)v != source_pos)
-      pos += snprintf(buf + pos, sizeof(buf) - pos,
-                      pos > 0 ? "\n%lu" : "%lu", v);
-    if (*end == '\n')
-      p = end + 1;
-    else
+  while (!w->err && cnt) {
+    ssize_t r = pwritev(w->fd, v, cnt, (off_t) w->at);
+
+    if (r < 0 && errno == EINTR)
+      continue;
+
+    if (r <= 0) {
+      w->err = r < 0 ? errno : EIO;
       break;
+    }
+
+    w->at += (uint64_t) r;
+    for (; cnt && (size_t) r >= v->iov_len; v++, cnt--)
+      r -= (ssize_t) v->iov_len;
+
+    if (cnt) {
+      v->iov_base = (char *) v->iov_base + r;
+      v->iov_len -= (size_t) r;
+    }
   }
 
-  if (pos == 0)
-    qmap_del(inv_hd, &target_pos);
-  else
-    qmap_put(inv_hd, &target_pos, buf);
+  w->len = 0;
 }
 
-static void clean_inverses_for_pos(qmap_head_t *head, uint32_t pos)
+  static void
+qmap_wbuf_put(qmap_wbuf_t *w, const void *data, size_t len)
 {
-  qmap_record_t *rec = &qmap_records[head->record_id];
-  const void *struct_ptr = qmap_val(head->phd, pos);
-  if (!struct_ptr)
-    return;
+  if (w->crc)
+    XXH32_update(w->crc, data, len);
+  w->off += len;
 
-  for (size_t fi = 0; fi < rec->field_count; fi++) {
-    if (rec->fields[fi].target_record == 0)
-      continue;
-    uint32_t ft = rec->fields[fi].type;
-    size_t  fo = rec->fields[fi].offset;
-    size_t  fm = rec->fields[fi].max_size;
+  if (!w->buf)
+    return;
 
-    if (ft == QM_REFERENCE) {
-      const char *id = (const char *)struct_ptr + fo;
-      if (id && id[0]) {
-        uint32_t target_hd = rec->fields[fi].target_hd;
-        if (target_hd > 0) {
-          uint32_t tp = qmap_pos(target_hd, id);
-          if (tp != UINT32_MAX)
-            inverse_remove(head, (int)fi, tp, pos);
-        }
-      }
-    } else if (ft == QM_MULTI_REFERENCE && fm > 0) {
-      const char *s = (const char *)struct_ptr + fo;
-      while (*s) {
-        char *end;
-        unsigned long p = strtoul(s, &end, 10);
-        if (end > s)
-          inverse_remove(head, (int)fi, (uint32_t)p, pos);
-        if (*end == '\n')
-          s = end + 1;
-        else
-          break;
-      }
-    }
+  if (len <= QMAP_WBUF - w->len) {
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+  } else if (len >= QMAP_WBUF / 2)
+    /* large payloads go out from where they are */
+    qmap_wbuf_flush(w, data, len);
+  else {
+    qmap_wbuf_flush(w, NULL, 0);
+    memcpy(w->buf, data, len);
+    w->len = len;
   }
 }
 
-/* Parse \n-separated positions from a string into pos[].
- * Returns number parsed. */
-static size_t parse_positions(const char *s, uint32_t *pos, size_t max)
+/* Zeroes up to the next multiple of QMAP_ALIGN */
+  static void
+qmap_wbuf_pad(qmap_wbuf_t *w, size_t len)
 {
-  size_t count = 0;
-  if (!s) return 0;
-  while (*s && count < max) {
-    char *end;
-    unsigned long v = strtoul(s, &end, 10);
-    if (end > s)
-      pos[count++] = (uint32_t)v;
-    if (*end == '\n')
-      s = end + 1;
-    else
-      break;
-  }
-  return count;
+  static const char zero[QMAP_ALIGN(1)];
+
+  qmap_wbuf_put(w, zero, QMAP_ALIGN(len) - len);
 }
 
-/* Handle inverse index update after a field put on a reference field.
- * Called AFTER the struct has been re-put, with source_pos known. */
-static void handle_inverse_put(qmap_head_t *head, int fi,
-    uint32_t source_pos,
-    const uint8_t *old_val, const void *new_val,
-    uint32_t ft, size_t fm)
+/* Everything of the section of hd but its records: fills in de but
+ * for off and crc, and returns the part before the records (l->rec
+ * bytes), setting *kptr to the key and value of each entry, in pairs
+ * (values of QM_VLOG maps, secondaries and QM_PGET maps need not
+ * follow their keys). Sizes come from the size arrays, so the payloads
+ * themselves are not read, but for maps whose values are another's:
+ * those are measured. Of a sharded map, only the entries of shard are
+ * in it */
+  static char *
+qmap_sec_build(uint32_t hd, uint32_t shard, qmap_dirent_t *de,
+    qmap_layout_t *l, const char ***kptr)
 {
-  qmap_record_t *rec = &qmap_records[head->record_id];
-  (void)fm;
-  if (rec->fields[fi].target_record == 0)
-    return;
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  uint32_t last = qmap->idm.last;
+  uint32_t *dense = malloc(sizeof(uint32_t) * (last ? last : 1));
+  uint32_t *order = malloc(sizeof(uint32_t) * (last ? last : 1));
+  uint32_t n = 0, m;
+  size_t off;
+  int own = head->phd == hd && !(head->flags & QM_PGET);
+  char *base;
+
+  CBUG(!dense || !order, "malloc error (save)\n");
+
+  /* positions with holes become entry indexes without, in key order
+   * for QM_SORTED maps so that loading them needs no sort */
+  if (head->flags & QM_SORTED) {
+    if (head->iflags & QM_SDIRTY)
+      qmap_rebuild_sorted(hd);
 
-  uint32_t old_pos[2048], new_pos[2048];
-  size_t n_old = 0, n_new = 0;
+    n = head->sorted_n;
+    memcpy(order, qmap->sorted_idx, sizeof(uint32_t) * n);
+  } else
+    for (uint32_t p = 0; p < last; p++)
+      if (qmap_key(hd, p))
+        order[n++] = p;
 
-  if (ft == QM_REFERENCE) {
-    uint32_t target_hd = rec->fields[fi].target_hd;
-    const char *id = (const char *)new_val;
-    if (id && id[0] && target_hd > 0) {
-      uint32_t p = qmap_pos(target_hd, id);
-      if (p != UINT32_MAX) new_pos[n_new++] = p;
-    }
-    id = (const char *)old_val;
-    if (id && id[0] && target_hd > 0) {
-      uint32_t p = qmap_pos(target_hd, id);
-      if (p != UINT32_MAX) old_pos[n_old++] = p;
-    }
-  } else if (ft == QM_MULTI_REFERENCE) {
-    n_new = parse_positions((const char *)new_val, new_pos, 2048);
-    n_old = parse_positions((const char *)old_val, old_pos, 2048);
+  if (head->nshard) {
+    uint32_t kept = 0;
+
+    for (uint32_t i = 0; i < n; i++)
+      if (qmap_shard(qmap->key_hashes[order[i]], head->nshard) == shard)
+        order[kept++] = order[i];
+    n = kept;
   }
 
-  /* removed = old \ new */
-  for (size_t i = 0; i < n_old; i++) {
-    int found = 0;
-    for (size_t j = 0; j < n_new; j++) {
-      if (old_pos[i] == new_pos[j]) { found = 1; break; }
-    }
-    if (!found)
-      inverse_remove(head, fi, old_pos[i], source_pos);
+  memset(dense, 0xFF, sizeof(uint32_t) * last);
+  for (uint32_t i = 0; i < n; i++)
+    dense[order[i]] = i;
+
+  qmap_sec_plan(de, hd, n);
+  qmap_layout(l, de);
+  m = de->m;
+
+  /* zeroed for the padding */
+  base = calloc(1, l->rec);
+  *kptr = malloc(sizeof(char *) * 2 * (n ? n : 1));
+  CBUG(!base || !*kptr, "malloc error (save)\n");
+
+  uint64_t *koff = (uint64_t *) (base + l->koff);
+  uint64_t *ksize = (uint64_t *) (base + l->ksize);
+  uint64_t *vsize = (uint64_t *) (base + l->vsize);
+  uint32_t *hash = (uint32_t *) (base + l->hash);
+  uint32_t *map = (uint32_t *) (base + l->map);
+  uint32_t *sorted = (uint32_t *) (base + l->sorted);
+
+  off = l->rec;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t p = order[i];
+
+    (*kptr)[2 * i] = qmap_key(hd, p);
+    (*kptr)[2 * i + 1] = qmap_val(hd, p);
+    ksize[i] = own ? qmap->key_sizes[p]
+      : qmap_len(head->types[QM_KEY], (*kptr)[2 * i]);
+    vsize[i] = own ? qmap->val_sizes[p]
+      : qmap_len(head->types[QM_VALUE], (*kptr)[2 * i + 1]);
+    koff[i] = off;
+    hash[i] = qmap->key_hashes[p];
+    off += qmap_payload_off(ksize[i]) + QMAP_ALIGN(vsize[i]);
   }
 
-  /* added = new \ old */
-  for (size_t i = 0; i < n_new; i++) {
-    int found = 0;
-    for (size_t j = 0; j < n_old; j++) {
-      if (new_pos[i] == old_pos[j]) { found = 1; break; }
-    }
-    if (!found)
-      inverse_add(head, fi, new_pos[i], source_pos);
+  memset(map, 0xFF, sizeof(uint32_t) * m);
+
+  /* keep what the hash table reaches (first duplicates of
+   * QM_MULTIVALUE maps only), in the order it does */
+  for (uint32_t i = 0; m && i < head->m; i++) {
+    uint32_t p = qmap->map[i], id;
+
+    if (p >= last || dense[p] == QM_MISS)
+      continue;
+
+    id = hash[dense[p]] & (m - 1);
+    while (map[id] != QM_MISS)
+      id = (id + 1) & (m - 1);
+    map[id] = dense[p];
   }
+
+  /* entries are in key order: QM_RDONLY_MMAP maps use this as is */
+  if (de->flags & QMAP_SEC_SORTED)
+    for (uint32_t i = 0; i < n; i++)
+      sorted[i] = i;
+
+  de->size = off;
+
+  free(order);
+  free(dense);
+  return base;
 }
 
-/* }}} */
+/* Stream records [i, end) of a section built by qmap_sec_build */
+  static void
+qmap_sec_records(qmap_wbuf_t *w, const char *base,
+    const qmap_layout_t *l, const char **kptr, uint32_t i, uint32_t end)
+{
+  const uint64_t *ksize = (const uint64_t *) (base + l->ksize);
+  const uint64_t *vsize = (const uint64_t *) (base + l->vsize);
+
+  for (; i < end; i++) {
+    qmap_wbuf_put(w, kptr[2 * i], ksize[i]);
+    qmap_wbuf_pad(w, ksize[i]);
+    qmap_wbuf_put(w, kptr[2 * i + 1], vsize[i]);
+    qmap_wbuf_pad(w, vsize[i]);
+  }
+}
 
-  static inline uint32_t
-_qmap_put(uint32_t hd, const void * key,
-    const void *value, uint32_t pn)
+/* Has any map to save of the file changed since it was read? */
+  static int
+qmap_file_dirty(const qmap_file_t *file)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
+  idsi_t *cur = ids_iter((ids_t *) &file->ids);
+  uint32_t hd;
 
-  /* Grow before clustering gets pathological */
-  if (!(head->flags & QM_NOGROW)) {
-    if ((head->n + 1) * 4 >= head->m * 3)
-      qmap_grow(hd);
-  }
+  while (ids_next(&hd, &cur))
+    if (mdbs[hd] && qmap_dirty(hd, file))
+      return 1;
 
-  uint32_t n;
-  const void *aval = value;
-  void *rval, *rkey;
-  size_t key_len, klen;
-  uint32_t key_hash;
-  uint32_t lookup_id;
-  uint32_t key_id;
+  return 0;
+}
 
-  if (key) {
-    uint32_t old_n;
+/* Write all of buf at off, 0 or an errno */
+  static int
+qmap_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+  while (len) {
+    ssize_t w = pwrite(fd, buf, len, off);
 
-    lookup_id = qmap_id_ex(hd, key, &key_len, &key_hash);
-    if (lookup_id == QM_MISS) {
-      WARN("qmap %u: probe failure after grow", hd);
-      return QM_MISS;
-    }
-    old_n = qmap->map[lookup_id];
+    if (w < 0 && errno == EINTR)
+      continue;
 
-    if (old_n == QM_MISS) {
-      if (pn != QM_MISS) {
-        n = pn;
-        /* Update IDM to know about this position */
-        update_idm_last(qmap, pn);
-      } else {
-        n = idm_new(&qmap->idm);
-      }
-      head->n ++;
-    } else if (head->flags & QM_MULTIVALUE) {
-      /* QM_MULTIVALUE: Allow duplicate keys.
-       * If pn is provided (from qmap_assoc), use it.
-       * Otherwise, allocate a new position.
-       * Don't update hash table - it keeps pointing to first occurrence.
-       * Duplicate is accessible via sorted_idx iteration. */
-      if (pn != QM_MISS && pn != old_n) {
-        n = pn;
-        /* Update IDM to know about this position */
-        update_idm_last(qmap, pn);
-      } else if (pn == QM_MISS) {
-        n = idm_new(&qmap->idm);
-      } else {
-        n = old_n;  /* pn == old_n, update in place */
-      }
+    if (w <= 0)
+      return w < 0 ? errno : EIO;
 
-      if (n != old_n)
-        head->n ++;
-    } else
-      n = old_n;
-  } else {
-    key_id = n = idm_new(&qmap->idm);
-    head->n ++;
-    key = &key_id;
-    if (head->types[QM_KEY] == QM_STR) {
-      static char _auto_key[32];
-      snprintf(_auto_key, sizeof(_auto_key), "%u", key_id);
-      key = _auto_key;
-    }
-    lookup_id = qmap_id_ex(hd, key, &key_len, &key_hash);
+    buf = (const char *) buf + w;
+    len -= (size_t) w;
+    off += w;
   }
 
-  if (n >= head->m) {
-    if (head->flags & QM_NOGROW) {
-      head->n--;
-      WARN("qmap %u: capacity reached (%u entries, max %u)",
-          hd, head->n, head->m);
-      return QM_MISS;
-    }
-    qmap_grow(hd);
-    lookup_id = qmap_id_hash(hd, key, key_len, key_hash);
+  return 0;
+}
+
+/* Make a rename in the directory of filename durable */
+  static void
+qmap_sync_dir(const char *filename)
+{
+  const char *slash = strrchr(filename, '/');
+  size_t len = slash ? (size_t) (slash - filename) : 0;
+  char dir[len + 2];
+  int fd;
+
+  if (!slash)
+    strcpy(dir, ".");
+  else if (!len)
+    strcpy(dir, "/");
+  else {
+    memcpy(dir, filename, len);
+    dir[len] = '\0';
+  }
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return;
+
+  fsync(fd);
+  close(fd);
+}
+
+/* Open <filename>.tmp for a new image, with the mode of the file */
+  static int
+qmap_tmp_open(const char *filename)
+{
+  char tmp[strlen(filename) + sizeof(".tmp")];
+  struct stat sb;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    WARN("qmap: %s: %s, not saved\n", tmp, strerror(errno));
+    return -1;
   }
-  DEBUG(2, "%u %u %u %p\n", hd, n, lookup_id, key);
 
-  rkey = (void *) key;
-  qmap->key_hashes[n] = key_hash;
+  if (stat(filename, &sb) == 0)
+    fchmod(fd, sb.st_mode & 07777);
 
-  if (head->phd == hd) {
-    if (head->types[QM_VALUE] == QM_PTR)
-      value = &value;
+  return fd;
+}
 
-    klen = qmap_len(head->types[QM_VALUE], aval);
+/* Sync the image at fd and rename it over the file, or drop it if
+ * err (an errno) is set. Returns 0 or -1 */
+  static int
+qmap_tmp_commit(int fd, int err, const char *filename)
+{
+  char tmp[strlen(filename) + sizeof(".tmp")];
 
-    if (qmap->map[lookup_id] == n) {
-      const void *old_key = qmap_key(hd, n);
-      size_t off = qmap_payload_off(key_len);
-      size_t need = qmap_payload_off(key_len) + klen;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+  if (!err && fsync(fd) == -1)
+    err = errno;
 
-      /* Reuse key allocation if key/value fit in the existing block. */
-      if (qmap->key_sizes[n] == key_len &&
-          memcmp(old_key, key, key_len) == 0 &&
-          qmap_payload_cap(old_key) >= need) {
-        rkey = (void *) old_key;
-        rval = (void *) ((char *) rkey + off);
-      } else {
-        qmap_payload_free(qmap, (void *) old_key);
-        rkey = qmap_payload_alloc(qmap, key_len, klen);
-        rval = (void *) ((char *) rkey + off);
-      }
+  close(fd);
 
-      memcpy(rkey, key, key_len);
-      memcpy(rval, value, klen);
-      qmap->key_sizes[n] = key_len;
-      qmap->val_sizes[n] = klen;
-    } else {
-      /* New entry - allocate fresh */
-      size_t off = qmap_payload_off(key_len);
-      rkey = qmap_payload_alloc(qmap, key_len, klen);
-      rval = (void *) ((char *) rkey + off);
-      memcpy(rkey, key, key_len);
-      memcpy(rval, value, klen);
-      qmap->key_sizes[n] = key_len;
-      qmap->val_sizes[n] = klen;
-    }
+  if (!err && rename(tmp, filename) == -1)
+    err = errno;
 
-    * VAL_ADDR(qmap, n) = rval;
+  if (err) {
+    WARN("qmap: %s: %s, not saved\n", filename, strerror(err));
+    unlink(tmp);
+    return -1;
   }
 
-  qmap->omap[n] = rkey;
+  return 0;
+}
 
-  /* When sharing a position with the primary on updates, a different
-   * secondary key may overwrite the same position. Clear any stale hash
-   * entries that still point to this position from the former key. */
-  if (head->phd != hd && pn != QM_MISS) {
-    for (uint32_t i = 0; i < head->m; i++) {
-      if (qmap->map[i] == n) {
-        qmap->map[i] = QM_MISS;
-        break;
-      }
-    }
+/* Set in the child of qmap_save_async */
+static int qmap_async_child;
+
+/* qmap_save builds the sections of every file to save first, which
+ * gives their sizes and so where each one goes. Workers then write
+ * parts of them in place: whole sections, or for large ones the part
+ * before the records and ranges of records, the checksum of those
+ * being taken in a pass of its own. How the work is split does not
+ * change a byte of the output. Sections to compress have their blocks
+ * compressed in between, which makes them one part. */
+
+/* Bytes of records per part of a section that is split */
+#define QMAP_SAVE_PART (8 << 20)
+
+typedef struct {
+  char *filename;
+  qmap_file_t *file;
+  qmap_fhdr_t *fhdr;	// then the directory
+  size_t hsize;
+  uint64_t size;
+  uint32_t nsec;
+  int fd, err;		// err: errno of the first failure
+} qmap_sfile_t;
+
+typedef struct {
+  qmap_sfile_t *f;
+  uint32_t hd;
+  qmap_dirent_t *de;
+  qmap_layout_t l;
+  char *base;		// the section up to its records
+  const char **kptr;	// entry -> key, value
+  uint32_t nrec;	// records after base, none once compact
+
+  /* compressed: the qmap_zhdr_t and block offsets, then the blocks */
+  char *zidx;
+  size_t zlen;
+  uint32_t nblk;
+  char **zblk;
+  size_t *zsize;
+  int zfail;		// a block did not compress
+} qmap_ssec_t;
+
+/* Block b of section s, to compress */
+typedef struct {
+  qmap_ssec_t *s;
+  uint32_t b;
+} qmap_sblk_t;
+
+/* The part before the records if head, then records [i, end): written
+ * out if write, checksummed into the directory entry if crc */
+typedef struct {
+  qmap_ssec_t *s;
+  uint32_t i, end;
+  uint8_t head, write, crc;
+} qmap_spart_t;
+
+enum {
+  QMAP_SAVE_BUILD,	// qmap_ssec_t items
+  QMAP_SAVE_SQUEEZE,	// qmap_sblk_t items
+  QMAP_SAVE_FILL,	// qmap_spart_t items
+  QMAP_SAVE_COMMIT,	// qmap_sfile_t items
+};
+
+typedef struct {
+  int phase;
+  void *items;
+  uint32_t n, cap;
+  uint32_t *next;	// next item, shared
+} qmap_save_job_t;
+
+  static void
+qmap_save_part(qmap_spart_t *p, char *buf, XXH32_state_t *crc,
+    qmap_uring_t *ring)
+{
+  qmap_ssec_t *s = p->s;
+  const uint64_t *koff = (const uint64_t *) (s->base + s->l.koff);
+  qmap_wbuf_t w = {
+    .fd = s->f->fd,
+    .at = s->de->off + (p->head ? 0 : koff[p->i]),
+    .crc = p->crc ? crc : NULL,
+    .ring = p->write ? ring : NULL,
+    .errp = &s->f->err,
+  };
+
+  if (__atomic_load_n(&s->f->err, __ATOMIC_RELAXED))
+    return;
+
+  if (p->write)
+    w.buf = ring ? qmap_uring_buf(ring) : buf;
+
+  if (p->crc)
+    XXH32_reset(crc, QM_SEED);
+
+  if (s->zblk) {
+    qmap_wbuf_put(&w, s->zidx, s->zlen);
+    for (uint32_t b = 0; b < s->nblk; b++)
+      qmap_wbuf_put(&w, s->zblk[b], s->zsize[b]);
+    qmap_wbuf_pad(&w, w.off);
+  } else {
+    if (p->head)
+      qmap_wbuf_put(&w, s->base, s->l.rec);
+
+    qmap_sec_records(&w, s->base, &s->l, s->kptr, p->i, p->end);
   }
 
-  /* For QM_MULTIVALUE duplicates, don't update hash table */
-  if (!(head->flags & QM_MULTIVALUE) || qmap->map[lookup_id] == QM_MISS || qmap->map[lookup_id] == n)
-    qmap->map[lookup_id] = n;
+  if (p->write) {
+    qmap_wbuf_flush(&w, NULL, 0);
+    if (ring)
+      qmap_uring_unbuf(ring, w.buf);
+  }
 
-  head->iflags |= QM_SDIRTY;
+  if (p->crc)
+    s->de->crc = XXH32_digest(crc);
 
-  return lookup_id;
+  if (w.err)
+    __atomic_store_n(&s->f->err, w.err, __ATOMIC_RELAXED);
 }
 
-  uint32_t /* API */
-qmap_put(uint32_t hd, const void * const key,
-    const void * const value)
+/* Append a key or value of type at *p, as qmap_unpack_one reads it;
+ * prev is the previous key of an ordered key but at restart points */
+  static void
+qmap_pack_one(char **p, uint32_t type, const char *src, size_t len,
+    int ordered, const char *prev, uint64_t *last)
 {
-  uint32_t ahd, n, id;
-  idsi_t *cur;
-  const void *rkey, *rval;
-  qmap_head_t *head = &qmap_heads[hd];
+  uint32_t v;
+  size_t shared = 0;
+
+  switch (qmap_enc_kind(type)) {
+  case QMAP_ENC_VARINT:
+    memcpy(&v, src, sizeof(v));
+    qmap_vput(p, ordered && prev ? (uint32_t) (v - *last) : v);
+    if (last)
+      *last = v;
+    return;
 
-  /* ── Field-level put for record-aware maps ────────────────────────── */
-  if (head->record_id > 0) {
-    const char *k = (const char *)key;
-    const char *colon = strchr(k, ':');
-    if (colon) {
-      size_t sk_len = (size_t)(colon - k);
-      char struct_key[256];
-      if (sk_len >= sizeof(struct_key))
-        return QM_MISS;
-      memcpy(struct_key, k, sk_len);
-      struct_key[sk_len] = '\0';
-      const char *field_name = colon + 1;
+  case QMAP_ENC_STR:
+    len = len ? len - 1 : 0;
+    if (ordered) {
+      while (prev && shared < len && prev[shared] == src[shared])
+        shared++;
+      qmap_vput(p, shared);
+    }
 
-      int fi = qmap_record_find_field(head->record_id, field_name);
-      if (fi < 0)
-        return QM_MISS;
+    src += shared;
+    len -= shared;
+    break;
 
-      size_t struct_size = qmap_records[head->record_id].struct_size;
+  case QMAP_ENC_FIXED:
+    memcpy(*p, src, len);
+    *p += len;
+    return;
+  }
 
-      /* Get or create the struct entry */
-      void *struct_ptr = (void *)qmap_get(hd, struct_key);
-      if (!struct_ptr) {
-        void *tmp = calloc(1, struct_size);
-        if (!tmp) return QM_MISS;
-        if (qmap_put(hd, struct_key, tmp) == QM_MISS) {
-          free(tmp);
-          return QM_MISS;
-        }
-        free(tmp);
-        struct_ptr = (void *)qmap_get(hd, struct_key);
-      }
+  qmap_vput(p, len);
+  memcpy(*p, src, len);
+  *p += len;
+}
 
-      /* Write the field value */
-      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
-      size_t  fo = qmap_records[head->record_id].fields[fi].offset;
-      size_t  fm = qmap_records[head->record_id].fields[fi].max_size;
+/* Encode the section built for s compactly (QMAP_SEC_COMPACT): all of
+ * it then goes before the records, of which there are none */
+  static void
+qmap_sec_compact(qmap_ssec_t *s)
+{
+  qmap_dirent_t *de = s->de;
+  qmap_head_t *head = &qmap_heads[s->hd];
+  const uint64_t *ksize = (const uint64_t *) (s->base + s->l.ksize);
+  const uint64_t *vsize = (const uint64_t *) (s->base + s->l.vsize);
+  uint32_t nrst = (de->n + QMAP_RESTART - 1) / QMAP_RESTART;
+  int ordered = !!(de->flags & QMAP_SEC_ORDERED);
+  size_t cap = sizeof(qmap_chdr_t) + sizeof(uint64_t) * nrst;
+  const char *prev = NULL;
+  uint64_t last = 0, *rst;
+  qmap_chdr_t *ch;
+  char *out, *p;
+
+  /* a varint takes 10 bytes at most, a length and a shared count */
+  for (uint32_t i = 0; i < de->n; i++)
+    cap += ksize[i] + vsize[i] + 40;
+
+  /* zeroed for the padding */
+  out = calloc(1, QMAP_ALIGN(cap));
+  CBUG(!out, "malloc error (save)\n");
+  ch = (qmap_chdr_t *) out;
+  ch->nrst = nrst;
+  ch->every = QMAP_RESTART;
+  rst = (uint64_t *) (ch + 1);
+  p = (char *) (rst + nrst);
+
+  for (uint32_t i = 0; i < de->n; i++) {
+    const char *key = s->kptr[2 * i];
+
+    if (i % QMAP_RESTART == 0) {
+      rst[i / QMAP_RESTART] = (uint64_t) (p - out);
+      prev = NULL;
+    }
 
-      if (ft == QM_VSTR) {
-        /* QM_VSTR: store directly under composite key in vstr map,
-         * bypassing struct modification entirely. */
-        ensure_vstr_hd(head);
-        return qmap_put(head->vstr_hd, key, value);
-      }
+    qmap_pack_one(&p, head->types[QM_KEY], key, ksize[i], ordered,
+        prev, &last);
+    qmap_pack_one(&p, head->types[QM_VALUE], s->kptr[2 * i + 1],
+        vsize[i], 0, NULL, NULL);
+    prev = key;
+  }
 
-      /* Save old field value for inverse diff */
-      size_t old_sz = (ft == QM_STR || ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE) ? fm : sizeof(uint32_t);
-      uint8_t old_val_stack[8192];
-      uint8_t *old_val = NULL;
-      if (head->inv_hds) {
-        if (old_sz > sizeof(old_val_stack)) {
-          old_val = malloc(old_sz);
-          if (!old_val) return QM_MISS;
-        } else {
-          old_val = old_val_stack;
-        }
-        memcpy(old_val, (char *)struct_ptr + fo, old_sz);
-      }
+  free(s->base);
+  s->base = out;
+  s->nrec = 0;
+  de->size = QMAP_ALIGN((size_t) (p - out));
+  de->flags = (de->flags & QMAP_SEC_ORDERED) | QMAP_SEC_COMPACT;
+  de->m = 0;
+  qmap_layout(&s->l, de);
+  s->l.rec = de->size;
+}
 
-      if (ft == QM_STR && fm > 0) {
-        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
-        *((char *)struct_ptr + fo + fm - 1) = '\0';
-      } else if (ft == QM_REFERENCE && fm > 0) {
-        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
-        *((char *)struct_ptr + fo + fm - 1) = '\0';
-      } else if (ft == QM_MULTI_REFERENCE && fm > 0) {
-        strncpy((char *)struct_ptr + fo, (const char *)value, fm - 1);
-        *((char *)struct_ptr + fo + fm - 1) = '\0';
-      } else {
-        size_t val_len = qmap_len(ft, value);
-        memcpy((char *)struct_ptr + fo, value, val_len);
-      }
+/* Bytes [from, to) of section s, as it is streamed */
+  static void
+qmap_sec_render(const qmap_ssec_t *s, char *dst, uint64_t from,
+    uint64_t to)
+{
+  static const char zero[QMAP_ALIGN(1)];
+  const uint64_t *koff = (const uint64_t *) (s->base + s->l.koff);
+  const uint64_t *ksize = (const uint64_t *) (s->base + s->l.ksize);
+  const uint64_t *vsize = (const uint64_t *) (s->base + s->l.vsize);
+  uint32_t lo = 0, hi = s->nrec;
 
-      /* Re-put the struct */
-      uint32_t put_id = qmap_put(hd, struct_key, struct_ptr);
-      if (put_id == QM_MISS) return QM_MISS;
-      uint32_t source_pos = qmaps[hd].map[put_id];
+  if (from < s->l.rec)
+    memcpy(dst, s->base + from, (to < s->l.rec ? to : s->l.rec) - from);
 
-      /* Auto-maintain inverse index for reference fields */
-      if (head->inv_hds) {
-        handle_inverse_put(head, fi, source_pos, old_val, value, ft, fm);
-        if (old_val && old_val != old_val_stack) free(old_val);
-      }
+  /* from the last record starting at or before from */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
 
-      return put_id;
-    }
+    if (koff[mid] <= from)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
 
-  /* ── Whole-struct put: snapshot old struct for inverse diff ── */
-  uint8_t *old_snap = NULL;
-  if (head->record_id > 0 && head->inv_hds) {
-    size_t ss = qmap_records[head->record_id].struct_size;
-    old_snap = malloc(ss);
-    if (old_snap) {
-      const void *old_val = qmap_get(hd, key);
-      if (old_val)
-        memcpy(old_snap, old_val, ss);
-      else
-        memset(old_snap, 0, ss);  /* new entry, diff against zeros */
+  for (uint32_t i = lo ? lo - 1 : 0; i < s->nrec && koff[i] < to; i++) {
+    const char *piece[4] = {
+      s->kptr[2 * i], zero, s->kptr[2 * i + 1], zero,
+    };
+    uint64_t len[4] = {
+      ksize[i], QMAP_ALIGN(ksize[i]) - ksize[i],
+      vsize[i], QMAP_ALIGN(vsize[i]) - vsize[i],
+    };
+    uint64_t pos = koff[i];
+
+    for (int p = 0; p < 4; pos += len[p], p++) {
+      uint64_t a = pos > from ? pos : from;
+      uint64_t e = pos + len[p] < to ? pos + len[p] : to;
+
+      if (a < e)
+        memcpy(dst + (a - from), piece[p] + (a - pos), e - a);
     }
   }
+}
 
-  id = _qmap_put(hd, key, value, QM_MISS);
-  if (id == QM_MISS) {
-    free(old_snap);
-    return QM_MISS;
+/* Compress block b of section s, through raw (QMAP_ZBLOCK bytes)
+ * and out (the bound of that) */
+  static void
+qmap_save_squeeze(qmap_ssec_t *s, uint32_t b, char *raw, char *out)
+{
+  uint64_t from = (uint64_t) b * QMAP_ZBLOCK;
+  uint64_t to = s->de->size - from < QMAP_ZBLOCK
+    ? s->de->size : from + QMAP_ZBLOCK;
+  size_t cap = qmap_codec_bound(qmap_cfg_codec, QMAP_ZBLOCK);
+
+  qmap_sec_render(s, raw, from, to);
+  s->zsize[b] = qmap_codec_pack(qmap_cfg_codec, out, cap, raw, to - from);
+
+  if (!s->zsize[b]) {
+    __atomic_store_n(&s->zfail, 1, __ATOMIC_RELAXED);
+    return;
   }
-  n = qmaps[hd].map[id];
 
-  cur = ids_iter(&qmaps[hd].linked);
-  rkey = qmap_key(hd, n);
-  rval = qmap_val(hd, n);
+  /* all of them are held until written, so no more than that */
+  s->zblk[b] = malloc(s->zsize[b]);
+  CBUG(!s->zblk[b], "malloc error (save)\n");
+  memcpy(s->zblk[b], out, s->zsize[b]);
+}
 
-  while (ids_next(&ahd, &cur)) {
-    qmap_t *aqmap;
-    qmap_head_t *ahead;
+  static void *
+qmap_save_job(void *arg)
+{
+  qmap_save_job_t *job = arg;
+  uint32_t cap = qmap_worker_cap, i;
+  XXH32_state_t *crc = NULL;
+  qmap_uring_t *ring = NULL;
+  char *buf = NULL, *raw = NULL, *out = NULL;
+
+  /* sorting an index while building still splits, over fewer CPUs */
+  qmap_worker_cap = job->cap;
+  while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->n)
+    switch (job->phase) {
+    case QMAP_SAVE_BUILD: {
+      qmap_ssec_t *s = (qmap_ssec_t *) job->items + i;
+
+      s->base = qmap_sec_build(s->hd, s->f->file->shard, s->de, &s->l,
+          &s->kptr);
+      s->nrec = s->de->n;
+      if (qmap_cfg_compact)
+        qmap_sec_compact(s);
+      break;
+    }
+    case QMAP_SAVE_SQUEEZE: {
+      qmap_sblk_t *z = (qmap_sblk_t *) job->items + i;
 
-    aqmap = &qmaps[ahd];
-    ahead = &qmap_heads[ahd];
+      if (!raw) {
+        raw = malloc(QMAP_ZBLOCK);
+        out = malloc(qmap_codec_bound(qmap_cfg_codec, QMAP_ZBLOCK));
+        CBUG(!raw || !out, "malloc error (save)\n");
+      }
 
-    if (aqmap->m_assoc) {
-      /* Multi-key association: produce multiple secondary keys.
-       * Secondary is a root map storing (ref_value, primary_key). */
-      const void *skeys[64];
-      size_t nkeys = aqmap->m_assoc(skeys, 64, rkey, rval, aqmap->m_assoc_userdata);
-      for (size_t i = 0; i < nkeys; i++) {
-        _qmap_put(ahd, skeys[i], rkey, QM_MISS);
-        free((void *)skeys[i]);
+      qmap_save_squeeze(z->s, z->b, raw, out);
+      break;
+    }
+    case QMAP_SAVE_FILL:
+      if (!crc) {
+        crc = XXH32_createState();
+        ring = qmap_uring_new(QMAP_WBUF);
+        buf = ring ? NULL : malloc(QMAP_WBUF);
+        CBUG(!crc || (!ring && !buf), "malloc error (save)\n");
       }
-    } else if (aqmap->assoc) {
-      const void *skey;
 
-      aqmap->assoc(&skey, rkey, rval, aqmap->assoc_userdata);
+      qmap_save_part((qmap_spart_t *) job->items + i, buf, crc, ring);
+      break;
+    default: {
+      qmap_sfile_t *f = (qmap_sfile_t *) job->items + i;
 
-      /* Share positions with QM_MIRROR and non-MULTIVALUE linked maps.
-       * MULTIVALUE linked maps keep independent positions to avoid
-       * hash table repointing complexity on duplicate removal. */
-      if (ahead->iflags & QM_IS_MIRROR) {
-        _qmap_put(ahd, skey, rval, n);  /* Mirror: share position */
-      } else if (ahead->flags & QM_MULTIVALUE) {
-        _qmap_put(ahd, skey, rval, QM_MISS);  /* MULTIVALUE: independent */
-      } else {
-        _qmap_put(ahd, skey, rval, n);  /* General: share position */
-      }
+      if (qmap_tmp_commit(f->fd, f->err, f->filename) && !f->err)
+        f->err = EIO;
+      f->fd = -1;
     }
-  }
-
-  /* ── Update inverse index for reference fields after whole-struct put ── */
-  if (old_snap) {
-    qmap_record_t *rec = &qmap_records[head->record_id];
-    for (size_t fi = 0; fi < rec->field_count; fi++) {
-      uint32_t ft = rec->fields[fi].type;
-      if ((ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE)
-          && rec->fields[fi].target_record > 0) {
-        handle_inverse_put(head, (int)fi, n,
-            old_snap + rec->fields[fi].offset,
-            (const uint8_t *)rval + rec->fields[fi].offset,
-            ft, rec->fields[fi].max_size);
-      }
     }
-    free(old_snap);
+
+  /* the file is complete once its writes are */
+  qmap_uring_free(ring);
+  if (crc)
+    XXH32_freeState(crc);
+  free(buf);
+  free(raw);
+  free(out);
+  qmap_worker_cap = cap;
+  return NULL;
+}
+
+/* Run a phase of the save over n items on up to k threads */
+  static void
+qmap_save_run(int phase, void *items, uint32_t n, uint32_t k)
+{
+  qmap_save_job_t jobs[QM_MAX_WORKERS];
+  uint32_t cpus = qmap_workers(SIZE_MAX, 0), next = 0;
+
+  if (k > n)
+    k = n;
+
+  for (uint32_t j = 0; j < k; j++) {
+    jobs[j].phase = phase;
+    jobs[j].items = items;
+    jobs[j].n = n;
+    jobs[j].cap = k > 1 ? (cpus / k ? cpus / k : 1) : qmap_worker_cap;
+    jobs[j].next = &next;
   }
 
-  return id;
+  if (k)
+    qmap_par(qmap_save_job, jobs, sizeof(*jobs), k);
 }
 
-/* }}} */
+/* Compress the sections big enough to, on k threads. Those that do
+ * not shrink are left as they are */
+  static void
+qmap_save_compress(qmap_ssec_t *secs, uint32_t ns, uint32_t k)
+{
+  qmap_sblk_t *blks;
+  uint32_t nb = 0;
+
+  for (uint32_t i = 0; i < ns; i++) {
+    qmap_ssec_t *s = &secs[i];
 
-/* GET {{{ */
+    if (s->de->size < QMAP_ZMIN)
+      continue;
 
-static int qmap_lnext(uint32_t *sn, uint32_t cur_id);
+    s->nblk = (uint32_t) ((s->de->size + QMAP_ZBLOCK - 1) / QMAP_ZBLOCK);
+    s->zblk = calloc(s->nblk, sizeof(char *));
+    s->zsize = calloc(s->nblk, sizeof(size_t));
+    CBUG(!s->zblk || !s->zsize, "malloc error (save)\n");
+    nb += s->nblk;
+  }
 
-  const void * /* API */
-qmap_get(uint32_t hd, const void * const key)
-{
-  qmap_head_t *head = &qmap_heads[hd];
+  blks = malloc(sizeof(*blks) * (nb ? nb : 1));
+  CBUG(!blks, "malloc error (save)\n");
 
-  /* ── Composite-key resolution for record-aware maps ──────────────── */
-  if (head->record_id > 0) {
-    const char *k = (const char *)key;
-    const char *colon = strchr(k, ':');
-    if (colon) {
-      size_t sk_len = (size_t)(colon - k);
-      char struct_key[256];
-      if (sk_len >= sizeof(struct_key))
-        return NULL;
-      memcpy(struct_key, k, sk_len);
-      struct_key[sk_len] = '\0';
+  nb = 0;
+  for (uint32_t i = 0; i < ns; i++)
+    for (uint32_t b = 0; b < secs[i].nblk; b++)
+      blks[nb++] = (qmap_sblk_t) { &secs[i], b };
 
-      int fi = qmap_record_find_field(head->record_id, colon + 1);
-      if (fi < 0)
-        return NULL;
+  qmap_save_run(QMAP_SAVE_SQUEEZE, blks, nb, k);
+  free(blks);
 
-      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+  for (uint32_t i = 0; i < ns; i++) {
+    qmap_ssec_t *s = &secs[i];
+    qmap_zhdr_t *zh;
+    uint64_t *zoff;
+    size_t total;
 
-      if (ft == QM_VSTR) {
-        /* QM_VSTR: look up the composite key directly in vstr map */
-        if (head->vstr_hd == 0)
-          return NULL;
-        return qmap_get(head->vstr_hd, k);
-      }
+    if (!s->zblk)
+      continue;
 
-      const void *struct_ptr = qmap_get(hd, struct_key);
-      if (!struct_ptr)
-        return NULL;
+    s->zlen = sizeof(*zh) + sizeof(uint64_t) * (s->nblk + 1);
+    total = s->zlen;
+    for (uint32_t b = 0; b < s->nblk; b++)
+      total += s->zsize[b];
 
-      size_t field_offset = qmap_records[head->record_id].fields[fi].offset;
-      const char *result = (const char *)struct_ptr + field_offset;
-      return result;
+    if (s->zfail || QMAP_ALIGN(total) >= s->de->size) {
+      for (uint32_t b = 0; b < s->nblk; b++)
+        free(s->zblk[b]);
+      free(s->zblk);
+      s->zblk = NULL;
+      continue;
     }
-  }
 
-  uint32_t cur_id = qmap_iter(hd, key, 0), sn;
-
-  if (!qmap_lnext(&sn, cur_id))
-    return NULL;
+    s->zidx = malloc(s->zlen);
+    CBUG(!s->zidx, "malloc error (save)\n");
+    zh = (qmap_zhdr_t *) s->zidx;
+    zoff = (uint64_t *) (zh + 1);
+    zh->raw = s->de->size;
+    zh->nblk = s->nblk;
+    zh->blk = QMAP_ZBLOCK;
 
-  qmap_fin(cur_id);
+    zoff[0] = s->zlen;
+    for (uint32_t b = 0; b < s->nblk; b++)
+      zoff[b + 1] = zoff[b] + s->zsize[b];
 
-  return qmap_val(hd, sn);
+    s->de->codec = qmap_cfg_codec;
+    s->de->size = QMAP_ALIGN(total);
+  }
 }
 
-/* }}} */
-
-/* DELETE {{{ */
+/* Are the records of s written in parts, on k threads? */
+  static inline int
+qmap_save_split(const qmap_ssec_t *s, uint32_t k)
+{
+  return k > 1 && !s->zblk && s->de->size - s->l.rec > QMAP_SAVE_PART;
+}
 
-  static inline uint32_t
-qmap_root(uint32_t hd)
+/* Write the maps to save of each of the n files to <filename>.tmp and
+ * rename it over the file, which stays whole until then. Returns 0,
+ * or -1 if any file could not be written */
+  static int
+qmap_save_files(char **names, uint32_t n)
 {
-  while(qmap_heads[hd].phd != hd)
-    hd = qmap_heads[hd].phd;
+  qmap_sfile_t *files = calloc(n ? n : 1, sizeof(*files));
+  qmap_ssec_t *secs;
+  qmap_spart_t *parts;
+  uint32_t nf = 0, ns = 0, np = 0, k, hd;
+  size_t work = 0;
+  int err = 0;
+  idsi_t *cur;
 
-  return hd;
-}
+  CBUG(!files, "malloc error (save)\n");
 
-static void qmap_ndel(uint32_t hd, uint32_t n);
+  for (uint32_t i = 0; i < n; i++) {
+    qmap_file_t *file = (qmap_file_t *) qmap_get(qmap_files_hd, names[i]);
+    qmap_sfile_t *f = &files[nf];
 
-static void qmap_ndel_topdown(uint32_t hd, uint32_t n) {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
-  const void *key;
-  uint32_t id, ahd;
-  idsi_t *cur;
+    CBUG(!file, "called with unknown filename");
 
-  // Guard against already-closed maps (omap is NULL after close)
-  if (!qmap->omap)
-    return;
+    /* QM_RDONLY_MMAP maps still use the mapping */
+    if (file->rdonly || !qmap_file_dirty(file))
+      continue;
 
-  if (n >= head->m)
-    return;
+    qmap_lazy_file(file);
+    if (file->mmaped)
+      file_close(file);
 
-  key = qmap_key(hd, n);
+    f->fd = qmap_tmp_open(names[i]);
+    if (f->fd < 0) {
+      err = -1;
+      continue;
+    }
 
-  cur = ids_iter(&qmap->linked);
+    f->filename = names[i];
+    f->file = file;
 
-  while (ids_next(&ahd, &cur)) {
-    if (qmaps[ahd].m_assoc && key) {
-      /* Multi-assoc: secondary is a root map storing (ref_val, pkey).
-       * Iterate to find and delete entries whose value matches the
-       * primary key being deleted. */
-      uint32_t mcur = qmap_iter(ahd, NULL, 0);
-      uint32_t msn;
-      uint32_t to_del[256];
-      size_t ndel = 0;
+    cur = ids_iter(&file->ids);
+    while (ids_next(&hd, &cur))
+      if (mdbs[hd]) {
+        qmap_head_t *head = &qmap_heads[hd];
 
-      while (qmap_lnext(&msn, mcur)) {
-        const void *mval = qmap_val(ahd, msn);
-        if (mval && qmap_scmp(mval, key, 0) == 0) {
-          to_del[ndel++] = msn;
-          if (ndel >= 256) break;
-        }
+        /* shards of a map are built at once: sort its index first */
+        if (head->nshard && (head->flags & QM_SORTED)
+            && (head->iflags & QM_SDIRTY))
+          qmap_rebuild_sorted(hd);
+
+        work += qmaps[hd].idm.last;
+        f->nsec++;
       }
-      qmap_fin(mcur);
 
-      for (size_t i = 0; i < ndel; i++)
-        qmap_ndel(ahd, to_del[i]);
-    } else {
-      qmap_ndel_topdown(ahd, n);
+    /* no maps to save leave an empty file */
+    if (f->nsec) {
+      f->hsize = sizeof(*f->fhdr) + sizeof(qmap_dirent_t) * f->nsec;
+      f->fhdr = calloc(1, f->hsize);
+      CBUG(!f->fhdr, "malloc error (save)\n");
+      f->fhdr->magic = QMAP_MAGIC;
+      f->fhdr->version = QMAP_VERSION;
+      f->fhdr->ndb = f->nsec;
     }
-  }
 
-  if (!key) {
-    qmap->omap[n] = NULL;
-    idm_del(&qmap->idm, n);
-    head->n --;
-    return;
+    f->size = f->hsize;
+    ns += f->nsec;
+    nf++;
   }
 
-  id = qmap_id(hd, key);
+  secs = calloc(ns ? ns : 1, sizeof(*secs));
+  CBUG(!secs, "malloc error (save)\n");
 
-  /* For QM_MULTIVALUE maps, check if other duplicates exist before clearing hash entry.
-   * Do this BEFORE freeing the key! */
-  uint32_t new_map_entry = QM_MISS;
-  if (head->flags & QM_MULTIVALUE) {
-    int first = qmap_bsearch_ex(hd, key, NULL, QMAP_BSEARCH_FIRST);
+  ns = 0;
+  for (uint32_t i = 0; i < nf; i++) {
+    qmap_dirent_t *dir;
+    uint32_t j = 0;
 
-    if (first != -1) {
-      uint32_t first_pos = qmap->sorted_idx[first];
-      if (first_pos == n) {
-        /* Deleting the first entry, check if a second exists */
-        int second = first + 1;
-        if (second < (int)head->sorted_n) {
-          const void *second_key = qmap_key(hd, qmap->sorted_idx[second]);
-          qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
-          size_t key_len = qmap->key_sizes[n];
-          size_t len;
-          if (type->measure) {
-            size_t second_len = qmap->key_sizes[qmap->sorted_idx[second]];
-            len = (key_len > second_len) ? key_len : second_len;
-          } else
-            len = type->len;
+    if (!files[i].nsec)
+      continue;
 
-          if (type->cmp(key, second_key, len) == 0)
-            new_map_entry = qmap->sorted_idx[second];
-        }
-      } else {
-        /* Not deleting first entry, first remains valid */
-        new_map_entry = first_pos;
+    dir = (qmap_dirent_t *) (files[i].fhdr + 1);
+    cur = ids_iter(&files[i].file->ids);
+    while (ids_next(&hd, &cur))
+      if (mdbs[hd]) {
+        secs[ns].f = &files[i];
+        secs[ns].hd = hd;
+        secs[ns++].de = &dir[j++];
       }
-    }
   }
 
-  if (head->phd == hd) {
-    qmap_payload_free(qmap, (void *) key);
-    * VAL_ADDR(qmap, n) = NULL;
-  }
+  k = qmap_workers(work, qmap_cfg_par_min);
+  qmap_save_run(QMAP_SAVE_BUILD, secs, ns, k);
 
-  qmap->key_hashes[n] = 0;
-  qmap->key_sizes[n] = 0;
-  qmap->val_sizes[n] = 0;
+  if (qmap_cfg_codec)
+    qmap_save_compress(secs, ns, k);
 
-  head->iflags |= QM_SDIRTY;
+  /* sections follow the directory in the order they were built */
+  uint32_t maxp = 0;
 
-  /* Update hash table entry */
-  if (id != QM_MISS) {
-    if (new_map_entry != QM_MISS)
-      qmap->map[id] = new_map_entry;
-    else
-      qmap->map[id] = QM_MISS;
-  }
+  for (uint32_t i = 0; i < ns; i++) {
+    qmap_ssec_t *s = &secs[i];
 
-  qmap->omap[n] = NULL;
-  idm_del(&qmap->idm, n);
-  head->n --;
+    s->de->off = s->f->size;
+    s->f->size += s->de->size;
+    maxp += qmap_save_split(s, k)
+      ? 3 + (uint32_t) ((s->de->size - s->l.rec) / QMAP_SAVE_PART) : 1;
+  }
 
-}
+  parts = malloc(sizeof(*parts) * (maxp ? maxp : 1));
+  CBUG(!parts, "malloc error (save)\n");
 
-/* Delete based on position */
-static inline void
-qmap_ndel(uint32_t hd, uint32_t n) {
-  qmap_ndel_topdown(qmap_root(hd), n);
-}
+  /* the checksums of split sections take longest, so they go first */
+  for (uint32_t i = 0; i < ns; i++)
+    if (qmap_save_split(&secs[i], k))
+      parts[np++] = (qmap_spart_t) { &secs[i], 0, secs[i].nrec, 1, 0, 1 };
 
-  static void
-qmap_clear_fast(uint32_t hd)
-{
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
+  for (uint32_t i = 0; i < ns; i++) {
+    qmap_ssec_t *s = &secs[i];
+    const uint64_t *koff = (const uint64_t *) (s->base + s->l.koff);
+    uint32_t cnt = s->nrec;
 
-  if (head->phd == hd) {
-    for (uint32_t n = 0; n < qmap->idm.last; n++) {
-      const void *key = qmap->omap[n];
-      if (!key)
-        continue;
-      qmap_payload_free(qmap, (void *) key);
+    if (!qmap_save_split(s, k)) {
+      parts[np++] = (qmap_spart_t) { s, 0, cnt, 1, 1, 1 };
+      continue;
     }
-  }
 
-  memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
-  memset(qmap->omap, 0, sizeof(void *) * head->m);
-  memset(qmap->key_hashes, 0, sizeof(uint32_t) * head->m);
-  memset(qmap->key_sizes, 0, sizeof(size_t) * head->m);
-  if (head->phd == hd) {
-    memset(qmap->table, 0, sizeof(void *) * head->m);
-    memset(qmap->val_sizes, 0, sizeof(size_t) * head->m);
-  }
+    parts[np++] = (qmap_spart_t) { s, 0, 0, 1, 1, 0 };
 
-  idm_drop(&qmap->idm);
-  qmap->idm.last = 0;
-  head->n = 0;
-  head->iflags |= QM_SDIRTY;
-}
+    /* records up to QMAP_SAVE_PART bytes on from the first of each */
+    for (uint32_t r = 0; r < cnt; ) {
+      uint64_t lim = koff[r] + QMAP_SAVE_PART;
+      uint32_t lo = r + 1, hi = cnt;
 
-  void /* API */
-qmap_del(uint32_t hd, const void * const key)
-{
-  qmap_head_t *head = &qmap_heads[hd];
+      while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-  /* ── Field-level delete for record-aware maps ─────────────────────── */
-  if (head->record_id > 0) {
-    const char *k = (const char *)key;
-    const char *colon = strchr(k, ':');
-    if (colon) {
-      size_t sk_len = (size_t)(colon - k);
-      char struct_key[256];
-      if (sk_len >= sizeof(struct_key))
-        return;
-      memcpy(struct_key, k, sk_len);
-      struct_key[sk_len] = '\0';
+        if (koff[mid] < lim)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
 
-      int fi = qmap_record_find_field(head->record_id, colon + 1);
-      if (fi < 0)
-        return;
+      parts[np++] = (qmap_spart_t) { s, r, lo, 0, 1, 0 };
+      r = lo;
+    }
+  }
 
-      void *struct_ptr = (void *)qmap_get(hd, struct_key);
-      if (!struct_ptr)
-        return;
+  qmap_save_run(QMAP_SAVE_FILL, parts, np, k);
 
-      uint32_t ft = qmap_records[head->record_id].fields[fi].type;
-      size_t   fo = qmap_records[head->record_id].fields[fi].offset;
-      size_t   fm = qmap_records[head->record_id].fields[fi].max_size;
+  for (uint32_t i = 0; i < ns; i++) {
+    for (uint32_t b = 0; secs[i].zblk && b < secs[i].nblk; b++)
+      free(secs[i].zblk[b]);
+    free(secs[i].zblk);
+    free(secs[i].zsize);
+    free(secs[i].zidx);
+    free(secs[i].kptr);
+    free(secs[i].base);
+  }
 
-      if (ft == QM_VSTR) {
-        /* QM_VSTR: delete the composite key entry from the vstr map */
-        if (head->vstr_hd) {
-          qmap_del(head->vstr_hd, k);
-        }
-        return;
-      }
+  for (uint32_t i = 0; i < nf; i++)
+    if (!files[i].err && files[i].nsec)
+      files[i].err = qmap_pwrite(files[i].fd, files[i].fhdr,
+          files[i].hsize, 0);
 
-      size_t field_size = fm;
-      if (field_size == 0)
-        field_size = qmap_len(ft, NULL);
+  /* the syncs of the files overlap too */
+  qmap_save_run(QMAP_SAVE_COMMIT, files, nf, k);
 
-      /* Snapshot old value for inverse cleanup */
-      uint8_t old_val[8192];
-      size_t old_sz = (ft == QM_STR || ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE) ? fm : sizeof(uint32_t);
-      if (old_sz > sizeof(old_val)) return;
-      memcpy(old_val, (char *)struct_ptr + fo, old_sz);
+  for (uint32_t i = 0; i < nf; i++) {
+    qmap_sfile_t *f = &files[i];
 
-      memset((char *)struct_ptr + fo, 0, field_size);
+    free(f->fhdr);
+    if (f->err) {
+      err = -1;
+      continue;
+    }
 
-      /* Re-put the struct */
-      uint32_t put_id = qmap_put(hd, struct_key, struct_ptr);
-      if (put_id == QM_MISS) return;
-      uint32_t source_pos = qmaps[hd].map[put_id];
+    f->file->size = f->size;
 
-      /* Clean inverse: old references removed (new value is zeroed) */
-      if (head->inv_hds && (ft == QM_REFERENCE || ft == QM_MULTI_REFERENCE)) {
-        handle_inverse_put(head, fi, source_pos, old_val,
-                           (const void*)"",
-                           ft, fm);
-      }
-      return;
+    cur = ids_iter(&f->file->ids);
+    while (ids_next(&hd, &cur))
+      if (mdbs[hd])
+        qmap_saved(hd, f->file, qmap_heads[hd].mods);
+
+    /* a background save leaves the log to the parent (qmap_wal_trim) */
+    if (f->file->wal_fd >= 0) {
+      qmap_sync_dir(f->filename);
+      if (!qmap_async_child)
+        qmap_wal_reset(f->file);
     }
   }
 
-  uint32_t cur = qmap_iter(hd, key, 0), sn;
+  free(parts);
+  free(secs);
+  free(files);
+  return err;
+}
 
-  if (head->flags & QM_MULTIVALUE) {
-    if (qmap_lnext(&sn, cur)) {
-      if (head->record_id > 0 && head->inv_hds)
-        clean_inverses_for_pos(head, sn);
-      qmap_ndel(hd, sn);
-    }
-    qmap_fin(cur);
-  } else {
-    while (qmap_lnext(&sn, cur)) {
-      if (head->record_id > 0 && head->inv_hds)
-        clean_inverses_for_pos(head, sn);
-      qmap_ndel(hd, sn);
-    }
-    qmap_fin(cur);
-  }
+/* The names of the open files, but for those whose maps all log their
+ * changes unless all; the caller frees the array */
+  static char **
+qmap_file_names(uint32_t *n, int all)
+{
+  uint32_t c = qmap_iter(qmap_files_hd, NULL, 0);
+  char **names = malloc(sizeof(char *)
+      * (qmap_heads[qmap_files_hd].n + 1));
+  const void *key, *value;
+
+  CBUG(!names, "malloc error (save)\n");
+
+  *n = 0;
+  while (qmap_next(&key, &value, c))
+    if (all || !qmap_wal_covers((const qmap_file_t *) value))
+      names[(*n)++] = (char *) key;
+
+  return names;
 }
 
-  void
-qmap_del_all(uint32_t hd, const void * const key)
+  void /* API */
+qmap_save(void)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
+  char **names;
+  uint32_t n;
 
-  if (head->flags & QM_MULTIVALUE) {
-    /* Fast path: if nothing is linked to this map, bulk-delete by
-     * clearing the matching slots once and rebuilding the hash table.
-     * This avoids repeated probe-chain maintenance for every duplicate. */
-    uint32_t cur = qmap_get_multi(hd, key);
-    uint32_t sn;
-    size_t n = 0, cap = head->n ? head->n : 1;
-    uint32_t *positions = malloc(sizeof(*positions) * cap);
-    int fast_path = ids_iter(&qmap->linked) == NULL && head->phd == hd;
+  /* these would write <filename>.tmp too */
+  qmap_save_wait();
+  qmap_ckpt_finish();
 
-    if (cur == QM_MISS)
-      return;
+  names = qmap_file_names(&n, 1);
+  qmap_save_files(names, n);
+  free(names);
 
-    CBUG(!positions, "malloc error (del_all)\n");
+  /* heaps are their files already: they only need writing out */
+  for (uint32_t hd = 0; hd < idm.last; hd++)
+    if (qmaps[hd].heap)
+      qmap_heap_sync(hd);
+}
 
-    while (qmap_lnext(&sn, cur))
-      positions[n++] = sn;
+/* WRITE-AHEAD LOG {{{ */
 
-    if (fast_path) {
-      for (size_t i = 0; i < n; i++) {
-        uint32_t pos = positions[i];
-        const void *old_key = qmap_key(hd, pos);
+/* Changes to QM_WAL maps are appended to <file>.wal as records of
+ * [crc u32][dbid u32][op u32][alen u32][blen u32][a][b], crc being
+ * the XXH32 of what follows it. qmap_open replays the records of its
+ * database on top of the snapshot, and qmap_save (the checkpoint)
+ * empties the log once the snapshot is on disk. */
 
-        qmap_payload_free(qmap, (void *) old_key);
-        qmap->key_sizes[pos] = 0;
-        qmap->val_sizes[pos] = 0;
-        qmap->omap[pos] = NULL;
-        * VAL_ADDR(qmap, pos) = NULL;
-        idm_del(&qmap->idm, pos);
-        head->n--;
-      }
+#define QMAP_WAL_BUF (1 << 16)
+#define QMAP_WAL_HDR (5 * sizeof(uint32_t))
 
-      head->iflags |= QM_SDIRTY;
+/* Write all of buf, 0 or -1 */
+  static int
+qmap_write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t w = write(fd, buf, len);
 
-      if (head->n == 0)
-        memset(qmap->map, 0xFF, sizeof(uint32_t) * head->m);
-      else
-        qmap_rebuild_map(hd);
-    } else {
-      for (size_t i = 0; i < n; i++)
-        qmap_ndel(hd, positions[i]);
-    }
+    if (w < 0 && errno == EINTR)
+      continue;
 
-    free(positions);
-  } else {
-    /* For regular maps, just call qmap_del once */
-    qmap_del(hd, key);
+    if (w <= 0)
+      return -1;
+
+    buf += w;
+    len -= (size_t) w;
   }
+
+  return 0;
 }
 
-/* }}} */
+  static void
+qmap_wal_write(int fd, const char *buf, size_t len)
+{
+  CBUG(qmap_write_all(fd, buf, len), "wal write failed\n");
+}
 
-/* ITERATION {{{ */
+/* The length of the record of a change to hd, written to rec if it
+ * fits in room bytes */
+  static size_t
+qmap_wal_rec(uint32_t hd, uint32_t op, const void *a, const void *b,
+    char *rec, size_t room)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  uint32_t btype = op == QMAP_WAL_PUT
+    ? head->types[QM_VALUE] : head->types[QM_KEY];
+  uint32_t hdr[5];
+  const void *ptr = b;
+  size_t len;
 
-  void /* API */
-qmap_fin(uint32_t cur_id)
+  /* a QM_PTR value is the pointer itself */
+  if (b && btype == QM_PTR)
+    b = &ptr;
+
+  hdr[1] = head->dbid;
+  hdr[2] = op;
+  hdr[3] = a ? (uint32_t) qmap_len(head->types[QM_KEY], a) : 0;
+  hdr[4] = b ? (uint32_t) qmap_len(btype, b) : 0;
+  len = QMAP_WAL_HDR + hdr[3] + hdr[4];
+
+  if (len > room)
+    return len;
+
+  if (hdr[3])
+    memcpy(rec + QMAP_WAL_HDR, a, hdr[3]);
+  if (hdr[4])
+    memcpy(rec + QMAP_WAL_HDR + hdr[3], b, hdr[4]);
+  memcpy(rec + sizeof(uint32_t), hdr + 1, QMAP_WAL_HDR - sizeof(uint32_t));
+  hdr[0] = XXH32(rec + sizeof(uint32_t), len - sizeof(uint32_t), QM_SEED);
+  memcpy(rec, hdr, sizeof(uint32_t));
+  return len;
+}
+
+/* Append the record of a change to hd to the *blen bytes buffered in
+ * buf, of QMAP_WAL_BUF bytes, writing them out to fd when it is full;
+ * 0 or -1 if a write fails */
+  static int
+qmap_wal_append(int fd, char *buf, size_t *blen,
+    uint32_t hd, uint32_t op, const void *a, const void *b)
 {
-  qmap_cur_t *cursor = &qmap_cursors[cur_id];
+  size_t len = qmap_wal_rec(hd, op, a, b, NULL, 0);
+  char *rec;
+  int ret;
+
+  if (*blen + len > QMAP_WAL_BUF) {
+    if (qmap_write_all(fd, buf, *blen))
+      return -1;
+    *blen = 0;
+  }
 
-  if (cursor->sub_cur)
-    qmap_fin(cursor->sub_cur);
+  if (len <= QMAP_WAL_BUF) {
+    *blen += qmap_wal_rec(hd, op, a, b, buf + *blen, len);
+    return 0;
+  }
 
-  idm_del(&cursor_idm, cur_id);
+  rec = malloc(len);
+  CBUG(!rec, "malloc error (wal)\n");
+  qmap_wal_rec(hd, op, a, b, rec, len);
+  ret = qmap_write_all(fd, rec, len);
+  free(rec);
+  return ret;
 }
 
-  uint32_t /* API */
-qmap_iter(uint32_t hd, const void * const key, uint32_t flags)
+/* Write out buffered records, and fsync them too if sync is set */
+  static void
+qmap_wal_flush(qmap_file_t *file, int sync)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
-  uint32_t cur_id = idm_new(&cursor_idm);
-  qmap_cur_t *cursor = &qmap_cursors[cur_id];
+  if (file->wal_fd < 0)
+    return;
 
-  if (key && (head->flags & QM_MULTIVALUE)) {
-    /* For QM_MULTIVALUE maps, use sorted iteration to find all duplicates.
-     * Find first occurrence of this key */
-    int first = qmap_bsearch_ex(hd, key, NULL, QMAP_BSEARCH_FIRST);
-    cursor->pos = (first != -1) ? (uint32_t)first : head->sorted_n;
-    cursor->end_pos = QM_MISS;
-    /* Use sorted iteration but stop at key boundary */
-    flags |= QM_RANGE;
-  } else if (key && (flags & QM_RANGE) && (head->flags & QM_SORTED)) {
-    int exact;
-    cursor->pos = qmap_bsearch(hd, key, &exact);
-    cursor->end_pos = head->sorted_n;
-  } else if (key && !(flags & QM_RANGE)) {
-    uint32_t id = qmap_id(hd, key);
-    if (id == QM_MISS) {
-      cursor->pos = QM_MISS;
-      cursor->end_pos = QM_MISS;
-    } else {
-      cursor->pos = qmap->map[id];
-      cursor->end_pos = cursor->pos;
-    }
-  } else
-    cursor->pos = cursor->end_pos = 0;
+  if (file->wal_len) {
+    qmap_wal_write(file->wal_fd, file->wal_buf, file->wal_len);
+    file->wal_len = 0;
+  }
 
-  cursor->ipos = cursor->pos;
-  cursor->sub_cur = 0;
-  cursor->hd = hd;
-  cursor->key = key;
-  cursor->key_len = key ? qmap_len(head->types[QM_KEY], key) : 0;
-  cursor->flags = flags;
-  return cur_id;
+  if (sync && file->wal_unsynced) {
+    CBUG(fsync(file->wal_fd) == -1, "wal fsync failed\n");
+    file->wal_unsynced = 0;
+  }
 }
 
-/* low-level next */
-  static int
-qmap_lnext(uint32_t *sn, uint32_t cur_id)
+  static void
+qmap_wal_log(uint32_t hd, uint32_t op, const void *a, const void *b)
 {
-  register qmap_cur_t *cursor
-    = &qmap_cursors[cur_id];
-  register qmap_head_t *head = &qmap_heads[cursor->hd];
-  register qmap_t *qmap = &qmaps[cursor->hd];
-  uint32_t n;
-  const void *key;
+  qmap_file_t *file = qmap_heads[hd].wal;
 
-  if ((cursor->flags & QM_RANGE)
-      && (head->flags & QM_SORTED))
-  {
-    if (head->iflags & QM_SDIRTY)
-      qmap_rebuild_sorted(cursor->hd);
+  CBUG(qmap_wal_append(file->wal_fd, file->wal_buf, &file->wal_len,
+        hd, op, a, b), "wal write failed\n");
 
-    if (cursor->pos >= head->sorted_n)
-      goto end;
+  file->wal_unsynced++;
+  if (qmap_cfg_wal_sync && file->wal_unsynced >= qmap_cfg_wal_sync)
+    qmap_wal_flush(file, 1);
+}
 
-    n = qmap->sorted_idx[cursor->pos];
+/* Changes made through "item:field" keys of record maps are logged
+ * as a put of the whole struct they leave behind. Returns 1 if key
+ * was such a key. */
+  static int
+qmap_wal_record(uint32_t hd, const void *key)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  const char *colon;
+  char struct_key[256];
+  const void *st;
+  size_t len;
 
-    if (cursor->key && (head->flags & QM_MULTIVALUE)) {
-      if (cursor->end_pos == QM_MISS)
-        cursor->end_pos = (uint32_t) qmap_bsearch_ex(
-            cursor->hd, cursor->key, NULL,
-            QMAP_BSEARCH_LAST);
-      if (cursor->pos > cursor->end_pos)
-        goto end;
-    }
+  if (!head->record_id || !key || !(colon = strchr(key, ':')))
+    return 0;
 
-    *sn = n;
-    cursor->pos++;
+  len = (size_t) (colon - (const char *) key);
+  if (len >= sizeof(struct_key))
     return 1;
-  }
 
-cagain:
-  n = cursor->pos;
+  memcpy(struct_key, key, len);
+  struct_key[len] = '\0';
 
-  if (n >= qmap->idm.last)
-    goto end;
+  st = qmap_get(hd, struct_key);
+  if (st)
+    qmap_wal_log(hd, QMAP_WAL_PUT, struct_key, st);
 
-  key = qmap_key(cursor->hd, n);
-  if (key == NULL) {
-    cursor->pos++;
-    goto cagain;
-  }
+  return 1;
+}
 
-  if (cursor->flags & QM_RANGE) {
-    if (!cursor->key)
-      goto next;
+/* Apply the records of hd's database. Returns how many bytes at the
+ * start of the log hold whole, intact records. */
+  static size_t
+qmap_wal_replay(uint32_t hd, const char *log, size_t size)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  size_t off = 0;
 
-    qmap_type_t *type = &qmap_types[head->types[QM_KEY]];
+  while (size - off >= QMAP_WAL_HDR) {
+    const char *a = log + off + QMAP_WAL_HDR, *b;
+    uint32_t hdr[5];
     size_t len;
 
-    if (type->measure) {
-      size_t key_len = type->measure(key);
-      size_t start_key_len = cursor->key_len;
-      len = (key_len > start_key_len)
-        ? key_len
-        : start_key_len;
-    } else
-      len = type->len;
+    memcpy(hdr, log + off, sizeof(hdr));
+    len = QMAP_WAL_HDR + (size_t) hdr[3] + hdr[4];
 
-    if (type->cmp(key, cursor->key, len) < 0) {
-      cursor->pos++;
-      goto cagain;
+    if (len > size - off || XXH32(log + off + sizeof(uint32_t),
+          len - sizeof(uint32_t), QM_SEED) != hdr[0])
+      break;
+
+    b = a + hdr[3];
+    off += len;
+
+    if (hdr[1] != head->dbid)
+      continue;
+
+    switch (hdr[2]) {
+    case QMAP_WAL_PUT:
+      if (head->types[QM_VALUE] == QM_PTR)
+        memcpy(&b, b, sizeof(b));
+      qmap_lput(hd, a, b);
+      break;
+    case QMAP_WAL_DEL:
+      qmap_ldel(hd, a);
+      break;
+    case QMAP_WAL_DEL_ALL:
+      qmap_ldel_all(hd, a);
+      break;
+    case QMAP_WAL_DEL_RANGE:
+      /* an open bound is logged empty */
+      qmap_ldel_range(hd, hdr[3] ? a : NULL, hdr[4] ? b : NULL);
+      break;
+    case QMAP_WAL_DROP:
+      qmap_ldrop(hd);
+      break;
     }
-  } else if (cursor->key && n != cursor->ipos)
-    goto end;
-next:
+  }
 
-  DEBUG(3, "NEXT! cur_id %u key %p\n",
-      cur_id, key);
+  return off;
+}
 
-  cursor->pos++;
-  *sn = n;
-  return 1;
-end:
-  idm_del(&cursor_idm, cur_id);
-  *sn = QM_MISS;
-  return 0;
+/* Open the log of hd's file, replay it and start logging */
+  static void
+qmap_wal_open(uint32_t hd)
+{
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_file_t *file = (qmap_file_t *)
+    qmap_get(qmap_files_hd, head->file);
+  struct stat sb;
+
+  if (file->wal_fd < 0) {
+    char path[strlen(head->file) + sizeof(".wal")];
+
+    snprintf(path, sizeof(path), "%s.wal", head->file);
+    file->wal_fd = open(path, O_RDWR | O_CREAT | O_APPEND,
+        S_IRUSR | S_IWUSR);
+    CBUG(file->wal_fd < 0, "wal open failed\n");
+
+    file->wal_buf = malloc(QMAP_WAL_BUF);
+    CBUG(!file->wal_buf, "malloc error (wal)\n");
+    file->wal_len = 0;
+    file->wal_unsynced = 0;
+  } else
+    qmap_wal_flush(file, 0);
+
+  CBUG(fstat(file->wal_fd, &sb) == -1, "fstat");
+
+  if (sb.st_size) {
+    size_t size = (size_t) sb.st_size, good;
+    char *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+        file->wal_fd, 0);
+
+    CBUG(log == MAP_FAILED, "wal mmap failed\n");
+    good = qmap_wal_replay(hd, log, size);
+    munmap(log, size);
+
+    /* a torn record at the end is from a write that never finished */
+    if (good < size) {
+      WARN("qmap %u: dropping %zu bytes of torn log\n",
+          hd, size - good);
+      CBUG(ftruncate(file->wal_fd, (off_t) good) == -1,
+          "wal ftruncate failed\n");
+    }
+  }
+
+  head->wal = file;
+  head->iflags |= QM_WLOG;
 }
 
-  int /* API */
-qmap_next(const void ** ckey, const void ** cval,
-    uint32_t cur_id)
+/* The snapshot holds everything logged so far: start the log over */
+  static void
+qmap_wal_reset(qmap_file_t *file)
 {
-  register qmap_cur_t *c;
-  uint32_t sn;
-  int ret = qmap_lnext(&sn, cur_id);
+  file->wal_len = 0;
+  file->wal_unsynced = 0;
+  CBUG(ftruncate(file->wal_fd, 0) == -1, "wal ftruncate failed\n");
+  CBUG(fsync(file->wal_fd) == -1, "wal fsync failed\n");
+}
 
-  if (!ret)
+/* Can the log stand in for a snapshot of this file at exit? */
+  static int
+qmap_wal_covers(const qmap_file_t *file)
+{
+  idsi_t *cur = ids_iter((ids_t *) &file->ids);
+  uint32_t hd;
+
+  if (file->wal_fd < 0)
     return 0;
 
-  c = &qmap_cursors[cur_id];
-  if (ckey)
-    *ckey = qmap_key(c->hd, sn);
-  if (cval)
-    *cval = qmap_val(c->hd, sn);
+  while (ids_next(&hd, &cur))
+    if (mdbs[hd] && !(qmap_heads[hd].iflags & QM_WLOG))
+      return 0;
+
   return 1;
 }
 
-/* }}} */
+  static void
+qmap_wal_close(qmap_file_t *file)
+{
+  if (file->wal_fd < 0)
+    return;
+
+  qmap_wal_flush(file, 1);
+  close(file->wal_fd);
+  free(file->wal_buf);
+  file->wal_fd = -1;
+  file->wal_buf = NULL;
+}
+
+  void /* API */
+qmap_wal_sync(void)
+{
+  uint32_t c = qmap_iter(qmap_files_hd, NULL, 0);
+  const void *key, *value;
+
+  while (qmap_next(&key, &value, c))
+    qmap_wal_flush((qmap_file_t *) value, 1);
+}
+
+/* }}} */
+
+/* DELTA {{{ */
+
+/* QM_DELTA maps note in mseq the head->mods each entry was last
+ * changed at, and keep the keys they deleted in a ring of the last
+ * QM_CFG_DELTA_WINDOW deletions. qmap_delta_export writes what
+ * changed after a given mods as a qmap_dhdr_t and records of the
+ * write-ahead log's format, ending in a QMAP_WAL_END one: deletions
+ * first, then the entries as they are now. If deletions it no longer
+ * has are needed, or the mods is not one of this map's, it writes a
+ * drop and every entry instead. mods start at the time the map was
+ * opened, in nanoseconds, so that those of a map opened since always
+ * get the whole of it. qmap_delta_apply makes the changes through
+ * qmap_put, qmap_del and qmap_drop, as if the caller had. */
+
+#define QMAP_DELTA_MAGIC 0x544c4451 /* "QDLT" */
+#define QMAP_DELTA_VERSION 1
+
+typedef struct {
+  uint32_t magic, version, dbid;
+  uint32_t types[2];
+} qmap_dhdr_t;
 
-/* DROP + CLOSE + OTHERS {{{ */
+typedef struct {
+  uint64_t seq;		// head->mods of the deletion
+  void *key;
+} qmap_tomb_t;
+
+struct qmap_delta {
+  qmap_tomb_t *tombs;	// a ring of cap, len of them from first
+  uint32_t cap, first, len;
+  uint64_t floor;	// deltas since before it are whole maps
+};
 
-  void /* API */
-qmap_drop(uint32_t hd)
+  static void
+qmap_delta_new(uint32_t hd)
 {
+  qmap_head_t *head = &qmap_heads[hd];
   qmap_t *qmap = &qmaps[hd];
+  struct timespec ts;
 
-  if (ids_iter(&qmap->linked) == NULL) {
-    qmap_clear_fast(hd);
-    return;
-  }
-
-  uint32_t cur_id = qmap_iter(hd, NULL, 0), sn;
+  qmap->delta = calloc(1, sizeof(*qmap->delta));
+  qmap->mseq = calloc(head->m, sizeof(uint64_t));
+  CBUG(!qmap->delta || !qmap->mseq, "malloc error (delta)\n");
 
-  while (qmap_lnext(&sn, cur_id))
-    qmap_ndel(hd, sn);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  head->mods = head->saved_mods
+    = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+  qmap->delta->floor = head->mods;
+  qmap->delta->cap = (uint32_t) qmap_cfg_delta_window;
 }
 
-  void /* API */
-qmap_close(uint32_t hd)
+/* Keep key, which the last change to hd deleted */
+  static void
+qmap_delta_tomb(uint32_t hd, const void *key)
 {
   qmap_head_t *head = &qmap_heads[hd];
-  qmap_t *qmap = &qmaps[hd];
-  idsi_t *cur;
-  uint32_t ahd;
+  struct qmap_delta *d = qmaps[hd].delta;
+  size_t len = qmap_len(head->types[QM_KEY], key);
+  qmap_tomb_t *t;
 
-  if (!qmap->omap)
+  if (!d->cap) {
+    d->floor = head->mods;
     return;
+  }
 
-  qmap_drop(hd);
-
-  cur = ids_iter(&qmap->linked);
-  while (ids_next(&ahd, &cur))
-    qmap_close(ahd);
-
-  ids_drop(&qmap->linked);
-
-  /* Close inverse index maps */
-  if (head->inv_hds) {
-    uint32_t fc = head->record_id > 0 && head->record_id < qmap_records_n
-                ? (uint32_t)qmap_records[head->record_id].field_count : 0;
-    for (uint32_t i = 0; i < fc; i++) {
-      if (head->inv_hds[i])
-        qmap_close(head->inv_hds[i]);
-    }
-    free(head->inv_hds);
-    head->inv_hds = NULL;
+  if (!d->tombs) {
+    d->tombs = malloc(sizeof(qmap_tomb_t) * d->cap);
+    CBUG(!d->tombs, "malloc error (delta)\n");
   }
 
-  /* Close variable-length string map */
-  if (head->vstr_hd) {
-    qmap_close(head->vstr_hd);
-    head->vstr_hd = 0;
+  /* the oldest goes, and deltas from before it with it */
+  if (d->len == d->cap) {
+    t = &d->tombs[d->first];
+    d->floor = t->seq;
+    free(t->key);
+    d->first = (d->first + 1) % d->cap;
+    d->len--;
   }
 
-  idm_drop(&qmap->idm);
-  qmap->idm.last = 0;
-  qmap_payload_flush(qmap);
-  free(qmap->map);
-  free(qmap->omap);
-  free(qmap->key_hashes);
-  free(qmap->key_sizes);
-  free(qmap->val_sizes);
-  if (qmap->sorted_idx)
-    free(qmap->sorted_idx);
-  if (qmap_heads[hd].phd == hd)
-    free(qmap->table);
-  qmap->omap = NULL;
-  idm_del(&idm, hd);
+  t = &d->tombs[(d->first + d->len++) % d->cap];
+  t->seq = head->mods;
+  t->key = malloc(len);
+  CBUG(!t->key, "malloc error (delta)\n");
+  memcpy(t->key, key, len);
+}
 
-  // remove any file associations so we don't try
-  // saving it to a file after it is closed.
-  if (!head->file)
-    return;
-  const qmap_file_t *file = qmap_get(qmap_files_hd, head->file);
-  if (!file)
-    return;
-  ids_remove((ids_t *) &file->ids, hd);
+/* Forget the deletions: every entry of hd may have changed */
+  static void
+qmap_delta_reset(uint32_t hd)
+{
+  struct qmap_delta *d = qmaps[hd].delta;
+
+  for (uint32_t i = 0; i < d->len; i++)
+    free(d->tombs[(d->first + i) % d->cap].key);
 
+  d->first = d->len = 0;
+  d->floor = qmap_heads[hd].mods;
 }
 
-  void /* API */
-qmap_assoc(uint32_t hd, uint32_t link, qmap_assoc_t cb, void *userdata)
+  static void
+qmap_delta_free(uint32_t hd)
 {
   qmap_t *qmap = &qmaps[hd];
 
-  if (!cb)
-    cb = qmap_rassoc;
+  if (!qmap->delta)
+    return;
 
-  ids_push(&qmaps[link].linked, hd);
+  qmap_delta_reset(hd);
+  free(qmap->delta->tombs);
+  free(qmap->delta);
+  free(qmap->mseq);
+  qmap->delta = NULL;
+  qmap->mseq = NULL;
+}
 
-  qmap->assoc = cb;
-  qmap->assoc_userdata = userdata;
-  qmap_heads[hd].phd = link;
+/* Read all of len bytes, 0 or -1 */
+  static int
+qmap_read_all(int fd, void *buf, size_t len)
+{
+  while (len) {
+    ssize_t r = read(fd, buf, len);
 
-  free(qmap->table);
-  qmap->table = NULL;
+    if (r < 0 && errno == EINTR)
+      continue;
 
-  if (qmap_heads[link].n > 0) {
-    uint32_t cur = qmap_iter(link, NULL, 0);
-    const void *key, *value;
+    if (r <= 0)
+      return -1;
 
-    while (qmap_next(&key, &value, cur)) {
-      const void *skey;
-      qmap->assoc(&skey, key, value, qmap->assoc_userdata);
-      _qmap_put(hd, skey, value, QM_MISS);
-    }
-    qmap_fin(cur);
+    buf = (char *) buf + r;
+    len -= (size_t) r;
   }
+
+  return 0;
 }
 
-  void /* API */
-qmap_assoc_multi(uint32_t hd, uint32_t link, qmap_assoc_multi_t cb, void *userdata)
+/* Read the next record of a delta of database dbid into *rec, of *cap
+ * bytes; 0, or -1 at the end of fd or if it is not intact */
+  static int
+qmap_delta_read(int fd, char **rec, size_t *cap, uint32_t dbid)
 {
-  qmap_t *qmap = &qmaps[hd];
-
-  if (!cb)
-    return;
+  uint32_t hdr[5];
+  size_t len;
 
-  ids_push(&qmaps[link].linked, hd);
+  if (qmap_read_all(fd, hdr, sizeof(hdr)))
+    return -1;
 
-  qmap->m_assoc = cb;
-  qmap->m_assoc_userdata = userdata;
-  qmap_heads[hd].phd = link;
+  len = QMAP_WAL_HDR + (size_t) hdr[3] + hdr[4];
+  if (len > *cap) {
+    char *tmp = realloc(*rec, len);
 
-  /* Backfill existing entries in the primary */
-  if (qmap_heads[link].n > 0) {
-    uint32_t cur = qmap_iter(link, NULL, 0);
-    const void *key, *value;
+    if (!tmp)
+      return -1;
 
-    while (qmap_next(&key, &value, cur)) {
-      const void *skeys[64];
-      size_t nkeys = qmap->m_assoc(skeys, 64, key, value, qmap->m_assoc_userdata);
-      for (size_t i = 0; i < nkeys; i++) {
-        _qmap_put(hd, skeys[i], key, QM_MISS);
-        free((void *)skeys[i]);
-      }
-    }
-    qmap_fin(cur);
+    *rec = tmp;
+    *cap = len;
   }
-}
 
-  uint32_t /* API */
-qmap_reg(size_t len)
-{
-  if (types_n > TYPES_MASK) {
-    fprintf(stderr, "qmap_reg: type limit reached\n");
-    return QM_MISS;
-  }
-  uint32_t id = types_n ++;
-  qmap_type_t *type = &qmap_types[id];
+  memcpy(*rec, hdr, sizeof(hdr));
+  if (qmap_read_all(fd, *rec + QMAP_WAL_HDR, len - QMAP_WAL_HDR)
+      || XXH32(*rec + sizeof(uint32_t), len - sizeof(uint32_t), QM_SEED)
+      != hdr[0] || hdr[1] != dbid)
+    return -1;
 
-  memset(type, 0, sizeof(qmap_type_t));
-  type->len = len;
-  type->hash = qmap_chash;
-  type->cmp = qmap_ccmp;
-  return id;
+  return 0;
 }
 
-  void
-qmap_cmp_set(uint32_t ref, qmap_cmp_t *cmp)
+  uint64_t /* API */
+qmap_delta_export(uint32_t hd, uint64_t since, int fd)
 {
-  qmap_type_t *type = &qmap_types[ref];
-  type->cmp = cmp;
-}
+  qmap_head_t *head = &qmap_heads[hd];
+  qmap_t *qmap = &qmaps[hd];
+  struct qmap_delta *d = qmap->delta;
+  qmap_dhdr_t dh;
+  size_t blen;
+  char *buf;
+  int err, full;
 
-  uint32_t /* API */
-qmap_mreg(qmap_measure_t *measure)
-{
-  if (types_n > TYPES_MASK) {
-    fprintf(stderr, "qmap_mreg: type limit reached\n");
-    return QM_MISS;
-  }
-  uint32_t id = types_n ++;
-  qmap_type_t *type = &qmap_types[id];
+  qmap_lazy(hd);
 
-  memset(type, 0, sizeof(qmap_type_t));
-  type->measure = measure;
-  type->hash = qmap_chash;
-  type->cmp = qmap_ccmp;
-  type->len = 0;
-  return id;
-}
+  if (!d) {
+    WARN("qmap %u: not a QM_DELTA map\n", hd);
+    return since;
+  }
 
-  size_t /* API */
-qmap_len(uint32_t type_id, const void *key)
-{
-  qmap_type_t *type = &qmap_types[type_id];
+  buf = malloc(QMAP_WAL_BUF);
+  CBUG(!buf, "malloc error (delta)\n");
 
-  return type->measure
-    ? type->measure(key)
-    : type->len;
-}
+  dh = (qmap_dhdr_t) { QMAP_DELTA_MAGIC, QMAP_DELTA_VERSION, head->dbid,
+    { head->types[QM_KEY], head->types[QM_VALUE] } };
+  memcpy(buf, &dh, sizeof(dh));
+  blen = sizeof(dh);
 
-/* }}} */
+  full = since < d->floor || since > head->mods;
+  err = full && qmap_wal_append(fd, buf, &blen, hd, QMAP_WAL_DROP,
+      NULL, NULL);
 
-/* RECORD-AWARE MAP SUPPORT {{{ */
+  for (uint32_t i = 0; !full && !err && i < d->len; i++) {
+    qmap_tomb_t *t = &d->tombs[(d->first + i) % d->cap];
 
-  uint32_t /* API */
-qmap_record_register(const char *name, size_t struct_size,
-    const qmap_record_field_t *fields, size_t field_count)
-{
-  if (qmap_records_n >= QMAP_MAX_RECORDS) {
-    fprintf(stderr, "qmap_record_register: record limit reached\n");
-    return QM_MISS;
-  }
-  if (struct_size == 0) {
-    fprintf(stderr, "qmap_record_register: struct_size must be > 0\n");
-    return QM_MISS;
-  }
-  if (!fields || field_count == 0 || field_count > QMAP_MAX_RECORD_FIELDS) {
-    fprintf(stderr, "qmap_record_register: invalid fields\n");
-    return QM_MISS;
+    if (t->seq > since)
+      err = qmap_wal_append(fd, buf, &blen, hd, QMAP_WAL_DEL,
+          t->key, NULL);
   }
 
-  uint32_t struct_type_id = qmap_reg(struct_size);
-  if (struct_type_id == QM_MISS) {
-    fprintf(stderr, "qmap_record_register: qmap_reg failed\n");
-    return QM_MISS;
-  }
+  for (uint32_t n = 0; !err && n < qmap->idm.last; n++) {
+    const void *val;
 
-  uint32_t id = ++qmap_records_n;
-  qmap_record_t *rec = &qmap_records[id];
+    if (!qmap->omap[n] || (!full && qmap->mseq[n] <= since))
+      continue;
 
-  memset(rec, 0, sizeof(*rec));
-  strncpy(rec->name, name ? name : "unnamed", sizeof(rec->name) - 1);
-  rec->struct_size = struct_size;
-  rec->struct_type_id = struct_type_id;
-  rec->field_count = field_count;
+    /* a QM_PTR value is the pointer itself */
+    val = qmap_val(hd, n);
+    if (head->types[QM_VALUE] == QM_PTR)
+      memcpy(&val, val, sizeof(val));
 
-  for (size_t i = 0; i < field_count; i++) {
-    strncpy(rec->fields[i].name, fields[i].name,
-            sizeof(rec->fields[i].name) - 1);
-    rec->fields[i].type = fields[i].type;
-    rec->fields[i].offset = fields[i].offset;
-    rec->fields[i].max_size = fields[i].max_size;
-    rec->fields[i].target_record = fields[i].target_record;
-    rec->fields[i].target_hd = fields[i].target_hd;
-    strncpy(rec->fields[i].inverse, fields[i].inverse ? fields[i].inverse : "",
-            sizeof(rec->fields[i].inverse) - 1);
+    err = qmap_wal_append(fd, buf, &blen, hd, QMAP_WAL_PUT,
+        qmap_key(hd, n), val);
   }
 
-  return id;
-}
+  err = err
+    || qmap_wal_append(fd, buf, &blen, hd, QMAP_WAL_END, NULL, NULL)
+    || qmap_write_all(fd, buf, blen);
+  free(buf);
 
-  uint32_t /* API */
-qmap_record_type_id(uint32_t record_id)
-{
-  if (!record_id || record_id > qmap_records_n)
-    return QM_MISS;
-  return qmap_records[record_id].struct_type_id;
-}
+  if (!err)
+    return head->mods;
 
-  void /* API */
-qmap_record_field_set_target_hd(uint32_t record_id,
-    const char *field_name,
-    uint32_t target_hd)
-{
-  if (!record_id || record_id > qmap_records_n) return;
-  int fi = qmap_record_find_field(record_id, field_name);
-  if (fi < 0) return;
-  qmap_records[record_id].fields[fi].target_hd = target_hd;
+  WARN("qmap %u: delta write failed\n", hd);
+  return since;
 }
 
-  uint32_t /* API */
-qmap_field_put(uint32_t hd, const char *item_id,
-    const char *field_name, const char *value)
+  int /* API */
+qmap_delta_apply(uint32_t hd, int fd)
 {
-  if (!value) return QM_MISS;
   qmap_head_t *head = &qmap_heads[hd];
-  if (head->record_id == 0) return QM_MISS;
-  int fi = qmap_record_find_field(head->record_id, field_name);
-  if (fi < 0) return QM_MISS;
-  uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+  char *rec = NULL;
+  size_t cap = 0;
+  qmap_dhdr_t dh;
+  int ret = -1;
 
-  char key[256];
-  snprintf(key, sizeof(key), "%s:%s", item_id, field_name);
+  qmap_lazy(hd);
 
-  if (ft == QM_REFERENCE) {
-    uint32_t thd = qmap_records[head->record_id].fields[fi].target_hd;
-    if (thd == 0)
-      return QM_MISS;
-    if (!value || ((const char *)value)[0] == '\0')
-      return QM_MISS;
-    uint32_t pos = qmap_pos(thd, value);
-    if (pos == UINT32_MAX)
-      return QM_MISS;
-    return qmap_put(hd, key, value);
+  if (qmap_read_all(fd, &dh, sizeof(dh))
+      || dh.magic != QMAP_DELTA_MAGIC || dh.version != QMAP_DELTA_VERSION
+      || dh.dbid != head->dbid || dh.types[0] != head->types[QM_KEY]
+      || dh.types[1] != head->types[QM_VALUE])
+  {
+    WARN("qmap %u: not a delta of this map\n", hd);
+    return -1;
+  }
+
+  /* a QM_SHARED writer publishes the delta as a single change */
+  if (qmap_rdonly(hd))
+    return -1;
+
+  while (ret && !qmap_delta_read(fd, &rec, &cap, head->dbid)) {
+    uint32_t hdr[5];
+    const char *a = rec + QMAP_WAL_HDR;
+    const void *b;
+
+    memcpy(hdr, rec, sizeof(hdr));
+    b = a + hdr[3];
+
+    switch (hdr[2]) {
+    case QMAP_WAL_PUT:
+      if (head->types[QM_VALUE] == QM_PTR)
+        memcpy(&b, b, sizeof(b));
+      qmap_put(hd, a, b);
+      continue;
+    case QMAP_WAL_DEL:
+      qmap_del(hd, a);
+      continue;
+    case QMAP_WAL_DROP:
+      qmap_drop(hd);
+      continue;
+    case QMAP_WAL_END:
+      ret = 0;
+      continue;
+    }
+
+    break;
   }
 
-	if (ft == QM_MULTI_REFERENCE) {
-	    uint32_t thd = qmap_records[head->record_id].fields[fi].target_hd;
-	    if (!thd) return qmap_put(hd, key, value);
+  free(rec);
+  qmap_done(hd);
 
-	    static char resolved[65536];
-	    size_t off = 0;
-	    const char *p = value;
-	    while (*p) {
-	      const char *nl = strchr(p, '\n');
-	      size_t len = nl ? (size_t)(nl - p) : strlen(p);
-	      if (len > 0) {
-	        char id[256];
-	        size_t cplen = len < sizeof(id) - 1 ? len : sizeof(id) - 1;
-	        memcpy(id, p, cplen);
-	        id[cplen] = '\0';
-	        uint32_t pos = qmap_pos(thd, id);
-	        if (off > 0 && off < sizeof(resolved) - 1)
-	          resolved[off++] = '\n';
-	        if (pos != UINT32_MAX) {
-	          off += (size_t)snprintf(resolved + off, sizeof(resolved) - off,
-	                                 "%u", pos);
-	        } else {
-	          size_t slen = strlen(id);
-	          if (slen > sizeof(resolved) - off - 1)
-	            slen = sizeof(resolved) - off - 1;
-	          memcpy(resolved + off, id, slen);
-	          off += slen;
-	        }
-	      }
-	      if (!nl) break;
-	      p = nl + 1;
-	    }
-	    resolved[off < sizeof(resolved) ? off : sizeof(resolved) - 1] = '\0';
-	    return qmap_put(hd, key, resolved);
-	  }
+  if (ret)
+    WARN("qmap %u: delta cut short or corrupt\n", hd);
 
-  return qmap_put(hd, key, value);
+  return ret;
 }
 
-  const char * /* API */
-qmap_field_get(uint32_t hd, const char *item_id,
-    const char *field_name)
+/* }}} */
+
+/* BACKGROUND SAVE {{{ */
+
+/* qmap_save_async forks: the child sees the maps as they were and
+ * saves them, while the parent goes on. Once it is reaped, the maps
+ * count as saved up to what they were at the fork, and logs drop the
+ * records from before it. */
+
+static pid_t qmap_async_pid;
+static int qmap_async_err;
+
+/* Drop the first len bytes of the log, which a snapshot now holds */
+  static void
+qmap_wal_trim(qmap_file_t *file, const char *filename, off_t len)
 {
-  if (!item_id || !field_name) return NULL;
-  qmap_head_t *head = &qmap_heads[hd];
-  if (head->record_id == 0) return NULL;
-  int fi = qmap_record_find_field(head->record_id, field_name);
-  if (fi < 0) return NULL;
-  uint32_t ft = qmap_records[head->record_id].fields[fi].type;
+  char path[strlen(filename) + sizeof(".wal")];
+  char tmp[strlen(filename) + sizeof(".wal.tmp")];
+  struct stat sb;
+  char *log;
+  int fd;
 
-  char key[256];
-  snprintf(key, sizeof(key), "%s:%s", item_id, field_name);
+  qmap_wal_flush(file, 0);
+  CBUG(fstat(file->wal_fd, &sb) == -1, "fstat");
 
-  if (ft == QM_REFERENCE) {
-    const char *stored = qmap_get(hd, key);
-    if (!stored || stored[0] == '\0')
-      return NULL;
-    return stored;
+  if (sb.st_size <= len) {
+    qmap_wal_reset(file);
+    return;
   }
 
-  return qmap_get(hd, key);
+  /* the rest goes to a new log, renamed over the old one */
+  snprintf(path, sizeof(path), "%s.wal", filename);
+  snprintf(tmp, sizeof(tmp), "%s.wal.tmp", filename);
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+      S_IRUSR | S_IWUSR);
+  CBUG(fd < 0, "wal open failed\n");
+
+  log = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE,
+      file->wal_fd, 0);
+  CBUG(log == MAP_FAILED, "wal mmap failed\n");
+  qmap_wal_write(fd, log + len, (size_t) (sb.st_size - len));
+  munmap(log, (size_t) sb.st_size);
+
+  CBUG(fsync(fd) == -1, "wal fsync failed\n");
+  CBUG(rename(tmp, path) == -1, "wal rename failed\n");
+  qmap_sync_dir(path);
+
+  close(file->wal_fd);
+  file->wal_fd = fd;
+  file->wal_unsynced = 0;
 }
 
-  const char * /* API */
-qmap_get_key(uint32_t hd, uint32_t pos)
+/* Account for the child that exited with status */
+  static void
+qmap_save_done(int status)
 {
-  qmap_t *qmap = &qmaps[hd];
-  if (pos >= qmap->idm.last)
-    return NULL;
-  const void *key = qmap->omap[pos];
-  return key ? (const char *)key : NULL;
+  uint32_t c = qmap_iter(qmap_files_hd, NULL, 0);
+  const void *key, *value;
+  int ok = WIFEXITED(status) && !WEXITSTATUS(status);
+
+  qmap_async_pid = 0;
+  qmap_async_err = !ok;
+
+  for (uint32_t hd = 0; hd < idm.last; hd++) {
+    qmap_head_t *head = &qmap_heads[hd];
+
+    if (!(head->iflags & QM_ASYNC))
+      continue;
+
+    head->iflags &= ~QM_ASYNC;
+    if (ok)
+      qmap_saved(hd, NULL, head->async_mods);
+  }
+
+  while (qmap_next(&key, &value, c)) {
+    qmap_file_t *file = (qmap_file_t *) value;
+
+    if (ok && file->wal_snap >= 0 && file->wal_fd >= 0)
+      qmap_wal_trim(file, key, file->wal_snap);
+    file->wal_snap = -1;
+  }
 }
 
-  uint32_t /* API */
-qmap_pos(uint32_t hd, const char *key)
+  int /* API */
+qmap_save_wait(void)
 {
-  qmap_t *qmap = &qmaps[hd];
-  for (uint32_t i = 0; i < qmap->idm.last; i++)
-    if (qmap->omap[i] && strcmp((const char *)qmap->omap[i], key) == 0)
-      return i;
-  return UINT32_MAX;
+  int status;
+
+  if (!qmap_async_pid)
+    return qmap_async_err ? -1 : 0;
+
+  while (waitpid(qmap_async_pid, &status, 0) == -1)
+    CBUG(errno != EINTR, "waitpid failed\n");
+
+  qmap_save_done(status);
+  return qmap_async_err ? -1 : 0;
 }
 
-  size_t /* API */
-qmap_inv_get(uint32_t hd, const char *field_name,
-    uint32_t target_pos,
-    uint32_t *out, size_t max)
+  int /* API */
+qmap_save_async(void)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  if (!head->inv_hds || head->record_id == 0 || !field_name)
-    return 0;
+  uint32_t c;
+  const void *key, *value;
+  uint32_t hd, dirty = 0;
+  pid_t pid;
 
-  int fi = qmap_record_find_field(head->record_id, field_name);
-  if (fi < 0)
-    return 0;
+  if (qmap_async_pid)
+    return -1;
 
-  qmap_record_t *rec = &qmap_records[head->record_id];
-  if (rec->fields[fi].target_record == 0)
-    return 0;
+  qmap_ckpt_finish();
+  c = qmap_iter(qmap_files_hd, NULL, 0);
+  while (qmap_next(&key, &value, c)) {
+    qmap_file_t *file = (qmap_file_t *) value;
+    idsi_t *cur;
 
-  uint32_t inv_hd = head->inv_hds[fi];
-  if (inv_hd == 0)
-    return 0;
+    if (file->rdonly || !qmap_file_dirty(file))
+      continue;
 
-  const char *val = qmap_get(inv_hd, &target_pos);
-  if (!val || !*val)
+    /* what the log holds at the fork is in the image */
+    if (file->wal_fd >= 0) {
+      qmap_wal_flush(file, 0);
+      file->wal_snap = lseek(file->wal_fd, 0, SEEK_END);
+      CBUG(file->wal_snap < 0, "wal lseek failed\n");
+    }
+
+    cur = ids_iter(&file->ids);
+    while (ids_next(&hd, &cur))
+      if (mdbs[hd]) {
+        qmap_heads[hd].iflags |= QM_ASYNC;
+        qmap_heads[hd].async_mods = qmap_heads[hd].mods;
+      }
+
+    dirty++;
+  }
+
+  if (!dirty)
     return 0;
 
-  size_t count = 0;
-  const char *p = val;
-  while (*p && count < max) {
-    char *end;
-    unsigned long v = strtoul(p, &end, 10);
-    if (end > p)
-      out[count++] = (uint32_t)v;
-    if (*end == '\n')
-      p = end + 1;
-    else
-      break;
+  pid = fork();
+
+  if (pid == 0) {
+    char **names;
+    uint32_t n;
+
+    qmap_async_child = 1;
+    names = qmap_file_names(&n, 1);
+
+    /* no destructor: the parent owns the maps */
+    _exit(qmap_save_files(names, n) ? 1 : 0);
   }
 
-  return count;
+  if (pid < 0) {
+    WARN("qmap: fork: %s, background save not started\n",
+        strerror(errno));
+    qmap_save_done(1 << 8);
+    return -1;
+  }
+
+  qmap_async_pid = pid;
+  qmap_async_err = 0;
+  return 0;
+}
+
+  int /* API */
+qmap_save_poll(void)
+{
+  int status;
+  pid_t r;
+
+  if (!qmap_async_pid)
+    return qmap_async_err ? -1 : 0;
+
+  do
+    r = waitpid(qmap_async_pid, &status, WNOHANG);
+  while (r == -1 && errno == EINTR);
+
+  CBUG(r == -1, "waitpid failed\n");
+  if (!r)
+    return 1;
+
+  qmap_save_done(status);
+  return qmap_async_err ? -1 : 0;
 }
 
 /* }}} */
 
-  inline static size_t
-_qmap_load(uint32_t hd, const char *mmaped, uint32_t dbid)
-{
-  const char *mm = mmaped;
-  const char *mm_start = mmaped;
+/* INCREMENTAL SAVE {{{ */
 
-  uint32_t lid = * (uint32_t *) mm;
-  mm += sizeof(uint32_t);
+/* qmap_save_step spreads a checkpoint over many calls. The first one
+ * captures every dirty file as it is: the part of each section before
+ * the records, and where each entry's payload is. Later calls stream
+ * records until their time is up. Maps being written hold on to the
+ * payloads they free (qmap_payload_free) and stop overwriting values
+ * in place, so the records still read as they were at the start. */
 
-  size_t size = * (size_t *) mm;
-  mm += sizeof(size_t);
+typedef struct {
+  uint32_t hd;
+  uint64_t mods;	// of hd at the start
+  qmap_layout_t l;
+  char *base;		// the section up to its records
+  const char **kptr;	// entry -> key, value
+  uint32_t i;		// next record, or QM_MISS before base
+} qmap_ckpt_sec_t;
 
-  if (dbid != QM_MISS && lid != dbid)
-    return mm + size + sizeof(uint32_t) - mm_start;
+typedef struct {
+  const char *filename;
+  qmap_file_t *file;
+  qmap_fhdr_t *fhdr;	// then the directory
+  size_t hsize;
+  int fd;
+  off_t wal_snap;	// log length at the start, or -1
+  uint32_t nsec, sec;
+  qmap_ckpt_sec_t *secs;
+} qmap_ckpt_file_t;
+
+static struct {
+  qmap_ckpt_file_t *files;
+  uint32_t nfiles, cur;
+  qmap_wbuf_t w;
+} qmap_ckpt;
+
+/* Let go of the payloads hd held for the checkpoint */
+  static void
+qmap_ckpt_release(qmap_ckpt_sec_t *sec)
+{
+  qmap_t *qmap = &qmaps[sec->hd];
 
-  uint32_t amount = * (uint32_t*) mm;
-  mm += sizeof(uint32_t);
+  free(sec->kptr);
+  free(sec->base);
+  sec->kptr = NULL;
+  sec->base = NULL;
 
-  qmap_head_t *head = &qmap_heads[hd];
-  uint32_t ktype = head->types[QM_KEY];
-  uint32_t vtype = head->types[QM_VALUE];
+  /* the other shards of a sharded map may still be written */
+  if (--qmap->hold)
+    return;
 
-  for (uint32_t i = 0; i < amount; i++) {
-    size_t klen = qmap_len(ktype, mm);
-    const char *mval = mm + klen;
-    size_t vlen = qmap_len(vtype, mval);
+  while (qmap->held) {
+    qmap_blk_t *next = qmap->held->next;
 
-    qmap_put(hd, mm, mval);
-    mm = mval + vlen;
+    qmap_payload_free(qmap, qmap->held + 1);
+    qmap->held = next;
   }
 
-  head->iflags |= QM_SDIRTY;
-  return mm - mm_start;
+  /* what qmap_clear_fast left for later */
+  if (!qmap_heads[sec->hd].n && qmap->arenas)
+    qmap_payload_flush(qmap);
 }
 
-  static inline void
-qmap_load_file(char *filename, uint32_t dbid)
+/* Capture the dirty files; returns how many there are */
+  static uint32_t
+qmap_ckpt_begin(void)
 {
-  qmap_file_t *file = (qmap_file_t *)
-    qmap_get(qmap_files_hd, filename);
+  uint32_t c = qmap_iter(qmap_files_hd, NULL, 0);
+  const void *key, *value;
+  qmap_ckpt_file_t *f;
 
-  struct stat sb;
-  char *mm;
-  idsi_t *cur;
-  uint32_t hd;
+  while (qmap_next(&key, &value, c)) {
+    qmap_file_t *file = (qmap_file_t *) value;
+    uint32_t hd;
+    idsi_t *cur;
+    int fd;
 
-  if (file->mmaped)
-    goto skip_open;
+    if (file->rdonly || !qmap_file_dirty(file))
+      continue;
 
-  file->fd = open(filename, O_RDONLY);
-  if (file->fd < 0)
-    return;
+    fd = qmap_tmp_open(key);
+    if (fd < 0)
+      continue;
 
-  CBUG(fstat(file->fd, &sb) == -1, "fstat");
+    qmap_lazy_file(file);
+    if (file->mmaped)
+      file_close(file);
+
+    qmap_ckpt.files = realloc(qmap_ckpt.files,
+        sizeof(*f) * (qmap_ckpt.nfiles + 1));
+    CBUG(!qmap_ckpt.files, "malloc error (checkpoint)\n");
+    f = &qmap_ckpt.files[qmap_ckpt.nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->filename = key;
+    f->file = file;
+    f->fd = fd;
+    f->wal_snap = -1;
+
+    cur = ids_iter(&file->ids);
+    while (ids_next(&hd, &cur))
+      f->nsec += mdbs[hd];
+
+    f->hsize = f->nsec ? sizeof(qmap_fhdr_t)
+      + sizeof(qmap_dirent_t) * f->nsec : 0;
+    f->fhdr = calloc(1, f->hsize ? f->hsize : 1);
+    f->secs = calloc(f->nsec ? f->nsec : 1, sizeof(*f->secs));
+    CBUG(!f->fhdr || !f->secs, "malloc error (checkpoint)\n");
+
+    f->fhdr->magic = QMAP_MAGIC;
+    f->fhdr->version = QMAP_VERSION;
+    f->fhdr->ndb = f->nsec;
+
+    qmap_dirent_t *dir = (qmap_dirent_t *) (f->fhdr + 1);
+    uint32_t i = 0;
+
+    cur = ids_iter(&file->ids);
+    while (ids_next(&hd, &cur)) {
+      qmap_ckpt_sec_t *sec = &f->secs[i];
+
+      if (!mdbs[hd])
+        continue;
 
-  file->size = sb.st_size;
-  if (file->size == 0) {
-    close(file->fd);
-    file->fd = -1;
-    return;
-  }
+      sec->hd = hd;
+      sec->mods = qmap_heads[hd].mods;
+      sec->base = qmap_sec_build(hd, file->shard, &dir[i], &sec->l,
+          &sec->kptr);
+      sec->i = QM_MISS;
+      qmaps[hd].hold++;
+      i++;
+    }
 
-  file->mmaped = (char*) mmap(NULL, file->size,
-      PROT_READ, MAP_SHARED, file->fd, 0);
-  if (file->mmaped == MAP_FAILED) {
-    file->mmaped = 0;
-    close(file->fd);
-    file->fd = -1;
-    return;
+    /* what the log holds now is in the image */
+    if (file->wal_fd >= 0) {
+      qmap_wal_flush(file, 0);
+      f->wal_snap = lseek(file->wal_fd, 0, SEEK_END);
+      CBUG(f->wal_snap < 0, "wal lseek failed\n");
+    }
   }
 
-skip_open:
-  cur = (idsi_t *) ids_iter(&file->ids);
+  if (!qmap_ckpt.nfiles)
+    return 0;
 
-  mm = file->mmaped;
-  while (ids_next(&hd, &cur))
-    mm += _qmap_load(hd, mm, dbid);
+  qmap_ckpt.w.buf = malloc(QMAP_WBUF);
+  qmap_ckpt.w.crc = XXH32_createState();
+  CBUG(!qmap_ckpt.w.buf || !qmap_ckpt.w.crc,
+      "malloc error (checkpoint)\n");
+  qmap_ckpt.cur = 0;
+  qmap_ckpt.w.fd = -1;
+  return qmap_ckpt.nfiles;
 }
 
-  static size_t
-_qmap_calc_size(uint32_t hd)
+/* Done with the checkpoint, successful or not */
+  static void
+qmap_ckpt_end(void)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  uint32_t ktype = head->types[QM_KEY];
-  uint32_t vtype = head->types[QM_VALUE];
-  size_t total_size = sizeof(uint32_t) + sizeof(size_t) + sizeof(head->n);
-  uint32_t cur = qmap_iter(hd, NULL, 0);
-  const void *key, *value;
+  for (uint32_t i = qmap_ckpt.cur; i < qmap_ckpt.nfiles; i++) {
+    qmap_ckpt_file_t *f = &qmap_ckpt.files[i];
+
+    for (uint32_t j = 0; j < f->nsec; j++)
+      if (f->secs[j].base)
+        qmap_ckpt_release(&f->secs[j]);
+
+    if (f->fd >= 0)
+      qmap_tmp_commit(f->fd, qmap_ckpt.w.err ? qmap_ckpt.w.err : ECANCELED,
+          f->filename);
+  }
 
-  while (qmap_next(&key, &value, cur)) {
-    total_size += qmap_len(ktype, key);
-    total_size += qmap_len(vtype, value);
+  for (uint32_t i = 0; i < qmap_ckpt.nfiles; i++) {
+    free(qmap_ckpt.files[i].secs);
+    free(qmap_ckpt.files[i].fhdr);
   }
 
-  qmap_fin(cur);
-  return total_size;
+  free(qmap_ckpt.files);
+  free(qmap_ckpt.w.buf);
+  XXH32_freeState(qmap_ckpt.w.crc);
+  memset(&qmap_ckpt, 0, sizeof(qmap_ckpt));
 }
 
-  static inline size_t
-qmap_calc_file_size(const ids_t *hds)
+/* Write out what is left of file f's image and put it in place */
+  static int
+qmap_ckpt_commit(qmap_ckpt_file_t *f)
 {
-  size_t size = 0;
-  idsi_t *cur = (idsi_t *) ids_iter((ids_t *) hds);
-  uint32_t hd;
+  qmap_wbuf_t *w = &qmap_ckpt.w;
+  int fd = f->fd;
 
-  while (ids_next(&hd, &cur))
-    if (mdbs[hd])
-      size += _qmap_calc_size(hd);
+  qmap_wbuf_flush(w, NULL, 0);
+  if (!w->err && f->nsec)
+    w->err = qmap_pwrite(fd, f->fhdr, f->hsize, 0);
+
+  f->fd = -1;
+  if (qmap_tmp_commit(fd, w->err, f->filename))
+    return -1;
+
+  f->file->size = f->hsize + w->off;
+
+  for (uint32_t j = 0; j < f->nsec; j++)
+    qmap_saved(f->secs[j].hd, f->file, f->secs[j].mods);
 
-  return size;
+  if (f->file->wal_fd >= 0 && f->wal_snap >= 0) {
+    qmap_sync_dir(f->filename);
+    qmap_wal_trim(f->file, f->filename, f->wal_snap);
+  }
+
+  return 0;
 }
 
-  inline static size_t
-_qmap_save(void *mmaped, uint32_t hd)
+  static inline uint64_t
+qmap_now_us(void)
 {
-  qmap_head_t *head = &qmap_heads[hd];
-  uint32_t ktype = head->types[QM_KEY];
-  uint32_t vtype = head->types[QM_VALUE];
-  char *mm_start = mmaped;
-  char *mm = mmaped;
-  uint32_t cur = qmap_iter(hd, NULL, 0);
-  const void *key, *value;
+  struct timespec ts;
 
-  memcpy(mm, &head->dbid, sizeof(head->dbid));
-  mm += sizeof(head->dbid);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
 
-  size_t size = _qmap_calc_size(hd);
-  memcpy(mm, &size, sizeof(size));
-  mm += sizeof(size);
+/* Records streamed between looks at the clock */
+#define QMAP_CKPT_BATCH 256
 
-  memcpy(mm, &head->n, sizeof(head->n));
-  mm += sizeof(head->n);
+  int /* API */
+qmap_save_step(uint32_t budget_us)
+{
+  qmap_wbuf_t *w = &qmap_ckpt.w;
+  uint64_t deadline;
 
-  while (qmap_next(&key, &value, cur)) {
-    size_t klen = qmap_len(ktype, key);
-    size_t vlen = qmap_len(vtype, value);
+  if (!qmap_ckpt.files) {
+    /* both would write <filename>.tmp */
+    if (qmap_async_pid && qmap_save_poll() == 1)
+      return 1;
 
-    memcpy(mm, key, klen);
-    mm += klen;
-    memcpy(mm, value, vlen);
-    mm += vlen;
+    if (!qmap_ckpt_begin())
+      return 0;
   }
 
-  qmap_fin(cur);
-  return mm - mm_start;
-}
-
-  static inline void
-qmap_save_file(char *filename)
-{
-  qmap_file_t *file = (qmap_file_t *) qmap_get(qmap_files_hd, filename);
-  CBUG(!file, "called with unknown filename");
+  deadline = qmap_now_us() + budget_us;
 
-  if (file->mmaped)
-    file_close(file);
+  while (qmap_ckpt.cur < qmap_ckpt.nfiles) {
+    qmap_ckpt_file_t *f = &qmap_ckpt.files[qmap_ckpt.cur];
+    qmap_dirent_t *dir = (qmap_dirent_t *) (f->fhdr + 1);
 
-  file->size = qmap_calc_file_size(&file->ids);
+    if (w->fd != f->fd) {
+      w->fd = f->fd;
+      w->off = 0;
+      w->at = f->hsize;
+    }
 
-  file->fd = open(filename, O_RDWR | O_CREAT,
-      S_IRUSR | S_IWUSR);
+    for (; !w->err && f->sec < f->nsec; f->sec++) {
+      qmap_ckpt_sec_t *sec = &f->secs[f->sec];
+      qmap_dirent_t *de = &dir[f->sec];
 
-  CBUG(file->fd == -1, "open for save failed");
+      if (sec->i == QM_MISS) {
+        XXH32_reset(w->crc, QM_SEED);
+        qmap_wbuf_put(w, sec->base, sec->l.rec);
+        sec->i = 0;
+      }
 
-  CBUG(ftruncate(file->fd, (off_t) file->size) == -1,
-      "ftruncate failed");
+      while (!w->err && sec->i < de->n) {
+        uint32_t end = sec->i + QMAP_CKPT_BATCH;
 
-  if (file->size == 0) {
-    close(file->fd);
-    file->fd = -1;
-    return;
-  }
+        if (end > de->n)
+          end = de->n;
 
-  file->mmaped = (char*) mmap(NULL, file->size,
-      PROT_WRITE, MAP_SHARED, file->fd, 0);
-  CBUG(file->mmaped == MAP_FAILED, "mmap for save failed");
+        qmap_sec_records(w, sec->base, &sec->l, sec->kptr, sec->i, end);
+        sec->i = end;
 
-  char *mm = file->mmaped;
-  uint32_t hd;
+        if (budget_us && sec->i < de->n && qmap_now_us() >= deadline)
+          return 1;
+      }
 
-  idsi_t *idsi = ids_iter(&file->ids);
+      de->crc = XXH32_digest(w->crc);
+      de->off = f->hsize + w->off - de->size;
+      qmap_ckpt_release(sec);
+    }
 
-  while (ids_next(&hd, &idsi)) {
-    if (!mdbs[hd])
-      continue;
+    if (w->err || qmap_ckpt_commit(f)) {
+      qmap_ckpt_end();
+      return -1;
+    }
 
-    size_t size_written = _qmap_save(mm, hd);
-    mm += size_written;
+    qmap_ckpt.cur++;
+    if (budget_us && qmap_ckpt.cur < qmap_ckpt.nfiles
+        && qmap_now_us() >= deadline)
+      return 1;
   }
 
-  file_close(file);
+  qmap_ckpt_end();
+  return 0;
 }
 
-  void /* API */
-qmap_save(void)
+/* Complete a checkpoint qmap_save_step has in progress */
+  static void
+qmap_ckpt_finish(void)
 {
-  uint32_t c = qmap_iter(qmap_files_hd, NULL, 0);
-  const void *key, *value;
-
-  while (qmap_next(&key, &value, c))
-    qmap_save_file((char *) key);
+  if (qmap_ckpt.files)
+    qmap_save_step(0);
 }
 
+/* }}} */
+
 /* MULTI-VALUE API {{{ */
 
   uint32_t /* API */
@@ -2586,6 +8716,8 @@ qmap_count(uint32_t hd, const void *key)
 {
   qmap_head_t *head = &qmap_heads[hd];
 
+  qmap_lazy(hd);
+
   if (key == NULL) {
     /* Count total entries in map */
     return head->n;
@@ -10,6 +10,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #define TEST_MASK 0xF  // Small capacity for testing limits
 
@@ -807,6 +812,2177 @@ static void test_file_reopen_append(void) {
 	remove(filename);
 }
 
+/* Test 17: Range delete on sorted maps */
+static void test_del_range(void) {
+	printf("\n=== Test 17: Range Delete ===\n");
+
+	uint32_t hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF, QM_SORTED);
+	for (uint32_t i = 0; i < 100; i++)
+		qmap_put(hd, &i, &(uint32_t){i * 2});
+
+	printf("Delete [10, 19]:");
+	uint32_t deleted = qmap_del_range(hd, &(uint32_t){10}, &(uint32_t){19});
+	ASSERT(deleted == 10 && qmap_count(hd, NULL) == 90, "10 entries deleted");
+
+	printf("Keys outside the range survive:");
+	const uint32_t *v9 = qmap_get(hd, &(uint32_t){9});
+	const uint32_t *v20 = qmap_get(hd, &(uint32_t){20});
+	ASSERT(v9 && *v9 == 18 && v20 && *v20 == 40
+	       && !qmap_get(hd, &(uint32_t){15}), "Lookups after range delete");
+
+	printf("Sorted iteration skips the range:");
+	uint32_t cur = qmap_iter(hd, NULL, QM_RANGE);
+	const void *key, *value;
+	uint32_t prev = 0, count = 0;
+	int ok = 1;
+	while (qmap_next(&key, &value, cur)) {
+		uint32_t k = *(const uint32_t *)key;
+		if ((count && k <= prev) || (k >= 10 && k <= 19)) ok = 0;
+		prev = k;
+		count++;
+	}
+	ASSERT(ok && count == 90, "Sorted order intact");
+
+	printf("Open-ended ranges:");
+	qmap_del_range(hd, NULL, &(uint32_t){4});
+	qmap_del_range(hd, &(uint32_t){95}, NULL);
+	ASSERT(qmap_count(hd, NULL) == 80 && !qmap_get(hd, &(uint32_t){0})
+	       && !qmap_get(hd, &(uint32_t){99}) && qmap_get(hd, &(uint32_t){94}),
+	       "Both ends trimmed");
+	qmap_close(hd);
+
+	printf("Multivalue duplicates removed together:");
+	hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF, QM_SORTED | QM_MULTIVALUE);
+	for (uint32_t i = 0; i < 30; i++)
+		qmap_put(hd, &(uint32_t){i / 3}, &i);
+	qmap_del_range(hd, &(uint32_t){2}, &(uint32_t){4});
+	ASSERT(qmap_count(hd, NULL) == 21 && qmap_count(hd, &(uint32_t){3}) == 0
+	       && qmap_count(hd, &(uint32_t){5}) == 3, "Runs of duplicates deleted");
+	qmap_close(hd);
+
+	printf("Multivalue with a secondary:");
+	hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF, QM_SORTED | QM_MULTIVALUE);
+	uint32_t by_val = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF, 0);
+	qmap_assoc(by_val, hd, assoc_cb, NULL);
+	for (uint32_t i = 0; i < 30; i++)
+		qmap_put(hd, &(uint32_t){i / 3}, &i);
+	qmap_del_range(hd, &(uint32_t){2}, &(uint32_t){4});
+	cur = qmap_iter(hd, NULL, QM_RANGE);
+	count = 0;
+	ok = 1;
+	while (qmap_next(&key, &value, cur)) {
+		uint32_t k = *(const uint32_t *)key;
+		if ((count && k < prev) || (k >= 2 && k <= 4)) ok = 0;
+		prev = k;
+		count++;
+	}
+	ASSERT(ok && count == 21 && qmap_count(hd, &(uint32_t){1}) == 3
+	       && qmap_count(hd, &(uint32_t){5}) == 3
+	       && !qmap_get(by_val, &(uint32_t){9})
+	       && qmap_get(by_val, &(uint32_t){15}), "Index spliced once");
+	qmap_close(hd);
+	qmap_close(by_val);
+
+	printf("Cascade to secondary and mirror:");
+	uint32_t prim = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF,
+	                          QM_SORTED | QM_MIRROR);
+	uint32_t sec = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xFF, 0);
+	qmap_assoc(sec, prim, assoc_cb, NULL);
+	for (uint32_t t = 0; t < 50; t++)
+		qmap_put(prim, &t, &(uint32_t){1000 + t});
+	qmap_del_range(prim, NULL, &(uint32_t){24});
+	ASSERT(qmap_count(prim, NULL) == 25 && qmap_count(sec, NULL) == 25
+	       && !qmap_get(sec, &(uint32_t){1010})
+	       && !qmap_get(prim + 1, &(uint32_t){1010})
+	       && qmap_get(sec, &(uint32_t){1030})
+	       && qmap_get(prim + 1, &(uint32_t){1030}),
+	       "Secondary and mirror follow the primary");
+	qmap_close(prim);
+	qmap_close(sec);
+}
+
+/* Test 18: Bulk build mode */
+static void test_bulk(void) {
+	printf("\n=== Test 18: Bulk Build Mode ===\n");
+
+	uint32_t hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, QM_MIRROR);
+	qmap_bulk_begin(hd, 5000);
+	for (uint32_t i = 0; i < 5000; i++)
+		qmap_put(hd, &i, &(uint32_t){i + 1});
+	qmap_put(hd, &(uint32_t){7}, &(uint32_t){70000});
+	qmap_bulk_end(hd);
+
+	printf("Entries visible after bulk end:");
+	const uint32_t *v1 = qmap_get(hd, &(uint32_t){1});
+	const uint32_t *v4999 = qmap_get(hd, &(uint32_t){4999});
+	ASSERT(v1 && *v1 == 2 && v4999 && *v4999 == 5000
+	       && qmap_count(hd, NULL) == 5000, "All entries retrievable");
+
+	printf("Later put of the same key wins:");
+	const uint32_t *v7 = qmap_get(hd, &(uint32_t){7});
+	ASSERT(v7 && *v7 == 70000, "Duplicate key replaced");
+
+	printf("Mirror populated once at bulk end:");
+	const uint32_t *m = qmap_get(hd + 1, &(uint32_t){70000});
+	ASSERT(m && *m == 7 && qmap_count(hd + 1, NULL) == 5000
+	       && !qmap_get(hd + 1, &(uint32_t){8}), "Mirror in sync");
+
+	printf("Puts after bulk end propagate again:");
+	qmap_put(hd, &(uint32_t){9000}, &(uint32_t){9001});
+	m = qmap_get(hd + 1, &(uint32_t){9001});
+	ASSERT(m && *m == 9000, "Mirror follows regular puts");
+	qmap_close(hd);
+
+	printf("Multivalue bulk keeps duplicates:");
+	hd = qmap_open(NULL, NULL, QM_STR, QM_U32, 0xF, QM_SORTED | QM_MULTIVALUE);
+	qmap_bulk_begin(hd, 300);
+	for (uint32_t i = 0; i < 300; i++) {
+		char key[16];
+		snprintf(key, sizeof(key), "k%u", i % 100);
+		qmap_put(hd, key, &i);
+	}
+	qmap_bulk_end(hd);
+	const uint32_t *first = qmap_get(hd, "k5");
+	ASSERT(qmap_count(hd, "k5") == 3 && qmap_count(hd, NULL) == 300
+	       && first && *first == 5, "Duplicates kept, first wins lookup");
+	qmap_close(hd);
+}
+
+/* Test 19: Parallel bulk put and build */
+static void test_bulk_parallel(void) {
+	printf("\n=== Test 19: Parallel Bulk Put ===\n");
+
+	enum { N = 20000 };
+	static char kbuf[N][16];
+	static uint32_t vbuf[N];
+	const void *keys[N], *vals[N];
+
+	qmap_config(QM_CFG_THREADS, 4);
+	qmap_config(QM_CFG_PAR_MIN, 64);
+
+	/* keys repeat every N / 2 entries: the second half wins */
+	for (uint32_t i = 0; i < N; i++) {
+		snprintf(kbuf[i], sizeof(kbuf[i]), "key%u", i % (N / 2));
+		vbuf[i] = i;
+		keys[i] = kbuf[i];
+		vals[i] = &vbuf[i];
+	}
+
+	uint32_t hd = qmap_open(NULL, NULL, QM_STR, QM_U32, 0xF, QM_MIRROR);
+	printf("All pairs stored:");
+	ASSERT(qmap_bulk_put(hd, keys, vals, N) == N
+	       && qmap_count(hd, NULL) == N / 2, "Count after duplicates");
+
+	printf("Later duplicate wins across threads:");
+	uint32_t ok = 1;
+	for (uint32_t i = 0; i < N / 2 && ok; i++) {
+		const uint32_t *v = qmap_get(hd, kbuf[i]);
+		ok = v && *v == i + N / 2;
+	}
+	ASSERT(ok, "Every key maps to its last value");
+
+	printf("Mirror rebuilt from parallel load:");
+	const char *mk = qmap_get(hd + 1, &(uint32_t){N - 1});
+	ASSERT(mk && !strcmp(mk, kbuf[N - 1])
+	       && !qmap_get(hd + 1, &(uint32_t){0}), "Mirror in sync");
+
+	printf("Arena payloads recycled after drop:");
+	qmap_drop(hd);
+	qmap_bulk_put(hd, keys, vals, N / 2);
+	qmap_put(hd, "extra", &(uint32_t){1});
+	qmap_del(hd, "key3");
+	const uint32_t *v = qmap_get(hd, "key9");
+	ASSERT(v && *v == 9 && qmap_count(hd, NULL) == N / 2
+	       && !qmap_get(hd, "key3"), "Map usable after drop");
+	qmap_close(hd);
+
+	printf("Multivalue parallel bulk keeps duplicates:");
+	hd = qmap_open(NULL, NULL, QM_STR, QM_U32, 0xF, QM_SORTED | QM_MULTIVALUE);
+	qmap_bulk_put(hd, keys, vals, N);
+	const uint32_t *first = qmap_get(hd, "key5");
+	ASSERT(qmap_count(hd, "key5") == 2 && qmap_count(hd, NULL) == N
+	       && first && *first == 5, "Duplicates kept, first wins lookup");
+	qmap_close(hd);
+
+	qmap_config(QM_CFG_THREADS, 0);
+	qmap_config(QM_CFG_PAR_MIN, 1 << 16);
+}
+
+/* Test 20: Parallel sorted index build */
+static void test_sort_parallel(void) {
+	printf("\n=== Test 20: Parallel Sorted Index ===\n");
+
+	qmap_config(QM_CFG_SORT_MIN, 64);
+
+	for (uint32_t threads = 3; threads <= 4; threads++) {
+		qmap_config(QM_CFG_THREADS, threads);
+
+		uint32_t hd = qmap_open(NULL, NULL, QM_STR, QM_U32, 0xF,
+				QM_SORTED | QM_MULTIVALUE);
+		for (uint32_t i = 0; i < 5000; i++) {
+			char key[16];
+			snprintf(key, sizeof(key), "k%05u", (i * 7919) % 1000);
+			qmap_put(hd, key, &i);
+		}
+
+		printf("Ordered iteration (%u threads):", threads);
+		uint32_t cur = qmap_iter(hd, NULL, QM_RANGE), cnt = 0, ok = 1;
+		const void *k, *v;
+		char prev[16] = "";
+		while (qmap_next(&k, &v, cur)) {
+			ok = ok && strcmp(prev, k) <= 0;
+			snprintf(prev, sizeof(prev), "%s", (const char *) k);
+			cnt++;
+		}
+		ASSERT(ok && cnt == 5000, "Keys come out sorted");
+
+		printf("Duplicates found after parallel sort:");
+		ASSERT(qmap_count(hd, "k00042") == 5 && qmap_count(hd, "k01000") == 0,
+		       "Counts match");
+		qmap_close(hd);
+	}
+
+	printf("Sorted secondary indexed on bulk end:");
+	uint32_t prim = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, 0);
+	uint32_t sec = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, QM_SORTED);
+	qmap_assoc(sec, prim, assoc_cb, NULL);
+	qmap_bulk_begin(prim, 2000);
+	for (uint32_t i = 0; i < 2000; i++)
+		qmap_put(prim, &i, &(uint32_t){(i * 7919) % 2000});
+	qmap_bulk_end(prim);
+	uint32_t cur = qmap_iter(sec, &(uint32_t){1990}, QM_RANGE), cnt = 0;
+	const void *k, *v;
+	while (qmap_next(&k, &v, cur))
+		cnt++;
+	ASSERT(cnt == 10, "Range scan over the secondary");
+	qmap_close(prim);
+	qmap_close(sec);
+
+	qmap_config(QM_CFG_THREADS, 0);
+	qmap_config(QM_CFG_SORT_MIN, 1 << 16);
+}
+
+/* Drain one split cursor, summing its values */
+static void *split_sum(void *arg) {
+	uint32_t *cur = arg;
+	const void *k, *v;
+	uint64_t *sum = calloc(1, sizeof(*sum));
+	while (qmap_next(&k, &v, *cur))
+		*sum += *(const uint32_t *) v;
+	return sum;
+}
+
+/* Test 21: Split iteration */
+static void test_iter_split(void) {
+	printf("\n=== Test 21: Split Iteration ===\n");
+
+	uint32_t hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, QM_SORTED);
+	for (uint32_t i = 0; i < 10000; i++) {
+		uint32_t key = (i * 7919) % 10000;
+		qmap_put(hd, &key, &i);
+	}
+	for (uint32_t i = 0; i < 10000; i += 3)
+		qmap_del(hd, &i);
+
+	uint64_t expect = 0;
+	uint32_t one = qmap_iter(hd, NULL, 0);
+	const void *ek, *ev;
+	while (qmap_next(&ek, &ev, one))
+		expect += *(const uint32_t *) ev;
+
+	printf("Concurrent drain visits every entry once:");
+	uint32_t curs[4];
+	pthread_t th[4];
+	uint64_t total = 0;
+	qmap_iter_split(hd, 4, curs, 0);
+	for (int i = 0; i < 4; i++)
+		pthread_create(&th[i], NULL, split_sum, &curs[i]);
+	for (int i = 0; i < 4; i++) {
+		void *r;
+		pthread_join(th[i], &r);
+		total += *(uint64_t *) r;
+		free(r);
+	}
+	ASSERT(total == expect, "Sum over all cursors matches");
+
+	printf("Sorted split yields consecutive ordered slices:");
+	uint32_t prev = 0, cnt = 0, ok = 1;
+	qmap_iter_split(hd, 3, curs, QM_RANGE);
+	for (int i = 0; i < 3; i++) {
+		const void *k, *v;
+		while (qmap_next(&k, &v, curs[i])) {
+			ok = ok && (!cnt || *(const uint32_t *) k > prev);
+			prev = *(const uint32_t *) k;
+			cnt++;
+		}
+	}
+	ASSERT(ok && cnt == qmap_count(hd, NULL), "Slices in key order");
+
+	printf("More cursors than entries:");
+	uint32_t small = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, 0);
+	qmap_put(small, &(uint32_t){1}, &(uint32_t){1});
+	uint32_t many[8];
+	cnt = 0;
+	qmap_iter_split(small, 8, many, 0);
+	for (int i = 0; i < 8; i++) {
+		const void *k, *v;
+		while (qmap_next(&k, &v, many[i]))
+			cnt++;
+	}
+	ASSERT(cnt == 1, "Empty slices end right away");
+	qmap_close(small);
+	qmap_close(hd);
+}
+
+/* Test 22: Batched iteration */
+static void test_next_batch(void) {
+	printf("\n=== Test 22: Batched Iteration ===\n");
+
+	uint32_t hd = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF,
+			QM_SORTED | QM_MULTIVALUE);
+	for (uint32_t i = 0; i < 1000; i++)
+		qmap_put(hd, &(uint32_t){(i * 7) % 500}, &i);
+	for (uint32_t i = 0; i < 500; i += 4)
+		qmap_del_all(hd, &i);
+
+	const void *keys[64], *vals[64];
+	uint32_t total = qmap_count(hd, NULL), got, cnt, ok;
+
+	printf("Full scan in batches matches qmap_next:");
+	uint32_t a = qmap_iter(hd, NULL, 0), b = qmap_iter(hd, NULL, 0);
+	cnt = 0;
+	ok = 1;
+	while ((got = qmap_next_batch(b, keys, vals, 64))) {
+		for (uint32_t i = 0; i < got; i++) {
+			const void *k, *v;
+			ok = ok && qmap_next(&k, &v, a) && k == keys[i] && v == vals[i];
+		}
+		cnt += got;
+	}
+	ASSERT(ok && cnt == total, "Same pairs, same order");
+
+	printf("Sorted range scan in batches:");
+	uint32_t sorted = qmap_open(NULL, NULL, QM_U32, QM_U32, 0xF, QM_SORTED);
+	for (uint32_t i = 0; i < 500; i++)
+		if ((i * 7) % 500 % 4)
+			qmap_put(sorted, &(uint32_t){(i * 7) % 500}, &i);
+	uint32_t cur = qmap_iter(sorted, &(uint32_t){250}, QM_RANGE), prev = 0;
+	cnt = 0;
+	ok = 1;
+	while ((got = qmap_next_batch(cur, keys, vals, 7)))
+		for (uint32_t i = 0; i < got; i++) {
+			uint32_t k = *(const uint32_t *) keys[i];
+			ok = ok && k >= 250 && k > prev && k % 4;
+			prev = k;
+			cnt++;
+		}
+	ASSERT(ok && cnt == 188, "Ordered keys from 250 on");
+	qmap_close(sorted);
+
+	printf("Multivalue key through the batch API:");
+	cur = qmap_iter(hd, &(uint32_t){7}, 0);
+	got = qmap_next_batch(cur, keys, vals, 64);
+	ASSERT(got == 2 && !qmap_next_batch(cur, keys, vals, 64),
+	       "Both duplicates, then done");
+
+	printf("Split cursors drain in batches:");
+	uint32_t curs[3];
+	cnt = 0;
+	qmap_iter_split(hd, 3, curs, 0);
+	for (int i = 0; i < 3; i++)
+		while ((got = qmap_next_batch(curs[i], keys, vals, 10)))
+			cnt += got;
+	ASSERT(cnt == total, "All entries once");
+	qmap_close(hd);
+
+	printf("QM_PGET and mirror values are primary keys:");
+	uint32_t prim = qmap_open(NULL, NULL, QM_U32, QM_STR, 0xFF, QM_MIRROR);
+	uint32_t pget = qmap_open(NULL, NULL, QM_STR, QM_U32, 0xFF,
+			QM_PGET | QM_SORTED);
+	char name[16];
+	qmap_assoc(pget, prim, assoc_cb, NULL);
+	for (uint32_t i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "n%03u", i);
+		qmap_put(prim, &i, name);
+	}
+	uint32_t scans[3] = {
+		qmap_iter(pget, NULL, 0),
+		qmap_iter(pget, "n050", QM_RANGE),
+		qmap_iter(prim + 1, NULL, 0),
+	};
+	cnt = 0;
+	ok = 1;
+	for (int s = 0; s < 3; s++)
+		while ((got = qmap_next_batch(scans[s], keys, vals, 16)))
+			for (uint32_t i = 0; i < got; i++) {
+				const char *v = qmap_get(prim, vals[i]);
+				ok = ok && v && !strcmp(v, keys[i]);
+				cnt++;
+			}
+	ASSERT(ok && cnt == 250, "Keys of the primary");
+	qmap_close(prim);
+}
+
+/* Test 23: Write-ahead log */
+static void test_wal(void) {
+	printf("\n=== Test 23: Write-Ahead Log ===\n");
+
+	const char *fn = "test_wal.qmap", *wal = "test_wal.qmap.wal";
+	struct stat st;
+	int status;
+	uint32_t hd;
+
+	remove(fn);
+	remove(wal);
+
+	printf("Logged changes survive a crash:");
+	pid_t pid = fork();
+	if (!pid) {
+		hd = qmap_open(fn, "w", QM_STR, QM_U32, 0xF, QM_WAL);
+		for (uint32_t i = 0; i < 100; i++) {
+			char key[16];
+			snprintf(key, sizeof(key), "k%u", i);
+			qmap_put(hd, key, &i);
+		}
+		qmap_del(hd, "k5");
+		qmap_put(hd, "k7", &(uint32_t){700});
+		qmap_wal_sync();
+		_exit(0); /* no destructor, so no snapshot */
+	}
+	waitpid(pid, &status, 0);
+
+	hd = qmap_open(fn, "w", QM_STR, QM_U32, 0xF, QM_WAL);
+	const uint32_t *v7 = qmap_get(hd, "k7");
+	ASSERT(stat(fn, &st) != 0 && qmap_count(hd, NULL) == 99
+	       && !qmap_get(hd, "k5") && v7 && *v7 == 700,
+	       "State rebuilt from the log alone");
+
+	printf("Checkpoint empties the log:");
+	qmap_put(hd, "k8", &(uint32_t){800});
+	qmap_save();
+	ASSERT(stat(wal, &st) == 0 && st.st_size == 0
+	       && stat(fn, &st) == 0 && st.st_size > 0, "Snapshot written, log empty");
+
+	printf("Torn record at the end is dropped:");
+	qmap_put(hd, "k9", &(uint32_t){900});
+	qmap_close(hd);
+	qmap_wal_sync();
+	stat(wal, &st);
+	off_t good = st.st_size;
+	FILE *fp = fopen(wal, "ab");
+	fwrite("\x01\x02\x03\x04\x05\x06\x07", 1, 7, fp);
+	fclose(fp);
+
+	pid = fork();
+	if (!pid) {
+		hd = qmap_open(fn, "w", QM_STR, QM_U32, 0xF, QM_WAL);
+		const uint32_t *v8 = qmap_get(hd, "k8"), *v9 = qmap_get(hd, "k9");
+		_exit(v8 && *v8 == 800 && v9 && *v9 == 900
+		      && qmap_count(hd, NULL) == 99 ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0
+	       && stat(wal, &st) == 0 && st.st_size == good,
+	       "Intact records replayed, log truncated");
+	remove(fn);
+	remove(wal);
+
+	printf("Open ended range deletes replayed:");
+	pid = fork();
+	if (!pid) {
+		hd = qmap_open(fn, "r", QM_U32, QM_U32, 0xF, QM_SORTED | QM_WAL);
+		for (uint32_t i = 0; i < 10; i++)
+			qmap_put(hd, &i, &i);
+		qmap_save();
+		qmap_del_range(hd, NULL, &(uint32_t){3});
+		qmap_del_range(hd, &(uint32_t){8}, NULL);
+		qmap_wal_sync();
+		_exit(qmap_count(hd, NULL) == 4 ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	hd = qmap_open(fn, "r", QM_U32, QM_U32, 0xF, QM_SORTED | QM_WAL);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0
+	       && qmap_count(hd, NULL) == 4 && !qmap_get(hd, &(uint32_t){3})
+	       && qmap_get(hd, &(uint32_t){4}) && !qmap_get(hd, &(uint32_t){8}),
+	       "Same entries as before the crash");
+	qmap_close(hd);
+
+	remove(fn);
+	remove(wal);
+}
+
+/* Test 24: Zero-copy read-only open */
+static void test_rdonly_mmap(void) {
+	printf("\n=== Test 24: Read-Only Mapped Open ===\n");
+
+	const char *fn = "test_rdonly.qmap";
+	uint32_t hd, nd, i;
+
+	remove(fn);
+	hd = qmap_open(fn, "s", QM_STR, QM_STR, 0xF, QM_SORTED);
+	nd = qmap_open(fn, "n", QM_U32, QM_U32, 0xF, 0);
+	for (i = 0; i < 200; i++) {
+		char key[16], val[32];
+		uint32_t sq = i * i;
+		snprintf(key, sizeof(key), "k%03u", 199 - i);
+		snprintf(val, sizeof(val), "value-%u", 199 - i);
+		qmap_put(hd, key, val);
+		qmap_put(nd, &i, &sq);
+	}
+	qmap_del(hd, "k100");
+	qmap_save();
+	qmap_close(hd);
+	qmap_close(nd);
+
+	printf("Lookups come from the shared mapping:");
+	hd = qmap_open(fn, "s", QM_STR, QM_STR, 0, QM_SORTED | QM_RDONLY_MMAP);
+	uint32_t hd2 = qmap_open(fn, "s", QM_STR, QM_STR, 0, QM_RDONLY_MMAP);
+	nd = qmap_open(fn, "n", QM_U32, QM_U32, 0, QM_RDONLY_MMAP);
+	const char *v = qmap_get(hd, "k042");
+	const uint32_t *sq = qmap_get(nd, &(uint32_t){12});
+	ASSERT(v && strcmp(v, "value-42") == 0 && v == qmap_get(hd2, "k042")
+	       && !qmap_get(hd, "k100") && !qmap_get(hd, "nope")
+	       && sq && *sq == 144 && qmap_count(hd, NULL) == 199,
+	       "Same pointer from two handles, misses still miss");
+
+	printf("Sorted iteration over a mapped map:");
+	uint32_t cur = qmap_iter(hd, "k150", QM_RANGE), count = 0;
+	const void *key, *val;
+	char prev[16] = "k149";
+	int ordered = 1;
+	while (qmap_next(&key, &val, cur)) {
+		ordered &= strcmp(prev, key) < 0;
+		snprintf(prev, sizeof(prev), "%s", (const char *) key);
+		count++;
+	}
+	ASSERT(ordered && count == 50, "Keys k150..k199 in order");
+
+	printf("Changes are refused:");
+	ASSERT(qmap_put(hd, "k100", "x") == QM_MISS && !qmap_get(hd, "k100")
+	       && qmap_del_range(nd, &(uint32_t){0}, &(uint32_t){9}) == 0
+	       && qmap_get(nd, &(uint32_t){3}),
+	       "Put and delete leave the map alone");
+
+	qmap_close(hd2);
+	qmap_close(nd);
+	qmap_close(hd);
+	remove(fn);
+}
+
+/* Test 25: Indexed file format */
+static void test_file_format(void) {
+	printf("\n=== Test 25: Indexed File Format ===\n");
+
+	const char *fn = "test_fmt.qmap", *old = "test_fmt_v1.qmap";
+	const char *crc = "test_fmt_crc.qmap";
+	const char *names[] = { "a", "b", "c" };
+	uint32_t hds[3], i, dbid_b;
+	struct stat st;
+	FILE *fp;
+
+	remove(fn);
+	remove(old);
+	remove(crc);
+	for (i = 0; i < 3; i++) {
+		hds[i] = qmap_open(fn, names[i], QM_U32, QM_U32, 0xF, 0);
+		for (uint32_t k = 0; k < 50; k++) {
+			uint32_t v = k + 1000 * i;
+			qmap_put(hds[i], &k, &v);
+		}
+	}
+	qmap_save();
+	for (i = 0; i < 3; i++)
+		qmap_close(hds[i]);
+
+	printf("One database out of several:");
+	uint32_t hd = qmap_open(fn, "b", QM_U32, QM_U32, 0xF, 0);
+	const uint32_t *v = qmap_get(hd, &(uint32_t){7});
+	ASSERT(v && *v == 1007 && qmap_count(hd, NULL) == 50,
+	       "Found through the directory");
+	qmap_close(hd);
+
+	printf("Type mismatch is refused:");
+	hd = qmap_open(fn, "c", QM_STR, QM_U32, 0xF, 0);
+	ASSERT(qmap_count(hd, NULL) == 0, "Section not loaded");
+	qmap_close(hd);
+
+	/* directory entry 1 (after the 16 byte header) starts with b's id */
+	fp = fopen(fn, "rb");
+	fseek(fp, 16 + 48, SEEK_SET);
+	if (fread(&dbid_b, sizeof(dbid_b), 1, fp) != 1)
+		dbid_b = 0;
+	fclose(fp);
+
+	printf("Old format, second database:");
+	fp = fopen(old, "wb");
+	for (i = 0; i < 2; i++) {
+		uint32_t id = i ? dbid_b : 0x1234, n = 2;
+		uint64_t size = 16 + 2 * 8;
+		uint32_t kv[4] = { 1, 10 + i, 2, 20 + i };
+		fwrite(&id, 4, 1, fp);
+		fwrite(&size, 8, 1, fp);
+		fwrite(&n, 4, 1, fp);
+		fwrite(kv, 4, 4, fp);
+	}
+	fclose(fp);
+	hd = qmap_open(old, "b", QM_U32, QM_U32, 0xF, 0);
+	v = qmap_get(hd, &(uint32_t){2});
+	ASSERT(v && *v == 21 && qmap_count(hd, NULL) == 2,
+	       "Run found after skipping the first");
+	qmap_close(hd);
+
+	printf("Checksum mismatch is detected:");
+	hd = qmap_open(crc, "c", QM_U32, QM_U32, 0xF, 0);
+	qmap_put(hd, &(uint32_t){1}, &(uint32_t){2});
+	qmap_save();
+	qmap_close(hd);
+	stat(crc, &st);
+	off_t crc_size = st.st_size;
+	fp = fopen(crc, "r+b");
+	fseek(fp, -4, SEEK_END);
+	fputc('X', fp);
+	fclose(fp);
+	pid_t pid = fork();
+	if (!pid) {
+		hd = qmap_open(crc, "c", QM_U32, QM_U32, 0xF, 0);
+		uint32_t n = qmap_count(hd, NULL);
+		qmap_save();
+		_exit(n == 0 ? 0 : 1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	stat(crc, &st);
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0
+	       && st.st_size == crc_size,
+	       "Corrupt section not loaded, nor saved over");
+
+	remove(fn);
+	remove(old);
+	remove(crc);
+}
+
+/* Test 26: Sorted maps saved in key order */
+static void test_sorted_persist(void) {
+	printf("\n=== Test 26: Sorted Save Order ===\n");
+
+	const char *fn = "test_sorted_save.qmap";
+	const void *key, *val;
+	uint32_t hd, mv, i, cur, count;
+	int ordered;
+
+	remove(fn);
+	hd = qmap_open(fn, "s", QM_STR, QM_U32, 0xF, QM_SORTED);
+	mv = qmap_open(fn, "m", QM_U32, QM_U32, 0xF,
+	               QM_SORTED | QM_MULTIVALUE);
+	for (i = 0; i < 1000; i++) {
+		char key[16];
+		uint32_t k = i % 10;
+		snprintf(key, sizeof(key), "key%04u", 999 - i);
+		qmap_put(hd, key, &i);
+		qmap_put(mv, &k, &i);
+	}
+	qmap_save();
+	qmap_close(hd);
+	qmap_close(mv);
+
+	hd = qmap_open(fn, "s", QM_STR, QM_U32, 0xF, QM_SORTED);
+	mv = qmap_open(fn, "m", QM_U32, QM_U32, 0xF,
+	               QM_SORTED | QM_MULTIVALUE);
+
+	printf("Loaded positions follow key order:");
+	char prev[16] = "";
+	cur = qmap_iter(hd, NULL, 0);
+	ordered = 1;
+	count = 0;
+	while (qmap_next(&key, &val, cur)) {
+		ordered &= strcmp(prev, key) < 0;
+		snprintf(prev, sizeof(prev), "%s", (const char *) key);
+		count++;
+	}
+	ASSERT(ordered && count == 1000, "Unordered scan is already sorted");
+
+	printf("Ordered scan after load:");
+	cur = qmap_iter(hd, "key0500", QM_RANGE);
+	ordered = qmap_next(&key, &val, cur)
+		&& strcmp(key, "key0500") == 0 && *(const uint32_t *) val == 499;
+	count = 1;
+	while (qmap_next(&key, &val, cur))
+		count++;
+	ASSERT(ordered && count == 500, "Range starts at the right key");
+
+	printf("Duplicates keep their order:");
+	uint32_t last = 0;
+	cur = qmap_iter(mv, &(uint32_t){3}, 0);
+	ordered = 1;
+	count = 0;
+	while (qmap_next(&key, &val, cur)) {
+		ordered &= !count || *(const uint32_t *) val > last;
+		last = *(const uint32_t *) val;
+		count++;
+	}
+	ASSERT(ordered && count == 100 && qmap_count(mv, &(uint32_t){3}) == 100,
+	       "100 values of key 3, in insertion order");
+
+	qmap_close(hd);
+	qmap_close(mv);
+	remove(fn);
+}
+
+/* Append a marker that survives only as long as fn is not rewritten */
+static void mark_file(const char *fn) {
+	FILE *fp = fopen(fn, "ab");
+	fputc('!', fp);
+	fclose(fp);
+}
+
+static int file_marked(const char *fn) {
+	FILE *fp = fopen(fn, "rb");
+	int c = EOF;
+	if (fp && fseek(fp, -1, SEEK_END) == 0)
+		c = fgetc(fp);
+	if (fp)
+		fclose(fp);
+	return c == '!';
+}
+
+/* Test 27: Clean files are not rewritten */
+static void test_dirty_tracking(void) {
+	printf("\n=== Test 27: Dirty Tracking ===\n");
+
+	const char *fn = "test_dirty.qmap";
+	uint32_t hd;
+
+	remove(fn);
+	hd = qmap_open(fn, "d", QM_U32, QM_U32, 0xF, 0);
+	qmap_put(hd, &(uint32_t){1}, &(uint32_t){10});
+	qmap_save();
+	mark_file(fn);
+
+	printf("Reads leave the file alone:");
+	qmap_get(hd, &(uint32_t){1});
+	qmap_save();
+	ASSERT(file_marked(fn), "Clean map not saved");
+
+	printf("A put makes it dirty:");
+	qmap_put(hd, &(uint32_t){2}, &(uint32_t){20});
+	qmap_save();
+	ASSERT(!file_marked(fn), "Saved after a put");
+
+	printf("A reopened file starts clean:");
+	qmap_close(hd);
+	hd = qmap_open(fn, "d", QM_U32, QM_U32, 0xF, 0);
+	mark_file(fn);
+	qmap_save();
+	ASSERT(file_marked(fn) && qmap_count(hd, NULL) == 2,
+	       "Loading is not a change");
+
+	printf("A delete makes it dirty:");
+	qmap_del(hd, &(uint32_t){1});
+	qmap_save();
+	ASSERT(!file_marked(fn), "Saved after a delete");
+	qmap_close(hd);
+
+	printf("Range and duplicate deletes persist:");
+	remove(fn);
+	hd = qmap_open(fn, "r", QM_STR, QM_U32, 0xF, QM_SORTED);
+	qmap_put(hd, "a", &(uint32_t){1});
+	qmap_put(hd, "b", &(uint32_t){2});
+	qmap_put(hd, "c", &(uint32_t){3});
+	{
+		uint32_t mv = qmap_open(fn, "m", QM_STR, QM_U32, 0xF,
+		                        QM_MULTIVALUE | QM_SORTED);
+		int ok;
+
+		qmap_put(mv, "a", &(uint32_t){1});
+		qmap_put(mv, "a", &(uint32_t){2});
+		qmap_put(mv, "b", &(uint32_t){3});
+		qmap_save();
+		ok = qmap_del_range(hd, "a", "b") == 2;
+		qmap_del_all(mv, "a");
+		qmap_save();
+		qmap_close(mv);
+		qmap_close(hd);
+		hd = qmap_open(fn, "r", QM_STR, QM_U32, 0xF, QM_SORTED);
+		mv = qmap_open(fn, "m", QM_STR, QM_U32, 0xF,
+		               QM_MULTIVALUE | QM_SORTED);
+		ASSERT(ok && qmap_count(hd, NULL) == 1 && qmap_get(hd, "c")
+		       && qmap_count(mv, NULL) == 1 && !qmap_get(mv, "a"),
+		       "Saved after del_range and del_all");
+		qmap_close(mv);
+	}
+
+	qmap_close(hd);
+	remove(fn);
+}
+
+/* Test 28: Saves replace the file whole */
+static void test_atomic_save(void) {
+	printf("\n=== Test 28: Atomic Save ===\n");
+
+	const char *fn = "test_atomic.qmap";
+	struct stat before, after, old;
+	uint32_t hd;
+	int fd;
+
+	remove(fn);
+	hd = qmap_open(fn, "d", QM_U32, QM_STR, 0xFF, 0);
+	for (uint32_t i = 0; i < 100; i++)
+		qmap_put(hd, &i, "first");
+	qmap_save();
+	chmod(fn, 0640);
+	stat(fn, &before);
+	fd = open(fn, O_RDONLY);
+
+	for (uint32_t i = 0; i < 100; i++)
+		qmap_put(hd, &i, "second, longer");
+	qmap_save();
+	stat(fn, &after);
+	fstat(fd, &old);
+
+	printf("Readers keep the old file:");
+	ASSERT(after.st_ino != before.st_ino && old.st_size == before.st_size,
+	       "Old file untouched by the save");
+
+	printf("File mode kept, no temporary left:");
+	ASSERT((after.st_mode & 0777) == 0640
+	       && access("test_atomic.qmap.tmp", F_OK) != 0,
+	       "Renamed into place");
+	close(fd);
+
+	printf("New contents load:");
+	qmap_close(hd);
+	hd = qmap_open(fn, "d", QM_U32, QM_STR, 0xFF, 0);
+	ASSERT(qmap_count(hd, NULL) == 100
+	       && !strcmp(qmap_get(hd, &(uint32_t){42}), "second, longer"),
+	       "All entries saved");
+
+	qmap_close(hd);
+	remove(fn);
+}
+
+/* Test 29: Background saves */
+static void test_save_async(void) {
+	printf("\n=== Test 29: Background Save ===\n");
+
+	const char *fn = "test_async.qmap";
+	const char *wfn = "test_async_wal.qmap";
+	struct stat st;
+	off_t s0, s1;
+	uint32_t hd, whd;
+	int r;
+
+	remove(fn);
+	hd = qmap_open(fn, "d", QM_U32, QM_U32, 0xFFF, 0);
+	for (uint32_t i = 0; i < 1000; i++)
+		qmap_put(hd, &i, &i);
+
+	printf("Starts and completes:");
+	r = qmap_save_async();
+	qmap_put(hd, &(uint32_t){5000}, &(uint32_t){5000});
+	while (qmap_save_poll() == 1)
+		usleep(1000);
+	ASSERT(r == 0 && qmap_save_poll() == 0 && qmap_save_wait() == 0,
+	       "Background save succeeded");
+
+	printf("Changes after the fork stay dirty:");
+	mark_file(fn);
+	qmap_save();
+	ASSERT(!file_marked(fn), "Saved again");
+
+	printf("Nothing to do when clean:");
+	mark_file(fn);
+	ASSERT(qmap_save_async() == 0 && qmap_save_wait() == 0
+	       && file_marked(fn), "No child for clean files");
+
+	qmap_close(hd);
+	remove(fn);
+
+	printf("Log keeps only what came after the fork:");
+	remove(wfn);
+	unlink("test_async_wal.qmap.wal");
+	whd = qmap_open(wfn, "d", QM_U32, QM_U32, 0xFF, QM_WAL);
+	for (uint32_t i = 0; i < 10; i++)
+		qmap_put(whd, &i, &i);
+	qmap_wal_sync();
+	stat("test_async_wal.qmap.wal", &st);
+	s0 = st.st_size;
+	qmap_save_async();
+	qmap_put(whd, &(uint32_t){10}, &(uint32_t){10});
+	qmap_wal_sync();
+	stat("test_async_wal.qmap.wal", &st);
+	s1 = st.st_size;
+	qmap_save_wait();
+	stat("test_async_wal.qmap.wal", &st);
+	ASSERT(s0 > 0 && st.st_size == s1 - s0, "Log trimmed to the tail");
+
+	printf("Image plus log reload:");
+	qmap_close(whd);
+	whd = qmap_open(wfn, "d", QM_U32, QM_U32, 0xFF, QM_WAL);
+	ASSERT(qmap_count(whd, NULL) == 11
+	       && *(uint32_t *) qmap_get(whd, &(uint32_t){10}) == 10,
+	       "Nothing lost or doubled");
+
+	qmap_close(whd);
+	remove(wfn);
+	unlink("test_async_wal.qmap.wal");
+}
+
+/* Test 30: Incremental checkpoints */
+static void test_save_step(void) {
+	printf("\n=== Test 30: Incremental Save ===\n");
+
+	const char *fn = "test_step.qmap";
+	uint32_t hd, steps = 1;
+	char buf[16];
+	int r;
+
+	remove(fn);
+	hd = qmap_open(fn, "d", QM_U32, QM_STR, 0x7FFF, 0);
+	for (uint32_t i = 0; i < 20000; i++) {
+		snprintf(buf, sizeof(buf), "v%u", i);
+		qmap_put(hd, &i, buf);
+	}
+
+	printf("Spreads over several steps:");
+	r = qmap_save_step(1);
+	qmap_put(hd, &(uint32_t){19999}, "changed");
+	qmap_del(hd, &(uint32_t){19998});
+	qmap_put(hd, &(uint32_t){30000}, "new");
+	while (r == 1) {
+		r = qmap_save_step(1);
+		steps++;
+	}
+	ASSERT(r == 0 && steps > 1, "Checkpoint completed in steps");
+
+	printf("Live map has the changes:");
+	ASSERT(!strcmp(qmap_get(hd, &(uint32_t){19999}), "changed")
+	       && !qmap_get(hd, &(uint32_t){19998})
+	       && !strcmp(qmap_get(hd, &(uint32_t){30000}), "new"),
+	       "Changes during the checkpoint intact");
+
+	printf("Image is the map as it was at the start:");
+	qmap_close(hd);
+	hd = qmap_open(fn, "d", QM_U32, QM_STR, 0x7FFF, 0);
+	ASSERT(qmap_count(hd, NULL) == 20000
+	       && !strcmp(qmap_get(hd, &(uint32_t){19999}), "v19999")
+	       && !strcmp(qmap_get(hd, &(uint32_t){19998}), "v19998")
+	       && !qmap_get(hd, &(uint32_t){30000}),
+	       "Consistent image");
+
+	printf("Closing a map finishes its checkpoint:");
+	qmap_put(hd, &(uint32_t){30000}, "new");
+	r = qmap_save_step(1);
+	qmap_close(hd);
+	hd = qmap_open(fn, "d", QM_U32, QM_STR, 0x7FFF, 0);
+	ASSERT(r == 1 && qmap_count(hd, NULL) == 20001
+	       && qmap_save_step(1) == 0, "Nothing left to do");
+	qmap_close(hd);
+
+	printf("Secondaries saved with their values:");
+	{
+		uint32_t prim = qmap_open(NULL, NULL, QM_U32, QM_STR, 0xFF, 0);
+		uint32_t sec = qmap_open(fn, "sec", QM_STR, QM_STR, 0xFF, 0);
+		uint32_t pget = qmap_open(fn, "pget", QM_STR, QM_U32, 0xFF,
+		                          QM_PGET);
+		const uint32_t *k;
+		const char *v;
+
+		qmap_assoc(sec, prim, assoc_cb, NULL);
+		qmap_assoc(pget, prim, assoc_cb, NULL);
+		qmap_put(prim, &(uint32_t){7}, "seven");
+		qmap_put(prim, &(uint32_t){12}, "twelve");
+		qmap_save();
+		qmap_close(prim);
+
+		sec = qmap_open(fn, "sec", QM_STR, QM_STR, 0xFF, 0);
+		pget = qmap_open(fn, "pget", QM_STR, QM_U32, 0xFF, 0);
+		v = qmap_get(sec, "twelve");
+		k = qmap_get(pget, "seven");
+		ASSERT(v && !strcmp(v, "twelve") && k && *k == 7
+		       && qmap_count(sec, NULL) == 2, "Read back");
+		qmap_close(sec);
+		qmap_close(pget);
+	}
+
+	remove(fn);
+}
+
+/* Test 31: Lazy loading */
+static void lazy_fill(const char *fn) {
+	const char *dbs[] = { "a", "b", "c" };
+	uint32_t hds[3];
+
+	/* saves write the databases open at the time */
+	for (int d = 0; d < 3; d++) {
+		hds[d] = qmap_open(fn, dbs[d], QM_U32, QM_U32, 0xFF, 0);
+		for (uint32_t i = 0; i < 10; i++)
+			qmap_put(hds[d], &i, &(uint32_t){i + 100 * d});
+	}
+
+	qmap_save();
+	for (int d = 0; d < 3; d++)
+		qmap_close(hds[d]);
+}
+
+static void test_lazy_load(void) {
+	printf("\n=== Test 31: Lazy Loading ===\n");
+
+	const char *fn = "test_lazy.qmap";
+	uint32_t a, b, c;
+
+	remove(fn);
+	lazy_fill(fn);
+
+	printf("Read on first use, not at open:");
+	a = qmap_open(fn, "a", QM_U32, QM_U32, 0xFF, QM_LAZY);
+	b = qmap_open(fn, "b", QM_U32, QM_U32, 0xFF, QM_LAZY);
+	rename(fn, "test_lazy.qmap.bak");
+	ASSERT(qmap_count(a, NULL) == 0, "File gone before first use");
+
+	printf("Same file, another map:");
+	rename("test_lazy.qmap.bak", fn);
+	ASSERT(qmap_count(b, NULL) == 10
+	       && *(uint32_t *) qmap_get(b, &(uint32_t){3}) == 103,
+	       "Loaded when first used");
+	qmap_close(a);
+	qmap_close(b);
+
+	printf("Rewriting keeps unread maps:");
+	a = qmap_open(fn, "a", QM_U32, QM_U32, 0xFF, QM_LAZY);
+	b = qmap_open(fn, "b", QM_U32, QM_U32, 0xFF, QM_LAZY);
+	c = qmap_open(fn, "c", QM_U32, QM_U32, 0xFF, QM_LAZY);
+	qmap_put(a, &(uint32_t){50}, &(uint32_t){50});
+	qmap_save();
+	qmap_close(a);
+	qmap_close(b);
+	qmap_close(c);
+	a = qmap_open(fn, "a", QM_U32, QM_U32, 0xFF, 0);
+	b = qmap_open(fn, "b", QM_U32, QM_U32, 0xFF, 0);
+	c = qmap_open(fn, "c", QM_U32, QM_U32, 0xFF, 0);
+	ASSERT(qmap_count(a, NULL) == 11 && qmap_count(b, NULL) == 10
+	       && *(uint32_t *) qmap_get(c, &(uint32_t){9}) == 209,
+	       "All databases saved");
+
+	qmap_close(a);
+	qmap_close(b);
+	qmap_close(c);
+	remove(fn);
+}
+
+/* Test 32: Opening many databases at once */
+static void test_open_all(void) {
+	printf("\n=== Test 32: Open All ===\n");
+
+	const char *fn = "test_open_all.qmap";
+	const char *dbs[] = { "d0", "d1", "d2", "d3", "d4", "d5" };
+	qmap_spec_t specs[6];
+	uint32_t opened;
+	int ok = 1;
+
+	remove(fn);
+	for (int d = 0; d < 6; d++) {
+		specs[d] = (qmap_spec_t) { dbs[d], QM_U32, QM_U32, 0xFFF,
+			d == 5 ? QM_LAZY : QM_SORTED, 0 };
+		specs[d].hd = qmap_open(fn, dbs[d], QM_U32, QM_U32, 0xFFF,
+		                        specs[d].flags & ~QM_LAZY);
+		for (uint32_t i = 0; i < 5000; i++)
+			qmap_put(specs[d].hd, &i, &(uint32_t){i * 10 + d});
+	}
+	qmap_save();
+	for (int d = 0; d < 6; d++)
+		qmap_close(specs[d].hd);
+
+	printf("All databases load:");
+	opened = qmap_open_all(fn, specs, 6);
+	for (int d = 0; d < 6; d++) {
+		const uint32_t *v = qmap_get(specs[d].hd, &(uint32_t){4321});
+
+		ok &= qmap_count(specs[d].hd, NULL) == 5000
+			&& v && *v == 43210u + (uint32_t) d;
+	}
+	ASSERT(opened == 6 && ok, "Each into its own handle");
+
+	printf("Sorted ones come in order:");
+	uint32_t cur = qmap_iter(specs[2].hd, NULL, QM_RANGE);
+	const void *k, *v;
+	uint32_t prev = 0, n = 0;
+	ok = 1;
+	while (qmap_next(&k, &v, cur)) {
+		ok &= !n || *(const uint32_t *) k > prev;
+		prev = *(const uint32_t *) k;
+		n++;
+	}
+	ASSERT(ok && n == 5000, "Key order");
+
+	for (int d = 0; d < 6; d++)
+		qmap_close(specs[d].hd);
+	remove(fn);
+}
+
+/* Test 33: Parallel saves write what serial ones do */
+static void par_save_fill(const char *fn, uint32_t *hds) {
+	const char *dbs[] = { "big", "s0", "s1", "s2" };
+	char val[300];
+
+	memset(val, 'v', sizeof(val) - 1);
+	val[sizeof(val) - 1] = '\0';
+	for (int d = 0; d < 4; d++)
+		hds[d] = qmap_open(fn, dbs[d], QM_U32, QM_STR, 0xFFF,
+		                   d == 1 ? QM_SORTED : 0);
+	for (uint32_t i = 0; i < 40000; i++) {
+		val[i % 299] = 'a' + i % 26;
+		qmap_put(hds[0], &i, val);
+		val[i % 299] = 'v';
+	}
+	for (int d = 1; d < 4; d++)
+		for (uint32_t i = 0; i < 3000; i++)
+			qmap_put(hds[d], &(uint32_t){i * 7 + d}, "x");
+}
+
+static void test_par_save(void) {
+	printf("\n=== Test 33: Parallel Save ===\n");
+
+	const char *fa = "test_par_a.qmap", *fb = "test_par_b.qmap";
+	uint32_t a[4], b[4];
+	int same = 1;
+
+	remove(fa);
+	remove(fb);
+	qmap_config(QM_CFG_PAR_MIN, 64);
+
+	par_save_fill(fa, a);
+	qmap_config(QM_CFG_THREADS, 1);
+	qmap_save();
+
+	par_save_fill(fb, b);
+	qmap_config(QM_CFG_THREADS, 4);
+	qmap_save();
+
+	printf("Same bytes as a serial save:");
+	FILE *pa = fopen(fa, "rb"), *pb = fopen(fb, "rb");
+	int ca, cb;
+	long len = 0;
+	do {
+		ca = pa ? fgetc(pa) : EOF;
+		cb = pb ? fgetc(pb) : EOF;
+		same &= ca == cb;
+		len++;
+	} while (same && ca != EOF);
+	if (pa)
+		fclose(pa);
+	if (pb)
+		fclose(pb);
+	ASSERT(pa && pb && same && len > (8 << 20), "Files match");
+
+	for (int d = 0; d < 4; d++) {
+		qmap_close(a[d]);
+		qmap_close(b[d]);
+	}
+
+	printf("Parallel save reads back:");
+	const char *v;
+	uint32_t hd = qmap_open(fb, "big", QM_U32, QM_STR, 0xFFF, 0);
+	uint32_t s2 = qmap_open(fb, "s2", QM_U32, QM_STR, 0xFFF, 0);
+	v = qmap_get(hd, &(uint32_t){39999});
+	ASSERT(qmap_count(hd, NULL) == 40000 && v && strlen(v) == 299
+	       && v[39999 % 299] == 'a' + 39999 % 26
+	       && qmap_count(s2, NULL) == 3000
+	       && qmap_get(s2, &(uint32_t){7 * 2999 + 3}), "Values intact");
+	qmap_close(hd);
+	qmap_close(s2);
+
+	qmap_config(QM_CFG_THREADS, 0);
+	qmap_config(QM_CFG_PAR_MIN, 1 << 16);
+	remove(fa);
+	remove(fb);
+}
+
+/* Test 34: io_uring reads and writes what the default path does */
+static void test_io_uring(void) {
+	printf("\n=== Test 34: io_uring I/O ===\n");
+
+	const char *fa = "test_ring_a.qmap", *fb = "test_ring_b.qmap";
+	uint32_t a[4], b[4];
+	int same = 1;
+
+	remove(fa);
+	remove(fb);
+
+	par_save_fill(fa, a);
+	qmap_save();
+
+	qmap_config(QM_CFG_IO_URING, 1);
+	par_save_fill(fb, b);
+	qmap_save();
+
+	printf("Same bytes as a plain save:");
+	FILE *pa = fopen(fa, "rb"), *pb = fopen(fb, "rb");
+	int ca, cb;
+	do {
+		ca = pa ? fgetc(pa) : EOF;
+		cb = pb ? fgetc(pb) : EOF;
+		same &= ca == cb;
+	} while (same && ca != EOF);
+	if (pa)
+		fclose(pa);
+	if (pb)
+		fclose(pb);
+	ASSERT(pa && pb && same, "Files match");
+
+	for (int d = 0; d < 4; d++) {
+		qmap_close(a[d]);
+		qmap_close(b[d]);
+	}
+
+	printf("Sections read back:");
+	qmap_spec_t specs[2] = {
+		{ "big", QM_U32, QM_STR, 0xFFF, 0, 0 },
+		{ "s0", QM_U32, QM_STR, 0xFFF, QM_SORTED, 0 },
+	};
+	const char *v;
+	uint32_t s2 = qmap_open(fb, "s2", QM_U32, QM_STR, 0xFFF, 0);
+	qmap_open_all(fb, specs, 2);
+	v = qmap_get(specs[0].hd, &(uint32_t){12345});
+	ASSERT(qmap_count(specs[0].hd, NULL) == 40000 && v
+	       && strlen(v) == 299 && v[12345 % 299] == 'a' + 12345 % 26
+	       && qmap_count(specs[1].hd, NULL) == 3000
+	       && qmap_get(s2, &(uint32_t){7 * 10 + 3}), "Values intact");
+
+	printf("Damage is caught:");
+	uint32_t hd;
+	FILE *fp = fopen(fb, "r+b");
+	if (fp) {
+		/* the big section takes most of the file */
+		fseek(fp, 0, SEEK_END);
+		fseek(fp, ftell(fp) / 2, SEEK_SET);
+		fputc('#', fp);
+		fclose(fp);
+	}
+	qmap_close(specs[0].hd);
+	qmap_close(specs[1].hd);
+	qmap_close(s2);
+	hd = qmap_open(fb, "big", QM_U32, QM_STR, 0xFFF, 0);
+	ASSERT(qmap_count(hd, NULL) == 0, "Checksum mismatch refused");
+	qmap_close(hd);
+
+	qmap_config(QM_CFG_IO_URING, 0);
+	remove(fa);
+	remove(fb);
+}
+
+/* Test 35: Compressed sections */
+static long file_size(const char *fn) {
+	FILE *fp = fopen(fn, "rb");
+	long len = -1;
+	if (fp && fseek(fp, 0, SEEK_END) == 0)
+		len = ftell(fp);
+	if (fp)
+		fclose(fp);
+	return len;
+}
+
+static void test_compress(void) {
+	printf("\n=== Test 35: Section Compression ===\n");
+
+	const char *fn = "test_compress.qmap";
+	const uint32_t codecs[] = { QM_CODEC_LZ4, QM_CODEC_ZSTD };
+	const int built[] = {
+#ifdef QMAP_LZ4
+		1,
+#else
+		0,
+#endif
+#ifdef QMAP_ZSTD
+		1,
+#else
+		0,
+#endif
+	};
+	uint32_t hds[4];
+	long plain;
+
+	remove(fn);
+	par_save_fill(fn, hds);
+	qmap_save();
+	plain = file_size(fn);
+	for (int d = 0; d < 4; d++)
+		qmap_close(hds[d]);
+
+	for (int c = 0; c < 2; c++) {
+		const char *v;
+		uint32_t hd, s0;
+		long size;
+
+		printf("Codec %u:", codecs[c]);
+		remove(fn);
+		qmap_config(QM_CFG_COMPRESS, codecs[c]);
+		par_save_fill(fn, hds);
+		qmap_save();
+		size = file_size(fn);
+		for (int d = 0; d < 4; d++)
+			qmap_close(hds[d]);
+		qmap_config(QM_CFG_COMPRESS, QM_CODEC_NONE);
+		ASSERT(built[c] ? size > 0 && size * 5 < plain : size == plain,
+		       "Smaller when built in");
+
+		printf("Codec %u reads back:", codecs[c]);
+		hd = qmap_open(fn, "big", QM_U32, QM_STR, 0xFFF, 0);
+		s0 = qmap_open(fn, "s0", QM_U32, QM_STR, 0xFFF,
+		               QM_SORTED | QM_RDONLY_MMAP);
+		v = qmap_get(hd, &(uint32_t){31337});
+		ASSERT(qmap_count(hd, NULL) == 40000 && v && strlen(v) == 299
+		       && v[31337 % 299] == 'a' + 31337 % 26
+		       && qmap_count(s0, NULL) == 3000
+		       && qmap_get(s0, &(uint32_t){7 * 2999 + 1}),
+		       "Values intact");
+		qmap_close(hd);
+		qmap_close(s0);
+	}
+
+	remove(fn);
+}
+
+/* Test 36: Compact sections */
+static void compact_fill(const char *fn, uint32_t *hds) {
+	char key[64], val[16];
+
+	hds[0] = qmap_open(fn, "paths", QM_STR, QM_U32, 0xFFF, QM_SORTED);
+	hds[1] = qmap_open(fn, "ids", QM_U32, QM_U32, 0xFFF, QM_SORTED);
+	hds[2] = qmap_open(fn, "hash", QM_U32, QM_STR, 0xFFF, 0);
+	hds[3] = qmap_open(fn, "multi", QM_U32, QM_STR, 0xFFF,
+	                   QM_SORTED | QM_MULTIVALUE);
+	for (uint32_t i = 0; i < 20000; i++) {
+		snprintf(key, sizeof(key), "/usr/share/doc/pkg%04u/file%u.txt",
+		         i / 10, i % 10);
+		qmap_put(hds[0], key, &i);
+		qmap_put(hds[1], &(uint32_t){i * 3}, &(uint32_t){i * i});
+	}
+	for (uint32_t i = 0; i < 5000; i++) {
+		snprintf(val, sizeof(val), "v%u", i);
+		qmap_put(hds[2], &(uint32_t){i * 2654435761u}, val);
+		qmap_put(hds[3], &(uint32_t){i / 3}, val);
+	}
+}
+
+static int compact_check(const char *fn, uint32_t flags) {
+	uint32_t paths = qmap_open(fn, "paths", QM_STR, QM_U32, 0xFFF,
+	                           QM_SORTED | flags);
+	uint32_t ids = qmap_open(fn, "ids", QM_U32, QM_U32, 0xFFF,
+	                         QM_SORTED | flags);
+	uint32_t hash = qmap_open(fn, "hash", QM_U32, QM_STR, 0xFFF, flags);
+	uint32_t multi = qmap_open(fn, "multi", QM_U32, QM_STR, 0xFFF,
+	                           QM_SORTED | QM_MULTIVALUE);
+	char key[64], val[16];
+	int ok = qmap_count(paths, NULL) == 20000
+		&& qmap_count(ids, NULL) == 20000
+		&& qmap_count(hash, NULL) == 5000
+		&& qmap_count(multi, NULL) == 5000
+		&& qmap_count(multi, &(uint32_t){1000}) == 3;
+
+	for (uint32_t i = 0; ok && i < 20000; i += 7) {
+		const uint32_t *v, *w;
+
+		snprintf(key, sizeof(key), "/usr/share/doc/pkg%04u/file%u.txt",
+		         i / 10, i % 10);
+		v = qmap_get(paths, key);
+		w = qmap_get(ids, &(uint32_t){i * 3});
+		ok = v && *v == i && w && *w == i * i
+			&& !qmap_get(ids, &(uint32_t){i * 3 + 1});
+	}
+
+	for (uint32_t i = 0; ok && i < 5000; i += 3) {
+		const char *v = qmap_get(hash, &(uint32_t){i * 2654435761u});
+
+		snprintf(val, sizeof(val), "v%u", i);
+		ok = v && !strcmp(v, val);
+	}
+
+	qmap_close(paths);
+	qmap_close(ids);
+	qmap_close(hash);
+	qmap_close(multi);
+	return ok;
+}
+
+static void test_compact(void) {
+	printf("\n=== Test 36: Compact Sections ===\n");
+
+	const char *fn = "test_compact.qmap";
+	uint32_t hds[4];
+	long plain, compact;
+
+	remove(fn);
+	compact_fill(fn, hds);
+	qmap_save();
+	plain = file_size(fn);
+	for (int d = 0; d < 4; d++)
+		qmap_close(hds[d]);
+
+	printf("Compact save:");
+	remove(fn);
+	qmap_config(QM_CFG_COMPACT, 1);
+	compact_fill(fn, hds);
+	qmap_save();
+	compact = file_size(fn);
+	for (int d = 0; d < 4; d++)
+		qmap_close(hds[d]);
+	ASSERT(compact > 0 && compact * 3 < plain, "Much smaller");
+
+	printf("Reads back:");
+	ASSERT(compact_check(fn, 0), "Values intact");
+
+	printf("Decoded on several threads:");
+	qmap_config(QM_CFG_PAR_MIN, 64);
+	ASSERT(compact_check(fn, 0), "Values intact");
+	qmap_config(QM_CFG_PAR_MIN, 1 << 16);
+
+	printf("Loaded by QM_RDONLY_MMAP maps:");
+	ASSERT(compact_check(fn, QM_RDONLY_MMAP), "Values intact");
+
+#if defined(QMAP_LZ4) || defined(QMAP_ZSTD)
+	printf("Compressed too:");
+	remove(fn);
+#ifdef QMAP_ZSTD
+	qmap_config(QM_CFG_COMPRESS, QM_CODEC_ZSTD);
+#else
+	qmap_config(QM_CFG_COMPRESS, QM_CODEC_LZ4);
+#endif
+	compact_fill(fn, hds);
+	qmap_save();
+	for (int d = 0; d < 4; d++)
+		qmap_close(hds[d]);
+	qmap_config(QM_CFG_COMPRESS, QM_CODEC_NONE);
+	ASSERT(file_size(fn) < compact && compact_check(fn, 0),
+	       "Smaller still, values intact");
+#endif
+
+	qmap_config(QM_CFG_COMPACT, 0);
+	remove(fn);
+}
+
+/* Test 37: Sharded maps */
+static void shard_names(char names[4][32]) {
+	for (int i = 0; i < 4; i++)
+		snprintf(names[i], 32, "test_shard.%03d", i);
+}
+
+static void test_sharded(void) {
+	printf("\n=== Test 37: Sharded Maps ===\n");
+
+	char names[4][32], key[32];
+	ino_t ino[4];
+	uint32_t hd, n, sum, changed, cur;
+	const void *k, *v;
+	int ok;
+
+	shard_names(names);
+	for (int i = 0; i < 4; i++)
+		remove(names[i]);
+
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 4);
+	for (uint32_t i = 0; i < 20000; i++) {
+		snprintf(key, sizeof(key), "key%05u", i);
+		qmap_put(hd, key, &i);
+	}
+	qmap_save();
+	qmap_close(hd);
+
+	printf("Spread over the files:");
+	sum = 0;
+	ok = 1;
+	for (int i = 0; i < 4; i++) {
+		uint32_t one = qmap_open(names[i], "db", QM_STR, QM_U32, 0xFFF,
+		                         QM_SORTED);
+
+		n = qmap_count(one, NULL);
+		ok &= n > 4000 && n < 6000;
+		sum += n;
+		qmap_close(one);
+	}
+	ASSERT(ok && sum == 20000, "Every entry in one of four shards");
+
+	printf("Reads back whole and sorted:");
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 4);
+	ok = qmap_count(hd, NULL) == 20000;
+	n = 0;
+	cur = qmap_iter(hd, "key00000", QM_RANGE);
+	while (qmap_next(&k, &v, cur)) {
+		snprintf(key, sizeof(key), "key%05u", n);
+		ok &= !strcmp(k, key) && *(const uint32_t *) v == n;
+		n++;
+	}
+	ASSERT(ok && n == 20000, "Entries intact, in key order");
+
+	printf("Only changed shards are rewritten:");
+	for (int i = 0; i < 4; i++) {
+		struct stat st;
+		ino[i] = stat(names[i], &st) ? 0 : st.st_ino;
+	}
+	qmap_put(hd, "key00042", &(uint32_t){ 1 });
+	qmap_save();
+	changed = 0;
+	for (int i = 0; i < 4; i++) {
+		struct stat st;
+		changed += stat(names[i], &st) || st.st_ino != ino[i];
+	}
+	ASSERT(changed == 1, "One file replaced");
+
+	printf("Deletes persist, checkpointed:");
+	qmap_del(hd, "key00043");
+	qmap_put(hd, "key19999", &(uint32_t){ 7 });
+	while (qmap_save_step(100) == 1)
+		;
+	qmap_close(hd);
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 4);
+	v = qmap_get(hd, "key00042");
+	k = qmap_get(hd, "key19999");
+	ASSERT(qmap_count(hd, NULL) == 19999 && v && *(const uint32_t *) v == 1
+	       && k && *(const uint32_t *) k == 7
+	       && !qmap_get(hd, "key00043"), "Changes and delete kept");
+	qmap_close(hd);
+
+	printf("Refuses fewer shards than written:");
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 3);
+	ok = hd == QM_MISS;
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 4);
+	ASSERT(ok && qmap_count(hd, NULL) == 19999, "QM_MISS, files intact");
+
+	printf("Range deletes persist:");
+	ok = qmap_del_range(hd, "key00100", "key00199") == 100;
+	qmap_save();
+	qmap_close(hd);
+	hd = qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                       QM_SORTED, 4);
+	ASSERT(ok && qmap_count(hd, NULL) == 19899
+	       && !qmap_get(hd, "key00150") && qmap_get(hd, "key00200"),
+	       "Shards rewritten");
+	qmap_close(hd);
+
+	printf("Refuses per-file flags:");
+	ASSERT(qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                         QM_WAL, 4) == QM_MISS
+	       && qmap_open_sharded("test_shard", "db", QM_STR, QM_U32, 0xFFF,
+	                            0, 0) == QM_MISS, "QM_MISS");
+
+	for (int i = 0; i < 4; i++)
+		remove(names[i]);
+}
+
+/* Test 38: Value log */
+
+/* Is p in the mapping of a value log? */
+static int vlog_mapped(const void *p) {
+	FILE *f = fopen("/proc/self/maps", "r");
+	char line[512];
+	int in = 0;
+
+	if (!f)
+		return 0;
+
+	while (!in && fgets(line, sizeof(line), f)) {
+		unsigned long lo, hi;
+
+		if (strstr(line, ".qmap-vlog-")
+		    && sscanf(line, "%lx-%lx", &lo, &hi) == 2)
+			in = (unsigned long) p >= lo && (unsigned long) p < hi;
+	}
+
+	fclose(f);
+	return in;
+}
+
+/* Value of entry i, the gen-th time it is put: long unless small */
+static void vlog_value(char *buf, uint32_t i, uint32_t gen, int small) {
+	size_t len = small ? 20 : 3000 + i % 500;
+
+	memset(buf, 'a' + (i + gen) % 26, len);
+	snprintf(buf, 16, "%u.%u", i, gen);
+	buf[strlen(buf)] = '-';
+	buf[len] = '\0';
+}
+
+/* Do entries [0, n) of hd hold vlog_value(i, gen(i)), 0 for deleted? */
+static int vlog_check(uint32_t hd, uint32_t n, uint32_t (*gen)(uint32_t)) {
+	char key[32], want[4096];
+	int ok = 1;
+
+	for (uint32_t i = 0; i < n; i++) {
+		const char *v;
+
+		snprintf(key, sizeof(key), "k%05u", i);
+		v = qmap_get(hd, key);
+		if (!gen(i)) {
+			ok &= !v;
+			continue;
+		}
+
+		vlog_value(want, i, gen(i), i % 10 == 0);
+		ok &= v && !strcmp(v, want);
+	}
+
+	return ok;
+}
+
+static uint32_t vlog_gen1(uint32_t i) { (void) i; return 1; }
+
+/* Every seventh updated, every eleventh deleted */
+static uint32_t vlog_gen2(uint32_t i) {
+	return i % 11 == 5 ? 0 : i % 7 == 3 ? 2 : 1;
+}
+
+static void test_vlog(void) {
+	printf("\n=== Test 38: Value Log ===\n");
+
+	const char *fn = "test_vlog.qmap";
+	const uint32_t n = 4000;
+	const void *keys[2000], *vals[2000];
+	char (*bufs)[2][4096] = malloc(sizeof(*bufs) * 2000);
+	char key[32], val[4096];
+	uint32_t hd, plain, live;
+	const char *v;
+	int ok;
+
+	remove(fn);
+	qmap_config(QM_CFG_VLOG_MIN, 1024);
+	qmap_config(QM_CFG_PAR_MIN, 64);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_VLOG);
+
+	/* half one by one, half in bulk, spread over threads */
+	for (uint32_t i = 0; i < n / 2; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		vlog_value(val, i, 1, i % 10 == 0);
+		qmap_put(hd, key, val);
+	}
+	for (uint32_t i = 0; i < n / 2; i++) {
+		snprintf(bufs[i][0], 32, "k%05u", n / 2 + i);
+		vlog_value(bufs[i][1], n / 2 + i, 1, (n / 2 + i) % 10 == 0);
+		keys[i] = bufs[i][0];
+		vals[i] = bufs[i][1];
+	}
+	qmap_bulk_put(hd, keys, vals, n / 2);
+
+	printf("Large values in the log:");
+	ok = 1;
+	for (uint32_t i = 0; i < n; i += 3) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		v = qmap_get(hd, key);
+		ok &= v && vlog_mapped(v) == (i % 10 != 0);
+	}
+	ASSERT(ok && vlog_check(hd, n, vlog_gen1), "Small ones stay in memory");
+
+	printf("Updates and deletes:");
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		if (!vlog_gen2(i))
+			qmap_del(hd, key);
+		else if (vlog_gen2(i) == 2) {
+			vlog_value(val, i, 2, i % 10 == 0);
+			qmap_put(hd, key, val);
+		}
+	}
+	ASSERT(vlog_check(hd, n, vlog_gen2), "Values as last put");
+
+	printf("Saved and read back:");
+	qmap_save();
+	qmap_close(hd);
+	plain = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED);
+	ok = vlog_check(plain, n, vlog_gen2);
+	qmap_close(plain);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_VLOG);
+	ASSERT(ok && vlog_check(hd, n, vlog_gen2), "Same file either way");
+
+	printf("Checkpointed while changed:");
+	qmap_put(hd, "k00003", "small now");
+	vlog_value(val, 11, 3, 0);
+	qmap_put(hd, "k00005", val);
+	/* what is replaced or deleted meanwhile is written as it was */
+	while (qmap_save_step(256) == 1) {
+		vlog_value(val, 1, 3, 0);
+		qmap_put(hd, "k00001", val);
+		qmap_del(hd, "k00002");
+	}
+	qmap_close(hd);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED);
+	v = qmap_get(hd, "k00005");
+	vlog_value(val, 11, 3, 0);
+	ok = v && !strcmp(v, val);
+	v = qmap_get(hd, "k00003");
+	ok &= v && !strcmp(v, "small now");
+	vlog_value(val, 1, 1, 0);
+	v = qmap_get(hd, "k00001");
+	ok &= v && !strcmp(v, val);
+	vlog_value(val, 2, 1, 0);
+	v = qmap_get(hd, "k00002");
+	ok &= v && !strcmp(v, val);
+	/* k00005 was among those deleted */
+	live = 1;
+	for (uint32_t i = 0; i < n; i++)
+		live += vlog_gen2(i) != 0;
+	ASSERT(ok && qmap_count(hd, NULL) == live, "As at the first step");
+	qmap_close(hd);
+
+	printf("Refused with QM_RDONLY_MMAP:");
+	ASSERT(qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	                 QM_VLOG | QM_RDONLY_MMAP) == QM_MISS, "QM_MISS");
+
+	qmap_config(QM_CFG_PAR_MIN, 65536);
+	qmap_config(QM_CFG_VLOG_MIN, 4096);
+	free(bufs);
+	remove(fn);
+}
+
+/* Test 39: Persistent heap */
+
+/* Do entries [0, n) of a heap map hold what heap_fill put, but for
+ * every ninth, deleted, and are they in key order? */
+static int heap_check(uint32_t hd, uint32_t n) {
+	char key[32], want[8192];
+	const void *k, *v;
+	uint32_t cur, i = 0, seen = 0;
+	int ok = qmap_count(hd, NULL) == n - (n + 4) / 9;
+
+	cur = qmap_iter(hd, "k00000", QM_RANGE);
+	while (qmap_next(&k, &v, cur)) {
+		while (i % 9 == 4)
+			i++;
+		snprintf(key, sizeof(key), "k%05u", i);
+		vlog_value(want, i, 1, i % 100 != 7);
+		ok &= !strcmp(k, key) && !strcmp(v, want);
+		i++;
+		seen++;
+	}
+
+	return ok && seen == n - (n + 4) / 9;
+}
+
+static void heap_fill(uint32_t hd, uint32_t n) {
+	char key[32], val[8192];
+
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		vlog_value(val, i, 1, i % 100 != 7);
+		qmap_put(hd, key, val);
+	}
+	for (uint32_t i = 4; i < n; i += 9) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		qmap_del(hd, key);
+	}
+}
+
+static void test_pheap(void) {
+	printf("\n=== Test 39: Persistent Heap ===\n");
+
+	const char *fn = "test_pheap.qmap";
+	const uint32_t n = 30000;
+	char val[32];
+	uint32_t hd, again;
+	uint64_t base;
+	void *block;
+	pid_t pid;
+	int status, fd;
+
+	remove(fn);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_PHEAP);
+	heap_fill(hd, n);
+
+	printf("Second open refused:");
+	again = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	                  QM_SORTED | QM_PHEAP);
+	ASSERT(hd != QM_MISS && again == QM_MISS, "File in use");
+
+	printf("Reopened as it was:");
+	qmap_save();
+	qmap_close(hd);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_PHEAP);
+	ASSERT(heap_check(hd, n), "Entries, values and order kept");
+
+	printf("Changes kept on close:");
+	qmap_put(hd, "k00004", "back");
+	qmap_del(hd, "k00000");
+	qmap_close(hd);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_PHEAP);
+	ASSERT(qmap_get(hd, "k00004") && !strcmp(qmap_get(hd, "k00004"), "back")
+	       && !qmap_get(hd, "k00000")
+	       && qmap_count(hd, NULL) == n - (n + 4) / 9, "Put and delete");
+	vlog_value(val, 0, 1, 1);
+	qmap_put(hd, "k00000", val);
+	qmap_del(hd, "k00004");
+	qmap_close(hd);
+
+	/* the address the heap was mapped at follows its magic and
+	 * version: taking it moves the heap elsewhere */
+	printf("Mapped elsewhere:");
+	fd = open(fn, O_RDONLY);
+	base = 0;
+	if (fd >= 0 && pread(fd, &base, sizeof(base), 8) != sizeof(base))
+		base = 0;
+	if (fd >= 0)
+		close(fd);
+	block = mmap((void *) (uintptr_t) base, 1 << 20, PROT_NONE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_PHEAP);
+	ASSERT(base && block == (void *) (uintptr_t) base
+	       && qmap_get(hd, "k00000") && heap_check(hd, n),
+	       "Pointers moved along");
+	qmap_put(hd, "k99999", "grown");
+	qmap_close(hd);
+	munmap(block, 1 << 20);
+
+	printf("Not closed is refused:");
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		uint32_t c = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+		                       QM_SORTED | QM_PHEAP);
+		qmap_put(c, "k00001", "lost");
+		_exit(c == QM_MISS);
+	}
+	waitpid(pid, &status, 0);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED | QM_PHEAP);
+	ASSERT(WIFEXITED(status) && !WEXITSTATUS(status) && hd == QM_MISS,
+	       "Changed since synced");
+
+	printf("Refuses other flags:");
+	ASSERT(qmap_open(NULL, "db", QM_STR, QM_STR, 0xFF, QM_PHEAP) == QM_MISS
+	       && qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	                    QM_PHEAP | QM_WAL) == QM_MISS, "QM_MISS");
+
+	remove(fn);
+}
+
+/* Test 40: Shared maps */
+
+/* Value i of the key the writer keeps changing: one digit, repeated,
+ * of a size that has it written over the last one */
+static void shared_value(char *buf, uint32_t i) {
+	memset(buf, '0' + (int) (i % 10), 600);
+	buf[600] = '\0';
+}
+
+/* Reader side, in a process of its own: bit 1 if the map is not as
+ * first put, 2 if changes do not show, 4 if a value read is torn, 8 if
+ * it could change the map */
+static int shared_reader(const char *fn, int ready, int go, uint32_t n) {
+	char key[32], buf[1024], want[1024];
+	const void *k, *v;
+	uint32_t hd, cur, i = 0;
+	int ret = 0, ok;
+
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	               QM_SORTED | QM_RDONLY_MMAP | QM_SHARED);
+	if (hd == QM_MISS)
+		return 15;
+
+	ok = qmap_count(hd, NULL) == n;
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		v = qmap_get(hd, key);
+		ok &= v && !strcmp(v, key);
+	}
+	ret |= ok ? 0 : 1;
+
+	if (write(ready, "r", 1) != 1 || read(go, buf, 1) != 1)
+		return 15;
+
+	/* the writer deleted k00000, changed k00001 and put as many
+	 * again, which grew the table and the file */
+	v = qmap_get(hd, "k00001");
+	ok = qmap_count(hd, NULL) == 2 * n && !qmap_get(hd, "k00000")
+		&& v && !strcmp(v, "changed");
+	i = 1;
+	cur = qmap_iter(hd, NULL, QM_RANGE);
+	while (qmap_next(&k, &v, cur)) {
+		snprintf(key, sizeof(key), "k%05u", i++);
+		ok &= !strcmp(k, key);
+	}
+	ret |= ok && i == 2 * n + 1 ? 0 : 2;
+
+	if (write(ready, "r", 1) != 1)
+		return 15;
+
+	/* whole values only, while the writer keeps changing them */
+	buf[0] = '\0';
+	for (uint32_t j = 0; j < 100000000 && strcmp(buf, "done"); j++) {
+		uint64_t ver;
+		size_t len;
+
+		do {
+			ver = qmap_version(hd);
+			v = qmap_get(hd, "x");
+			len = v ? strnlen(v, sizeof(buf) - 1) : 0;
+			memcpy(buf, v ? v : "", len);
+			buf[len] = '\0';
+		} while ((ver & 1) || qmap_version(hd) != ver);
+
+		if (!len || !strcmp(buf, "done"))
+			continue;
+		shared_value(want, (uint32_t) (buf[0] - '0'));
+		ret |= strcmp(buf, want) ? 4 : 0;
+	}
+
+	ret |= qmap_put(hd, "k00000", "reader") == QM_MISS ? 0 : 8;
+	qmap_close(hd);
+	return ret;
+}
+
+static void test_shared(void) {
+	printf("\n=== Test 40: Shared Maps ===\n");
+
+	const char *fn = "test_shared.qmap";
+	const uint32_t n = 3000;
+	int ready[2], go[2], status;
+	char key[32], val[1024];
+	uint32_t hd;
+	pid_t pid;
+
+	remove(fn);
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	               QM_SORTED | QM_PHEAP | QM_SHARED);
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		qmap_put(hd, key, key);
+	}
+
+	printf("No reader where the writer is:");
+	ASSERT(hd != QM_MISS
+	       && qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SORTED
+	                    | QM_RDONLY_MMAP | QM_SHARED) == QM_MISS,
+	       "Address taken");
+	qmap_close(hd);
+
+	/* the reader forks before the writer maps the file again */
+	if (pipe(ready) || pipe(go)) {
+		ASSERT(0, "pipe");
+		return;
+	}
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		close(ready[0]);
+		close(go[1]);
+		_exit(shared_reader(fn, ready[1], go[0], n));
+	}
+	close(ready[1]);
+	close(go[0]);
+
+	hd = qmap_open(fn, "db", QM_STR, QM_STR, 0xFF,
+	               QM_SORTED | QM_PHEAP | QM_SHARED);
+	if (read(ready[0], val, 1) != 1)
+		hd = QM_MISS;
+
+	qmap_del(hd, "k00000");
+	qmap_put(hd, "k00001", "changed");
+	for (uint32_t i = n; i <= 2 * n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		qmap_put(hd, key, key);
+	}
+	if (write(go[1], "g", 1) != 1 || read(ready[0], val, 1) != 1)
+		hd = QM_MISS;
+
+	for (uint32_t i = 0; i < 200000; i++) {
+		shared_value(val, i);
+		qmap_put(hd, "x", val);
+	}
+	qmap_put(hd, "x", "done");
+
+	waitpid(pid, &status, 0);
+	close(ready[0]);
+	close(go[1]);
+	status = WIFEXITED(status) ? WEXITSTATUS(status) : 15;
+
+	printf("Reader maps the file:");
+	ASSERT(hd != QM_MISS && !(status & 1), "Entries as put");
+
+	printf("Reader sees changes:");
+	ASSERT(!(status & 2), "Deleted, changed, grown and in order");
+
+	printf("Reader sees whole values:");
+	ASSERT(!(status & 4), "No torn value");
+
+	printf("Reader cannot write:");
+	ASSERT(!(status & 8), "Put refused");
+	qmap_close(hd);
+
+	printf("Refuses other flags:");
+	ASSERT(qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SHARED) == QM_MISS
+	       && qmap_open(fn, "db", QM_STR, QM_STR, 0xFF, QM_SHARED
+	                    | QM_PHEAP | QM_RDONLY_MMAP) == QM_MISS, "QM_MISS");
+
+	remove(fn);
+}
+
+/* Test 41: Deltas between maps */
+
+/* Export hd's delta since *since to a file, and apply it to dst;
+ * its size in *size. Returns what qmap_delta_apply returns */
+static int delta_sync(uint32_t hd, uint32_t dst, uint64_t *since,
+		      off_t *size) {
+	FILE *f = tmpfile();
+	int fd, ret;
+
+	if (!f)
+		return -2;
+	fd = fileno(f);
+	*since = qmap_delta_export(hd, *since, fd);
+	*size = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	ret = qmap_delta_apply(dst, fd);
+	fclose(f);
+	return ret;
+}
+
+/* Do a and b hold the same entries? */
+static int delta_same(uint32_t a, uint32_t b) {
+	uint32_t cur = qmap_iter(a, NULL, 0), na = 0, nb = 0;
+	const void *k, *v, *w;
+	int ok = 1;
+
+	while (qmap_next(&k, &v, cur)) {
+		w = qmap_get(b, k);
+		ok &= w && !strcmp(v, w);
+		na++;
+	}
+	cur = qmap_iter(b, NULL, 0);
+	while (qmap_next(&k, &v, cur))
+		nb++;
+
+	return ok && na == nb;
+}
+
+static void test_delta(void) {
+	printf("\n=== Test 41: Deltas ===\n");
+
+	const uint32_t n = 5000;
+	uint32_t hd, standby, other;
+	uint64_t since = 0, before;
+	off_t full, size;
+	char key[32], val[32];
+	int ret, fds[2];
+
+	qmap_config(QM_CFG_DELTA_WINDOW, 100);
+	hd = qmap_open(NULL, "db", QM_STR, QM_STR, 0xFF, QM_DELTA);
+	standby = qmap_open(NULL, "db", QM_STR, QM_STR, 0xFF, QM_MIRROR);
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		snprintf(val, sizeof(val), "v%05u", i);
+		qmap_put(hd, key, val);
+	}
+	qmap_put(standby, "stale", "gone after a whole delta");
+
+	printf("First delta holds the whole map:");
+	ret = delta_sync(hd, standby, &since, &full);
+	ASSERT(!ret && since && delta_same(hd, standby), "Same entries");
+
+	printf("Later ones hold what changed:");
+	for (uint32_t i = 0; i < 50; i++) {
+		snprintf(key, sizeof(key), "k%05u", i * 7);
+		qmap_del(hd, key);
+		snprintf(key, sizeof(key), "k%05u", i * 7 + 1);
+		qmap_put(hd, key, "changed");
+		snprintf(key, sizeof(key), "n%05u", i);
+		qmap_put(hd, key, "new");
+	}
+	qmap_del(hd, "n00003");
+	ret = delta_sync(hd, standby, &since, &size);
+	ASSERT(!ret && size < full / 10 && delta_same(hd, standby),
+	       "Deletes, updates and puts");
+
+	printf("Mirror of the copy kept up:");
+	ASSERT(qmap_get(standby + 1, "changed") && !qmap_get(standby + 1, "v00000")
+	       && qmap_get(standby + 1, "v00002"), "Values to keys");
+
+	printf("Nothing changed, nothing to do:");
+	before = since;
+	ret = delta_sync(hd, standby, &since, &size);
+	ASSERT(!ret && since == before && size < 64, "Empty delta");
+
+	printf("Past the deletions kept:");
+	for (uint32_t i = 1000; i < 1200; i++) {
+		snprintf(key, sizeof(key), "k%05u", i);
+		qmap_del(hd, key);
+	}
+	ret = delta_sync(hd, standby, &since, &size);
+	ASSERT(!ret && size > full / 2 && delta_same(hd, standby),
+	       "Whole map again");
+
+	printf("Drop:");
+	qmap_drop(hd);
+	qmap_put(hd, "after", "drop");
+	ret = delta_sync(hd, standby, &since, &size);
+	ASSERT(!ret && delta_same(hd, standby)
+	       && qmap_get(standby, "after"), "Only what was put since");
+
+	printf("Through a pipe:");
+	qmap_put(hd, "piped", "yes");
+	ret = -1;
+	if (!pipe(fds)) {
+		since = qmap_delta_export(hd, since, fds[1]);
+		close(fds[1]);
+		ret = qmap_delta_apply(standby, fds[0]);
+		close(fds[0]);
+	}
+	ASSERT(!ret && delta_same(hd, standby), "Applied");
+
+	printf("Refuses other deltas:");
+	other = qmap_open(NULL, "other", QM_STR, QM_STR, 0xFF, 0);
+	before = 0;
+	ret = delta_sync(hd, other, &before, &size);
+	ASSERT(ret == -1 && !qmap_get(other, "after"), "Other database");
+
+	printf("Refuses torn deltas:");
+	{
+		FILE *f = tmpfile();
+		char buf[256];
+		ssize_t len;
+		int fd = fileno(f);
+
+		qmap_put(hd, "torn", "no");
+		qmap_delta_export(hd, since, fd);
+		len = pread(fd, buf, sizeof(buf), 0);
+		if (ftruncate(fd, len - 4))
+			len = 0;
+		lseek(fd, 0, SEEK_SET);
+		ret = qmap_delta_apply(standby, fd);
+		fclose(f);
+	}
+	ASSERT(ret == -1, "Cut short");
+
+	printf("Needs QM_DELTA:");
+	before = qmap_delta_export(other, 7, fds[0]);
+	ASSERT(before == 7 && qmap_open(NULL, "db", QM_STR, QM_STR, 0xFF,
+	                                QM_DELTA | QM_MULTIVALUE) == QM_MISS,
+	       "Not exported");
+
+	printf("Range deletes:");
+	{
+		uint32_t src = qmap_open(NULL, "rdb", QM_STR, QM_STR, 0xFF,
+		                         QM_DELTA | QM_SORTED);
+		uint32_t dst = qmap_open(NULL, "rdb", QM_STR, QM_STR, 0xFF, 0);
+
+		qmap_put(src, "a", "1");
+		qmap_put(src, "b", "2");
+		qmap_put(src, "c", "3");
+		since = 0;
+		ret = delta_sync(src, dst, &since, &size);
+		qmap_del_range(src, "a", "b");
+		ret |= delta_sync(src, dst, &since, &size);
+		ASSERT(!ret && qmap_count(dst, NULL) == 1 && qmap_get(dst, "c"),
+		       "Deleted in the copy");
+		qmap_close(dst);
+		qmap_close(src);
+	}
+
+	qmap_config(QM_CFG_DELTA_WINDOW, 1 << 16);
+	qmap_close(other);
+	qmap_close(standby);
+	qmap_close(hd);
+}
+
 int main(void) {
 	printf("╔════════════════════════════════════════════════════════════╗\n");
 	printf("║        Extended Test Suite for libqmap                    ║\n");
@@ -831,6 +3007,31 @@ int main(void) {
 	test_file_loading_no_mirror();
 	test_pointer_stability();
 	test_file_reopen_append();
+	test_del_range();
+	test_bulk();
+	test_bulk_parallel();
+	test_sort_parallel();
+	test_iter_split();
+	test_next_batch();
+	test_wal();
+	test_rdonly_mmap();
+	test_file_format();
+	test_sorted_persist();
+	test_dirty_tracking();
+	test_atomic_save();
+	test_save_async();
+	test_save_step();
+	test_lazy_load();
+	test_open_all();
+	test_par_save();
+	test_io_uring();
+	test_compress();
+	test_compact();
+	test_sharded();
+	test_vlog();
+	test_pheap();
+	test_shared();
+	test_delta();
 	
 	printf("\n╔════════════════════════════════════════════════════════════╗\n");
 	if (errors == 0) {
@@ -1327,6 +1327,55 @@ static void test_vstr_field(void)
   qmap_close(hd);
 }
 
+/* ── Test: Field writes during a checkpoint ────────────────────────── */
+
+static void test_field_put_checkpoint(void)
+{
+  printf("=== Field writes during a checkpoint ===\n");
+
+  qmap_record_field_t fields[] = {
+    { "name", QM_STR, offsetof(person_t, name), sizeof(((person_t*)0)->name) , 0, 0, NULL },
+    { "age",  QM_U32, offsetof(person_t, age),  sizeof(uint32_t) , 0, 0, NULL },
+  };
+  uint32_t rec = qmap_record_register("test_checkpoint", sizeof(person_t), fields, 2);
+  const char *fn = "test_record_step.qmap";
+  char key[32];
+
+  remove(fn);
+  uint32_t hd = qmap_open(fn, "p", QM_STR, qmap_record_type_id(rec),
+                          0x7FFF, QM_RECORD(rec));
+  for (uint32_t i = 0; i < 20000; i++) {
+    person_t p = { .name = "Frank", .age = i };
+    snprintf(key, sizeof(key), "p%05u", i);
+    qmap_put(hd, key, &p);
+  }
+
+  /* the checkpoint has yet to write these when they change */
+  int r = qmap_save_step(1);
+  qmap_put(hd, "p19999:age", &(uint32_t){ 7 });
+  qmap_put(hd, "p19999:name", "Grace");
+  qmap_del(hd, "p19998:name");
+  while (r == 1)
+    r = qmap_save_step(1);
+
+  const person_t *got = qmap_get(hd, "p19999");
+  ASSERT(got->age == 7 && !strcmp(got->name, "Grace"), "live map changed");
+  got = qmap_get(hd, "p19998");
+  ASSERT(got->name[0] == '\0', "live field deleted");
+
+  qmap_close(hd);
+  hd = qmap_open(fn, "p", QM_STR, qmap_record_type_id(rec),
+                 0x7FFF, QM_RECORD(rec));
+  got = qmap_get(hd, "p19999");
+  ASSERT(got && got->age == 19999 && !strcmp(got->name, "Frank"),
+         "image has the struct as it was");
+  got = qmap_get(hd, "p19998");
+  ASSERT(got && !strcmp(got->name, "Frank"), "image has the deleted field");
+
+  qmap_close(hd);
+  remove(fn);
+}
+
 int main(void)
 {
   test_record_register();
@@ -1350,6 +1399,7 @@ int main(void)
   test_iteration();
   test_same_type_multi_records();
   test_u32_field_put_via_ptr();
+  test_field_put_checkpoint();
 
   test_ref_field_get();
   test_multi_ref_field_get();